@@ -9,10 +9,17 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | NAME '(' argument (',' argument)* ')'  # Function
     | CELL  # Cell
     | NUMBER  # Literal
     ;
 
+argument
+    : CELL ':' CELL  # RangeArgument
+    | STRING  # CriterionArgument
+    | expr  # ExpressionArgument
+    ;
+
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
@@ -28,4 +35,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
+STRING: '"' ~["]* '"' ;
 WS: [ \t\n\r]+ -> skip ;
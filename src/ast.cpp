@@ -4,34 +4,413 @@
 
 #include <numeric>
 #include <algorithm>
+#include <charconv>
 #include <cmath>
+#include <string_view>
 
 
 using namespace std;
 
 
+BoxedValue ApplyUnary(char operation, BoxedValue value) {
+    if (value.IsError()) 
+        return value;
+    double temp  = value.GetNumber();
+    if (operation == '-')
+        return -temp;
+    return temp;    
+}
+
+
+BoxedValue ApplyBinary(char operation, BoxedValue lhsExec, BoxedValue rhsExec) {
+    if (lhsExec.IsError())
+        return lhsExec;
+    if (rhsExec.IsError())
+        return rhsExec;
+    double lhsValue = lhsExec.GetNumber();
+    double rhsValue = rhsExec.GetNumber();
+
+    if (operation == '+') {
+        double temp = lhsValue + rhsValue;
+        if (isfinite(temp) == false)
+            return FormulaError(FormulaError::Category::Div0);
+        return temp;
+    }
+    else if (operation == '-') {
+        double temp = lhsValue - rhsValue;
+        if (isfinite(temp) == false)
+            return FormulaError(FormulaError::Category::Div0);
+        return temp;
+    }
+    else if (operation == '*') {
+        double temp = lhsValue * rhsValue;
+        if (isfinite(temp) == false)
+            return FormulaError(FormulaError::Category::Div0);
+        return temp;
+    }
+    else if (operation == '/') {
+        if (rhsValue <= 1e-200)
+            return FormulaError(FormulaError::Category::Div0);   
+        return lhsValue / rhsValue;
+    }
+    return 0.0; //Ошибка должна быть на уровне синтаксиса - в реальности мы не должны сюда дойти
+}
+
+
+BoxedValue ApplyFunction(Function function, const RangeSummary& summary) {
+    if (function == Function::Count)
+        return static_cast<double>(summary.count);
+    if (summary.error)
+        return *summary.error;
+    switch (function) {
+    case Function::Sum:
+        if (isfinite(summary.sum) == false)
+            return FormulaError(FormulaError::Category::Div0);
+        return summary.sum;
+    case Function::Average: {
+        const double average = summary.sum / static_cast<double>(summary.count);
+        if (summary.count == 0 || isfinite(average) == false)
+            return FormulaError(FormulaError::Category::Div0);
+        return average;
+    }
+    case Function::Min:
+        return summary.count > 0 ? summary.min : 0.0;
+    case Function::Max:
+        return summary.count > 0 ? summary.max : 0.0;
+    default:
+        return 0.0;
+    }
+}
+
+
+Program Compile(const Statement& root) {
+    Program program;
+    vector<pair<const Statement*, bool>> stack {{&root, false}};
+    vector<const Statement*> arguments;
+    while (stack.empty() == false) {
+        auto [statement, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            program.push_back(statement->Emit());
+            continue;
+        }
+        stack.push_back({statement, true});
+        arguments.clear();
+        statement->Arguments(arguments);
+        for (auto it = arguments.rbegin(); it != arguments.rend(); ++it)
+            stack.push_back({*it, false});
+    }
+    return program;
+}
+
+
+namespace {
+
+    // Scratch stack shared by nested evaluations on the same thread,
+    // each call works above the size it found on entry
+    template <typename T>
+    struct StackFrame {
+        vector<T>& values;
+        size_t base;
+
+        StackFrame() : values(Stack()), base(values.size()) {}
+        ~StackFrame() {
+            values.resize(base);
+        }
+
+        static vector<T>& Stack() {
+            thread_local vector<T> values;
+            return values;
+        }
+    };
+
+    ValueView ToValueView(BoxedValue value) {
+        if (value.IsError())
+            return value.GetError();
+        return value.GetNumber();
+    }
+
+    const Range& CheckedRange(const RangeStatement& statement) {
+        if (statement.range.IsValid() == false)
+            throw FormulaException("Invalid position");
+        return statement.range;
+    }
+
+    bool IsLine(const Range& range) {
+        return range.first.row == range.last.row || range.first.col == range.last.col;
+    }
+
+    int LineLength(const Range& range) {
+        return max(range.last.row - range.first.row, range.last.col - range.first.col) + 1;
+    }
+
+    Position LineCell(const Range& range, int offset) {
+        if (range.first.row == range.last.row)
+            return {range.first.row, range.first.col + offset};
+        return {range.first.row + offset, range.first.col};
+    }
+
+    // Numbers are results, empty cells are 0, texts can not be
+    BoxedValue ReadCell(const ISheet& sheet, Position pos) {
+        const ICell* cell = sheet.GetCell(pos);
+        if (cell == nullptr || cell->GetText().empty())
+            return 0.0;
+        const ValueView value = cell->GetValueView();
+        if (value.IsNumber())
+            return value.GetNumber();
+        if (value.IsError())
+            return value.GetError();
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    // Sign of the mode argument as in MATCH and XLOOKUP, smaller is the sorted ascending case
+    LookupMode ToLookupMode(double mode, bool smallerIsPositive) {
+        if (mode == 0.0)
+            return LookupMode::Exact;
+        return (mode > 0.0) == smallerIsPositive ? LookupMode::NextSmaller : LookupMode::NextLarger;
+    }
+
+    // MATCH(value, line[, type]) gives the 1-based place, VLOOKUP(value, table, column[, approximate])
+    // looks up the first column of the table, XLOOKUP(value, line, line[, mode]) takes the same place
+    // of the second line. Approximate MATCH and VLOOKUP find the next smaller number as on sorted data.
+    // The value not found is a Value error
+    BoxedValue ApplyLookup(Function function, const ISheet& sheet, const Range* const* ranges,
+            const BoxedValue* values, size_t valueCount) {
+        for (size_t i = 0; i < valueCount; ++i)
+            if (values[i].IsError())
+                return values[i];
+        const double key = values[0].GetNumber();
+        const Range& line = *ranges[0];
+        Range lookup = line;
+        LookupMode mode = LookupMode::Exact;
+        int column = 0;
+        switch (function) {
+        case Function::Match:
+            mode = ToLookupMode(valueCount > 1 ? values[1].GetNumber() : 1.0, true);
+            break;
+        case Function::VLookup: {
+            // Checked as a double, a column number past int would not survive the cast
+            const double columnNumber = floor(values[1].GetNumber());
+            if ((columnNumber >= 1.0) == false)
+                return FormulaError(FormulaError::Category::Value);
+            if (columnNumber > line.last.col - line.first.col + 1)
+                return FormulaError(FormulaError::Category::Ref);
+            column = static_cast<int>(columnNumber);
+            lookup.last.col = lookup.first.col;
+            mode = valueCount > 2 && values[2].GetNumber() == 0.0 ? LookupMode::Exact : LookupMode::NextSmaller;
+            break;
+        }
+        default:
+            if (LineLength(*ranges[1]) != LineLength(line) || IsLine(*ranges[1]) == false)
+                return FormulaError(FormulaError::Category::Value);
+            mode = ToLookupMode(valueCount > 1 ? values[1].GetNumber() : 0.0, false);
+            break;
+        }
+        if (IsLine(lookup) == false)
+            return FormulaError(FormulaError::Category::Value);
+        const auto offset = sheet.LookupRange(lookup, key, mode);
+        if (offset.has_value() == false)
+            return FormulaError(FormulaError::Category::Value);
+        switch (function) {
+        case Function::Match:
+            return static_cast<double>(*offset + 1);
+        case Function::VLookup:
+            return ReadCell(sheet, {line.first.row + *offset, line.first.col + column - 1});
+        default:
+            return ReadCell(sheet, LineCell(*ranges[1], *offset));
+        }
+    }
+
+    // SUMIF(range, criterion[, sum range]), COUNTIF(range, criterion) and AVERAGEIF as SUMIF
+    // aggregate the cells of the sum range, the range itself by default, where the range matches.
+    // A criterion given as a value is the equality to it. The sum range must be of the same size
+    BoxedValue ApplyConditional(Function function, const ISheet& sheet, const Range* const* ranges,
+            const optional<Criterion>& written, const BoxedValue* values) {
+        Criterion criterion;
+        if (written.has_value())
+            criterion = *written;
+        else if (values[0].IsError())
+            return values[0];
+        else
+            criterion.value = values[0].GetNumber();
+        const Range& range = *ranges[0];
+        const Range& sumRange = ranges[1] != nullptr ? *ranges[1] : range;
+        if (sumRange.last.row - sumRange.first.row != range.last.row - range.first.row
+                || sumRange.last.col - sumRange.first.col != range.last.col - range.first.col)
+            return FormulaError(FormulaError::Category::Value);
+        const RangeSummary summary = sheet.SummarizeIf(range, criterion, sumRange);
+        switch (function) {
+        case Function::SumIf:
+            return ApplyFunction(Function::Sum, summary);
+        case Function::CountIf:
+            return ApplyFunction(Function::Count, summary);
+        default:
+            return ApplyFunction(Function::Average, summary);
+        }
+    }
+
+    // Arguments are in their order split into the ranges and the values
+    BoxedValue CallFunction(const FunctionStatement& function, const ISheet& sheet,
+            const RangeStatement* const* ranges, const BoxedValue* values) {
+        if (function.HasDeletedRange())
+            return FormulaError(FormulaError::Category::Value);
+        const size_t count = function.ArgumentCount();
+        if (function.GetFunction() == Function::SumProduct) {
+            vector<Range> productRanges;
+            for (size_t i = 0; i < count; ++i) {
+                productRanges.push_back(CheckedRange(*ranges[i]));
+                if (productRanges[i].last.row - productRanges[i].first.row != productRanges[0].last.row - productRanges[0].first.row
+                        || productRanges[i].last.col - productRanges[i].first.col != productRanges[0].last.col - productRanges[0].first.col)
+                    return FormulaError(FormulaError::Category::Value);
+            }
+            return ApplyFunction(Function::Sum, sheet.SumProduct(productRanges));
+        }
+        if (function.GetFunction() >= Function::SumIf) {
+            const Range* conditionRanges[2] = {&CheckedRange(*ranges[0]), nullptr};
+            if (count > 2)
+                conditionRanges[1] = &CheckedRange(*ranges[1]);
+            return ApplyConditional(function.GetFunction(), sheet, conditionRanges, function.GetCriterion(), values);
+        }
+        if (function.GetFunction() > Function::Count) {
+            const Range* lookupRanges[2] = {nullptr, nullptr};
+            size_t rangeCount = 0;
+            for (size_t i = 0; i < count; ++i)
+                if (function.IsRangeArgument(i)) {
+                    lookupRanges[rangeCount] = &CheckedRange(*ranges[rangeCount]);
+                    ++rangeCount;
+                }
+            return ApplyLookup(function.GetFunction(), sheet, lookupRanges, values, count - rangeCount);
+        }
+        // Arguments are combined in their order, so the error of the first one wins
+        RangeSummary total;
+        for (size_t i = 0; i < count; ++i) {
+            if (function.IsRangeArgument(i))
+                total.Merge(sheet.SummarizeRange(CheckedRange(**ranges++)));
+            else
+                total.Add(ToValueView(*values++));
+        }
+        return ApplyFunction(function.GetFunction(), total);
+    }
+
+}
+
+
+BoxedValue Execute(const Program& program, const ISheet& sheet) {
+    StackFrame<BoxedValue> frame;
+    StackFrame<const RangeStatement*> rangeFrame;
+    auto& values = frame.values;
+    auto& ranges = rangeFrame.values;
+    for (const auto& instruction: program) {
+        switch (instruction.code) {
+            case Instruction::Code::Literal:
+                values.push_back(instruction.value);
+                break;
+            case Instruction::Code::Cell:
+                values.push_back(instruction.cell->Execute(sheet));
+                break;
+            case Instruction::Code::Unary:
+                values.back() = ApplyUnary(instruction.operation, values.back());
+                break;
+            case Instruction::Code::Binary: {
+                auto rhsValue = values.back();
+                values.pop_back();
+                values.back() = ApplyBinary(instruction.operation, values.back(), rhsValue);
+                break;
+            }
+            case Instruction::Code::Parens:
+                break;
+            case Instruction::Code::Range:
+                ranges.push_back(instruction.range);
+                break;
+            case Instruction::Code::Criterion:
+                break;
+            case Instruction::Code::Function: {
+                const auto& function = *instruction.function;
+                const size_t count = function.ArgumentCount();
+                size_t rangeCount = 0;
+                size_t criterionCount = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    rangeCount += function.IsRangeArgument(i);
+                    criterionCount += function.IsCriterionArgument(i);
+                }
+                const size_t firstValue = values.size() - (count - rangeCount - criterionCount);
+                const size_t firstRange = ranges.size() - rangeCount;
+                auto result = CallFunction(function, sheet, ranges.data() + firstRange, values.data() + firstValue);
+                values.resize(firstValue);
+                ranges.resize(firstRange);
+                values.push_back(result);
+                break;
+            }
+        }
+    }
+    return values.back();
+}
+
+
+void Render(const Statement& root, string& text) {
+    // A statement not yet visited is marked by kVisit, otherwise the part to append next
+    constexpr size_t kVisit = numeric_limits<size_t>::max();
+    StackFrame<pair<const Statement*, size_t>> frame;
+    StackFrame<const Statement*> argumentsFrame;
+    auto& stack = frame.values;
+    auto& arguments = argumentsFrame.values;
+    stack.push_back({&root, kVisit});
+    while (stack.size() > frame.base) {
+        auto [statement, part] = stack.back();
+        stack.pop_back();
+        if (part != kVisit) {
+            statement->Formula(text, part);
+            continue;
+        }
+        statement->Formula(text, 0);
+        statement->Arguments(arguments);
+        const size_t count = arguments.size() - argumentsFrame.base;
+        if (count > 0)
+            stack.push_back({statement, count});
+        for (size_t i = count; i-- > 0;) {
+            stack.push_back({arguments[argumentsFrame.base + i], kVisit});
+            if (i > 0)
+                stack.push_back({statement, i});
+        }
+        arguments.resize(argumentsFrame.base);
+    }
+}
+
+
 LiteralStatement::LiteralStatement(double v) 
     : value(v) {}
 
 
-IFormula::Value LiteralStatement::Execute(const ISheet& sheet) const  {
+BoxedValue LiteralStatement::Execute(const ISheet& sheet) const  {
     return value;
 }
 
 
-string LiteralStatement::Formula() const  {
-    if (value == round(value))
-        return to_string(static_cast<int>(value));
-    return to_string(value);
+// Shortest text reading back to the same number, integers below 1e15 without an exponent
+void LiteralStatement::Formula(string& text, size_t part) const  {
+    char buffer[32];
+    const bool integral = value == round(value) && fabs(value) < 1e15;
+    const auto result = integral ? to_chars(begin(buffer), end(buffer), value, chars_format::fixed)
+        : to_chars(begin(buffer), end(buffer), value);
+    text.append(buffer, result.ptr);
 }
 
 
 
+Instruction LiteralStatement::Emit() const {
+    return {Instruction::Code::Literal, 0, value, {}};
+}
+
+
 CellStatement::CellStatement(string name)
     : pos(Position::FromString(move(name))) {}
 
 
-IFormula::Value CellStatement::Execute(const ISheet& sheet) const  {
+CellStatement::CellStatement(Position pos)
+    : pos(pos) {}
+
+
+BoxedValue CellStatement::Execute(const ISheet& sheet) const  {
 
     if (pos.col == -1 && pos.row == -1) //-1, -1 ref deletion
         return FormulaError(FormulaError::Category::Value);
@@ -39,37 +418,21 @@ IFormula::Value CellStatement::Execute(const ISheet& sheet) const  {
     if (pos.IsValid() == false) //-2, -2 parse error
         throw FormulaException("Invalid position");
 
-    auto cellPtr = sheet.GetCell(pos);
-    if (cellPtr == nullptr)
-        return 0.0;
-    auto cellValue =  cellPtr->GetValue();
-    
-    if (holds_alternative<string>(cellValue)) {
-        const auto& cellText = get<string>(cellValue);
-        bool containsLetter = find_if(cellText.begin(), cellText.end(),
-                [](char c) { return isalpha(c); }) != cellText.end();
-        if (containsLetter)
-                return FormulaError(FormulaError::Category::Value);
-        try {
-            double temp = stod(cellText);
-            return temp;
-        } 
-        catch(invalid_argument& e) {
-            return FormulaError(FormulaError::Category::Value);
-        }
-    }
-    else if (holds_alternative<double>(cellValue)) 
-        return get<double>(cellValue);
-
-    return get<FormulaError>(cellValue); 
+    return sheet.GetOperand(pos);
 }
 
 
-string CellStatement::Formula() const  {
+void CellStatement::Formula(string& text, size_t part) const  {
     const auto& posStr = pos.ToString();
     if (posStr.empty())
-        return "#!REF";
-    return posStr; 
+        text += "#!REF";
+    else
+        text += posStr;
+}
+
+
+Instruction CellStatement::Emit() const {
+    return {Instruction::Code::Cell, 0, 0.0, this};
 }
 
 
@@ -79,23 +442,225 @@ void CellStatement::setNewName(string newName) {
 
 
 
+RangeStatement::RangeStatement(Range range)
+    : range(range) {}
+
+
+// A bare range has no value, the parser accepts ranges only as function arguments
+BoxedValue RangeStatement::Execute(const ISheet& sheet) const {
+    return FormulaError(FormulaError::Category::Value);
+}
+
+
+void RangeStatement::Formula(string& text, size_t part) const {
+    if (range.first.IsValid() == false || range.last.IsValid() == false) {
+        text += "#!REF";
+        return;
+    }
+    text += range.first.ToString();
+    text += ':';
+    text += range.last.ToString();
+}
+
+
+Instruction RangeStatement::Emit() const {
+    Instruction instruction{Instruction::Code::Range, 0, 0.0, {}};
+    instruction.range = this;
+    return instruction;
+}
+
+
+
+CriterionStatement::CriterionStatement(Criterion criterion)
+    : criterion(criterion) {}
+
+
+// Like a range, a criterion has no value outside of its function
+BoxedValue CriterionStatement::Execute(const ISheet& sheet) const {
+    return FormulaError(FormulaError::Category::Value);
+}
+
+
+void CriterionStatement::Formula(string& text, size_t part) const {
+    text += '"';
+    text += criterion.ToString();
+    text += '"';
+}
+
+
+Instruction CriterionStatement::Emit() const {
+    return {Instruction::Code::Criterion, static_cast<char>(criterion.comparison), criterion.value, {}};
+}
+
+
+
+FunctionStatement::FunctionStatement(Function function, vector<unique_ptr<Statement>> arguments)
+    : arguments(move(arguments)), function(function) {
+    for (const auto& argument: this->arguments) {
+        if (dynamic_cast<const RangeStatement*>(argument.get()) != nullptr)
+            kinds.push_back(Argument::Range);
+        else if (dynamic_cast<const CriterionStatement*>(argument.get()) != nullptr)
+            kinds.push_back(Argument::Criterion);
+        else
+            kinds.push_back(Argument::Value);
+    }
+}
+
+
+BoxedValue FunctionStatement::Execute(const ISheet& sheet) const {
+    vector<const RangeStatement*> ranges;
+    vector<BoxedValue> values;
+    for (size_t i = 0; i < arguments.size(); ++i) {
+        if (kinds[i] == Argument::Range)
+            ranges.push_back(static_cast<const RangeStatement*>(arguments[i].get()));
+        else if (kinds[i] == Argument::Value)
+            values.push_back(arguments[i]->Execute(sheet));
+    }
+    return CallFunction(*this, sheet, ranges.data(), values.data());
+}
+
+
+namespace {
+    constexpr string_view kFunctionNames[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT", "MATCH", "VLOOKUP", "XLOOKUP",
+        "SUMIF", "COUNTIF", "AVERAGEIF", "SUMPRODUCT"};
+}
+
+
+void FunctionStatement::Formula(string& text, size_t part) const {
+    if (part == 0) {
+        text += kFunctionNames[static_cast<size_t>(function)];
+        text += '(';
+    }
+    if (part == arguments.size())
+        text += ')';
+    else if (part > 0)
+        text += ',';
+}
+
+
+Instruction FunctionStatement::Emit() const {
+    Instruction instruction{Instruction::Code::Function, static_cast<char>(function), 0.0, {}};
+    instruction.function = this;
+    return instruction;
+}
+
+
+void FunctionStatement::Arguments(vector<const Statement*>& arguments) const {
+    for (const auto& argument: this->arguments)
+        arguments.push_back(argument.get());
+}
+
+
+Function FunctionStatement::GetFunction() const {
+    return function;
+}
+
+
+size_t FunctionStatement::ArgumentCount() const {
+    return arguments.size();
+}
+
+
+bool FunctionStatement::IsRangeArgument(size_t index) const {
+    return kinds[index] == Argument::Range;
+}
+
+
+bool FunctionStatement::IsCriterionArgument(size_t index) const {
+    return kinds[index] == Argument::Criterion;
+}
+
+
+optional<Criterion> FunctionStatement::GetCriterion() const {
+    for (size_t i = 0; i < arguments.size(); ++i)
+        if (kinds[i] == Argument::Criterion)
+            return static_cast<const CriterionStatement&>(*arguments[i]).criterion;
+    return nullopt;
+}
+
+
+bool FunctionStatement::HasDeletedRange() const {
+    for (size_t i = 0; i < arguments.size(); ++i)
+        if (kinds[i] == Argument::Range) {
+            const Range& range = static_cast<const RangeStatement&>(*arguments[i]).range;
+            if (range.first.row == -1 && range.first.col == -1) //-1, -1 ref deletion
+                return true;
+        }
+    return false;
+}
+
+
+bool FunctionStatement::IsValid() const {
+    // Kinds of the arguments, the last one may be omitted unless all are required.
+    // In place of a criterion a value may be given
+    vector<Argument> expected;
+    size_t required = 0;
+    switch (function) {
+    case Function::Match:
+        expected = {Argument::Value, Argument::Range, Argument::Value};
+        break;
+    case Function::VLookup:
+        expected = {Argument::Value, Argument::Range, Argument::Value, Argument::Value};
+        break;
+    case Function::XLookup:
+        expected = {Argument::Value, Argument::Range, Argument::Range, Argument::Value};
+        break;
+    case Function::SumIf:
+    case Function::AverageIf:
+        expected = {Argument::Range, Argument::Criterion, Argument::Range};
+        break;
+    case Function::CountIf:
+        expected = {Argument::Range, Argument::Criterion};
+        required = expected.size();
+        break;
+    case Function::SumProduct:
+        return arguments.empty() == false && all_of(kinds.begin(), kinds.end(), [](Argument kind) {
+            return kind == Argument::Range;
+        });
+    default:
+        return arguments.empty() == false && find(kinds.begin(), kinds.end(), Argument::Criterion) == kinds.end();
+    }
+    if (required == 0)
+        required = expected.size() - 1;
+    if (kinds.size() < required || kinds.size() > expected.size())
+        return false;
+    return equal(kinds.begin(), kinds.end(), expected.begin(), [](Argument kind, Argument expected) {
+        return kind == expected || (kind == Argument::Value && expected == Argument::Criterion);
+    });
+}
+
+
+optional<Function> FunctionStatement::FromName(string_view name) {
+    for (size_t i = 0; i < size(kFunctionNames); ++i)
+        if (kFunctionNames[i] == name)
+            return static_cast<Function>(i);
+    return nullopt;
+}
+
+
+
 UnaryOperation::UnaryOperation(char op, unique_ptr<Statement> argument) 
     : argument(move(argument)), operation(op) {}
 
 
-IFormula::Value UnaryOperation::Execute(const ISheet& sheet) const  {
-    IFormula::Value value = argument->Execute(sheet);
-    if (holds_alternative<FormulaError>(value)) 
-        return value;
-    double temp  = get<double>(value);
-    if (operation == '-')
-        return -temp;
-    return temp;    
+BoxedValue UnaryOperation::Execute(const ISheet& sheet) const  {
+    return ApplyUnary(operation, argument->Execute(sheet));
+}
+
+
+void UnaryOperation::Formula(string& text, size_t part) const  {
+    if (part == 0)
+        text += operation;
+}
+
+
+Instruction UnaryOperation::Emit() const {
+    return {Instruction::Code::Unary, operation, 0.0, {}};
 }
 
 
-string UnaryOperation::Formula() const  {
-    return string(1, operation) + argument->Formula();
+void UnaryOperation::Arguments(vector<const Statement*>& arguments) const {
+    arguments.push_back(argument.get());
 }
 
 
@@ -104,47 +669,27 @@ BinaryOperation::BinaryOperation(char op, unique_ptr<Statement> lhs, unique_ptr<
 : lhs(move(lhs)), rhs(move(rhs)), operation(op) { }
 
 
-IFormula::Value BinaryOperation::Execute(const ISheet& sheet) const  {
-
+BoxedValue BinaryOperation::Execute(const ISheet& sheet) const  {
     auto rhsExec = rhs->Execute(sheet);
     auto lhsExec = lhs->Execute(sheet);
-    if (holds_alternative<FormulaError>(lhsExec))
-        return lhsExec;
-    if (holds_alternative<FormulaError>(rhsExec))
-        return rhsExec;
-    double lhsValue = get<double>(lhsExec);
-    double rhsValue = get<double>(rhsExec);
+    return ApplyBinary(operation, lhsExec, rhsExec);
+}
 
-    if (operation == '+') {
-        double temp = lhsValue + rhsValue;
-        if (isfinite(temp) == false)
-            return FormulaError(FormulaError::Category::Div0);
-        return temp;
-    }
-    else if (operation == '-') {
-        double temp = lhsValue - rhsValue;
-        if (isfinite(temp) == false)
-            return FormulaError(FormulaError::Category::Div0);
-        return temp;
-    }
-    else if (operation == '*') {
-        double temp = lhsValue * rhsValue;
-        if (isfinite(temp) == false)
-            return FormulaError(FormulaError::Category::Div0);
-        return temp;
-    }
-    else if (operation == '/') {
-        if (rhsValue <= 1e-200)
-            return FormulaError(FormulaError::Category::Div0);   
-        return lhsValue / rhsValue;
-    }
-    return 0.0; //Ошибка должна быть на уровне синтаксиса - в реальности мы не должны сюда дойти
+
+void BinaryOperation::Formula(string& text, size_t part) const  {
+    if (part == 1)
+        text += operation;
+}
+
+
+Instruction BinaryOperation::Emit() const {
+    return {Instruction::Code::Binary, operation, 0.0, {}};
 }
 
 
-string BinaryOperation::Formula() const  {
-    return lhs->Formula() + string(1, operation)
-        + rhs->Formula();
+void BinaryOperation::Arguments(vector<const Statement*>& arguments) const {
+    arguments.push_back(lhs.get());
+    arguments.push_back(rhs.get());
 }
 
 
@@ -157,11 +702,119 @@ ParensStatement::ParensStatement(unique_ptr<Statement> argument)
     : argument(move(argument)) {}
 
 
-IFormula::Value ParensStatement::Execute(const ISheet& sheet) const  {
+BoxedValue ParensStatement::Execute(const ISheet& sheet) const  {
     return argument->Execute(sheet);
 }
 
 
-string ParensStatement::Formula() const  {
-    return "(" + argument->Formula() + ")";
-}
\ No newline at end of file
+void ParensStatement::Formula(string& text, size_t part) const  {
+    text += part == 0 ? '(' : ')';
+}
+
+
+Instruction ParensStatement::Emit() const {
+    return {Instruction::Code::Parens, 0, 0.0, {}};
+}
+
+
+void ParensStatement::Arguments(vector<const Statement*>& arguments) const {
+    arguments.push_back(argument.get());
+}
+
+
+
+bool StatementBuilder::Add(Instruction::Code code, char operation, double value, Position pos) {
+    switch (code) {
+    case Instruction::Code::Literal:
+        stack.push_back(make_unique<LiteralStatement>(value));
+        return true;
+    case Instruction::Code::Cell: {
+        auto cell = make_unique<CellStatement>(pos);
+        cells.push_back(cell.get());
+        stack.push_back(move(cell));
+        return true;
+    }
+    case Instruction::Code::Criterion:
+        if (operation < 0 || operation > static_cast<char>(Criterion::Comparison::GreaterOrEqual))
+            return false;
+        stack.push_back(make_unique<CriterionStatement>(Criterion{static_cast<Criterion::Comparison>(operation), value}));
+        return true;
+    case Instruction::Code::Unary:
+        if (stack.empty() || IsArgumentOnTop(1) || (operation != '+' && operation != '-'))
+            return false;
+        stack.push_back(make_unique<UnaryOperation>(operation, Pop()));
+        return true;
+    case Instruction::Code::Binary: {
+        if (stack.size() < 2 || IsArgumentOnTop(2) || string_view("+-*/").find(operation) == string_view::npos)
+            return false;
+        auto rhs = Pop();
+        auto lhs = Pop();
+        stack.push_back(make_unique<BinaryOperation>(operation, move(lhs), move(rhs)));
+        return true;
+    }
+    case Instruction::Code::Parens:
+        if (stack.empty() || IsArgumentOnTop(1))
+            return false;
+        stack.push_back(make_unique<ParensStatement>(Pop()));
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+bool StatementBuilder::AddRange(Range range) {
+    auto statement = make_unique<RangeStatement>(range);
+    ranges.push_back(statement.get());
+    stack.push_back(move(statement));
+    return true;
+}
+
+
+bool StatementBuilder::AddFunction(char operation, uint32_t count) {
+    if (count == 0 || stack.size() < count || operation < 0
+            || operation > static_cast<char>(Function::SumProduct))
+        return false;
+    vector<unique_ptr<Statement>> arguments(count);
+    for (auto it = arguments.rbegin(); it != arguments.rend(); ++it)
+        *it = Pop();
+    auto function = make_unique<FunctionStatement>(static_cast<Function>(operation), move(arguments));
+    if (function->IsValid() == false)
+        return false;
+    stack.push_back(move(function));
+    return true;
+}
+
+
+unique_ptr<Statement> StatementBuilder::ExtractRoot() {
+    if (stack.size() != 1 || IsArgumentOnTop(1))
+        return nullptr;
+    return Pop();
+}
+
+
+vector<CellStatement*> StatementBuilder::ExtractCells() {
+    return move(cells);
+}
+
+
+vector<RangeStatement*> StatementBuilder::ExtractRanges() {
+    return move(ranges);
+}
+
+
+// Ranges and criteria are valid only as function arguments
+bool StatementBuilder::IsArgumentOnTop(size_t count) const {
+    for (size_t i = stack.size() - count; i < stack.size(); ++i)
+        if (dynamic_cast<const RangeStatement*>(stack[i].get()) != nullptr
+                || dynamic_cast<const CriterionStatement*>(stack[i].get()) != nullptr)
+            return true;
+    return false;
+}
+
+
+unique_ptr<Statement> StatementBuilder::Pop() {
+    auto statement = move(stack.back());
+    stack.pop_back();
+    return statement;
+}
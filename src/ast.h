@@ -4,20 +4,91 @@
 #include "formula.h"
 #include "common.h"
 
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+
+struct CellStatement;
+struct RangeStatement;
+class FunctionStatement;
+
+
+// Function of a call, kept in Instruction::operation.
+// Aggregates come first, then lookups, then conditional aggregates and the sum of products
+enum class Function : char {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+    Match,
+    VLookup,
+    XLookup,
+    SumIf,
+    CountIf,
+    AverageIf,
+    SumProduct
+};
+
+
+// Single step of a formula in post-order (RPN) form.
+// Parens is a no-op for evaluation and is kept only to restore the tree.
+// Range pushes its statement, Function takes the arguments of its statement.
+// Criterion keeps the comparison in operation and the number in value, its function reads it
+struct Instruction {
+    enum class Code : char {
+        Literal,
+        Cell,
+        Unary,
+        Binary,
+        Parens,
+        Range,
+        Function,
+        Criterion
+    };
+    Code code;
+    char operation = 0;
+    double value = 0.0;
+    union {
+        const CellStatement* cell = nullptr;
+        const RangeStatement* range;
+        const FunctionStatement* function;
+    };
+};
+
+using Program = std::vector<Instruction>;
 
 
 struct Statement {
     virtual ~Statement() = default;
-    virtual IFormula::Value Execute(const ISheet& sheet) const = 0;
-    virtual std::string Formula() const = 0;
+    virtual BoxedValue Execute(const ISheet& sheet) const = 0;
+    // Appends the text of the statement around its arguments: part i precedes argument i,
+    // the last part follows the last argument. A statement without arguments has only part 0
+    virtual void Formula(std::string& text, size_t part) const = 0;
+    virtual Instruction Emit() const = 0;
+    virtual void Arguments(std::vector<const Statement*>& arguments) const {}
 };
 
 
+BoxedValue ApplyUnary(char operation, BoxedValue value);
+BoxedValue ApplyBinary(char operation, BoxedValue lhs, BoxedValue rhs);
+BoxedValue ApplyFunction(Function function, const RangeSummary& summary);
+
+// These functions use explicit heap stacks, so the depth of the tree is bounded only by memory
+Program Compile(const Statement& root);
+BoxedValue Execute(const Program& program, const ISheet& sheet);
+// Appends the text of the formula without the sign
+void Render(const Statement& root, std::string& text);
+
+
 struct LiteralStatement : Statement {
     double value;
     explicit LiteralStatement(double v);
-    IFormula::Value Execute(const ISheet& sheet) const override;
-    std::string Formula() const override;
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
 };
 
 
@@ -25,18 +96,80 @@ struct CellStatement : Statement {
     Position pos;
 
     explicit CellStatement(std::string name);
-    IFormula::Value Execute(const ISheet& sheet) const override;
-    std::string Formula() const override;
+    explicit CellStatement(Position pos);
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
     void setNewName(std::string newName);
 };
 
 
 
+// Rectangle of cells, valid only as an argument of a function
+struct RangeStatement : Statement {
+    Range range;
+
+    explicit RangeStatement(Range range);
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+};
+
+
+// Condition written as text, valid only as an argument of a conditional aggregate
+struct CriterionStatement : Statement {
+    Criterion criterion;
+
+    explicit CriterionStatement(Criterion criterion);
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+};
+
+
+class FunctionStatement : public Statement {
+public:
+    FunctionStatement(Function function, std::vector<std::unique_ptr<Statement>> arguments);
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+    void Arguments(std::vector<const Statement*>& arguments) const override;
+
+    Function GetFunction() const;
+    size_t ArgumentCount() const;
+    bool IsRangeArgument(size_t index) const;
+    bool IsCriterionArgument(size_t index) const;
+    // Criterion of a conditional aggregate written as text, nullopt for a value to be equal to
+    std::optional<Criterion> GetCriterion() const;
+    // A reference to a deleted range is an error even for COUNT
+    bool HasDeletedRange() const;
+    // Count and kinds of the arguments fit the function: lookups and conditional aggregates
+    // take ranges at fixed places, criteria are accepted only by conditional aggregates
+    bool IsValid() const;
+
+    // Nullopt for an unknown name
+    static std::optional<Function> FromName(std::string_view name);
+private:
+    enum class Argument : char {
+        Value,
+        Range,
+        Criterion
+    };
+
+    std::vector<std::unique_ptr<Statement>> arguments;
+    std::vector<Argument> kinds;
+    Function function;
+};
+
+
+
 class UnaryOperation : public Statement {
 public:
     UnaryOperation(char op, std::unique_ptr<Statement> argument);
-    IFormula::Value Execute(const ISheet& sheet) const override;
-    std::string Formula() const override;
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+    void Arguments(std::vector<const Statement*>& arguments) const override;
 private:
     std::unique_ptr<Statement> argument;
     char operation;
@@ -48,8 +181,10 @@ class BinaryOperation : public Statement {
 public:
     BinaryOperation(char op, std::unique_ptr<Statement> lhs, 
         std::unique_ptr<Statement> rhs);
-    IFormula::Value Execute(const ISheet& sheet) const override;
-    std::string Formula() const override;
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+    void Arguments(std::vector<const Statement*>& arguments) const override;
     char getOperation();
 private:
     std::unique_ptr<Statement> lhs, rhs;
@@ -59,10 +194,37 @@ private:
 
 struct ParensStatement : public Statement {
     ParensStatement(std::unique_ptr<Statement> argument);
-    IFormula::Value Execute(const ISheet& sheet) const override;
-    std::string Formula() const override;
+    BoxedValue Execute(const ISheet& sheet) const override;
+    void Formula(std::string& text, size_t part) const override;
+    Instruction Emit() const override;
+    void Arguments(std::vector<const Statement*>& arguments) const override;
     std::unique_ptr<Statement> argument;
 };
 
 
+
+// Restores a tree from its program without parsing, e.g. when loading a snapshot.
+// Instructions are added in post-order, cell instructions carry the position instead of the pointer
+class StatementBuilder {
+public:
+    // False for an unknown instruction or operation, or when its arguments are missing.
+    // A criterion instruction carries its comparison in operation and its number in value
+    bool Add(Instruction::Code code, char operation, double value = 0.0, Position pos = {});
+    bool AddRange(Range range);
+    bool AddFunction(char operation, uint32_t count);
+    // Null unless exactly one tree was built
+    std::unique_ptr<Statement> ExtractRoot();
+    std::vector<CellStatement*> ExtractCells();
+    std::vector<RangeStatement*> ExtractRanges();
+
+private:
+    std::vector<std::unique_ptr<Statement>> stack;
+    std::vector<CellStatement*> cells;
+    std::vector<RangeStatement*> ranges;
+
+    std::unique_ptr<Statement> Pop();
+    bool IsArgumentOnTop(size_t count) const;
+};
+
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "background_snapshot.h"
+
+#include <cstdio>
+#include <fstream>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "sheet.h"
+
+
+using namespace std;
+
+
+#ifndef _WIN32
+namespace {
+
+bool SaveFile(const Sheet& sheet, const string& path, const Sheet::SnapshotProgress& progress) {
+    const string temporary = path + ".tmp";
+    {
+        ofstream output(temporary, ios::binary | ios::trunc);
+        if (output.is_open() == false)
+            return false;
+        sheet.SaveSnapshot(output, progress);
+        output.flush();
+        if (output.fail())
+            return false;
+    }
+    const int fd = open(temporary.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+}
+
+
+BackgroundSnapshot::BackgroundSnapshot(const Sheet& sheet, const string& path) {
+    void* memory = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw SnapshotError("Cannot share snapshot progress");
+    shared = new (memory) Shared;
+
+    child = fork();
+    if (child < 0) {
+        munmap(shared, sizeof(Shared));
+        throw SnapshotError("Cannot fork snapshot process");
+    }
+    if (child == 0) {
+        bool saved = false;
+        try {
+            saved = SaveFile(sheet, path, [this](uint64_t savedTiles, uint64_t tiles) {
+                shared->tiles.store(tiles, memory_order_relaxed);
+                shared->savedTiles.store(savedTiles, memory_order_relaxed);
+            });
+        }
+        catch (...) {
+        }
+        // Destructors and atexit handlers belong to the parent
+        _exit(saved ? 0 : 1);
+    }
+}
+
+
+BackgroundSnapshot::~BackgroundSnapshot() {
+    if (finished == false) {
+        int status = 0;
+        while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    munmap(shared, sizeof(Shared));
+}
+#else
+BackgroundSnapshot::BackgroundSnapshot(const Sheet& sheet, const string& path) {
+    throw logic_error("Background snapshots are not supported on this platform");
+}
+
+
+BackgroundSnapshot::~BackgroundSnapshot() {
+}
+#endif
+
+
+double BackgroundSnapshot::Progress() const {
+    if (finished)
+        return succeeded ? 1.0 : 0.0;
+    const uint64_t tiles = shared->tiles.load(memory_order_relaxed);
+    if (tiles == 0)
+        return 0.0;
+    return static_cast<double>(shared->savedTiles.load(memory_order_relaxed)) / tiles;
+}
+
+
+#ifndef _WIN32
+bool BackgroundSnapshot::Done() {
+    if (finished == false) {
+        int status = 0;
+        if (waitpid(child, &status, WNOHANG) == child)
+            Finish(status);
+    }
+    return finished;
+}
+
+
+void BackgroundSnapshot::Wait() {
+    if (finished == false) {
+        int status = 0;
+        pid_t result;
+        while ((result = waitpid(child, &status, 0)) < 0 && errno == EINTR) {
+        }
+        if (result != child)
+            throw SnapshotError("Lost snapshot process");
+        Finish(status);
+    }
+    if (succeeded == false)
+        throw SnapshotError("Background snapshot failed");
+}
+
+
+void BackgroundSnapshot::Finish(int status) {
+    finished = true;
+    succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#else
+bool BackgroundSnapshot::Done() {
+    return finished;
+}
+
+
+void BackgroundSnapshot::Wait() {
+}
+
+
+void BackgroundSnapshot::Finish(int status) {
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef TABLE_BACKGROUND_SNAPSHOT
+#define TABLE_BACKGROUND_SNAPSHOT
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+
+class Sheet;
+
+
+// Snapshot written by a forked child from its copy-on-write image of the sheet, see Sheet::SaveSnapshot.
+// The parent keeps editing meanwhile and pays only for the pages it touches first.
+// The child writes path + ".tmp" and renames it to path when the file is synced,
+// so path always holds a complete snapshot.
+// Only the forking thread exists in the child, other threads must not hold locks
+// the child needs: the child uses only the sheet and the heap.
+// Without fork, on Windows, the constructor throws std::logic_error
+class BackgroundSnapshot {
+public:
+    BackgroundSnapshot(const Sheet& sheet, const std::string& path);
+    // Waits for the child
+    ~BackgroundSnapshot();
+
+    BackgroundSnapshot(const BackgroundSnapshot&) = delete;
+    BackgroundSnapshot& operator=(const BackgroundSnapshot&) = delete;
+
+    // Share of the tiles written, from 0 to 1
+    double Progress() const;
+    // Does not block
+    bool Done();
+    // Throws SnapshotError if the child failed
+    void Wait();
+
+private:
+    struct Shared {
+        std::atomic<uint64_t> savedTiles{0};
+        std::atomic<uint64_t> tiles{0};
+    };
+
+    Shared* shared = nullptr;
+#ifndef _WIN32
+    pid_t child = -1;
+#endif
+    bool finished = false;
+    bool succeeded = false;
+
+    void Finish(int status);
+};
+
+
+#endif
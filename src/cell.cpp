@@ -2,9 +2,13 @@
 
 #include <variant>
 #include <algorithm>
+#include <charconv>
+#include <cstdlib>
 #include <iostream>
 
 #include "sheet.h"
+#include "formula_impl.h"
+#include "snapshot.h"
 
 
 
@@ -12,7 +16,7 @@ using namespace std;
 
 
 FormulaCell::FormulaCell(Sheet& sheet, std::unique_ptr<IFormula> formula, IFormula::Value cellValue) 
-    : sheet(sheet), formula(move(formula)), cellValue(cellValue), cacheInvalid(false)
+    : sheet(sheet), formula(move(formula)), cellValue(BoxedValue(cellValue)), cacheInvalid(false)
 {
 }
 
@@ -20,24 +24,73 @@ FormulaCell::FormulaCell(Sheet& sheet, std::unique_ptr<IFormula> formula, IFormu
 void FormulaCell::Update(const CellHolder* parent) const {
         if (formula) {
             sheet.UpdateDependent(parent);
-            cellValue = formula->Evaluate(sheet);
+            cellValue = BoxedValue(formula->Evaluate(sheet));
         }
         cacheInvalid = false;
 }
 
+
+BoxedValue FormulaCell::GetOperand() const {
+    return cellValue;
+}
+
+
+BoxedValue FormulaCell::GetBoxedValue() const {
+    return cellValue;
+}
+
+
 ICell::Value FormulaCell::GetValue() const {
-    if (std::holds_alternative<double>(cellValue))
-        return std::get<double>(cellValue);
-    if (std::holds_alternative<FormulaError>(cellValue))
-        return std::get<FormulaError>(cellValue);
-    return 0.0;
+    if (cellValue.IsError())
+        return cellValue.GetError();
+    return cellValue.GetNumber();
+}
+
+
+ValueView FormulaCell::GetValueView() const {
+    if (cellValue.IsError())
+        return cellValue.GetError();
+    return cellValue.GetNumber();
 }
 
 
 std::string FormulaCell::GetText() const  {
-    if (formula) 
-        return "=" + formula->GetExpression();
-    return "";
+    if (formula == nullptr)
+        return "";
+    if (auto cached = dynamic_cast<const Formula*>(formula.get()))
+        return "=" + cached->Expression();
+    return "=" + formula->GetExpression();
+}
+
+
+void FormulaCell::WriteText(TsvWriter& writer) const {
+    if (formula == nullptr)
+        return;
+    writer.Write('=');
+    if (auto cached = dynamic_cast<const Formula*>(formula.get()))
+        writer.Write(cached->Expression());
+    else
+        writer.Write(formula->GetExpression());
+}
+
+
+void FormulaCell::WriteValue(TsvWriter& writer, bool shortestNumbers) const {
+    if (cellValue.IsNumber())
+        writer.WriteNumber(cellValue.GetNumber(), shortestNumbers);
+}
+
+
+void FormulaCell::Save(SnapshotWriter& writer) const {
+    writer.Put(SnapshotCellKind::Formula);
+    dynamic_cast<const Formula&>(*formula).Save(writer);
+    if (cellValue.IsError()) {
+        writer.Put<uint8_t>(1);
+        writer.Put<uint8_t>(static_cast<uint8_t>(cellValue.GetError().GetCategory()));
+    }
+    else {
+        writer.Put<uint8_t>(0);
+        writer.Put<double>(cellValue.GetNumber());
+    }
 }
 
 
@@ -96,40 +149,166 @@ LiteralCell::LiteralCell(std::string literal)
             } 
             catch(invalid_argument& e) {
             }
+            catch(out_of_range& e) {
+                // Denormals are read as the nearest number, an overflow leaves the text
+                const double value = strtod(textValue.c_str(), nullptr);
+                if (isfinite(value))
+                    cellValue = value;
+            }
         }
 }
 
 
+LiteralCell::LiteralCell(std::string literal, double value) 
+: textValue(move(literal)), cellValue(value)
+{
+}
+
+
+LiteralCell::LiteralCell(double value) 
+: cellValue(value)
+{
+}
+
+
+// Shortest digits read back to the same number in fixed notation, as the literal parser
+// reads a text with an exponent as text. Large and tiny numbers take up to 326 characters
+const std::string& LiteralCell::Text() const {
+    if (textValue.empty()) {
+        char text[400];
+        const auto result = std::to_chars(text, text + sizeof(text), cellValue, std::chars_format::fixed);
+        textValue.assign(text, result.ptr);
+    }
+    return textValue;
+}
+
+
 ICell::Value LiteralCell::GetValue() const  {
     if (textValue[0] == '\'') 
         return textValue.substr(1);
-    if (cellValue != std::numeric_limits<double>::max())
+    if (HasNumber())
         return cellValue;
     return textValue;
 }
 
 
+ValueView LiteralCell::GetValueView() const {
+    if (textValue[0] == '\'')
+        return ValueView(std::string_view(textValue).substr(1));
+    if (HasNumber())
+        return cellValue;
+    return ValueView(std::string_view(textValue));
+}
+
+
+BoxedValue LiteralCell::GetOperand() const {
+    if (textValue[0] == '\'')
+        return BoxedValue::FromText(textValue.substr(1));
+    if (HasNumber())
+        return cellValue;
+    return BoxedValue::FromText(textValue);
+}
+
+
+BoxedValue LiteralCell::GetBoxedValue() const {
+    if (textValue[0] != '\'' && HasNumber())
+        return cellValue;
+    return BoxedValue::Text();
+}
+
+
+void LiteralCell::WriteText(TsvWriter& writer) const {
+    writer.Write(Text());
+}
+
+
+void LiteralCell::WriteValue(TsvWriter& writer, bool shortestNumbers) const {
+    if (textValue[0] == '\'') 
+        writer.Write(std::string_view(textValue).substr(1));
+    else if (HasNumber())
+        writer.WriteNumber(cellValue, shortestNumbers);
+    else
+        writer.Write(textValue);
+}
+
+
+void LiteralCell::Save(SnapshotWriter& writer) const {
+    if (HasNumber()) {
+        writer.Put(SnapshotCellKind::Number);
+        writer.PutString(Text());
+        writer.Put<double>(cellValue);
+    }
+    else {
+        writer.Put(SnapshotCellKind::Text);
+        writer.PutString(textValue);
+    }
+}
+
+
+void ErrorCell::WriteText(TsvWriter& writer) const {
+    writer.Write(textValue);
+}
+
+
+void ErrorCell::Save(SnapshotWriter& writer) const {
+    writer.Put(SnapshotCellKind::Error);
+    writer.PutString(textValue);
+    writer.Put<uint8_t>(static_cast<uint8_t>(cellValue.GetCategory()));
+}
+
+
 
 void CellHolder::reset(Sheet& sheet) {
+    sourceFingerprint = 0;
     cell = nullptr;
     sheet.InvalidateCache(this);
 }
 
 void CellHolder::reset(Sheet& sheet, std::string literal) {
+    sourceFingerprint = 0;
     cell = std::make_unique<LiteralCell>(literal); 
     sheet.InvalidateCache(this);
 }
 
 void CellHolder::reset(Sheet& sheet, std::unique_ptr<IFormula> formula, IFormula::Value cellValue) {
+    sourceFingerprint = 0;
     cell = std::make_unique<FormulaCell>(sheet, move(formula), cellValue); //Only if new value
     sheet.InvalidateCache(this);
 }
 
 void CellHolder::reset(Sheet& sheet, std::string text, FormulaError::Category errorCategory) {
+    sourceFingerprint = 0;
     cell = std::make_unique<ErrorCell>(text, errorCategory);
     sheet.InvalidateCache(this);
 }
 
+void CellHolder::reset(Sheet& sheet, std::unique_ptr<InnerCell> inner) {
+    sourceFingerprint = 0;
+    cell = move(inner);
+    sheet.InvalidateCache(this);
+}
+
+std::unique_ptr<InnerCell> CellHolder::Detach() {
+    sourceFingerprint = 0;
+    return move(cell);
+}
+
+void CellHolder::Attach(std::unique_ptr<InnerCell> inner) {
+    sourceFingerprint = 0;
+    cell = move(inner);
+}
+
+
+// 64-bit FNV-1a, std::hash has no fixed width or quality and is 32-bit on 32-bit targets
+uint64_t CellHolder::Fingerprint(std::string_view text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c: text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash != 0 ? hash : 1;
+}
+
 
  ICell::Value CellHolder::GetValue() const  {
     if (cell.get() != nullptr) {
@@ -141,6 +320,32 @@ void CellHolder::reset(Sheet& sheet, std::string text, FormulaError::Category er
     return 0.0;
 }
 
+ValueView CellHolder::GetValueView() const {
+    if (cell.get() == nullptr)
+        return 0.0;
+    if (cell->IsInvalid())
+        Update();
+    return cell->GetValueView();
+}
+
+BoxedValue CellHolder::GetOperand() const {
+    if (cell.get() == nullptr)
+        return 0.0;
+    if (cell->IsInvalid())
+        Update();
+    return cell->GetOperand();
+}
+
+
+BoxedValue CellHolder::GetBoxedValue() const {
+    if (cell.get() == nullptr)
+        return BoxedValue::Empty();
+    if (cell->IsInvalid())
+        Update();
+    return cell->GetBoxedValue();
+}
+
+
  std::string CellHolder::GetText() const  {
     string text;
     if (cell) 
@@ -148,6 +353,65 @@ void CellHolder::reset(Sheet& sheet, std::string text, FormulaError::Category er
     return text;
 }
 
+ void CellHolder::WriteText(TsvWriter& writer) const {
+    if (cell)
+        cell->WriteText(writer);
+}
+
+ void CellHolder::WriteValue(TsvWriter& writer, bool shortestNumbers) const {
+    if (cell.get() == nullptr) {
+        writer.WriteNumber(0.0, shortestNumbers);
+        return;
+    }
+    // Only formula cells get invalid
+    if (cell->IsInvalid())
+        static_cast<FormulaCell*>(cell.get())->Update(this);
+    cell->WriteValue(writer, shortestNumbers);
+}
+
+ void CellHolder::Save(SnapshotWriter& writer) const {
+    if (cell.get() == nullptr) {
+        writer.Put(SnapshotCellKind::Empty);
+        return;
+    }
+    if (cell->IsInvalid())
+        static_cast<FormulaCell*>(cell.get())->Update(this);
+    cell->Save(writer);
+}
+
+ void CellHolder::Load(Sheet& sheet, SnapshotReader& reader) {
+    sourceFingerprint = 0;
+    switch (reader.Get<SnapshotCellKind>()) {
+    case SnapshotCellKind::Empty:
+        cell = nullptr;
+        return;
+    case SnapshotCellKind::Text:
+        cell = std::make_unique<LiteralCell>(std::string(reader.GetString()), LiteralCell::kNoNumber);
+        return;
+    case SnapshotCellKind::Number: {
+        std::string text(reader.GetString());
+        cell = std::make_unique<LiteralCell>(move(text), reader.Get<double>());
+        return;
+    }
+    case SnapshotCellKind::Error: {
+        std::string text(reader.GetString());
+        cell = std::make_unique<ErrorCell>(move(text), reader.GetErrorCategory());
+        return;
+    }
+    case SnapshotCellKind::Formula: {
+        auto formula = Formula::Load(reader);
+        IFormula::Value value = 0.0;
+        if (reader.Get<uint8_t>() != 0)
+            value = FormulaError(reader.GetErrorCategory());
+        else
+            value = reader.Get<double>();
+        cell = std::make_unique<FormulaCell>(sheet, move(formula), value);
+        return;
+    }
+    }
+    throw SnapshotError("Unknown cell kind");
+ }
+
  std::vector<Position> CellHolder::GetReferencedCells() const  {
     if (cell) 
         return cell->GetReferencedCells();
@@ -156,24 +420,36 @@ void CellHolder::reset(Sheet& sheet, std::string text, FormulaError::Category er
 
 
 IFormula::HandlingResult CellHolder::HandleInsertedRows(int before, int count) { 
-    if (cell.get() != nullptr) 
-       return cell->HandleInsertedRows(before, count);
-    return IFormula::HandlingResult::NothingChanged;
+    if (cell.get() == nullptr) 
+        return IFormula::HandlingResult::NothingChanged;
+    const auto result = cell->HandleInsertedRows(before, count);
+    if (result != IFormula::HandlingResult::NothingChanged)
+        sourceFingerprint = 0;
+    return result;
 }
 IFormula::HandlingResult CellHolder::HandleInsertedCols(int before, int count)  {
-    if (cell.get() != nullptr) 
-        return cell->HandleInsertedCols(before, count);
-    return IFormula::HandlingResult::NothingChanged;
+    if (cell.get() == nullptr) 
+        return IFormula::HandlingResult::NothingChanged;
+    const auto result = cell->HandleInsertedCols(before, count);
+    if (result != IFormula::HandlingResult::NothingChanged)
+        sourceFingerprint = 0;
+    return result;
 }
 IFormula::HandlingResult CellHolder::HandleDeletedRows(int first, int count) {
-    if (cell.get() != nullptr) 
-        return cell->HandleDeletedRows(first, count);
-    return IFormula::HandlingResult::NothingChanged;
+    if (cell.get() == nullptr) 
+        return IFormula::HandlingResult::NothingChanged;
+    const auto result = cell->HandleDeletedRows(first, count);
+    if (result != IFormula::HandlingResult::NothingChanged)
+        sourceFingerprint = 0;
+    return result;
 }
 IFormula::HandlingResult CellHolder::HandleDeletedCols(int first, int count) {
-    if (cell.get() != nullptr) 
-        return cell->HandleDeletedCols(first, count);
-    return IFormula::HandlingResult::NothingChanged;
+    if (cell.get() == nullptr) 
+        return IFormula::HandlingResult::NothingChanged;
+    const auto result = cell->HandleDeletedCols(first, count);
+    if (result != IFormula::HandlingResult::NothingChanged)
+        sourceFingerprint = 0;
+    return result;
 }
 
 
@@ -184,6 +460,11 @@ bool CellHolder::IsInvalid() const {
 }
 
 
+bool CellHolder::IsEmpty() const {
+    return cell.get() == nullptr;
+}
+
+
 void CellHolder::Invalidate() const {
     if (cell.get() != nullptr) 
         cell->Invalidate();
@@ -200,7 +481,7 @@ void CellHolder::Update() const {
 
 
 bool FormulaCell::holdsError() const {
-    return std::holds_alternative<FormulaError>(cellValue);
+    return cellValue.IsError();
 }
 
 
@@ -219,6 +500,13 @@ bool CellHolder::HasFormula() const {
 }
 
 
+const IFormula* CellHolder::GetFormula() const {
+    if (auto formulaCell = dynamic_cast<const FormulaCell*>(cell.get()); formulaCell != nullptr)
+        return &formulaCell->GetFormula();
+    return nullptr;
+}
+
+
 std::string CellHolder::GetLastCall() const {
     if (cell.get()) 
         return cell->LastCallParams();
@@ -4,12 +4,16 @@
 #include "common.h"
 #include "formula.h" // позже разделить файлы
 
+#include <cmath>
 #include <iostream>
 #include <limits>
 
 
 class Sheet; 
 class CellHolder;
+class TsvWriter;
+class SnapshotWriter;
+class SnapshotReader;
 
 
 class InnerCell : public ICell {
@@ -17,6 +21,16 @@ class InnerCell : public ICell {
     virtual bool IsInvalid() const = 0;
     virtual void Invalidate() const = 0;
     virtual std::string LastCallParams() const = 0;
+    // Value read by a reference of a formula, see CellStatement::Execute
+    virtual BoxedValue GetOperand() const = 0;
+    // GetValue() with the tag of text instead of the text
+    virtual BoxedValue GetBoxedValue() const = 0;
+
+    // Export without copying the value variant, errors are written as nothing
+    virtual void WriteText(TsvWriter& writer) const = 0;
+    virtual void WriteValue(TsvWriter& writer, bool shortestNumbers) const = 0;
+    // Writes the kind and data of a snapshot cell record
+    virtual void Save(SnapshotWriter& writer) const = 0;
 
     virtual IFormula::HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
     virtual IFormula::HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
@@ -34,8 +48,11 @@ public:
 
     virtual ~FormulaCell() = default;
     virtual ICell::Value GetValue() const override ;
+    ValueView GetValueView() const override;
     virtual std::string GetText() const override ;
     virtual std::vector<Position> GetReferencedCells() const override ;
+    BoxedValue GetOperand() const override;
+    BoxedValue GetBoxedValue() const override;
 
     using FormulaPtr = std::unique_ptr<IFormula>;
 
@@ -47,17 +64,24 @@ public:
         return GetText(); 
     }
 
+    void WriteText(TsvWriter& writer) const override;
+    void WriteValue(TsvWriter& writer, bool shortestNumbers) const override;
+    void Save(SnapshotWriter& writer) const override;
+
     IFormula::HandlingResult HandleInsertedRows(int before, int count = 1);
     IFormula::HandlingResult HandleInsertedCols(int before, int count = 1);
     IFormula::HandlingResult HandleDeletedRows(int first, int count = 1);
     IFormula::HandlingResult HandleDeletedCols(int first, int count = 1);
 
     bool holdsError() const;
+    const IFormula& GetFormula() const {
+        return *formula;
+    }
     
 private:
     Sheet& sheet;
     FormulaPtr formula;
-    mutable IFormula::Value cellValue = 0.0;
+    mutable BoxedValue cellValue;
     mutable bool cacheInvalid;
 };
 
@@ -68,19 +92,35 @@ class LiteralCell : public InnerCell {
 public:
 
     LiteralCell(std::string literal);
+    // For a literal already known to hold a number
+    LiteralCell(std::string literal, double value);
+    // Number set by Sheet::SetNumber, its text is formatted by the first GetText
+    explicit LiteralCell(double value);
+
+    // Value of a literal without a number. Numbers of literals are finite: SetNumber rejects
+    // the rest and a text parsed by stod has no letters for "nan" or "inf"
+    static constexpr double kNoNumber = std::numeric_limits<double>::quiet_NaN();
 
     void Invalidate() const override {}
     bool IsInvalid() const override {
         return false;
     }
     std::string LastCallParams() const override {
-        return textValue; 
+        return Text(); 
     }
 
+    void WriteText(TsvWriter& writer) const override;
+    void WriteValue(TsvWriter& writer, bool shortestNumbers) const override;
+    void Save(SnapshotWriter& writer) const override;
+
     virtual ~LiteralCell() = default;
     virtual ICell::Value GetValue() const override;
+    // The text without the escape sign points into the literal
+    ValueView GetValueView() const override;
+    BoxedValue GetOperand() const override;
+    BoxedValue GetBoxedValue() const override;
     virtual std::string GetText() const override {
-        return textValue;
+        return Text();
     }
     virtual std::vector<Position> GetReferencedCells() const override {
         return {};
@@ -100,8 +140,14 @@ public:
     }
 
 private:
-    std::string textValue;
-    mutable double cellValue = std::numeric_limits<double>::max();
+    // Empty for a number whose text is not formatted yet
+    mutable std::string textValue;
+    mutable double cellValue = kNoNumber;
+
+    const std::string& Text() const;
+    bool HasNumber() const {
+        return std::isnan(cellValue) == false;
+    }
 };
 
 
@@ -114,12 +160,21 @@ public:
     virtual ICell::Value GetValue() const override {
         return cellValue;
     }
+    ValueView GetValueView() const override {
+        return cellValue;
+    }
     virtual std::string GetText() const override {
         return textValue;
     }
     virtual std::vector<Position> GetReferencedCells() const override {
         return {};
     }
+    BoxedValue GetOperand() const override {
+        return cellValue;
+    }
+    BoxedValue GetBoxedValue() const override {
+        return cellValue;
+    }
 
     void Invalidate() const override {}
     bool IsInvalid() const override {
@@ -128,6 +183,10 @@ public:
     std::string LastCallParams() const override {
         return textValue; 
     }
+    void WriteText(TsvWriter& writer) const override;
+    void WriteValue(TsvWriter& writer, bool shortestNumbers) const override {}
+    void Save(SnapshotWriter& writer) const override;
+
     virtual IFormula::HandlingResult HandleInsertedRows(int before, int count = 1) {
         return IFormula::HandlingResult::NothingChanged;
     }
@@ -172,10 +231,29 @@ public:
     void reset(Sheet& sheet, std::string literal);
     void reset(Sheet& sheet, std::unique_ptr<IFormula> formula, IFormula::Value cellValue);
     void reset(Sheet& sheet, std::string text, FormulaError::Category errorCategory);
+    void reset(Sheet& sheet, std::unique_ptr<InnerCell> inner);
+
+    // Swaps the inner cell without touching caches or the dependency graph
+    std::unique_ptr<InnerCell> Detach();
+    void Attach(std::unique_ptr<InnerCell> inner);
 
     virtual ICell::Value GetValue() const override ;
+    // Formulas are recalculated first as by GetValue(), an empty cell is 0
+    ValueView GetValueView() const override;
     virtual std::string GetText() const override;
     virtual std::vector<Position> GetReferencedCells() const override;
+    // Same as CellStatement::Execute of the cell without copying ICell::Value, an empty cell is 0
+    BoxedValue GetOperand() const;
+    // GetValue() without copying the text, an empty cell is BoxedValue::Empty()
+    BoxedValue GetBoxedValue() const;
+
+    // Same output as printing GetText() and GetValue(), an empty cell has value 0
+    void WriteText(TsvWriter& writer) const;
+    void WriteValue(TsvWriter& writer, bool shortestNumbers) const;
+
+    // Snapshot record of the cell without its dependents, formulas are recalculated first
+    void Save(SnapshotWriter& writer) const;
+    void Load(Sheet& sheet, SnapshotReader& reader);
 
     IFormula::HandlingResult HandleInsertedRows(int before, int count = 1);
     IFormula::HandlingResult HandleInsertedCols(int before, int count = 1);
@@ -184,15 +262,33 @@ public:
 
 
     bool IsInvalid() const; 
+    // No inner cell, e.g. a cell existing only as a reference of a formula
+    bool IsEmpty() const;
     void Update() const;
     void Invalidate() const;
     bool DepCheckFlag() const;
     bool HasFormula() const;
+    // Compiled formula of a formula cell, nullptr for other cells
+    const IFormula* GetFormula() const;
     void checkType() const;
 
     std::string GetLastCall() const;
 
     std::vector<CellHolder *> usedBy; 
+
+    // Scratch state of Sheet graph algorithms, reset after each use
+    mutable int graphMark = -1;
+    // Index of the edit of the cell in the batch of its sheet, -1 outside of a batch
+    int batchEdit = -1;
+    // Formula cell tracked by the range index of the sheet
+    mutable bool rangeIndexed = false;
+
+    // Fingerprint of the text the content was set from, 0 when unknown. Sheet::SetCell compares
+    // it to skip a repeated text without rendering the formula, see Sheet::SameText for the
+    // risk of a collision. Other changes of the content, including structural edits renaming
+    // references, forget it
+    static uint64_t Fingerprint(std::string_view text);
+    uint64_t sourceFingerprint = 0;
 };
 
 
@@ -0,0 +1,275 @@
+#include "column_kernels.h"
+
+#include <algorithm>
+#include <bitset>
+#include <limits>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TABLE_KERNELS_AVX2
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define TABLE_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+
+using namespace std;
+
+
+namespace {
+
+    constexpr double kInfinity = numeric_limits<double>::infinity();
+
+    struct Kernels {
+        const char* name;
+        double (*sum)(const double*, size_t);
+        double (*dot)(const double*, const double*, size_t);
+        void (*multiply)(double*, const double*, size_t);
+        void (*minMax)(const double*, const uint64_t*, size_t, size_t, double&, double&);
+    };
+
+    bool IsMarked(const uint64_t* marks, size_t row) {
+        return (marks[row / 64] >> (row % 64) & 1) != 0;
+    }
+
+    void MinMaxRows(const double* values, const uint64_t* marks, size_t first, size_t last, double& min, double& max) {
+        for (size_t row = first; row < last; ++row)
+            if (IsMarked(marks, row)) {
+                min = std::min(min, values[row]);
+                max = std::max(max, values[row]);
+            }
+    }
+
+
+    double SumScalar(const double* values, size_t count) {
+        double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            for (size_t lane = 0; lane < 4; ++lane)
+                lanes[lane] += values[i + lane];
+        double sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+        for (; i < count; ++i)
+            sum += values[i];
+        return sum;
+    }
+
+    double DotScalar(const double* lhs, const double* rhs, size_t count) {
+        double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            for (size_t lane = 0; lane < 4; ++lane)
+                lanes[lane] += lhs[i + lane] * rhs[i + lane];
+        double sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+        for (; i < count; ++i)
+            sum += lhs[i] * rhs[i];
+        return sum;
+    }
+
+    void MultiplyScalar(double* values, const double* factors, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            values[i] *= factors[i];
+    }
+
+    void MinMaxScalar(const double* values, const uint64_t* marks, size_t first, size_t count, double& min, double& max) {
+        MinMaxRows(values, marks, first, first + count, min, max);
+    }
+
+
+#ifdef TABLE_KERNELS_AVX2
+
+    // Lanes (l0 + l2) + (l1 + l3) as in the scalar code
+    __attribute__((target("avx2"))) double AddLanes(__m256d lanes) {
+        const __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(lanes), _mm256_extractf128_pd(lanes, 1));
+        return _mm_cvtsd_f64(pair) + _mm_cvtsd_f64(_mm_unpackhi_pd(pair, pair));
+    }
+
+    __attribute__((target("avx2"))) double SumAvx2(const double* values, size_t count) {
+        __m256d lanes = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            lanes = _mm256_add_pd(lanes, _mm256_loadu_pd(values + i));
+        double sum = AddLanes(lanes);
+        for (; i < count; ++i)
+            sum += values[i];
+        return sum;
+    }
+
+    __attribute__((target("avx2"))) double DotAvx2(const double* lhs, const double* rhs, size_t count) {
+        __m256d lanes = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            lanes = _mm256_add_pd(lanes, _mm256_mul_pd(_mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i)));
+        double sum = AddLanes(lanes);
+        for (; i < count; ++i)
+            sum += lhs[i] * rhs[i];
+        return sum;
+    }
+
+    __attribute__((target("avx2"))) void MultiplyAvx2(double* values, const double* factors, size_t count) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), _mm256_loadu_pd(factors + i)));
+        for (; i < count; ++i)
+            values[i] *= factors[i];
+    }
+
+    // Four rows aligned to four never cross a word of marks, their bits select the lanes
+    __attribute__((target("avx2"))) void MinMaxAvx2(const double* values, const uint64_t* marks, size_t first, size_t count,
+            double& min, double& max) {
+        const size_t last = first + count;
+        size_t row = std::min((first + 3) / 4 * 4, last);
+        MinMaxRows(values, marks, first, row, min, max);
+        const __m256i lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+        const __m256d high = _mm256_set1_pd(kInfinity);
+        const __m256d low = _mm256_set1_pd(-kInfinity);
+        __m256d least = high;
+        __m256d greatest = low;
+        for (; row + 4 <= last; row += 4) {
+            const long long bits = static_cast<long long>(marks[row / 64] >> (row % 64) & 15);
+            if (bits == 0)
+                continue;
+            const __m256i selected = _mm256_and_si256(_mm256_set1_epi64x(bits), lanes);
+            const __m256d mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(selected, lanes));
+            const __m256d numbers = _mm256_loadu_pd(values + row);
+            least = _mm256_min_pd(least, _mm256_blendv_pd(high, numbers, mask));
+            greatest = _mm256_max_pd(greatest, _mm256_blendv_pd(low, numbers, mask));
+        }
+        double leastLanes[4];
+        double greatestLanes[4];
+        _mm256_storeu_pd(leastLanes, least);
+        _mm256_storeu_pd(greatestLanes, greatest);
+        for (size_t lane = 0; lane < 4; ++lane) {
+            min = std::min(min, leastLanes[lane]);
+            max = std::max(max, greatestLanes[lane]);
+        }
+        MinMaxRows(values, marks, row, last, min, max);
+    }
+
+#endif
+
+
+#ifdef TABLE_KERNELS_NEON
+
+    // Lanes 0, 1 are in the first register and 2, 3 in the second, as in the scalar code
+    double AddLanes(float64x2_t first, float64x2_t second) {
+        const float64x2_t pair = vaddq_f64(first, second);
+        return vgetq_lane_f64(pair, 0) + vgetq_lane_f64(pair, 1);
+    }
+
+    double SumNeon(const double* values, size_t count) {
+        float64x2_t first = vdupq_n_f64(0.0);
+        float64x2_t second = vdupq_n_f64(0.0);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            first = vaddq_f64(first, vld1q_f64(values + i));
+            second = vaddq_f64(second, vld1q_f64(values + i + 2));
+        }
+        double sum = AddLanes(first, second);
+        for (; i < count; ++i)
+            sum += values[i];
+        return sum;
+    }
+
+    double DotNeon(const double* lhs, const double* rhs, size_t count) {
+        float64x2_t first = vdupq_n_f64(0.0);
+        float64x2_t second = vdupq_n_f64(0.0);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            first = vaddq_f64(first, vmulq_f64(vld1q_f64(lhs + i), vld1q_f64(rhs + i)));
+            second = vaddq_f64(second, vmulq_f64(vld1q_f64(lhs + i + 2), vld1q_f64(rhs + i + 2)));
+        }
+        double sum = AddLanes(first, second);
+        for (; i < count; ++i)
+            sum += lhs[i] * rhs[i];
+        return sum;
+    }
+
+    void MultiplyNeon(double* values, const double* factors, size_t count) {
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+            vst1q_f64(values + i, vmulq_f64(vld1q_f64(values + i), vld1q_f64(factors + i)));
+        for (; i < count; ++i)
+            values[i] *= factors[i];
+    }
+
+    void MinMaxNeon(const double* values, const uint64_t* marks, size_t first, size_t count, double& min, double& max) {
+        const size_t last = first + count;
+        size_t row = std::min((first + 1) / 2 * 2, last);
+        MinMaxRows(values, marks, first, row, min, max);
+        const uint64_t lanesBits[2] = {1, 2};
+        const uint64x2_t lanes = vld1q_u64(lanesBits);
+        const float64x2_t high = vdupq_n_f64(kInfinity);
+        const float64x2_t low = vdupq_n_f64(-kInfinity);
+        float64x2_t least = high;
+        float64x2_t greatest = low;
+        for (; row + 2 <= last; row += 2) {
+            const uint64_t bits = marks[row / 64] >> (row % 64) & 3;
+            if (bits == 0)
+                continue;
+            const uint64x2_t mask = vtstq_u64(vdupq_n_u64(bits), lanes);
+            const float64x2_t numbers = vld1q_f64(values + row);
+            least = vminq_f64(least, vbslq_f64(mask, numbers, high));
+            greatest = vmaxq_f64(greatest, vbslq_f64(mask, numbers, low));
+        }
+        min = std::min({min, vgetq_lane_f64(least, 0), vgetq_lane_f64(least, 1)});
+        max = std::max({max, vgetq_lane_f64(greatest, 0), vgetq_lane_f64(greatest, 1)});
+        MinMaxRows(values, marks, row, last, min, max);
+    }
+
+#endif
+
+
+    const Kernels& Selected() {
+        static const Kernels kernels = [] {
+#if defined(TABLE_KERNELS_AVX2)
+            if (__builtin_cpu_supports("avx2"))
+                return Kernels{"avx2", SumAvx2, DotAvx2, MultiplyAvx2, MinMaxAvx2};
+#elif defined(TABLE_KERNELS_NEON)
+            return Kernels{"neon", SumNeon, DotNeon, MultiplyNeon, MinMaxNeon};
+#endif
+            return Kernels{"scalar", SumScalar, DotScalar, MultiplyScalar, MinMaxScalar};
+        }();
+        return kernels;
+    }
+
+}
+
+
+const char* KernelsName() {
+    return Selected().name;
+}
+
+
+double SumNumbers(const double* values, size_t count) {
+    return Selected().sum(values, count);
+}
+
+
+double DotNumbers(const double* lhs, const double* rhs, size_t count) {
+    return Selected().dot(lhs, rhs, count);
+}
+
+
+void MultiplyNumbers(double* values, const double* factors, size_t count) {
+    Selected().multiply(values, factors, count);
+}
+
+
+void MinMaxNumbers(const double* values, const uint64_t* marks, size_t first, size_t count, double& min, double& max) {
+    Selected().minMax(values, marks, first, count, min, max);
+}
+
+
+size_t CountMarked(const uint64_t* marks, size_t first, size_t count) {
+    size_t marked = 0;
+    for (size_t row = first, last = first + count; row < last;) {
+        const size_t bit = row % 64;
+        const size_t taken = std::min<size_t>(64 - bit, last - row);
+        uint64_t word = marks[row / 64] >> bit;
+        if (taken < 64)
+            word &= (uint64_t{1} << taken) - 1;
+        marked += bitset<64>(word).count();
+        row += taken;
+    }
+    return marked;
+}
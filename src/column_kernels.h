@@ -0,0 +1,25 @@
+#ifndef TABLE_COLUMN_KERNELS
+#define TABLE_COLUMN_KERNELS
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Loops over dense columns of numbers. The widest implementation the processor supports
+// is chosen by the first call: AVX2 on x86-64, NEON on ARM64, scalar loops otherwise.
+// Sums are accumulated in four interleaved lanes by every implementation, so the results
+// do not depend on the one chosen. A row is marked by bit row % 64 of word row / 64
+
+// "avx2", "neon" or "scalar"
+const char* KernelsName();
+
+double SumNumbers(const double* values, size_t count);
+double DotNumbers(const double* lhs, const double* rhs, size_t count);
+// values[i] *= factors[i]
+void MultiplyNumbers(double* values, const double* factors, size_t count);
+// Extends min and max by the marked rows among [first, first + count)
+void MinMaxNumbers(const double* values, const uint64_t* marks, size_t first, size_t count, double& min, double& max);
+size_t CountMarked(const uint64_t* marks, size_t first, size_t count);
+
+
+#endif
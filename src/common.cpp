@@ -2,6 +2,9 @@
 #include <iostream>
 #include <string>
 #include <charconv>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 
 using namespace std;
 
@@ -104,6 +107,29 @@ bool Size::operator==(const Size& rhs) const {
 
 
 
+bool Range::operator==(const Range& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() 
+        && first.row <= last.row && first.col <= last.col;
+}
+
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row 
+        && pos.col >= first.col && pos.col <= last.col;
+}
+
+
+Size Range::GetSize() const {
+    return {last.row - first.row + 1, last.col - first.col + 1};
+}
+
+
+
 FormulaError::FormulaError(FormulaError::Category category) 
     : category_(category) {}
 
@@ -133,3 +159,240 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output;
 }
 
+
+ICell::Value ValueView::ToValue() const {
+    switch (kind_) {
+    case Kind::Text:
+        return string(text_);
+    case Kind::Number:
+        return number_;
+    default:
+        return error_;
+    }
+}
+
+
+BoxedValue::BoxedValue(const variant<double, FormulaError>& value) {
+    if (holds_alternative<double>(value))
+        *this = BoxedValue(get<double>(value));
+    else
+        *this = BoxedValue(get<FormulaError>(value));
+}
+
+
+BoxedValue BoxedValue::FromText(const string& text) {
+    bool containsLetter = find_if(text.begin(), text.end(),
+            [](char c) { return isalpha(c); }) != text.end();
+    if (containsLetter)
+        return FormulaError(FormulaError::Category::Value);
+    try {
+        return stod(text);
+    }
+    catch(invalid_argument& e) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    catch(out_of_range& e) {
+        // Read as by LiteralCell: denormals are numbers, digits beyond the largest double are not
+        const double value = strtod(text.c_str(), nullptr);
+        if (isfinite(value))
+            return value;
+        return FormulaError(FormulaError::Category::Value);
+    }
+}
+
+
+variant<double, FormulaError> BoxedValue::ToFormulaValue() const {
+    switch (GetKind()) {
+    case Kind::Number:
+        return GetNumber();
+    case Kind::Error:
+        return GetError();
+    case Kind::Text:
+        return FormulaError(FormulaError::Category::Value);
+    case Kind::Empty:
+        break;
+    }
+    return 0.0;
+}
+
+
+
+
+void RangeSummary::Add(ValueView value) {
+    if (value.IsNumber()) {
+        const double number = value.GetNumber();
+        sum += number;
+        min = std::min(min, number);
+        max = std::max(max, number);
+        ++count;
+    }
+    else if (value.IsError() && error.has_value() == false)
+        error = value.GetError();
+}
+
+
+void RangeSummary::Merge(const RangeSummary& other) {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+    if (error.has_value() == false)
+        error = other.error;
+}
+
+
+namespace {
+    constexpr string_view kComparisonSigns[] = {"=", "<>", "<", "<=", ">", ">="};
+}
+
+
+bool Criterion::Matches(double number) const {
+    switch (comparison) {
+    case Comparison::Equal:
+        return number == value;
+    case Comparison::NotEqual:
+        return number != value;
+    case Comparison::Less:
+        return number < value;
+    case Comparison::LessOrEqual:
+        return number <= value;
+    case Comparison::Greater:
+        return number > value;
+    case Comparison::GreaterOrEqual:
+        return number >= value;
+    }
+    return false;
+}
+
+
+string Criterion::ToString() const {
+    char text[32];
+    const auto result = to_chars(text, text + sizeof(text), value);
+    string criterion(kComparisonSigns[static_cast<size_t>(comparison)]);
+    return criterion.append(text, result.ptr);
+}
+
+
+// The longest sign is taken, so "<=" is not read as "<" followed by "=..."
+optional<Criterion> Criterion::FromString(string_view text) {
+    Criterion criterion;
+    size_t signLength = 0;
+    for (size_t i = 0; i < size(kComparisonSigns); ++i)
+        if (text.substr(0, kComparisonSigns[i].size()) == kComparisonSigns[i] && kComparisonSigns[i].size() > signLength) {
+            criterion.comparison = static_cast<Comparison>(i);
+            signLength = kComparisonSigns[i].size();
+        }
+    text.remove_prefix(signLength);
+    const auto [ptr, ec] = from_chars(text.data(), text.data() + text.size(), criterion.value);
+    if (text.empty() || ec != errc() || ptr != text.data() + text.size() || isfinite(criterion.value) == false)
+        return nullopt;
+    return criterion;
+}
+
+
+RangeSummary ISheet::SummarizeRange(Range range) const {
+    RangeSummary summary;
+    const Size size = GetPrintableSize();
+    const int lastRow = std::min(range.last.row, size.rows - 1);
+    const int lastCol = std::min(range.last.col, size.cols - 1);
+    for (int i = range.first.row; i <= lastRow; ++i)
+        for (int j = range.first.col; j <= lastCol; ++j)
+            if (const ICell* cell = GetCell({i, j}); cell != nullptr && cell->GetText().empty() == false)
+                summary.Add(cell->GetValueView());
+    return summary;
+}
+
+
+optional<int> ISheet::LookupRange(Range range, double value, LookupMode mode) const {
+    const Size size = GetPrintableSize();
+    const int lastRow = std::min(range.last.row, size.rows - 1);
+    const int lastCol = std::min(range.last.col, size.cols - 1);
+    optional<int> found;
+    double best = 0.0;
+    int offset = 0;
+    for (int i = range.first.row; i <= lastRow; ++i)
+        for (int j = range.first.col; j <= lastCol; ++j, ++offset) {
+            const ICell* cell = GetCell({i, j});
+            if (cell == nullptr || cell->GetText().empty())
+                continue;
+            const ValueView cellValue = cell->GetValueView();
+            if (cellValue.IsNumber() == false)
+                continue;
+            const double number = cellValue.GetNumber();
+            const bool fits = number == value || (mode == LookupMode::NextSmaller && number < value)
+                || (mode == LookupMode::NextLarger && number > value);
+            const bool nearer = (mode == LookupMode::NextSmaller && number > best)
+                || (mode == LookupMode::NextLarger && number < best);
+            if (fits == false || (found && nearer == false))
+                continue;
+            found = offset;
+            best = number;
+        }
+    return found;
+}
+
+
+RangeSummary ISheet::SummarizeIf(Range range, const Criterion& criterion, Range sumRange) const {
+    RangeSummary summary;
+    const Size size = GetPrintableSize();
+    const int lastRow = std::min(range.last.row, size.rows - 1);
+    const int lastCol = std::min(range.last.col, size.cols - 1);
+    for (int i = range.first.row; i <= lastRow; ++i)
+        for (int j = range.first.col; j <= lastCol; ++j) {
+            const ICell* cell = GetCell({i, j});
+            if (cell == nullptr || cell->GetText().empty())
+                continue;
+            const ValueView cellValue = cell->GetValueView();
+            if (cellValue.IsNumber() == false || criterion.Matches(cellValue.GetNumber()) == false)
+                continue;
+            const Position pos{sumRange.first.row + i - range.first.row, sumRange.first.col + j - range.first.col};
+            if (const ICell* sumCell = GetCell(pos); sumCell != nullptr && sumCell->GetText().empty() == false)
+                summary.Add(sumCell->GetValueView());
+        }
+    return summary;
+}
+
+
+RangeSummary ISheet::SumProduct(const std::vector<Range>& ranges) const {
+    RangeSummary summary;
+    const Range& shape = ranges.front();
+    for (const auto& range: ranges) {
+        for (int i = range.first.row; i <= range.last.row && summary.error.has_value() == false; ++i)
+            for (int j = range.first.col; j <= range.last.col && summary.error.has_value() == false; ++j)
+                if (const ICell* cell = GetCell({i, j}); cell != nullptr && cell->GetText().empty() == false)
+                    if (const ValueView value = cell->GetValueView(); value.IsError())
+                        summary.error = value.GetError();
+    }
+    const Size size = GetPrintableSize();
+    for (int i = 0; i <= shape.last.row - shape.first.row; ++i)
+        for (int j = 0; j <= shape.last.col - shape.first.col; ++j) {
+            double product = 1.0;
+            for (const auto& range: ranges) {
+                const Position pos{range.first.row + i, range.first.col + j};
+                const ICell* cell = pos.row < size.rows && pos.col < size.cols ? GetCell(pos) : nullptr;
+                const ValueView value = cell != nullptr && cell->GetText().empty() == false ? cell->GetValueView() : ValueView(0.0);
+                product *= value.IsNumber() ? value.GetNumber() : 0.0;
+            }
+            summary.sum += product;
+        }
+    return summary;
+}
+
+
+BoxedValue ISheet::GetOperand(Position pos) const {
+    const ICell* cell = GetCell(pos);
+    if (cell == nullptr)
+        return 0.0;
+    const ValueView value = cell->GetValueView();
+    if (value.IsText())
+        return BoxedValue::FromText(string(value.GetText()));
+    if (value.IsNumber())
+        return value.GetNumber();
+    return value.GetError();
+}
+
+
+ValueView ISheet::GetValueView(Position pos) const {
+    const ICell* cell = GetCell(pos);
+    return cell != nullptr ? cell->GetValueView() : ValueView(0.0);
+}
@@ -1,8 +1,12 @@
 #ifndef TABLE_COMMON
 #define TABLE_COMMON
 
+#include <cstdint>
+#include <cstring>
 #include <iosfwd>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -22,8 +26,8 @@ struct Position {
 
   static Position FromString(std::string_view str);
 
-  static const int kMaxRows = 16384;
-  static const int kMaxCols = 16384;
+  static constexpr int kMaxRows = 16384;
+  static constexpr int kMaxCols = 16384;
 };
 
 struct Size {
@@ -33,6 +37,18 @@ struct Size {
   bool operator==(const Size& rhs) const;
 };
 
+// Прямоугольная область ячеек, обе границы включаются в область.
+struct Range {
+  Position first;
+  Position last;
+
+  bool operator==(const Range& rhs) const;
+
+  bool IsValid() const;
+  bool Contains(Position pos) const;
+  Size GetSize() const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -83,6 +99,76 @@ public:
   using std::runtime_error::runtime_error;
 };
 
+// Видимое значение ячейки без копирования: текст не копируется, а
+// указывает внутрь ячейки, см. ICell::GetValueView()
+class ValueView {
+public:
+  enum class Kind : uint8_t {
+    Text,
+    Number,
+    Error,
+  };
+
+  ValueView(double number);
+  ValueView(FormulaError error);
+  explicit ValueView(std::string_view text);
+  // Текст временной строки пережил бы её, такое представление запрещено
+  explicit ValueView(std::string&& text) = delete;
+
+  Kind GetKind() const;
+  bool IsText() const;
+  bool IsNumber() const;
+  bool IsError() const;
+  std::string_view GetText() const;
+  double GetNumber() const;
+  FormulaError GetError() const;
+  // Копия значения, как его возвращает ICell::GetValue()
+  std::variant<std::string, double, FormulaError> ToValue() const;
+
+private:
+  Kind kind_;
+  std::string_view text_;
+  double number_ = 0.0;
+  FormulaError error_ = FormulaError::Category::Value;
+};
+
+inline ValueView::ValueView(double number)
+    : kind_(Kind::Number), number_(number) {}
+
+inline ValueView::ValueView(FormulaError error)
+    : kind_(Kind::Error), error_(error) {}
+
+inline ValueView::ValueView(std::string_view text)
+    : kind_(Kind::Text), text_(text) {}
+
+inline ValueView::Kind ValueView::GetKind() const {
+  return kind_;
+}
+
+inline bool ValueView::IsText() const {
+  return kind_ == Kind::Text;
+}
+
+inline bool ValueView::IsNumber() const {
+  return kind_ == Kind::Number;
+}
+
+inline bool ValueView::IsError() const {
+  return kind_ == Kind::Error;
+}
+
+inline std::string_view ValueView::GetText() const {
+  return text_;
+}
+
+inline double ValueView::GetNumber() const {
+  return number_;
+}
+
+inline FormulaError ValueView::GetError() const {
+  return error_;
+}
+
 class ICell {
 public:
   // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -95,6 +181,14 @@ public:
   // В случае текстовой ячейки это её текст (без экранирующих символов). В
   // случае формулы - числовое значение формулы или сообщение об ошибке.
   virtual Value GetValue() const = 0;
+  // То же видимое значение без выделения памяти: текст ячейки отдаётся как
+  // std::string_view, указывающий внутрь таблицы. Представление действительно,
+  // пока таблица не изменена: любой неконстантный метод таблицы (SetCell,
+  // ClearCell, вставка и удаление строк и столбцов, откат и загрузка) может
+  // сделать его текст недействительным. Чтения, в том числе пересчёт формул
+  // при чтении, представлений не портят. Для хранения дольше используйте
+  // ValueView::ToValue().
+  virtual ValueView GetValueView() const = 0;
   // Возвращает внутренний текст ячейки, как если бы мы начали её
   // редактирование. В случае текстовой ячейки это её текст (возможно,
   // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -109,6 +203,141 @@ public:
 inline constexpr char kFormulaSign = '=';
 inline constexpr char kEscapeSign = '\'';
 
+// Значение в 8 байтах для вычислений внутри таблицы: число хранится как
+// double, а ошибка, текст и пустая ячейка - как NaN с тегом в старших битах.
+// NaN-числа приводятся к одному каноническому NaN и с тегами не совпадают.
+// Наружу значения отдаются вариантами ICell::Value и IFormula::Value.
+class BoxedValue {
+public:
+  enum class Kind : uint8_t {
+    Number,
+    Error,
+    Text,   // только признак текста, сам текст хранит ячейка
+    Empty,
+  };
+
+  BoxedValue() = default;  // число 0
+  BoxedValue(double number);
+  BoxedValue(FormulaError error);
+  explicit BoxedValue(const std::variant<double, FormulaError>& value);
+  static BoxedValue Text();
+  static BoxedValue Empty();
+  // Текст ячейки как операнд формулы: число либо ошибка #VALUE!
+  static BoxedValue FromText(const std::string& text);
+
+  Kind GetKind() const;
+  bool IsNumber() const;
+  bool IsError() const;
+  double GetNumber() const;
+  FormulaError GetError() const;
+  // Текст даёт ошибку #VALUE!, пустое значение - ноль
+  std::variant<double, FormulaError> ToFormulaValue() const;
+
+  bool operator==(BoxedValue rhs) const;
+
+private:
+  static constexpr uint64_t kTag = 0xFFFF000000000000;
+  static constexpr uint64_t kCanonicalNaN = 0x7FF8000000000000;
+
+  static BoxedValue Tagged(Kind kind, uint32_t payload);
+
+  uint64_t bits = 0;
+};
+
+static_assert(sizeof(BoxedValue) == 8);
+
+inline BoxedValue::BoxedValue(double number) {
+  if (number != number)
+    bits = kCanonicalNaN;
+  else
+    std::memcpy(&bits, &number, sizeof(bits));
+}
+
+inline BoxedValue::BoxedValue(FormulaError error)
+    : bits(Tagged(Kind::Error, static_cast<uint32_t>(error.GetCategory())).bits) {}
+
+inline BoxedValue BoxedValue::Tagged(Kind kind, uint32_t payload) {
+  BoxedValue value;
+  value.bits = kTag | uint64_t{static_cast<uint8_t>(kind)} << 32 | payload;
+  return value;
+}
+
+inline BoxedValue BoxedValue::Text() {
+  return Tagged(Kind::Text, 0);
+}
+
+inline BoxedValue BoxedValue::Empty() {
+  return Tagged(Kind::Empty, 0);
+}
+
+inline bool BoxedValue::IsNumber() const {
+  return (bits & kTag) != kTag;
+}
+
+inline BoxedValue::Kind BoxedValue::GetKind() const {
+  return IsNumber() ? Kind::Number : static_cast<Kind>(bits >> 32 & 0xFF);
+}
+
+inline bool BoxedValue::IsError() const {
+  return GetKind() == Kind::Error;
+}
+
+inline double BoxedValue::GetNumber() const {
+  double number;
+  std::memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+
+inline FormulaError BoxedValue::GetError() const {
+  return FormulaError(static_cast<FormulaError::Category>(bits & 0xFFFFFFFF));
+}
+
+inline bool BoxedValue::operator==(BoxedValue rhs) const {
+  return bits == rhs.bits;
+}
+
+// Итоги по значениям ячеек для агрегатных функций. Числа учитываются, текст и
+// пустые ячейки пропускаются, из ошибок запоминается первая добавленная.
+struct RangeSummary {
+  double sum = 0.0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  size_t count = 0;
+  std::optional<FormulaError> error;
+
+  void Add(ValueView value);
+  // Добавляет числа другого итога, его ошибка берётся, если своей ещё нет
+  void Merge(const RangeSummary& other);
+};
+
+// Способ поиска числа функциями MATCH, VLOOKUP и XLOOKUP
+enum class LookupMode {
+  Exact,        // только равное число
+  NextSmaller,  // равное, иначе наибольшее из меньших
+  NextLarger,   // равное, иначе наименьшее из больших
+};
+
+// Условие функций SUMIF, COUNTIF и AVERAGEIF: сравнение числа ячейки с
+// заданным. Текст, ошибки и пустые ячейки условию не удовлетворяют.
+struct Criterion {
+  enum class Comparison : char {
+    Equal,
+    NotEqual,
+    Less,
+    LessOrEqual,
+    Greater,
+    GreaterOrEqual,
+  };
+
+  Comparison comparison = Comparison::Equal;
+  double value = 0.0;
+
+  bool Matches(double number) const;
+  // Запись вида "<=5": знак сравнения (по умолчанию "=") и число
+  std::string ToString() const;
+  static std::optional<Criterion> FromString(std::string_view text);
+};
+
 // Интерфейс таблицы
 class ISheet {
 public:
@@ -166,6 +395,37 @@ public:
   // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
   virtual void PrintValues(std::ostream& output) const = 0;
   virtual void PrintTexts(std::ostream& output) const = 0;
+
+  // Вычисляет итоги по непустым ячейкам корректного диапазона, ошибки
+  // учитываются построчно. По умолчанию перебирает ячейки через GetCell().
+  virtual RangeSummary SummarizeRange(Range range) const;
+
+  // Ищет число в диапазоне из одной строки или одного столбца. Возвращает
+  // номер (с нуля) первой ячейки с подходящим числом или nullopt. Текст,
+  // ошибки и пустые ячейки не совпадают ни с чем. По умолчанию перебирает
+  // ячейки через GetCell().
+  virtual std::optional<int> LookupRange(Range range, double value, LookupMode mode) const;
+
+  // Вычисляет итоги по ячейкам sumRange того же размера, что и range, для
+  // которых соответствующая ячейка range удовлетворяет условию. По умолчанию
+  // перебирает ячейки через GetCell().
+  virtual RangeSummary SummarizeIf(Range range, const Criterion& criterion, Range sumRange) const;
+
+  // Вычисляет сумму произведений чисел ячеек, стоящих на одинаковых местах
+  // диапазонов одного размера. Текст и пустые ячейки считаются нулями, из
+  // ошибок берётся первая построчно в первом содержащем их диапазоне. По
+  // умолчанию перебирает ячейки через GetCell().
+  virtual RangeSummary SumProduct(const std::vector<Range>& ranges) const;
+
+  // Возвращает значение ячейки корректной позиции как операнд формулы: число,
+  // ошибку, текст через BoxedValue::FromText, ноль для пустой ячейки. По
+  // умолчанию читает значение через GetCell().
+  virtual BoxedValue GetOperand(Position pos) const;
+
+  // Возвращает видимое значение ячейки без копирования текста, ноль для
+  // пустой ячейки. Действительно, как и ICell::GetValueView(), до изменения
+  // таблицы.
+  ValueView GetValueView(Position pos) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -11,20 +11,103 @@
 
 using namespace std;
 
-Formula::Formula(Listener *l) {
-    rootStatement = move(l->extractRootStatement());
-    referencedPtrs = move(l->extractCellsPtrs());
+Formula::Formula(Listener *l) 
+    : Formula(l->extractRootStatement(), l->extractCellsPtrs(), l->extractRangesPtrs()) {
+}
+
+
+Formula::Formula(unique_ptr<Statement> root, vector<CellStatement*> cells, vector<RangeStatement*> ranges) {
+    rootStatement = move(root);
+    referencedPtrs = move(cells);
+    rangePtrs = move(ranges);
+    program = Compile(*rootStatement);
     UpdateRefs();
 }
+
+
+void Formula::Save(SnapshotWriter& writer) const {
+    writer.Put<uint32_t>(static_cast<uint32_t>(program.size()));
+    for (const auto& instruction: program) {
+        writer.Put<uint8_t>(static_cast<uint8_t>(instruction.code));
+        writer.Put<char>(instruction.operation);
+        if (instruction.code == Instruction::Code::Literal || instruction.code == Instruction::Code::Criterion)
+            writer.Put<double>(instruction.value);
+        else if (instruction.code == Instruction::Code::Cell)
+            writer.PutPosition(instruction.cell->pos);
+        else if (instruction.code == Instruction::Code::Range) {
+            writer.PutPosition(instruction.range->range.first);
+            writer.PutPosition(instruction.range->range.last);
+        }
+        else if (instruction.code == Instruction::Code::Function)
+            writer.Put<uint32_t>(static_cast<uint32_t>(instruction.function->ArgumentCount()));
+    }
+}
+
+
+unique_ptr<Formula> Formula::Load(SnapshotReader& reader) {
+    StatementBuilder builder;
+    const uint32_t size = reader.Get<uint32_t>();
+    for (uint32_t i = 0; i < size; ++i) {
+        const auto code = static_cast<Instruction::Code>(reader.Get<uint8_t>());
+        const char operation = reader.Get<char>();
+        double value = 0.0;
+        Position pos;
+        bool added = false;
+        if (code == Instruction::Code::Range) {
+            Range range;
+            range.first = reader.GetPosition();
+            range.last = reader.GetPosition();
+            added = builder.AddRange(range);
+        }
+        else if (code == Instruction::Code::Function)
+            added = builder.AddFunction(operation, reader.Get<uint32_t>());
+        else {
+            if (code == Instruction::Code::Literal || code == Instruction::Code::Criterion)
+                value = reader.Get<double>();
+            else if (code == Instruction::Code::Cell)
+                pos = reader.GetPosition();
+            added = builder.Add(code, operation, value, pos);
+        }
+        if (added == false)
+            throw SnapshotError("Malformed formula program");
+    }
+    auto root = builder.ExtractRoot();
+    if (root == nullptr)
+        throw SnapshotError("Malformed formula program");
+    return make_unique<Formula>(move(root), builder.ExtractCells(), builder.ExtractRanges());
+}
+
+
+void Formula::SkipProgram(SnapshotReader& reader) {
+    const uint32_t size = reader.Get<uint32_t>();
+    for (uint32_t i = 0; i < size; ++i) {
+        const auto code = static_cast<Instruction::Code>(reader.Get<uint8_t>());
+        reader.Get<char>();
+        if (code == Instruction::Code::Literal || code == Instruction::Code::Cell
+                || code == Instruction::Code::Criterion)
+            reader.GetBytes(8);
+        else if (code == Instruction::Code::Range)
+            reader.GetBytes(16);
+        else if (code == Instruction::Code::Function)
+            reader.GetBytes(4);
+    }
+}
     
 
 IFormula::Value Formula::Evaluate(const ISheet& sheet) const  {
-    return rootStatement->Execute(sheet);;
+    return Execute(program, sheet).ToFormulaValue();
 }
 
 
 std::string Formula::GetExpression() const  {
-    return rootStatement->Formula();
+    return Expression();
+}
+
+
+const std::string& Formula::Expression() const {
+    if (expression.empty())
+        Render(*rootStatement, expression);
+    return expression;
 }
 
 
@@ -33,6 +116,36 @@ std::vector<Position> Formula::GetReferencedCells() const {
 }
 
 
+std::vector<Range> Formula::GetReferencedRanges() const {
+    std::vector<Range> ranges;
+    ranges.reserve(rangePtrs.size());
+    for (const auto& rangePtr: rangePtrs)
+        if (rangePtr->range.first.IsValid())
+            ranges.push_back(rangePtr->range);
+    return ranges;
+}
+
+
+bool Formula::HasInvalidReferences() const {
+    for (const auto& cellPtr: referencedPtrs) {
+        const auto& pos = cellPtr->pos;
+        if (pos.IsValid() == false && (pos.row != -1 || pos.col != -1))
+            return true;
+    }
+    for (const auto& rangePtr: rangePtrs) {
+        const auto& range = rangePtr->range;
+        if (range.IsValid() == false && (range.first.row != -1 || range.first.col != -1))
+            return true;
+    }
+    return false;
+}
+
+
+const Program& Formula::GetProgram() const {
+    return program;
+}
+
+
 void Formula::UpdateRefs() {
     refCells.clear();
     set<Position> s; 
@@ -47,8 +160,77 @@ void Formula::UpdateRefs() {
 
 
 
-IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
+// An insertion inside of a range grows it
+IFormula::HandlingResult Formula::HandleInsertedRanges(int before, int count, bool rows) {
+    auto handlingResult = IFormula::HandlingResult::NothingChanged;
+    for (const auto ptr: rangePtrs) {
+        auto& range = ptr->range;
+        if (range.first.IsValid() == false)
+            continue;
+        int& first = rows ? range.first.row : range.first.col;
+        int& last = rows ? range.last.row : range.last.col;
+        if (last < before)
+            continue;
+        if (first >= before)
+            first += count;
+        last += count;
+        if (last >= 16384)
+            throw TableTooBigException("Cannot move range");
+        handlingResult = IFormula::HandlingResult::ReferencesRenamedOnly;
+    }
+    return handlingResult;
+}
+
+
+// A deletion inside of a range shrinks it, a range deleted as a whole becomes #!REF
+IFormula::HandlingResult Formula::HandleDeletedRanges(int firstDeleted, int count, bool rows) {
     auto handlingResult = IFormula::HandlingResult::NothingChanged;
+    const int lastDeleted = firstDeleted + count - 1;
+    for (const auto ptr: rangePtrs) {
+        auto& range = ptr->range;
+        if (range.first.IsValid() == false)
+            continue;
+        int& first = rows ? range.first.row : range.first.col;
+        int& last = rows ? range.last.row : range.last.col;
+        if (last < firstDeleted)
+            continue;
+        if (first > lastDeleted) {
+            first -= count;
+            last -= count;
+            if (handlingResult != IFormula::HandlingResult::ReferencesChanged)
+                handlingResult = IFormula::HandlingResult::ReferencesRenamedOnly;
+            continue;
+        }
+        handlingResult = IFormula::HandlingResult::ReferencesChanged;
+        if (first >= firstDeleted && last <= lastDeleted) {
+            range = {{-1, -1}, {-1, -1}};
+            continue;
+        }
+        first = min(first, firstDeleted);
+        last = last > lastDeleted ? last - count : firstDeleted - 1;
+    }
+    return handlingResult;
+}
+
+
+IFormula::HandlingResult Formula::Handled(IFormula::HandlingResult result) {
+    if (result != IFormula::HandlingResult::NothingChanged)
+        expression.clear();
+    return result;
+}
+
+
+namespace {
+
+IFormula::HandlingResult Combine(IFormula::HandlingResult lhs, IFormula::HandlingResult rhs) {
+    return static_cast<int>(lhs) > static_cast<int>(rhs) ? lhs : rhs;
+}
+
+}
+
+
+IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
+    auto handlingResult = HandleInsertedRanges(before, count, true);
     const auto& cellsPtrs = referencedPtrs;
     for (const auto ptr: cellsPtrs) {
         auto& pos = ptr->pos;
@@ -63,13 +245,13 @@ IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
     if (handlingResult == IFormula::HandlingResult::ReferencesRenamedOnly)
         UpdateRefs();
 
-    return handlingResult;
+    return Handled(handlingResult);
 }
 
 
 IFormula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
 
-    auto handlingResult = IFormula::HandlingResult::NothingChanged;
+    auto handlingResult = HandleInsertedRanges(before, count, false);
 
     const auto& cellsPtrs = referencedPtrs;
     for (const auto ptr: cellsPtrs) {
@@ -85,7 +267,7 @@ IFormula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
     if (handlingResult == IFormula::HandlingResult::ReferencesRenamedOnly)
         UpdateRefs();
 
-    return handlingResult;
+    return Handled(handlingResult);
 }
 
 
@@ -109,7 +291,7 @@ IFormula::HandlingResult Formula::HandleDeletedRows(int first, int count) {
     if (handlingResult != IFormula::HandlingResult::NothingChanged)
         UpdateRefs();
 
-    return handlingResult;
+    return Handled(Combine(handlingResult, HandleDeletedRanges(first, count, true)));
 }
 
 
@@ -130,7 +312,7 @@ IFormula::HandlingResult Formula::HandleDeletedCols(int first, int count) {
     }
     if (handlingResult != IFormula::HandlingResult::NothingChanged)
         UpdateRefs();
-    return handlingResult;
+    return Handled(Combine(handlingResult, HandleDeletedRanges(first, count, false)));
 }
 
 
@@ -43,6 +43,11 @@ public:
   // ячеек.
   virtual std::vector<Position> GetReferencedCells() const = 0;
 
+  // Возвращает диапазоны, которые задействованы в вычислении формулы как
+  // аргументы функций, в порядке их записи. Ячейки диапазонов не входят в
+  // GetReferencedCells().
+  virtual std::vector<Range> GetReferencedRanges() const { return {}; }
+
   // Обновляет формулу при вставке заданного числа строк/столбцов перед
   // строкой/столбцом с заданным индексом.
   // Все ссылки обновляются таким образом, чтобы указывать на те же ячейки, что
@@ -4,6 +4,7 @@
 #include "formula.h"
 
 #include "listener.h"
+#include "snapshot.h"
 
 
 class Formula : public IFormula {
@@ -11,24 +12,46 @@ public:
 
     virtual ~Formula() = default;
     Formula(Listener *l);
+    Formula(std::unique_ptr<Statement> root, std::vector<CellStatement*> cells,
+        std::vector<RangeStatement*> ranges = {});
+
+    // Program of the formula in the snapshot format
+    void Save(SnapshotWriter& writer) const;
+    static std::unique_ptr<Formula> Load(SnapshotReader& reader);
+    static void SkipProgram(SnapshotReader& reader);
 
     virtual IFormula::Value Evaluate(const ISheet& sheet) const override;
     virtual std::string GetExpression() const override;
+    // Text of GetExpression, rendered by the first call and kept until the references move
+    const std::string& Expression() const;
     virtual std::vector<Position> GetReferencedCells() const override;
+    virtual std::vector<Range> GetReferencedRanges() const override;
 
     virtual IFormula::HandlingResult HandleInsertedRows(int before, int count = 1) override;
     virtual IFormula::HandlingResult HandleInsertedCols(int before, int count = 1) override;
     virtual IFormula::HandlingResult HandleDeletedRows(int first, int count = 1) override;
     virtual IFormula::HandlingResult HandleDeletedCols(int first, int count = 1) override;
 
+    // True if evaluation would throw FormulaException for a reference out of the table
+    bool HasInvalidReferences() const;
+
+    const Program& GetProgram() const;
 
 private:
 
     void UpdateRefs();
+    IFormula::HandlingResult HandleInsertedRanges(int before, int count, bool rows);
+    IFormula::HandlingResult HandleDeletedRanges(int first, int count, bool rows);
+    // Drops the rendered text unless nothing changed
+    IFormula::HandlingResult Handled(IFormula::HandlingResult result);
 
     std::vector<Position> refCells;
     std::unique_ptr<Statement> rootStatement;
     std::vector<CellStatement*> referencedPtrs; 
+    std::vector<RangeStatement*> rangePtrs;
+    Program program;
+    // Empty until rendered, a formula is never empty
+    mutable std::string expression;
 };
 
 #endif
\ No newline at end of file
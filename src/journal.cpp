@@ -0,0 +1,333 @@
+#include "journal.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+namespace {
+
+constexpr size_t kJournalHeaderSize = sizeof(kJournalMagic) + sizeof(uint32_t);
+constexpr size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+uint32_t Checksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+template <typename T>
+void PutRaw(vector<char>& buffer, T value) {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+void PutEdit(SnapshotWriter& writer, const JournalEdit& edit) {
+    writer.Put<JournalOp>(edit.op);
+    writer.PutPosition(edit.pos);
+    if (edit.op == JournalOp::SetCell)
+        writer.PutString(edit.text);
+}
+
+JournalEdit GetEdit(SnapshotReader& reader, JournalOp op) {
+    JournalEdit edit;
+    edit.op = op;
+    edit.pos = reader.GetPosition();
+    if (op == JournalOp::SetCell)
+        edit.text = string(reader.GetString());
+    else if (op != JournalOp::ClearCell)
+        throw SnapshotError("Unknown journal edit");
+    return edit;
+}
+
+JournalRecord DecodeRecord(const vector<char>& payload) {
+    SnapshotReader reader(payload.data(), payload.size());
+    JournalRecord record;
+    record.lsn = reader.Get<uint64_t>();
+    record.op = reader.Get<JournalOp>();
+    switch (record.op) {
+    case JournalOp::SetCell:
+    case JournalOp::ClearCell:
+        record.edits.push_back(GetEdit(reader, record.op));
+        break;
+    case JournalOp::InsertRows:
+    case JournalOp::InsertCols:
+    case JournalOp::DeleteRows:
+    case JournalOp::DeleteCols:
+        record.first = reader.Get<int32_t>();
+        record.count = reader.Get<int32_t>();
+        break;
+    case JournalOp::Batch: {
+        const uint32_t count = reader.Get<uint32_t>();
+        for (uint32_t i = 0; i < count; ++i)
+            record.edits.push_back(GetEdit(reader, reader.Get<JournalOp>()));
+        break;
+    }
+    default:
+        throw SnapshotError("Unknown journal operation");
+    }
+    if (reader.AtEnd() == false)
+        throw SnapshotError("Malformed journal record");
+    return record;
+}
+
+}
+
+
+Journal::Journal(const string& path)
+    : Journal(path, Options()) {
+}
+
+
+// The journal is written through a POSIX file descriptor, other platforms only read journals
+Journal::Journal(const string& path, Options options)
+    : options(options) {
+#ifdef _WIN32
+    throw logic_error("Writing journals is not supported on this platform");
+#else
+    const uint64_t validSize = Read(path, [this](const JournalRecord& record) {
+        lastLsn = record.lsn;
+    });
+    durableLsn = lastLsn;
+
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw JournalError("Cannot open journal " + path);
+    try {
+        // Cuts off the torn tail of a crash, new records go right after the valid ones
+        if (ftruncate(fd, static_cast<off_t>(validSize)) != 0
+                || lseek(fd, 0, SEEK_END) != static_cast<off_t>(validSize))
+            throw JournalError("Cannot truncate journal " + path);
+        if (validSize == 0) {
+            vector<char> header(kJournalMagic, kJournalMagic + sizeof(kJournalMagic));
+            PutRaw<uint32_t>(header, kJournalVersion);
+            WriteAll(header);
+            if (fdatasync(fd) != 0)
+                throw JournalError("Cannot sync journal " + path);
+        }
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    writer = thread([this] { WriteLoop(); });
+#endif
+}
+
+
+Journal::~Journal() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+#ifndef _WIN32
+    close(fd);
+#endif
+}
+
+
+template <typename Encode>
+uint64_t Journal::Append(JournalOp op, const Encode& encode) {
+    thread_local vector<char> payload;
+    {
+        SnapshotWriter payloadWriter(payload);
+        payloadWriter.Put<uint64_t>(0);
+        payloadWriter.Put<JournalOp>(op);
+        encode(payloadWriter);
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    if (error)
+        rethrow_exception(error);
+    const uint64_t lsn = ++lastLsn;
+    memcpy(payload.data(), &lsn, sizeof(lsn));
+    PutRaw<uint32_t>(pending, static_cast<uint32_t>(payload.size()));
+    PutRaw<uint32_t>(pending, Checksum(payload.data(), payload.size()));
+    pending.insert(pending.end(), payload.begin(), payload.end());
+    appendedLsn = lsn;
+    if (options.operations > 0 && ++pendingOps == options.operations)
+        wake.notify_one();
+    return lsn;
+}
+
+
+uint64_t Journal::SetCell(Position pos, string_view text) {
+    return Append(JournalOp::SetCell, [pos, text](SnapshotWriter& writer) {
+        writer.PutPosition(pos);
+        writer.PutString(text);
+    });
+}
+
+
+uint64_t Journal::ClearCell(Position pos) {
+    return Append(JournalOp::ClearCell, [pos](SnapshotWriter& writer) {
+        writer.PutPosition(pos);
+    });
+}
+
+
+uint64_t Journal::Structural(JournalOp op, int first, int count) {
+    if (op == JournalOp::SetCell || op == JournalOp::ClearCell || op == JournalOp::Batch)
+        throw invalid_argument("Not a structural journal operation");
+    return Append(op, [first, count](SnapshotWriter& writer) {
+        writer.Put<int32_t>(first);
+        writer.Put<int32_t>(count);
+    });
+}
+
+
+uint64_t Journal::Batch(const vector<JournalEdit>& edits) {
+    return Append(JournalOp::Batch, [&edits](SnapshotWriter& writer) {
+        writer.Put<uint32_t>(static_cast<uint32_t>(edits.size()));
+        for (const auto& edit: edits)
+            PutEdit(writer, edit);
+    });
+}
+
+
+void Journal::SkipTo(uint64_t lsn) {
+    lock_guard<std::mutex> lock(mutex);
+    lastLsn = max(lastLsn, lsn);
+}
+
+
+uint64_t Journal::LastLsn() const {
+    lock_guard<std::mutex> lock(mutex);
+    return lastLsn;
+}
+
+
+uint64_t Journal::DurableLsn() const {
+    lock_guard<std::mutex> lock(mutex);
+    return durableLsn;
+}
+
+
+void Journal::Sync() {
+    unique_lock<std::mutex> lock(mutex);
+    const uint64_t target = appendedLsn;
+    syncRequested = true;
+    wake.notify_one();
+    synced.wait(lock, [this, target] { return durableLsn >= target || error; });
+    if (error)
+        rethrow_exception(error);
+}
+
+
+void Journal::WriteLoop() {
+    unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait_for(lock, options.interval, [this] {
+            return stopping || syncRequested
+                || (options.operations > 0 && pendingOps >= options.operations);
+        });
+        syncRequested = false;
+        if (pending.empty() == false && error == nullptr) {
+            swap(pending, writing);
+            pendingOps = 0;
+            const uint64_t lsn = appendedLsn;
+            lock.unlock();
+            exception_ptr failure;
+            try {
+                WriteAll(writing);
+#ifndef _WIN32
+                if (fdatasync(fd) != 0)
+                    throw JournalError("Cannot sync journal: " + string(strerror(errno)));
+#endif
+            }
+            catch (...) {
+                failure = current_exception();
+            }
+            writing.clear();
+            lock.lock();
+            if (failure)
+                error = failure;
+            else
+                durableLsn = lsn;
+        }
+        synced.notify_all();
+        if (stopping && (pending.empty() || error))
+            return;
+    }
+}
+
+
+void Journal::WriteAll(const vector<char>& data) {
+#ifdef _WIN32
+    throw logic_error("Writing journals is not supported on this platform");
+#else
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t result = write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            throw JournalError("Cannot write journal: " + string(strerror(errno)));
+        written += static_cast<size_t>(result);
+    }
+#endif
+}
+
+
+uint64_t Journal::Read(const string& path, const function<void(const JournalRecord&)>& visit) {
+    ifstream input(path, ios::binary);
+    if (input.is_open() == false)
+        return 0;
+    char header[kJournalHeaderSize];
+    if (input.read(header, kJournalHeaderSize).gcount() != static_cast<streamsize>(kJournalHeaderSize))
+        return 0;
+    SnapshotReader headerReader(header, kJournalHeaderSize);
+    for (char c: kJournalMagic)
+        if (headerReader.Get<char>() != c)
+            throw JournalError("Not a sheet journal: " + path);
+    if (headerReader.Get<uint32_t>() != kJournalVersion)
+        throw JournalError("Unsupported journal version");
+    input.seekg(0, ios::end);
+    const uint64_t fileSize = static_cast<uint64_t>(input.tellg());
+    input.seekg(kJournalHeaderSize);
+
+    uint64_t validSize = kJournalHeaderSize;
+    uint64_t lastLsn = 0;
+    vector<char> payload;
+    while (true) {
+        char recordHeader[kRecordHeaderSize];
+        if (input.read(recordHeader, kRecordHeaderSize).gcount() != static_cast<streamsize>(kRecordHeaderSize))
+            break;
+        SnapshotReader reader(recordHeader, kRecordHeaderSize);
+        const uint32_t size = reader.Get<uint32_t>();
+        const uint32_t checksum = reader.Get<uint32_t>();
+        if (size > fileSize - validSize - kRecordHeaderSize)
+            break;
+        payload.resize(size);
+        if (input.read(payload.data(), size).gcount() != static_cast<streamsize>(size)
+                || Checksum(payload.data(), size) != checksum)
+            break;
+        JournalRecord record;
+        try {
+            record = DecodeRecord(payload);
+        }
+        catch (const SnapshotError&) {
+            break;
+        }
+        if (record.lsn <= lastLsn)
+            break;
+        lastLsn = record.lsn;
+        visit(record);
+        validSize += kRecordHeaderSize + size;
+    }
+    return validSize;
+}
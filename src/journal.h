@@ -0,0 +1,126 @@
+#ifndef TABLE_JOURNAL
+#define TABLE_JOURNAL
+
+#include "common.h"
+#include "snapshot.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+// Append-only journal of sheet operations.
+//   header: magic, u32 version
+//   record: u32 payload size, u32 FNV-1a checksum of the payload,
+//           payload: u64 lsn, u8 JournalOp, the operation specific data
+// Records carry increasing log sequence numbers. A torn or corrupt tail is ignored
+// by readers and cut off when the journal is opened again.
+inline constexpr char kJournalMagic[8] = "TBLJRNL";
+inline constexpr uint32_t kJournalVersion = 1;
+
+enum class JournalOp : uint8_t {
+    SetCell,
+    ClearCell,
+    InsertRows,
+    InsertCols,
+    DeleteRows,
+    DeleteCols,
+    // Edits of a committed batch, replayed as one batch
+    Batch
+};
+
+
+class JournalError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+struct JournalEdit {
+    JournalOp op = JournalOp::SetCell;
+    Position pos;
+    std::string text;
+};
+
+
+struct JournalRecord {
+    uint64_t lsn = 0;
+    JournalOp op = JournalOp::SetCell;
+    // SetCell, ClearCell and Batch
+    std::vector<JournalEdit> edits;
+    // Structural operations
+    int first = 0;
+    int count = 0;
+};
+
+
+// Operations are encoded by the caller into memory, a background thread writes them
+// and calls fdatasync once per group: every interval or as soon as Options::operations
+// operations are pending, whichever comes first.
+// An operation is durable only after the group containing it is synced, Sync waits for that.
+// A failed write or sync is rethrown by the next call.
+class Journal {
+public:
+    struct Options {
+        std::chrono::milliseconds interval{10};
+        // 0 syncs only by the interval
+        size_t operations = 1024;
+    };
+
+    explicit Journal(const std::string& path);
+    Journal(const std::string& path, Options options);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Return the lsn of the appended operation
+    uint64_t SetCell(Position pos, std::string_view text);
+    uint64_t ClearCell(Position pos);
+    uint64_t Structural(JournalOp op, int first, int count);
+    uint64_t Batch(const std::vector<JournalEdit>& edits);
+
+    // Next operations get numbers above lsn, keeps numbering after a snapshot newer than the journal
+    void SkipTo(uint64_t lsn);
+    uint64_t LastLsn() const;
+    uint64_t DurableLsn() const;
+    void Sync();
+
+    // Visits the valid records in order, returns the size of the valid prefix of the file.
+    // A missing file has no records, a file of another format throws JournalError
+    static uint64_t Read(const std::string& path, const std::function<void(const JournalRecord&)>& visit);
+
+private:
+    Options options;
+    int fd = -1;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable synced;
+    std::vector<char> pending;
+    std::vector<char> writing;
+    size_t pendingOps = 0;
+    bool syncRequested = false;
+    bool stopping = false;
+    uint64_t lastLsn = 0;
+    uint64_t appendedLsn = 0;
+    uint64_t durableLsn = 0;
+    std::exception_ptr error;
+    std::thread writer;
+
+    template <typename Encode>
+    uint64_t Append(JournalOp op, const Encode& encode);
+    void WriteLoop();
+    void WriteAll(const std::vector<char>& data);
+};
+
+
+#endif
@@ -1,5 +1,6 @@
 #include "listener.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 
@@ -7,7 +8,12 @@ using namespace std;
 
 
 
+// The listener is reused by every parse, a failed parse may leave statements behind
 void Listener::enterMain(FormulaParser::MainContext* ctx) {
+    lastStatements.clear();
+    rootStatement = nullptr;
+    referencedPtrs.clear();
+    rangePtrs.clear();
 }
 
 
@@ -67,6 +73,8 @@ void Listener::exitParens(FormulaParser::ParensContext* ctx) {
         skip = true;   
     if (auto unOp = dynamic_cast<UnaryOperation*>(ptr); unOp != nullptr)
         skip = true;
+    if (auto function = dynamic_cast<FunctionStatement*>(ptr); function != nullptr)
+        skip = true;
 
     if (skip == false) {
         unique_ptr<Statement> last = move(lastStatements.back());
@@ -194,6 +202,69 @@ void Listener::exitBinaryOp(FormulaParser::BinaryOpContext* ctx) { // TODO refac
 }
 
 
+void Listener::enterFunction(FormulaParser::FunctionContext* ctx) {
+}
+
+
+void Listener::exitFunction(FormulaParser::FunctionContext* ctx) {
+    auto function = FunctionStatement::FromName(ctx->NAME()->toString());
+    if (function.has_value() == false)
+        throw FormulaException("Unknown function " + ctx->NAME()->toString());
+
+    vector<unique_ptr<Statement>> arguments(ctx->argument().size());
+    for (auto it = arguments.rbegin(); it != arguments.rend(); ++it) {
+        *it = move(lastStatements.back());
+        lastStatements.pop_back();
+        if (auto parens = dynamic_cast<ParensStatement*>(it->get()); parens != nullptr)
+            *it = move(parens->argument);
+    }
+
+    auto s = make_unique<FunctionStatement>(*function, move(arguments));
+    if (s->IsValid() == false)
+        throw FormulaException("Invalid arguments of " + ctx->NAME()->toString());
+    lastStatements.push_back(move(s));
+}
+
+
+void Listener::enterRangeArgument(FormulaParser::RangeArgumentContext* ctx) {
+}
+
+
+void Listener::exitRangeArgument(FormulaParser::RangeArgumentContext* ctx) {
+    Position first = Position::FromString(ctx->CELL(0)->toString());
+    Position last = Position::FromString(ctx->CELL(1)->toString());
+    if (first.IsValid() == false || last.IsValid() == false)
+        throw FormulaException("Invalid position");
+    Range range{{min(first.row, last.row), min(first.col, last.col)},
+        {max(first.row, last.row), max(first.col, last.col)}};
+    auto s = make_unique<RangeStatement>(range);
+
+    rangePtrs.push_back(s.get());
+    lastStatements.push_back(move(s));
+}
+
+
+void Listener::enterCriterionArgument(FormulaParser::CriterionArgumentContext* ctx) {
+}
+
+
+void Listener::exitCriterionArgument(FormulaParser::CriterionArgumentContext* ctx) {
+    const string text = ctx->STRING()->toString();
+    auto criterion = Criterion::FromString(string_view(text).substr(1, text.size() - 2));
+    if (criterion.has_value() == false)
+        throw FormulaException("Invalid criterion " + text);
+    lastStatements.push_back(make_unique<CriterionStatement>(*criterion));
+}
+
+
+void Listener::enterExpressionArgument(FormulaParser::ExpressionArgumentContext* ctx) {
+}
+
+
+void Listener::exitExpressionArgument(FormulaParser::ExpressionArgumentContext* ctx) {
+}
+
+
 void Listener::enterEveryRule(antlr4::ParserRuleContext* ctx) {
 }
 
@@ -222,6 +293,11 @@ std::vector<CellStatement*> Listener::extractCellsPtrs() {
 }
 
 
+std::vector<RangeStatement*> Listener::extractRangesPtrs() {
+    return move(rangePtrs);
+}
+
+
 std::unique_ptr<Statement> Listener::extractRootStatement() {
     return move(rootStatement);
 }
@@ -35,6 +35,18 @@ public:
     virtual void enterBinaryOp(FormulaParser::BinaryOpContext * /*ctx*/) override;
     virtual void exitBinaryOp(FormulaParser::BinaryOpContext * /*ctx*/) override;
 
+    virtual void enterFunction(FormulaParser::FunctionContext * /*ctx*/) override;
+    virtual void exitFunction(FormulaParser::FunctionContext * /*ctx*/) override;
+
+    virtual void enterRangeArgument(FormulaParser::RangeArgumentContext * /*ctx*/) override;
+    virtual void exitRangeArgument(FormulaParser::RangeArgumentContext * /*ctx*/) override;
+
+    virtual void enterCriterionArgument(FormulaParser::CriterionArgumentContext * /*ctx*/) override;
+    virtual void exitCriterionArgument(FormulaParser::CriterionArgumentContext * /*ctx*/) override;
+
+    virtual void enterExpressionArgument(FormulaParser::ExpressionArgumentContext * /*ctx*/) override;
+    virtual void exitExpressionArgument(FormulaParser::ExpressionArgumentContext * /*ctx*/) override;
+
 
     virtual void enterEveryRule(antlr4::ParserRuleContext * /*ctx*/) override;
     virtual void exitEveryRule(antlr4::ParserRuleContext * /*ctx*/) override;
@@ -43,24 +55,27 @@ public:
 
     IFormula::Value Execute(const ISheet& sheet) { 
         if (rootStatement)
-            return rootStatement->Execute(sheet);
+            return rootStatement->Execute(sheet).ToFormulaValue();
         return 0.0;
     }
     
     std::string Formula() {
+        std::string text;
         if (rootStatement)
-            return rootStatement->Formula();
-        return "";
+            Render(*rootStatement, text);
+        return text;
     }
 
     const std::vector<CellStatement*>& GetCellsPtrs() const;
     std::vector<CellStatement*> extractCellsPtrs();
+    std::vector<RangeStatement*> extractRangesPtrs();
     std::unique_ptr<Statement> extractRootStatement();
 
 private:
     std::vector<std::unique_ptr<Statement>> lastStatements;
     std::unique_ptr<Statement> rootStatement;
     std::vector<CellStatement*> referencedPtrs;  
+    std::vector<RangeStatement*> rangePtrs;
 };
 
 
@@ -1,7 +1,15 @@
 #include <iostream>
+#include <cmath>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <iomanip>
 
 #include "cell.h"
 #include "sheet.h"
+#include "mapped_sheet.h"
+#include "range_tree.h"
+#include "column_kernels.h"
 #include "common.h"
 #include "formula.h"
 #include "test_runner.h"
@@ -904,6 +912,1749 @@ void TestCellClearFormulaUpdate()
     ASSERT_EQUAL(values.str()[0], '2');
 }
 
+Position ChainPosition(int index)
+{
+    return {index % Position::kMaxRows, index / Position::kMaxRows};
+}
+
+void FillChain(ISheet *sheet, int length)
+{
+    sheet->SetCell(ChainPosition(0), "1");
+    for (int i = 1; i < length; ++i)
+        sheet->SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+}
+
+void TestDeepDependencyChain()
+{
+    const int length = 4 * Position::kMaxRows;
+    auto sheet = CreateSheet();
+    FillChain(sheet.get(), length);
+    auto tail = ChainPosition(length - 1);
+    ASSERT_EQUAL(sheet->GetCell(tail)->GetValue(), ICell::Value(double(length)));
+
+    sheet->SetCell(ChainPosition(0), "2");
+    ASSERT_EQUAL(sheet->GetCell(tail)->GetValue(), ICell::Value(double(length + 1)));
+
+    sheet->SetCell(ChainPosition(0), "text");
+    bool caught = false;
+    try
+    {
+        sheet->SetCell(ChainPosition(0), "=" + tail.ToString());
+    }
+    catch (const CircularDependencyException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell(ChainPosition(0))->GetText(), "text");
+}
+
+void TestDeepRangeChain()
+{
+    // Each link reads the previous one through a range, so the evaluation of the tail
+    // goes through the range index instead of the references
+    const int length = 4 * Position::kMaxRows;
+    Sheet sheet;
+    {
+        Sheet::Batch batch(sheet);
+        sheet.SetCell(ChainPosition(0), "1");
+        for (int i = 1; i < length; ++i)
+        {
+            const std::string previous = ChainPosition(i - 1).ToString();
+            sheet.SetCell(ChainPosition(i), "=SUM(" + previous + ":" + previous + ")+1");
+        }
+        batch.Commit();
+    }
+    const Position tail = ChainPosition(length - 1);
+    ASSERT_EQUAL(sheet.GetCell(tail)->GetValue(), ICell::Value(double(length)));
+
+    sheet.SetCell(ChainPosition(0), "2");
+    ASSERT_EQUAL(sheet.GetCell(tail)->GetValue(), ICell::Value(double(length + 1)));
+    sheet.SetCell(ChainPosition(0), "3");
+    std::ostringstream values;
+    sheet.PrintValues(values, {Range{tail, tail}, false, 4});
+    ASSERT_EQUAL(values.str(), std::to_string(length + 2) + "\n");
+}
+
+void TestBatchCommit()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(10.0));
+    {
+        Sheet::Batch batch(sheet);
+        sheet.SetCell("A3"_pos, "=A2+1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT(sheet.InBatch());
+        batch.Commit();
+    }
+    ASSERT(!sheet.InBatch());
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), ICell::Value(7.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(50.0));
+
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), ICell::Value(3.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 2}));
+}
+
+void TestBatchClearCell()
+{
+    // Cleared cells of a batch end up as after immediate ClearCell calls
+    Sheet batched;
+    {
+        Sheet immediate;
+        for (Sheet *sheet : {&immediate, &batched})
+        {
+            sheet->SetCell("A1"_pos, "1");
+            sheet->SetCell("B2"_pos, "=A1+1");
+            sheet->SetCell("C3"_pos, "text");
+        }
+        immediate.ClearCell("C3"_pos);
+        immediate.ClearCell("A1"_pos);
+        {
+            Sheet::Batch batch(batched);
+            batched.ClearCell("C3"_pos);
+            batched.ClearCell("A1"_pos);
+            batch.Commit();
+        }
+        for (Sheet *sheet : {&immediate, &batched})
+        {
+            ASSERT_EQUAL(sheet->GetCell("C3"_pos), nullptr);
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos), nullptr);
+            ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), ICell::Value(1.0));
+        }
+        ASSERT_EQUAL(batched.GetPrintableSize(), immediate.GetPrintableSize());
+    }
+
+    // The last cell gone, the sheet is empty as after ClearCell
+    {
+        Sheet::Batch batch(batched);
+        batched.ClearCell("B2"_pos);
+        batch.Commit();
+    }
+    ASSERT_EQUAL(batched.GetCell("B2"_pos), nullptr);
+    ASSERT_EQUAL(batched.GetPrintableSize(), (Size{0, 0}));
+
+    // A later edit of the batch keeps the cell
+    {
+        Sheet::Batch batch(batched);
+        batched.SetCell("A1"_pos, "1");
+        batched.SetCell("B1"_pos, "2");
+        batched.ClearCell("A1"_pos);
+        batched.SetCell("A1"_pos, "1");
+        batched.ClearCell("B1"_pos);
+        batched.SetCell("B1"_pos, "");
+        batch.Commit();
+    }
+    ASSERT_EQUAL(batched.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT(batched.GetCell("B1"_pos) != nullptr);
+    ASSERT_EQUAL(batched.GetCell("B1"_pos)->GetText(), "");
+    ASSERT_EQUAL(batched.GetPrintableSize(), (Size{1, 2}));
+}
+
+void TestBatchRollback()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(1.0));
+
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "=C1");
+    sheet.SetCell("C1"_pos, "=D5+B1");
+    bool caught = false;
+    try
+    {
+        sheet.Commit();
+    }
+    catch (const CircularDependencyException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(!sheet.InBatch());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos), nullptr);
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos), nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(2.0));
+
+    {
+        Sheet::Batch batch(sheet);
+        sheet.SetCell("E5"_pos, "not committed");
+        sheet.ClearCell("A1"_pos);
+    }
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos), nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+}
+
+void TestImportTexts()
+{
+    Sheet source;
+    source.SetCell("A1"_pos, "=B1*2");
+    source.SetCell("B1"_pos, "21");
+    source.SetCell("C1"_pos, "'=text");
+    source.SetCell("A3"_pos, "-0.5");
+    source.SetCell("C3"_pos, "1e3");
+    source.SetCell("D2"_pos, "=A1+A3");
+    std::ostringstream texts;
+    source.PrintTexts(texts);
+
+    for (size_t blockSize : {size_t(3), TsvReader::kBlockSize})
+    {
+        Sheet sheet;
+        std::istringstream input(texts.str());
+        sheet.ImportTexts(input, blockSize);
+        std::ostringstream imported;
+        sheet.PrintTexts(imported);
+        ASSERT_EQUAL(imported.str(), texts.str());
+        ASSERT_EQUAL(sheet.GetPrintableSize(), source.GetPrintableSize());
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ICell::Value(41.5));
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), ICell::Value(-0.5));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value("1e3"));
+        sheet.SetCell("B1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ICell::Value(1.5));
+    }
+
+    Sheet sheet;
+    std::istringstream input("1\t=A2\r\n=B1\n");
+    bool caught = false;
+    try
+    {
+        sheet.ImportTexts(input);
+    }
+    catch (const CircularDependencyException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestExportRange()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.SetCell("B2"_pos, "=A1+D3");
+    sheet.SetCell("C2"_pos, "=1/0");
+    sheet.SetCell("B3"_pos, "'=x");
+    sheet.SetCell("C3"_pos, "0.00001");
+
+    std::ostringstream legacy;
+    sheet.PrintValues(legacy);
+    ASSERT_EQUAL(legacy.str(), "0.333333\t\t\t\n\t0.333333\t\t\n\t=x\t1e-05\t0\n");
+
+    std::ostringstream formatted;
+    formatted << std::fixed << std::setprecision(2);
+    sheet.PrintValues(formatted);
+    ASSERT_EQUAL(formatted.str(), "0.33\t\t\t\n\t0.33\t\t\n\t=x\t0.00\t0.00\n");
+    std::ostringstream parallelFormatted;
+    parallelFormatted << std::setprecision(3);
+    sheet.PrintValues(parallelFormatted, {std::nullopt, false, 2});
+    ASSERT_EQUAL(parallelFormatted.str(), "0.333\t\t\t\n\t0.333\t\t\n\t=x\t1e-05\t0\n");
+
+    std::ostringstream shortest;
+    sheet.PrintValues(shortest, {});
+    ASSERT_EQUAL(shortest.str(), 
+        "0.3333333333333333\t\t\t\n\t0.3333333333333333\t\t\n\t=x\t1e-05\t0\n");
+
+    std::ostringstream values;
+    sheet.PrintValues(values, {Range{"B2"_pos, "C3"_pos}, false});
+    ASSERT_EQUAL(values.str(), "0.333333\t\n=x\t1e-05\n");
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts, {Range{"C1"_pos, "F2"_pos}});
+    ASSERT_EQUAL(texts.str(), "\t\t\t\n=1/0\t\t\t\n");
+
+    bool caught = false;
+    try
+    {
+        sheet.PrintTexts(texts, {Range{"C3"_pos, "B3"_pos}});
+    }
+    catch (const InvalidPositionException &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void FillGrid(Sheet &sheet, int rows, int cols)
+{
+    for (int j = 0; j < cols; ++j)
+        sheet.SetCell(Position{0, j}, to_string(j));
+    for (int i = 1; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+        {
+            string text = "=" + Position{i - 1, j}.ToString();
+            if (j > 0)
+                text += "/2+" + Position{i - 1, j - 1}.ToString();
+            sheet.SetCell(Position{i, j}, text);
+        }
+}
+
+void TestParallelExport()
+{
+    Sheet serial, parallel;
+    FillGrid(serial, 21, 1000);
+    FillGrid(parallel, 21, 1000);
+    serial.SetCell("A1"_pos, "0.1");
+    parallel.SetCell("A1"_pos, "0.1");
+    serial.SetCell("B5"_pos, "=1/0");
+    parallel.SetCell("B5"_pos, "=1/0");
+
+    std::ostringstream serialValues, parallelValues;
+    serial.PrintValues(serialValues, {});
+    parallel.PrintValues(parallelValues, {std::nullopt, true, 4});
+    ASSERT_EQUAL(parallelValues.str(), serialValues.str());
+    ASSERT_EQUAL(parallel.GetCell("ALL21"_pos)->GetValue(), serial.GetCell("ALL21"_pos)->GetValue());
+
+    ExportOptions options{Range{"C3"_pos, "Z19"_pos}, false, 3};
+    std::ostringstream serialTexts, parallelTexts;
+    serial.PrintTexts(serialTexts, {options.range, false});
+    parallel.PrintTexts(parallelTexts, options);
+    ASSERT_EQUAL(parallelTexts.str(), serialTexts.str());
+
+    serial.SetCell("A1"_pos, "7");
+    parallel.SetCell("A1"_pos, "7");
+    std::ostringstream serialRange, parallelRange;
+    serial.PrintValues(serialRange, {options.range, false});
+    parallel.PrintValues(parallelRange, options);
+    ASSERT_EQUAL(parallelRange.str(), serialRange.str());
+}
+
+void TestSnapshot()
+{
+    Sheet source;
+    source.SetCell("A1"_pos, "=-(B1+C1)*2/4");
+    source.SetCell("B1"_pos, "1.5");
+    source.SetCell("D1"_pos, "'=escaped");
+    source.SetCell("E1"_pos, "text");
+    source.SetCell("A2"_pos, "=1/0");
+    source.SetCell("B2"_pos, "=A3+A1");
+    source.SetCell("C2"_pos, "=B70+CX3");
+    source.SetCell("A3"_pos, "=E1");
+    source.SetCell("A4"_pos, "=A5");
+    source.SetCell("A5"_pos, "1");
+    source.DeleteRows(4);
+    source.SetCell("B1"_pos, "2.5");
+
+    std::stringstream snapshot;
+    source.SaveSnapshot(snapshot);
+    Sheet sheet;
+    sheet.SetCell("Z9"_pos, "gone");
+    sheet.LoadSnapshot(snapshot);
+
+    std::ostringstream sourceTexts, texts, sourceValues, values;
+    source.PrintTexts(sourceTexts);
+    sheet.PrintTexts(texts);
+    source.PrintValues(sourceValues);
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(texts.str(), sourceTexts.str());
+    ASSERT_EQUAL(values.str(), sourceValues.str());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), source.GetPrintableSize());
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=#!REF");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(2.5));
+
+    for (Sheet *target : {&source, &sheet})
+    {
+        target->SetCell("C1"_pos, "1.5");
+        ASSERT_EQUAL(target->GetCell("A1"_pos)->GetValue(), ICell::Value(-2.0));
+        target->SetCell("E1"_pos, "3");
+        ASSERT_EQUAL(target->GetCell("B2"_pos)->GetValue(), ICell::Value(1.0));
+        target->SetCell("E1"_pos, "=A1*0+3");
+        ASSERT_EQUAL(target->GetCell("B2"_pos)->GetValue(), ICell::Value(1.0));
+    }
+    bool caught = false;
+
+    auto bytes = snapshot.str();
+    auto hugeTile = bytes;
+    hugeTile.replace(kSnapshotHeaderSize + kSnapshotTileHeaderSize - 8, 8, 8, '\xff');
+    for (auto corrupt : {bytes.substr(0, bytes.size() / 2), "X" + bytes.substr(1), hugeTile})
+    {
+        std::istringstream input(corrupt);
+        caught = false;
+        try
+        {
+            sheet.LoadSnapshot(input);
+        }
+        catch (const SnapshotError &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(1.0));
+    }
+}
+
+std::string SaveSnapshotFile(const Sheet &sheet, const std::string &name)
+{
+    auto path = (std::filesystem::temp_directory_path() / name).string();
+    std::ofstream output(path, std::ios::binary);
+    sheet.SaveSnapshot(output);
+    return path;
+}
+
+void AssertSamePrint(const ISheet &lhs, const ISheet &rhs)
+{
+    std::ostringstream lhsTexts, rhsTexts, lhsValues, rhsValues;
+    lhs.PrintTexts(lhsTexts);
+    rhs.PrintTexts(rhsTexts);
+    lhs.PrintValues(lhsValues);
+    rhs.PrintValues(rhsValues);
+    ASSERT_EQUAL(lhsTexts.str(), rhsTexts.str());
+    ASSERT_EQUAL(lhsValues.str(), rhsValues.str());
+    ASSERT_EQUAL(lhs.GetPrintableSize(), rhs.GetPrintableSize());
+}
+
+void TestMappedSheet()
+{
+    Sheet source;
+    source.SetCell("A1"_pos, "=(B1+C1)*2");
+    source.SetCell("B1"_pos, "1.5");
+    source.SetCell("C1"_pos, "'=escaped");
+    source.SetCell("D1"_pos, "=1/0");
+    source.SetCell("CZ200"_pos, "=B1+1");
+    source.SetCell("A130"_pos, "=CZ200*2+E3");
+    source.SetCell("B130"_pos, "text");
+    auto path = SaveSnapshotFile(source, "table_test_mapped.snapshot");
+
+    {
+        MappedSheet mapped(path);
+        ASSERT_EQUAL(mapped.DecodedTiles(), 0u);
+        ASSERT_EQUAL(mapped.GetCell("CZ200"_pos)->GetValue(), ICell::Value(2.5));
+        ASSERT_EQUAL(mapped.GetCell("A130"_pos)->GetText(), "=CZ200*2+E3");
+        ASSERT_EQUAL(mapped.DecodedTiles(), 2u);
+        ASSERT(mapped.GetCell("B2"_pos) == nullptr);
+        AssertSamePrint(mapped, source);
+
+        for (ISheet *sheet : {static_cast<ISheet *>(&mapped), static_cast<ISheet *>(&source)})
+        {
+            sheet->SetCell("B1"_pos, "4");
+            sheet->SetCell("E3"_pos, "=B1/2");
+            sheet->SetCell("A200"_pos, "=A130+1");
+            sheet->SetCell("C1"_pos, "3");
+            sheet->ClearCell("B130"_pos);
+        }
+        AssertSamePrint(mapped, source);
+        ASSERT_EQUAL(mapped.GetCell("A200"_pos)->GetValue(), ICell::Value(13.0));
+        ASSERT_EQUAL(mapped.PrivateTiles(), 3u);
+
+        bool caught = false;
+        try
+        {
+            mapped.SetCell("B1"_pos, "=A200");
+        }
+        catch (const CircularDependencyException &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+        caught = false;
+        try
+        {
+            mapped.InsertRows(0);
+        }
+        catch (const std::logic_error &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    MappedSheet reopened(path);
+    ASSERT_EQUAL(reopened.GetCell("A130"_pos)->GetValue(), ICell::Value(5.0));
+    ASSERT_EQUAL(reopened.GetCell("B130"_pos)->GetText(), "text");
+    std::filesystem::remove(path);
+}
+
+void TestJournal()
+{
+    auto path = (std::filesystem::temp_directory_path() / "table_test.journal").string();
+    std::filesystem::remove(path);
+    std::stringstream snapshot;
+    Sheet source;
+    {
+        Journal journal(path, {std::chrono::milliseconds(1), 4});
+        source.AttachJournal(&journal);
+        source.SetCell("A1"_pos, "=B1+C2");
+        source.SetCell("B1"_pos, "2");
+        source.SaveSnapshot(snapshot);
+        source.SetCell("C2"_pos, "'text");
+        bool caught = false;
+        try
+        {
+            source.SetCell("D1"_pos, "=A1+");
+        }
+        catch (const FormulaException &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+        source.InsertCols(1);
+        {
+            Sheet::Batch batch(source);
+            source.SetCell("E1"_pos, "=C1*10");
+            source.ClearCell("D2"_pos);
+            batch.Commit();
+        }
+        {
+            Sheet::Batch batch(source);
+            source.SetCell("F1"_pos, "rolled back");
+        }
+        source.SetCell("C1"_pos, "5");
+        journal.Sync();
+        ASSERT_EQUAL(source.JournalLsn(), 6u);
+        ASSERT_EQUAL(journal.DurableLsn(), 6u);
+        source.AttachJournal(nullptr);
+    }
+
+    Sheet replayed;
+    ASSERT_EQUAL(replayed.ReplayJournal(path), 6u);
+    AssertSamePrint(replayed, source);
+    Sheet recovered;
+    recovered.LoadSnapshot(snapshot);
+    ASSERT_EQUAL(recovered.JournalLsn(), 2u);
+    ASSERT_EQUAL(recovered.ReplayJournal(path), 4u);
+    AssertSamePrint(recovered, source);
+    ASSERT_EQUAL(recovered.GetCell("E1"_pos)->GetValue(), ICell::Value(50.0));
+
+    {
+        std::ofstream tail(path, std::ios::binary | std::ios::app);
+        tail.write("\x10\0\0\0torn", 8);
+    }
+    Sheet afterCrash;
+    ASSERT_EQUAL(afterCrash.ReplayJournal(path), 6u);
+    {
+        Journal journal(path);
+        ASSERT_EQUAL(journal.LastLsn(), 6u);
+        recovered.AttachJournal(&journal);
+        recovered.SetCell("G1"_pos, "7");
+        ASSERT_EQUAL(recovered.JournalLsn(), 7u);
+        recovered.AttachJournal(nullptr);
+    }
+    Sheet again;
+    ASSERT_EQUAL(again.ReplayJournal(path), 7u);
+    AssertSamePrint(again, recovered);
+    std::filesystem::remove(path);
+}
+
+void TestBackgroundSnapshot()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1*2");
+    sheet.SetCell("B1"_pos, "3");
+    sheet.SetCell("C70"_pos, "text");
+    std::stringstream expected;
+    sheet.SaveSnapshot(expected);
+    Sheet reference;
+    reference.LoadSnapshot(expected);
+
+    auto path = (std::filesystem::temp_directory_path() / "table_test_background.snapshot").string();
+    auto job = sheet.SaveSnapshotInBackground(path);
+    sheet.SetCell("B1"_pos, "4");
+    sheet.ClearCell("C70"_pos);
+    job->Wait();
+    ASSERT(job->Done());
+    ASSERT_EQUAL(job->Progress(), 1.0);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(8.0));
+
+    Sheet loaded;
+    std::ifstream input(path, std::ios::binary);
+    loaded.LoadSnapshot(input);
+    AssertSamePrint(loaded, reference);
+    std::filesystem::remove(path);
+
+    job = sheet.SaveSnapshotInBackground("/nonexistent/table.snapshot");
+    bool caught = false;
+    try
+    {
+        job->Wait();
+    }
+    catch (const SnapshotError &)
+    {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestSheetFork()
+{
+    Sheet base;
+    base.SetCell("A1"_pos, "1");
+    base.SetCell("A2"_pos, "=A1*2");
+    base.SetCell("A3"_pos, "=A2+B1");
+    base.SetCell("B1"_pos, "10");
+    base.SetCell("C1"_pos, "'=text");
+    base.SetCell("C2"_pos, "=1/0");
+    std::stringstream snapshot;
+    base.SaveSnapshot(snapshot);
+    Sheet copy;
+    copy.LoadSnapshot(snapshot);
+
+    {
+        auto fork = base.Fork();
+        AssertSamePrint(*fork, base);
+        ASSERT_EQUAL(fork->ForkedCells(), 0u);
+
+        for (ISheet *sheet : {static_cast<ISheet *>(fork.get()), static_cast<ISheet *>(&copy)})
+        {
+            sheet->SetCell("A1"_pos, "5");
+            ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), ICell::Value(20.0));
+            sheet->SetCell("D4"_pos, "=A3+E5");
+            sheet->ClearCell("B1"_pos);
+            ASSERT_EQUAL(sheet->GetCell("D4"_pos)->GetValue(), ICell::Value(10.0));
+            ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+        }
+        AssertSamePrint(*fork, copy);
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{5, 5}));
+        ASSERT_EQUAL(fork->ForkedCells(), 6u);
+        ASSERT_EQUAL(base.GetCell("A3"_pos)->GetValue(), ICell::Value(12.0));
+        ASSERT(base.GetCell("B1"_pos) != nullptr);
+
+        bool caught = false;
+        try
+        {
+            fork->SetCell("A1"_pos, "=D4");
+        }
+        catch (const CircularDependencyException &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(fork->GetCell("A1"_pos)->GetText(), "5");
+
+        auto second = base.Fork();
+        second->SetCell("B1"_pos, "0");
+        ASSERT_EQUAL(second->GetCell("A3"_pos)->GetValue(), ICell::Value(2.0));
+        ASSERT_EQUAL(fork->GetCell("A3"_pos)->GetValue(), ICell::Value(10.0));
+
+        for (auto edit : std::vector<std::function<void()>>{[&] { base.SetCell("A1"_pos, "2"); },
+                                                            [&] { fork->InsertRows(0); }})
+        {
+            caught = false;
+            try
+            {
+                edit();
+            }
+            catch (const std::logic_error &)
+            {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+    }
+    base.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(base.GetCell("A3"_pos)->GetValue(), ICell::Value(14.0));
+}
+
+ICell::Value ToCellValue(const IFormula::Value &value)
+{
+    if (holds_alternative<double>(value))
+        return get<double>(value);
+    return get<FormulaError>(value);
+}
+
+void TestScenarios()
+{
+    auto build = [](Sheet &sheet)
+    {
+        sheet.SetCell("B1"_pos, "1");
+        sheet.SetCell("C1"_pos, "=A1*2+B1");
+        sheet.SetCell("C2"_pos, "=C1/B1");
+        sheet.SetCell("C3"_pos, "=-(C2-D1)");
+        sheet.SetCell("C4"_pos, "=E1+A1");
+        sheet.SetCell("C5"_pos, "=D1*D1");
+        sheet.SetCell("D1"_pos, "3");
+        sheet.SetCell("E1"_pos, "'abc");
+    };
+    Sheet sheet;
+    build(sheet);
+    const std::vector<Position> inputs{"A1"_pos, "B1"_pos};
+    const std::vector<Position> outputs{"C1"_pos, "C2"_pos, "C3"_pos, "C4"_pos, "C5"_pos, "D1"_pos, "B1"_pos};
+    std::vector<double> values;
+    for (int k = 0; k < 37; ++k)
+    {
+        values.push_back(k % 5 == 4 ? 1e308 : k * 0.25 - 3);
+        values.push_back(k % 3 == 0 ? 0.0 : k * 0.5);
+    }
+
+    ScenarioModel model(sheet, inputs, outputs);
+    ASSERT_EQUAL(model.Formulas(), 4u);
+    ScenarioMatrix serial = model.Evaluate(values);
+    ScenarioMatrix parallel = sheet.EvaluateScenarios(inputs, values, outputs, 4);
+    ASSERT_EQUAL(serial.scenarios, 37u);
+    ASSERT_EQUAL(serial.outputs, outputs.size());
+
+    Sheet reference;
+    build(reference);
+    for (size_t k = 0; k < serial.scenarios; ++k)
+    {
+        for (size_t i = 0; i < inputs.size(); ++i)
+            reference.SetCell(inputs[i], std::to_string(values[k * inputs.size() + i]));
+        for (size_t j = 0; j < outputs.size(); ++j)
+        {
+            ASSERT_EQUAL(ToCellValue(serial.Get(k, j)), reference.GetCell(outputs[j])->GetValue());
+            ASSERT_EQUAL(ToCellValue(parallel.Get(k, j)), reference.GetCell(outputs[j])->GetValue());
+        }
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(1.0));
+
+    for (auto call : std::vector<std::function<void()>>{[&] { ScenarioModel(sheet, {"A1"_pos, "A1"_pos}, outputs); },
+                                                        [&] { model.Evaluate({1.0, 2.0, 3.0}); }})
+    {
+        bool caught = false;
+        try
+        {
+            call();
+        }
+        catch (const std::invalid_argument &)
+        {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+}
+
+void TestDifferentiate()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("C1"_pos, "=A1*2+B1");
+    sheet.SetCell("C2"_pos, "=C1/B1");
+    sheet.SetCell("C3"_pos, "=-(C2-D1)");
+    sheet.SetCell("C4"_pos, "=E1+A1");
+    sheet.SetCell("C5"_pos, "=A1*A1*B1");
+    sheet.SetCell("D1"_pos, "3");
+    sheet.SetCell("E1"_pos, "'abc");
+    const std::vector<Position> inputs{"A1"_pos, "B1"_pos};
+    ScenarioModel model(sheet, inputs, {"C1"_pos, "C2"_pos, "C3"_pos, "C4"_pos, "C5"_pos, "D1"_pos, "B1"_pos});
+
+    Sensitivities result = model.Differentiate({3.0, 2.0});
+    const std::vector<IFormula::Value> values{8.0, 4.0, -1.0, FormulaError(FormulaError::Category::Value), 18.0, 3.0, 2.0};
+    ASSERT_EQUAL(result.values.size(), values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        ASSERT_EQUAL(ToCellValue(result.values[i]), ToCellValue(values[i]));
+    const std::vector<double> partials{2.0, 1.0, 1.0, -1.5, -1.0, 1.5, NAN, NAN, 12.0, 9.0, 0.0, 0.0, 0.0, 1.0};
+    ASSERT_EQUAL(result.partials.size(), partials.size());
+    for (size_t i = 0; i < partials.size(); ++i)
+        ASSERT(result.partials[i] == partials[i] || (std::isnan(result.partials[i]) && std::isnan(partials[i])));
+
+    result = model.Differentiate({3.0, 2.0}, {1.0, 1.0});
+    ASSERT_EQUAL(result.partials[4], 21.0);
+    ASSERT_EQUAL(ToCellValue(model.Differentiate({3.0, 0.0}).values[1]), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+
+    // More inputs than lanes of one pass
+    std::vector<Position> many;
+    std::string formula = "=0";
+    for (int i = 0; i < 40; ++i)
+    {
+        many.push_back({i, 0});
+        formula += "+" + many.back().ToString() + "*" + std::to_string(i);
+    }
+    sheet.SetCell("F1"_pos, formula);
+    result = ScenarioModel(sheet, many, {"F1"_pos}).Differentiate(std::vector<double>(40, 1.0));
+    ASSERT_EQUAL(ToCellValue(result.values[0]), ICell::Value(780.0));
+    for (int i = 0; i < 40; ++i)
+        ASSERT_EQUAL(result.partials[i], double(i));
+}
+
+void TestLookupFunctions()
+{
+    auto invalid = [](ISheet &sheet, Position pos, std::string text)
+    {
+        try
+        {
+            sheet.SetCell(pos, std::move(text));
+        }
+        catch (const FormulaException &)
+        {
+            return true;
+        }
+        return false;
+    };
+    const ICell::Value valueError = FormulaError(FormulaError::Category::Value);
+
+    Sheet sheet;
+    const std::vector<std::string> keys{"10", "20", "20", "40", "text", "50"};
+    for (int i = 0; i < 6; ++i)
+    {
+        sheet.SetCell({i, 0}, keys[i]);
+        sheet.SetCell({i, 1}, std::to_string((i + 1) * 100));
+    }
+    sheet.SetCell("C4"_pos, "word");
+    sheet.SetCell("D1"_pos, "=MATCH(20,A1:A6,0)");
+    sheet.SetCell("D2"_pos, "=MATCH(25,A1:A6)");
+    sheet.SetCell("D3"_pos, "=MATCH(25,A1:A6,-1)");
+    sheet.SetCell("D4"_pos, "=MATCH(5,A1:A6)");
+    sheet.SetCell("D5"_pos, "=VLOOKUP(40,A1:B6,2,0)");
+    sheet.SetCell("D6"_pos, "=VLOOKUP(40,A1:B6,3)");
+    sheet.SetCell("D7"_pos, "=XLOOKUP(45,A1:A6,B1:B6,1)");
+    sheet.SetCell("D8"_pos, "=XLOOKUP(40,A1:A6,C1:C6)");
+    sheet.SetCell("D9"_pos, "=MATCH(1/0,A1:A6)+1");
+    sheet.SetCell("D10"_pos, "=MATCH(300,A3:F3,0)*(1+VLOOKUP(49.5,A2:C6,2))");
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=VLOOKUP(40,A1:B6,2,0)");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ICell::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), ICell::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), valueError);
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), ICell::Value(400.0));
+    ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), ICell::Value(600.0));
+    ASSERT_EQUAL(sheet.GetCell("D8"_pos)->GetValue(), valueError);
+    ASSERT_EQUAL(sheet.GetCell("D9"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(sheet.GetCell("D10"_pos)->GetValue(), ICell::Value(2.0 * 401));
+
+    sheet.SetCell("A4"_pos, "5");
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), ICell::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), ICell::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), valueError);
+    sheet.SetCell("A5"_pos, "=B1/10+30");
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), ICell::Value(500.0));
+    sheet.SetCell("B1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), valueError);
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), ICell::Value(5.0));
+
+    ASSERT(invalid(sheet, "E1"_pos, "=MATCH(A1,2)"));
+    ASSERT(invalid(sheet, "E1"_pos, "=VLOOKUP(1,A1:B2)"));
+    sheet.SetCell("E1"_pos, "=VLOOKUP(40,A1:B6,1e10)");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Ref)));
+    sheet.SetCell("E1"_pos, "=VLOOKUP(40,A1:B6,-1e10)");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), valueError);
+    sheet.ClearCell("E1"_pos);
+    ASSERT(invalid(sheet, "E1"_pos, "=XLOOKUP(1,A1:A2,B1:B2,0,0)"));
+    ASSERT(invalid(sheet, "E1"_pos, "=MATCHES(1,A1:A2)"));
+
+    std::stringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet copy;
+    copy.LoadSnapshot(snapshot);
+    AssertSamePrint(copy, sheet);
+    copy.SetCell("A6"_pos, "40");
+    ASSERT_EQUAL(copy.GetCell("D5"_pos)->GetValue(), ICell::Value(600.0));
+    ASSERT_EQUAL(copy.GetCell("D7"_pos)->GetValue(), valueError);
+
+    std::mt19937 random(7);
+    Sheet numbers;
+    for (int i = 0; i < 500; ++i)
+        numbers.SetCell({i, 0}, std::to_string(random() % 100));
+    for (int k = 0; k < 300; ++k)
+    {
+        // Ranges inside one tile of 64 rows, across two and across many
+        const int first = random() % 500;
+        const int last = std::min(first + static_cast<int>(random() % (k % 3 == 0 ? 40 : 500)), 599);
+        const Range column{{first, 0}, {last, 0}};
+        const double value = static_cast<int>(random() % 110) - 5 + (k % 2) * 0.5;
+        for (auto mode : {LookupMode::Exact, LookupMode::NextSmaller, LookupMode::NextLarger})
+            ASSERT(numbers.LookupRange(column, value, mode) == numbers.ISheet::LookupRange(column, value, mode));
+        numbers.SetCell({static_cast<int>(random() % 500), 0}, std::to_string(random() % 100));
+    }
+}
+
+void TestConditionalAggregates()
+{
+    auto invalid = [](ISheet &sheet, Position pos, std::string text)
+    {
+        try
+        {
+            sheet.SetCell(pos, std::move(text));
+        }
+        catch (const FormulaException &)
+        {
+            return true;
+        }
+        return false;
+    };
+    const ICell::Value div0 = FormulaError(FormulaError::Category::Div0);
+
+    Sheet sheet;
+    const std::vector<std::string> keys{"10", "20", "20", "40", "text", "50"};
+    for (int i = 0; i < 6; ++i)
+    {
+        sheet.SetCell({i, 0}, keys[i]);
+        sheet.SetCell({i, 1}, std::to_string((i + 1) * 100));
+    }
+    sheet.SetCell("F1"_pos, "=1/0");
+    sheet.SetCell("C1"_pos, "=COUNTIF(A1:A6,\">15\")");
+    sheet.SetCell("C2"_pos, "=SUMIF(A1:A6,\">=20\",B1:B6)");
+    sheet.SetCell("C3"_pos, "=AVERAGEIF(A1:A6,\"<40\",B1:B6)");
+    sheet.SetCell("C4"_pos, "=SUMIF(A1:A6,20)+COUNTIF(A1:A6,\"<>20\")");
+    sheet.SetCell("C5"_pos, "=COUNTIF(A1:A6,E1)");
+    sheet.SetCell("C6"_pos, "=AVERAGEIF(A1:A6,\">100\")");
+    sheet.SetCell("C7"_pos, "=SUMIF(A1:A6,\">0\",B1:B5)");
+    sheet.SetCell("C8"_pos, "=SUMIF(A1:A2,10,F1:F2)+SUMIF(A1:A2,20,F1:F2)");
+    sheet.SetCell("C9"_pos, "=COUNTIF(A1:A6,\"=2e1\")");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=SUMIF(A1:A6,\">=20\",B1:B6)");
+    ASSERT_EQUAL(sheet.GetCell("C9"_pos)->GetText(), "=COUNTIF(A1:A6,\"=20\")");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), ICell::Value(1500.0));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(200.0));
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), ICell::Value(43.0));
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), ICell::Value(0.0));
+    ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetValue(), div0);
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetValue(), div0);
+    ASSERT_EQUAL(sheet.GetCell("C9"_pos)->GetValue(), ICell::Value(2.0));
+
+    sheet.SetCell("E1"_pos, "20");
+    sheet.SetCell("A1"_pos, "30");
+    sheet.ClearCell("A4"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), ICell::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), ICell::Value(1200.0));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(200.0));
+    sheet.SetCell("A5"_pos, "=B1/10+10");
+    sheet.SetCell("B2"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), div0);
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetValue(), ICell::Value(0.0));
+
+    ASSERT(invalid(sheet, "G1"_pos, "=SUMIF(A1:A6)"));
+    ASSERT(invalid(sheet, "G1"_pos, "=COUNTIF(A1:A6,1,B1:B6)"));
+    ASSERT(invalid(sheet, "G1"_pos, "=COUNTIF(A1:A6,\">x\")"));
+    ASSERT(invalid(sheet, "G1"_pos, "=SUM(A1:A6,\">1\")"));
+    ASSERT(invalid(sheet, "G1"_pos, "=SUMIF(1,\">1\")"));
+
+    std::stringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet copy;
+    copy.LoadSnapshot(snapshot);
+    AssertSamePrint(copy, sheet);
+    ASSERT_EQUAL(copy.GetCell("C2"_pos)->GetText(), "=SUMIF(A1:A6,\">=20\",B1:B6)");
+    copy.SetCell("B2"_pos, "1");
+    ASSERT_EQUAL(copy.GetCell("C2"_pos)->GetValue(), ICell::Value(1501.0));
+
+    std::mt19937 random(11);
+    Sheet numbers;
+    auto randomCell = [&random]() -> std::string
+    {
+        const int kind = random() % 10;
+        if (kind == 0)
+            return "text";
+        if (kind == 1)
+            return "=1/0";
+        return std::to_string(static_cast<int>(random() % 20));
+    };
+    for (int i = 0; i < 300; ++i)
+        for (int j = 0; j < 4; ++j)
+            numbers.SetCell({i, j}, randomCell());
+    for (int k = 0; k < 300; ++k)
+    {
+        const int first = random() % 300;
+        const int last = first + random() % (300 - first);
+        const int cols = 1 + random() % 2;
+        const Range range{{first, 0}, {last, cols - 1}};
+        const int shift = random() % 2 == 0 ? 0 : static_cast<int>(random() % 2);
+        const Range sumRange{{first, 2 + shift - 2 * (k % 2)}, {last, 2 + shift - 2 * (k % 2) + cols - 1}};
+        const Criterion criterion{static_cast<Criterion::Comparison>(random() % 6), static_cast<double>(random() % 20)};
+        const RangeSummary indexed = numbers.SummarizeIf(range, criterion, sumRange);
+        const RangeSummary scanned = numbers.ISheet::SummarizeIf(range, criterion, sumRange);
+        ASSERT_EQUAL(indexed.sum, scanned.sum);
+        ASSERT_EQUAL(indexed.count, scanned.count);
+        ASSERT(indexed.error.has_value() == scanned.error.has_value());
+        numbers.SetCell({static_cast<int>(random() % 300), static_cast<int>(random() % 4)}, randomCell());
+    }
+
+    // Criteria of one use each between the uses of a cached one
+    const Range keysRange{{0, 0}, {299, 0}};
+    const Range sumRange{{0, 1}, {299, 1}};
+    const Criterion hot{Criterion::Comparison::Less, 10.0};
+    for (int k = 0; k < 100; ++k)
+    {
+        const Criterion once{Criterion::Comparison::Greater, k * 0.25};
+        for (const Criterion &criterion : {once, hot})
+        {
+            ASSERT_EQUAL(numbers.SummarizeIf(keysRange, criterion, sumRange).sum,
+                         numbers.ISheet::SummarizeIf(keysRange, criterion, sumRange).sum);
+        }
+        if (k % 10 == 0)
+            numbers.SetCell({k, 0}, std::to_string(k % 20));
+    }
+}
+
+void TestColumnKernels()
+{
+    std::mt19937 random(5);
+    std::vector<double> lhs(300);
+    std::vector<double> rhs(300);
+    std::vector<uint64_t> marks(5);
+    for (size_t i = 0; i < lhs.size(); ++i)
+    {
+        lhs[i] = static_cast<int>(random() % 200) - 100;
+        rhs[i] = static_cast<int>(random() % 20) - 10;
+        if (random() % 3 != 0)
+            marks[i / 64] |= uint64_t{1} << (i % 64);
+    }
+    for (int k = 0; k < 200; ++k)
+    {
+        const size_t first = random() % lhs.size();
+        const size_t count = random() % (lhs.size() - first + 1);
+        double sum = 0.0;
+        double dot = 0.0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -min;
+        size_t marked = 0;
+        for (size_t i = first; i < first + count; ++i)
+        {
+            sum += lhs[i];
+            dot += lhs[i] * rhs[i];
+            if ((marks[i / 64] >> (i % 64) & 1) != 0)
+            {
+                min = std::min(min, lhs[i]);
+                max = std::max(max, lhs[i]);
+                ++marked;
+            }
+        }
+        ASSERT_EQUAL(SumNumbers(lhs.data() + first, count), sum);
+        ASSERT_EQUAL(DotNumbers(lhs.data() + first, rhs.data() + first, count), dot);
+        ASSERT_EQUAL(CountMarked(marks.data(), first, count), marked);
+        double kernelMin = std::numeric_limits<double>::infinity();
+        double kernelMax = -kernelMin;
+        MinMaxNumbers(lhs.data(), marks.data(), first, count, kernelMin, kernelMax);
+        ASSERT_EQUAL(kernelMin, min);
+        ASSERT_EQUAL(kernelMax, max);
+        std::vector<double> products(lhs.begin() + first, lhs.begin() + first + count);
+        MultiplyNumbers(products.data(), rhs.data() + first, count);
+        for (size_t i = 0; i < count; ++i)
+            ASSERT_EQUAL(products[i], lhs[first + i] * rhs[first + i]);
+    }
+
+    Sheet sheet;
+    for (int i = 0; i < 5; ++i)
+    {
+        sheet.SetCell({i, 0}, std::to_string(i + 1));
+        sheet.SetCell({i, 1}, std::to_string(10 * (i + 1)));
+    }
+    sheet.SetCell("C1"_pos, "2");
+    sheet.SetCell("C2"_pos, "text");
+    sheet.SetCell("D1"_pos, "=SUMPRODUCT(A1:A5,B1:B5)");
+    sheet.SetCell("D2"_pos, "=SUMPRODUCT(A1:B5)+SUMPRODUCT(A1:A5,B1:B5,C1:C5)");
+    sheet.SetCell("D3"_pos, "=SUMPRODUCT(A1:A5,B1:B4)");
+    sheet.SetCell("D4"_pos, "=SUMPRODUCT(A1:A2,A100:A101)");
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=SUMPRODUCT(A1:B5)+SUMPRODUCT(A1:A5,B1:B5,C1:C5)");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(550.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ICell::Value(165.0 + 20.0));
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), ICell::Value(0.0));
+    sheet.SetCell("A3"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.SetCell("A3"_pos, "-3");
+    sheet.SetCell("C2"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(370.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ICell::Value(159.0 + 20.0 + 160.0));
+    try
+    {
+        sheet.SetCell("E1"_pos, "=SUMPRODUCT(A1:A5,2)");
+        ASSERT(false);
+    }
+    catch (const FormulaException &)
+    {
+    }
+
+    Sheet numbers;
+    for (int i = 0; i < 400; ++i)
+        for (int j = 0; j < 3; ++j)
+            numbers.SetCell({i, j}, random() % 15 == 0 ? "text" : std::to_string(static_cast<int>(random() % 21) - 10));
+    for (int k = 0; k < 200; ++k)
+    {
+        const int first = random() % 400;
+        const int rows = 1 + random() % (400 - first);
+        std::vector<Range> ranges;
+        const size_t count = 1 + random() % 3;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const int row = random() % (401 - rows);
+            const int col = random() % 3;
+            ranges.push_back({{row, col}, {row + rows - 1, col}});
+        }
+        ASSERT_EQUAL(numbers.SumProduct(ranges).sum, numbers.ISheet::SumProduct(ranges).sum);
+        const Range range{{first, 0}, {first + rows - 1, 2}};
+        ASSERT_EQUAL(numbers.SummarizeRange(range).min, numbers.ISheet::SummarizeRange(range).min);
+        ASSERT_EQUAL(numbers.SummarizeRange(range).sum, numbers.ISheet::SummarizeRange(range).sum);
+        numbers.SetCell({static_cast<int>(random() % 400), static_cast<int>(random() % 3)}, std::to_string(static_cast<int>(random() % 21) - 10));
+    }
+}
+
+void TestBoxedValue()
+{
+    static_assert(sizeof(BoxedValue) == 8);
+    using Kind = BoxedValue::Kind;
+    const double inf = std::numeric_limits<double>::infinity();
+    for (double number : {0.0, -0.0, 1.5, -1e300, 1e-310, inf, -inf})
+    {
+        const BoxedValue value(number);
+        ASSERT(value.GetKind() == Kind::Number);
+        ASSERT_EQUAL(value.GetNumber(), number);
+        ASSERT_EQUAL(std::signbit(value.GetNumber()), std::signbit(number));
+        ASSERT(value.ToFormulaValue() == (std::variant<double, FormulaError>(number)));
+    }
+    // Any NaN stays a number and is never taken for a tag
+    const BoxedValue nan(std::numeric_limits<double>::quiet_NaN());
+    ASSERT(nan.IsNumber());
+    ASSERT(std::isnan(nan.GetNumber()));
+    ASSERT(BoxedValue(-std::numeric_limits<double>::quiet_NaN()).IsNumber());
+    ASSERT(BoxedValue().IsNumber() && BoxedValue().GetNumber() == 0.0);
+
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value, FormulaError::Category::Div0})
+    {
+        const BoxedValue value{FormulaError(category)};
+        ASSERT(value.GetKind() == Kind::Error);
+        ASSERT(value.IsError() && value.IsNumber() == false);
+        ASSERT_EQUAL(value.GetError(), FormulaError(category));
+        ASSERT(value.ToFormulaValue() == (std::variant<double, FormulaError>(FormulaError(category))));
+        ASSERT(BoxedValue(value.ToFormulaValue()) == value);
+    }
+    ASSERT(BoxedValue::Text().GetKind() == Kind::Text);
+    ASSERT(BoxedValue::Empty().GetKind() == Kind::Empty);
+    ASSERT(BoxedValue::Text().ToFormulaValue() == (std::variant<double, FormulaError>(FormulaError(FormulaError::Category::Value))));
+    ASSERT(BoxedValue::Empty().ToFormulaValue() == (std::variant<double, FormulaError>(0.0)));
+    ASSERT(BoxedValue::FromText("2.5") == BoxedValue(2.5));
+    ASSERT(BoxedValue::FromText(" 4") == BoxedValue(4.0));
+    ASSERT(BoxedValue::FromText("abc") == BoxedValue(FormulaError(FormulaError::Category::Value)));
+
+    // The operands read by the sheet are the ones read through the cells
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'12");
+    sheet.SetCell("A3"_pos, "12");
+    sheet.SetCell("A4"_pos, "=1/0");
+    sheet.SetCell("A5"_pos, "=A3*2");
+    sheet.SetCell("A6"_pos, "=A8");
+    sheet.SetCell("A7"_pos, " 4");
+    for (int row = 0; row < 10; ++row)
+    {
+        const Position pos{row, 0};
+        ASSERT(sheet.GetOperand(pos) == sheet.ISheet::GetOperand(pos));
+    }
+    ASSERT(sheet.GetOperand("A5"_pos) == BoxedValue(24.0));
+    auto kind = [&sheet](Position pos)
+    { return dynamic_cast<const CellHolder *>(sheet.GetCell(pos))->GetBoxedValue().GetKind(); };
+    ASSERT(kind("A1"_pos) == Kind::Text);
+    ASSERT(kind("A2"_pos) == Kind::Text);
+    ASSERT(kind("A3"_pos) == Kind::Number);
+    ASSERT(kind("A4"_pos) == Kind::Error);
+    ASSERT(kind("A8"_pos) == Kind::Empty);
+}
+
+void TestValueView()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "1.5");
+    sheet.SetCell("A4"_pos, "=A3*2");
+    sheet.SetCell("A5"_pos, "=1/0");
+    sheet.SetCell("A6"_pos, "=A8");
+    sheet.SetCell("A7"_pos, "'12");
+    auto path = SaveSnapshotFile(sheet, "table_test_view.snapshot");
+    MappedSheet mapped(path);
+    auto fork = sheet.Fork();
+    for (const ISheet *source : {static_cast<const ISheet *>(&sheet), static_cast<const ISheet *>(&mapped), static_cast<const ISheet *>(fork.get())})
+        for (int row = 0; row < 10; ++row)
+        {
+            const Position pos{row, 0};
+            const ICell *cell = source->GetCell(pos);
+            const ICell::Value value = cell != nullptr ? cell->GetValue() : ICell::Value(0.0);
+            ASSERT_EQUAL(source->GetValueView(pos).ToValue(), value);
+            if (cell != nullptr)
+                ASSERT_EQUAL(cell->GetValueView().ToValue(), value);
+        }
+    ASSERT(sheet.GetValueView("A1"_pos).IsText());
+    ASSERT_EQUAL(sheet.GetValueView("A2"_pos).GetText(), "=escaped");
+    ASSERT(sheet.GetValueView("A7"_pos).IsText());
+    ASSERT_EQUAL(sheet.GetValueView("A4"_pos).GetNumber(), 3.0);
+    ASSERT_EQUAL(sheet.GetValueView("A5"_pos).GetError(), FormulaError(FormulaError::Category::Div0));
+    ASSERT(sheet.GetValueView("A9"_pos).IsNumber());
+    fork.reset();
+
+    // The text points into the cell and survives reads and recalculations
+    const std::string_view text = sheet.GetValueView("A1"_pos).GetText();
+    sheet.SetCell("A3"_pos, "2");
+    ASSERT_EQUAL(sheet.GetValueView("A4"_pos).GetNumber(), 4.0);
+    ASSERT_EQUAL(sheet.GetValueView("A1"_pos).GetText().data(), text.data());
+    ASSERT_EQUAL(text, "text");
+    const std::string_view mappedText = mapped.GetValueView("A1"_pos).GetText();
+    ASSERT_EQUAL(mapped.GetValueView("A1"_pos).GetText().data(), mappedText.data());
+
+    RangeSummary summary;
+    summary.Add(ValueView(2.0));
+    summary.Add(ValueView(std::string_view("text")));
+    summary.Add(ValueView(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(summary.count, size_t{1});
+    ASSERT(summary.error == FormulaError(FormulaError::Category::Ref));
+}
+
+void TestReadValues()
+{
+    const std::vector<std::string> inputs{"3", "-2.5", "text", "'7", "=1/0", "=A1+1", "", "=B1*2", "=ZZ1", "=C1"};
+    const int rows = 700;
+    Sheet sheet;
+    {
+        Sheet::Batch batch(sheet);
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < 4; ++j)
+                if (const auto &text = inputs[(i * 7 + j * 3) % inputs.size()]; text.empty() == false)
+                    sheet.SetCell({i, j}, text);
+        batch.Commit();
+    }
+    auto check = [&](Range range, unsigned threads)
+    {
+        const int cols = range.last.col - range.first.col + 1;
+        const size_t size = static_cast<size_t>(range.last.row - range.first.row + 1) * cols;
+        std::vector<double> values(size, -1.0);
+        std::vector<ValueStatus> statuses(size, ValueStatus::Number);
+        sheet.ReadValues(range, values.data(), statuses.data(), threads);
+        for (size_t k = 0; k < size; ++k)
+        {
+            const Position pos{range.first.row + static_cast<int>(k) / cols, range.first.col + static_cast<int>(k) % cols};
+            const ICell *cell = sheet.GetCell(pos);
+            const ICell::Value value = cell != nullptr ? cell->GetValue() : ICell::Value(0.0);
+            if (holds_alternative<double>(value))
+            {
+                ASSERT_EQUAL(values[k], get<double>(value));
+                ASSERT(statuses[k] == (cell != nullptr && cell->GetText().empty() == false ? ValueStatus::Number : ValueStatus::Empty));
+            }
+            else if (holds_alternative<std::string>(value))
+            {
+                ASSERT(std::isnan(values[k]));
+                ASSERT(statuses[k] == ValueStatus::Text);
+            }
+            else
+            {
+                ASSERT(std::isnan(values[k]));
+                const auto category = get<FormulaError>(value).GetCategory();
+                ASSERT(statuses[k] == (category == FormulaError::Category::Ref ? ValueStatus::RefError
+                    : category == FormulaError::Category::Value ? ValueStatus::ValueError : ValueStatus::Div0Error));
+            }
+        }
+        std::vector<double> onlyValues(size);
+        sheet.ReadValues(range, onlyValues.data(), nullptr, threads);
+        for (size_t k = 0; k < size; ++k)
+            ASSERT(onlyValues[k] == values[k] || (std::isnan(onlyValues[k]) && std::isnan(values[k])));
+    };
+    // Formulas are recalculated by the read
+    sheet.SetCell("A1"_pos, "10");
+    check({{0, 0}, {rows - 1, 3}}, 4);
+    sheet.SetCell("A1"_pos, "11");
+    check({{0, 0}, {rows - 1, 3}}, 1);
+    check({{5, 2}, {rows + 20, 6}}, 3);
+    check({{0, 0}, {0, 0}}, 1);
+    double value = 0.0;
+    try
+    {
+        sheet.ReadValues({{2, 2}, {1, 1}}, &value, nullptr);
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException &)
+    {
+    }
+}
+
+void TestTypedSetters()
+{
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "=A1*2+B1");
+    sheet.SetNumber("A1"_pos, 1.5);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1.5");
+    for (double value : {0.1, -0.0, 1.0 / 3, 123456789.0, 0.000125})
+    {
+        sheet.SetNumber("A2"_pos, value);
+        const std::string text = sheet.GetCell("A2"_pos)->GetText();
+        ASSERT_EQUAL(std::stod(text), value);
+        Sheet reference;
+        reference.SetCell("A2"_pos, text);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), reference.GetCell("A2"_pos)->GetValue());
+    }
+    // Texts in fixed notation read back as the same numbers by SetCell and ImportTexts
+    const double extremes[] = {1e-5, 1e16, 1e300, -2.5e-300, std::numeric_limits<double>::denorm_min(),
+        std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
+    Sheet typed, reference;
+    for (int i = 0; i < static_cast<int>(std::size(extremes)); ++i)
+    {
+        typed.SetNumber({i, 0}, extremes[i]);
+        const std::string text = typed.GetCell({i, 0})->GetText();
+        ASSERT(text.find('e') == std::string::npos);
+        reference.SetCell({i, 0}, text);
+        ASSERT_EQUAL(reference.GetCell({i, 0})->GetValue(), ICell::Value(extremes[i]));
+    }
+    // Digits beyond the largest double stay a text
+    reference.SetCell("B1"_pos, std::string(400, '9'));
+    ASSERT_EQUAL(reference.GetCell("B1"_pos)->GetValue(), ICell::Value(std::string(400, '9')));
+    ASSERT_EQUAL(typed.GetCell("A1"_pos)->GetText(), "0.00001");
+    ASSERT_EQUAL(typed.GetCell("A2"_pos)->GetText(), "10000000000000000");
+    std::stringstream texts;
+    typed.PrintTexts(texts);
+    Sheet imported;
+    imported.ImportTexts(texts);
+    AssertSamePrint(imported, typed);
+    for (int i = 0; i < static_cast<int>(std::size(extremes)); ++i)
+        ASSERT_EQUAL(imported.GetCell({i, 0})->GetValue(), ICell::Value(extremes[i]));
+    try
+    {
+        sheet.SetNumber("A4"_pos, std::numeric_limits<double>::infinity());
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument &)
+    {
+    }
+    ASSERT(sheet.GetCell("A4"_pos) == nullptr);
+
+    // Texts stay texts, escaped when SetCell would read them otherwise
+    reference.SetCell("A1"_pos, "1.5");
+    reference.SetCell("C1"_pos, "=A1*2+B1");
+    for (const std::string text : {"hello", "12", "=A1", "'x", "1-2", "=", "1e5"})
+    {
+        sheet.SetText("B1"_pos, text);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(text));
+        reference.SetCell("B1"_pos, sheet.GetCell("B1"_pos)->GetText());
+        ASSERT_EQUAL(reference.GetCell("B1"_pos)->GetValue(), ICell::Value(text));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), reference.GetCell("C1"_pos)->GetValue());
+    }
+    sheet.SetText("B1"_pos, "");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(3.0));
+
+    // A number replaces a formula with its references
+    sheet.SetCell("D1"_pos, "=E1");
+    sheet.SetNumber("D1"_pos, 4.0);
+    sheet.SetCell("E1"_pos, "=D1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), ICell::Value(4.0));
+
+    const double values[] = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+    sheet.SetCell("H1"_pos, "=SUM(F1:G3)");
+    sheet.SetCell("H2"_pos, "=F3*G3");
+    sheet.SetNumbers({{0, 5}, {2, 6}}, values);
+    ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), ICell::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("H2"_pos)->GetValue(), ICell::Value(30.0));
+    ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "4");
+
+    std::stringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet loaded;
+    loaded.LoadSnapshot(snapshot);
+    AssertSamePrint(loaded, sheet);
+
+    // The journal replays the texts of the numbers
+    auto path = (std::filesystem::temp_directory_path() / "table_test_typed.journal").string();
+    std::filesystem::remove(path);
+    const double numbers[] = {1e300, std::numeric_limits<double>::denorm_min()};
+    {
+        Journal journal(path);
+        loaded.AttachJournal(&journal);
+        loaded.SetNumber("A1"_pos, 1e300);
+        loaded.SetNumbers({{0, 9}, {0, 10}}, numbers);
+        loaded.SetText("B2"_pos, "1e5");
+        journal.Sync();
+        loaded.AttachJournal(nullptr);
+    }
+    Sheet replayed;
+    ASSERT_EQUAL(replayed.ReplayJournal(path), 3u);
+    ASSERT_EQUAL(replayed.GetCell("A1"_pos)->GetValue(), ICell::Value(1e300));
+    ASSERT_EQUAL(replayed.GetCell("J1"_pos)->GetValue(), ICell::Value(1e300));
+    ASSERT_EQUAL(replayed.GetCell("K1"_pos)->GetValue(), ICell::Value(numbers[1]));
+    ASSERT_EQUAL(replayed.GetCell("B2"_pos)->GetValue(), ICell::Value("1e5"));
+    std::filesystem::remove(path);
+}
+
+void TestRepeatedSetCell()
+{
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1 + 1");
+    auto formula = [&sheet](Position pos)
+    { return dynamic_cast<const CellHolder *>(sheet.GetCell(pos))->GetFormula(); };
+    const IFormula *compiled = formula("B1"_pos);
+    // The repeated text is skipped, another text of the same formula is set again
+    sheet.SetCell("B1"_pos, "=A1 + 1");
+    ASSERT_EQUAL(formula("B1"_pos), compiled);
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(3.0));
+    compiled = formula("B1"_pos);
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(formula("B1"_pos), compiled);
+
+    // Renamed references forget the text
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2+1");
+    sheet.SetCell("B2"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(1.0));
+
+    // So does a rolled back batch
+    sheet.SetCell("C1"_pos, "=B2*2");
+    {
+        Sheet::Batch batch(sheet);
+        sheet.SetCell("C1"_pos, "=B2*3");
+        sheet.SetCell("C1"_pos, "=B2*3");
+    }
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B2*2");
+    sheet.SetCell("C1"_pos, "=B2*3");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(3.0));
+
+    // Imported and literal texts
+    std::istringstream input("5\tx\n");
+    sheet.ImportTexts(input);
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "x");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(5.0));
+    sheet.SetCell("A1"_pos, "6");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(6.0));
+    sheet.SetNumber("A1"_pos, 7.0);
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(7.0));
+    sheet.SetCell("A1"_pos, "");
+    sheet.SetCell("A1"_pos, "");
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr || sheet.GetCell("A1"_pos)->GetText().empty());
+}
+
+void TestFormulaTextCache()
+{
+    auto reformat = [](std::string expr)
+    {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+    ASSERT_EQUAL(reformat("0.1"), "0.1");
+    ASSERT_EQUAL(reformat("2.50"), "2.5");
+    ASSERT_EQUAL(reformat("123456"), "123456");
+    ASSERT_EQUAL(reformat("1e20"), "1e+20");
+    ASSERT_EQUAL(reformat("SUM(A1:B2, 3, (C4))"), "SUM(A1:B2,3,C4)");
+    for (const std::string expr : {"0.1", "1.0E-7", "1e20", "123456789012", "3.14159265358979", "7/3+.2"})
+    {
+        const auto formula = ParseFormula(expr);
+        ASSERT_EQUAL(ParseFormula(formula->GetExpression())->GetExpression(), formula->GetExpression());
+        ASSERT(ParseFormula(formula->GetExpression())->Evaluate(Sheet()) == formula->Evaluate(Sheet()));
+    }
+
+    // The text follows moved and deleted references
+    auto formula = ParseFormula("B1+SUM(B1:B3)*(B2-1)");
+    ASSERT_EQUAL(formula->GetExpression(), "B1+SUM(B1:B3)*(B2-1)");
+    formula->HandleInsertedRows(0, 2);
+    ASSERT_EQUAL(formula->GetExpression(), "B3+SUM(B3:B5)*(B4-1)");
+    formula->HandleInsertedCols(0);
+    ASSERT_EQUAL(formula->GetExpression(), "C3+SUM(C3:C5)*(C4-1)");
+    formula->HandleDeletedRows(3);
+    ASSERT_EQUAL(formula->GetExpression(), "C3+SUM(C3:C4)*(#!REF-1)");
+    formula->HandleDeletedCols(2);
+    ASSERT_EQUAL(formula->GetExpression(), "#!REF+SUM(#!REF)*(#!REF-1)");
+    formula->HandleInsertedRows(10);
+    ASSERT_EQUAL(formula->GetExpression(), "#!REF+SUM(#!REF)*(#!REF-1)");
+
+    // Same edits of a sheet, the formula itself stays out of the deleted row and column
+    Sheet sheet;
+    sheet.SetCell("F10"_pos, "=B1+SUM(B1:B3)*(B2-1)");
+    ASSERT_EQUAL(sheet.GetCell("F10"_pos)->GetText(), "=B1+SUM(B1:B3)*(B2-1)");
+    sheet.InsertRows(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("F12"_pos)->GetText(), "=B3+SUM(B3:B5)*(B4-1)");
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("G12"_pos)->GetText(), "=C3+SUM(C3:C5)*(C4-1)");
+    sheet.DeleteRows(3);
+    ASSERT_EQUAL(sheet.GetCell("G11"_pos)->GetText(), "=C3+SUM(C3:C4)*(#!REF-1)");
+    sheet.DeleteCols(2);
+    ASSERT_EQUAL(sheet.GetCell("F11"_pos)->GetText(), "=#!REF+SUM(#!REF)*(#!REF-1)");
+    sheet.InsertRows(20);
+    ASSERT_EQUAL(sheet.GetCell("F11"_pos)->GetText(), "=#!REF+SUM(#!REF)*(#!REF-1)");
+
+    Sheet printed;
+    printed.SetCell("A1"_pos, "=COUNTIF(B1:B3, \">1\")/2");
+    printed.SetCell("B1"_pos, "=0.5*C1");
+    printed.InsertCols(0);
+    std::ostringstream texts;
+    printed.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t=COUNTIF(C1:C3,\">1\")/2\t=0.5*D1\t\n");
+}
+
+void TestStructuralEdits()
+{
+    {
+        // Every row after the inserted ones moves, so do the references to them
+        Sheet sheet;
+        for (int i = 0; i < 5; ++i)
+            sheet.SetCell({i, 0}, std::to_string(i + 1));
+        sheet.SetCell("B1"_pos, "=A5+A2");
+        sheet.InsertRows(1);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A6+A3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(7.0));
+        sheet.InsertCols(0, 2);
+        ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "5");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=C6+C3");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 4}));
+    }
+    {
+        // Deleted cells referencing each other and the last rows of the sheet
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=A4*2");
+        sheet.SetCell("A3"_pos, "=A4+1");
+        sheet.SetCell("A4"_pos, "=B4+A3");
+        sheet.SetCell("A3"_pos, "3");
+        sheet.SetCell("B4"_pos, "=A3");
+        sheet.DeleteRows(2, 5);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#!REF*2");
+        ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("A1"_pos)->GetValue()));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+        sheet.SetCell("A3"_pos, "4");
+        sheet.SetCell("B3"_pos, "=A1");
+        sheet.DeleteCols(0);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#!REF");
+        sheet.DeleteRows(10);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 1}));
+    }
+
+    // The values after random edits are those of a sheet set from the texts. Texts with
+    // deleted references are errors, their dependents are not compared
+    std::mt19937 random(13);
+    auto next = [&random](int limit)
+    { return static_cast<int>(random() % limit); };
+    Sheet sheet;
+    for (int k = 0; k < 400; ++k)
+    {
+        const Position pos{next(12), next(8)};
+        if (next(3) == 0)
+            sheet.SetCell(pos, std::to_string(next(100)));
+        else
+        {
+            const Position ref{next(12), next(8)};
+            try
+            {
+                sheet.SetCell(pos, "=" + ref.ToString() + "+" + Position{next(12), next(8)}.ToString() + "+1");
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+        }
+        if (k % 20 == 19)
+        {
+            const int first = next(10);
+            const int count = 1 + next(3);
+            switch (next(4))
+            {
+            case 0:
+                sheet.InsertRows(first, count);
+                break;
+            case 1:
+                sheet.InsertCols(first, count);
+                break;
+            case 2:
+                sheet.DeleteRows(first, count);
+                break;
+            default:
+                sheet.DeleteCols(first, count);
+            }
+        }
+    }
+    Sheet rebuilt;
+    const Size size = sheet.GetPrintableSize();
+    for (int i = 0; i < size.rows; ++i)
+        for (int j = 0; j < size.cols; ++j)
+            if (const ICell *cell = sheet.GetCell({i, j}); cell != nullptr && cell->GetText().empty() == false)
+                rebuilt.SetCell({i, j}, cell->GetText().find("#!REF") == std::string::npos ? cell->GetText() : "=1/0");
+    for (int i = 0; i < size.rows; ++i)
+        for (int j = 0; j < size.cols; ++j)
+            if (const ICell *cell = sheet.GetCell({i, j}); cell != nullptr && cell->GetText().empty() == false)
+            {
+                const auto value = rebuilt.GetCell({i, j})->GetValue();
+                if (std::holds_alternative<FormulaError>(cell->GetValue()))
+                    ASSERT(std::holds_alternative<FormulaError>(value));
+                ASSERT(std::holds_alternative<FormulaError>(cell->GetValue()) || cell->GetValue() == value);
+            }
+}
+
+void TestRangeTree()
+{
+    std::mt19937 random(42);
+    auto next = [&random](int limit)
+    { return static_cast<int>(random() % limit); };
+    std::vector<std::pair<Range, int>> stored;
+    RangeTree<int> tree;
+    for (int k = 0; k < 300; ++k)
+    {
+        Position first{next(200), next(50)};
+        Position last{first.row + next(100), first.col + next(20)};
+        if (k % 10 == 0)
+            last = {Position::kMaxRows - 1, first.col};
+        stored.push_back({{first, last}, k});
+        tree.Insert(stored.back().first, k);
+    }
+    for (int k = 0; k < 100; ++k)
+    {
+        const size_t index = next(static_cast<int>(stored.size()));
+        tree.Erase(stored[index].first, stored[index].second);
+        stored.erase(stored.begin() + index);
+    }
+    for (int k = 0; k < 1000; ++k)
+    {
+        const Position pos{next(320), next(80)};
+        std::vector<int> expected;
+        for (const auto &[range, value] : stored)
+            if (range.Contains(pos))
+                expected.push_back(value);
+        std::vector<int> found;
+        tree.Stab(pos, [&found](int value)
+                  { found.push_back(value); });
+        std::sort(found.begin(), found.end());
+        ASSERT_EQUAL(found, expected);
+    }
+    tree.Clear();
+    ASSERT(tree.Empty());
+
+    Sheet sheet;
+    for (int i = 0; i < 100; ++i)
+        sheet.SetCell({i, 0}, std::to_string(i));
+    for (int i = 0; i < 90; ++i)
+        sheet.SetCell({i, 1}, "=SUM(A" + std::to_string(i + 1) + ":A" + std::to_string(i + 10) + ",A1:A1)");
+    sheet.SetCell("A1"_pos, "100");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(145.0 + 100.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(55.0 + 100.0));
+    sheet.SetCell("A50"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("B45"_pos)->GetValue(), ICell::Value(44.0 + 45 + 46 + 47 + 48 + 50 + 51 + 52 + 53 + 100.0));
+    ASSERT_EQUAL(sheet.GetCell("B51"_pos)->GetValue(), ICell::Value(50.0 * 10 + 45 + 100));
+}
+
+void TestRangeFunctions()
+{
+    auto throws = [](const std::function<void()> &edit)
+    {
+        try
+        {
+            edit();
+        }
+        catch (const FormulaException &)
+        {
+            return 1;
+        }
+        catch (const CircularDependencyException &)
+        {
+            return 2;
+        }
+        catch (const std::logic_error &)
+        {
+            return 3;
+        }
+        return 0;
+    };
+    const ICell::Value div0 = FormulaError(FormulaError::Category::Div0);
+    const ICell::Value valueError = FormulaError(FormulaError::Category::Value);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A3,(B2*2))");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A3)");
+    sheet.SetCell("B3"_pos, "=MAX(A1:A3)-MIN(A3:A1)+COUNT(A1:A5)");
+    sheet.SetCell("B4"_pos, "=AVERAGE(D1:D9)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A3,B2*2)");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=MAX(A1:A3)-MIN(A1:A3)+COUNT(A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), ICell::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), div0);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells(), (std::vector<Position>{"B2"_pos}));
+
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(8.0));
+    sheet.SetCell("A5"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "=B4");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(8.0));
+    sheet.SetCell("B1"_pos, "=SUM(A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), div0);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), ICell::Value(4.0));
+    sheet.SetCell("D1"_pos, "6");
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), ICell::Value(6.0));
+    sheet.ClearCell("A5"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), ICell::Value(5.0));
+
+    ASSERT_EQUAL(throws([&] { sheet.SetCell("C1"_pos, "=SUM(A1:C1)"); }), 2);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(throws([&] { sheet.SetCell("D1"_pos, "=SUM(A1:A5)"); }), 2);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "6");
+    ASSERT_EQUAL(throws([&] { sheet.SetCell("D1"_pos, "=SUMM(A1:A2)"); }), 1);
+    ASSERT_EQUAL(throws([&] { sheet.SetCell("D1"_pos, "=A1:A2"); }), 1);
+    ASSERT_EQUAL(throws([&] { sheet.SetCell("D1"_pos, "=SUM(A1:A2)+A1:A2"); }), 1);
+
+    {
+        Sheet edited;
+        edited.SetCell("A1"_pos, "1");
+        edited.SetCell("A2"_pos, "2");
+        edited.SetCell("A3"_pos, "3");
+        edited.SetCell("B5"_pos, "=SUM(A1:A3)");
+        edited.InsertRows(2, 3);
+        ASSERT_EQUAL(edited.GetCell("B8"_pos)->GetText(), "=SUM(A1:A6)");
+        edited.SetCell("A3"_pos, "5");
+        ASSERT_EQUAL(edited.GetCell("B8"_pos)->GetValue(), ICell::Value(11.0));
+        edited.DeleteRows(1, 2);
+        ASSERT_EQUAL(edited.GetCell("B6"_pos)->GetText(), "=SUM(A1:A4)");
+        ASSERT_EQUAL(edited.GetCell("B6"_pos)->GetValue(), ICell::Value(4.0));
+
+        Sheet row;
+        row.SetCell("A1"_pos, "=COUNT(B1:C1)+MAX(B1:E1)");
+        row.SetCell("E1"_pos, "4");
+        row.DeleteCols(1, 2);
+        ASSERT_EQUAL(row.GetCell("A1"_pos)->GetText(), "=COUNT(#!REF)+MAX(B1:C1)");
+        ASSERT_EQUAL(row.GetCell("A1"_pos)->GetValue(), valueError);
+    }
+
+    std::stringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet copy;
+    copy.LoadSnapshot(snapshot);
+    AssertSamePrint(copy, sheet);
+    for (ISheet *target : {static_cast<ISheet *>(&copy), static_cast<ISheet *>(&sheet)})
+    {
+        target->SetCell("A3"_pos, "100");
+        ASSERT_EQUAL(target->GetCell("B1"_pos)->GetValue(), ICell::Value(107.0));
+    }
+    AssertSamePrint(copy, sheet);
+
+    auto path = SaveSnapshotFile(sheet, "table_test_ranges.snapshot");
+    {
+        MappedSheet mapped(path);
+        for (ISheet *target : {static_cast<ISheet *>(&mapped), static_cast<ISheet *>(&sheet)})
+        {
+            target->SetCell("A1"_pos, "11");
+            target->SetCell("F1"_pos, "=MIN(A1:B2)");
+        }
+        AssertSamePrint(mapped, sheet);
+        ASSERT_EQUAL(throws([&] { mapped.SetCell("A1"_pos, "=B1"); }), 2);
+        ASSERT_EQUAL(throws([&] { mapped.SetCell("A2"_pos, "=F1"); }), 2);
+    }
+    std::filesystem::remove(path);
+
+    sheet.BeginBatch();
+    sheet.SetCell("A2"_pos, "1");
+    sheet.SetCell("G1"_pos, "=SUM(B1:B2)");
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(118.0));
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), ICell::Value(118.0 + 112.0 / 3));
+    sheet.BeginBatch();
+    sheet.SetCell("A2"_pos, "=G1");
+    ASSERT_EQUAL(throws([&] { sheet.Commit(); }), 2);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "1");
+    sheet.SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), ICell::Value(119.0 + 113.0 / 3));
+
+    {
+        auto fork = sheet.Fork();
+        fork->SetCell("A4"_pos, "=SUM(A1:A3)");
+        ASSERT_EQUAL(fork->GetCell("B1"_pos)->GetValue(), ICell::Value(113.0 + 113.0));
+        fork->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(fork->GetCell("B1"_pos)->GetValue(), ICell::Value(206.0));
+        ASSERT_EQUAL(throws([&] { fork->SetCell("A3"_pos, "=B1"); }), 2);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(119.0));
+        ASSERT_EQUAL(throws([&] { ScenarioModel(sheet, {"A1"_pos}, {"B1"_pos}); }), 3);
+    }
+    sheet.SetCell("C1"_pos, "=E5*2+B1");
+    ScenarioModel model(sheet, {"E5"_pos}, {"C1"_pos});
+    ASSERT_EQUAL(ToCellValue(model.Evaluate({1.0}).Get(0, 0)), ICell::Value(121.0));
+}
+
 void PascaleTriangle(int size, bool print = false)
 {
     LOG_DURATION("Total time: " + to_string(size))
@@ -1009,6 +2760,646 @@ void PascaleTriangle(int size, bool print = false)
     cerr << getRAM() << " On Triangle finish";
 }
 
+void DeepChainBenchmark(int length)
+{
+    LOG_DURATION("Deep chain total n=" + to_string(length))
+    auto sheet = CreateSheet();
+    {
+        LOG_DURATION("Deep chain create n=" + to_string(length))
+        FillChain(sheet.get(), length);
+    }
+    {
+        LOG_DURATION("Deep chain recalculate from head n=" + to_string(length))
+        sheet->SetCell(ChainPosition(0), "2");
+        sheet->GetCell(ChainPosition(length - 1))->GetValue();
+    }
+    cerr << getRAM() << " On deep chain finish" << endl;
+}
+
+void FillTriangleBottomUp(Sheet &sheet, int size)
+{
+    for (int i = size - 1; i >= 0; --i)
+        for (int j = i; j >= 0; --j)
+        {
+            if (j == 0 || j == i)
+                sheet.SetCell({i, j}, "1");
+            else
+                sheet.SetCell({i, j}, "=" + Position{i - 1, j - 1}.ToString() + "+" + Position{i - 1, j}.ToString());
+        }
+}
+
+void BatchLoadBenchmark(int size)
+{
+    Sheet single, batched;
+    {
+        LOG_DURATION("Triangle load cell by cell n=" + to_string(size))
+        FillTriangleBottomUp(single, size);
+        single.GetCell({size - 1, size / 2})->GetValue();
+    }
+    {
+        LOG_DURATION("Triangle load in one batch n=" + to_string(size))
+        Sheet::Batch batch(batched);
+        FillTriangleBottomUp(batched, size);
+        batch.Commit();
+        batched.GetCell({size - 1, size / 2})->GetValue();
+    }
+}
+
+std::string MakeTsv(int rows, int cols, bool withFormulas)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+        {
+            Position pos{i, j};
+            if (withFormulas && j % 4 == 3 && i > 0)
+                sheet.SetCell(pos, "=" + Position{i - 1, j}.ToString() + "+" + Position{i, j - 1}.ToString());
+            else if (withFormulas && j % 4 == 2)
+                sheet.SetCell(pos, "text " + to_string(i));
+            else
+                sheet.SetCell(pos, to_string(i * 0.25 + j));
+        }
+    std::ostringstream output;
+    sheet.PrintTexts(output);
+    return output.str();
+}
+
+void ImportBenchmark(int rows, int cols, bool withFormulas)
+{
+    auto tsv = MakeTsv(rows, cols, withFormulas);
+    Sheet sheet;
+    std::istringstream input(tsv);
+    auto start = std::chrono::steady_clock::now();
+    sheet.ImportTexts(input);
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    cerr << "Import " << (withFormulas ? "mixed " : "numbers ") << tsv.size() << " bytes: "
+         << seconds.count() * 1000 << " ms, " << tsv.size() / seconds.count() / 1e9 << " GB/s, RSS "
+         << getRAM() << ", peak RSS " << getPeakRAM() << endl;
+}
+
+void ExportBenchmark(int rows, int cols, bool withFormulas, unsigned threads = 1)
+{
+    Sheet sheet;
+    std::istringstream input(MakeTsv(rows, cols, withFormulas));
+    sheet.ImportTexts(input);
+    for (bool values : {false, true})
+    {
+        std::ostringstream output;
+        auto start = std::chrono::steady_clock::now();
+        if (values)
+            sheet.PrintValues(output, {std::nullopt, true, threads});
+        else
+            sheet.PrintTexts(output, {std::nullopt, true, threads});
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        auto size = output.str().size();
+        cerr << "Export " << (values ? "values " : "texts ") << (withFormulas ? "mixed " : "numbers ")
+             << threads << " threads "
+             << size << " bytes: " << seconds.count() * 1000 << " ms, "
+             << size / seconds.count() / 1e9 << " GB/s" << endl;
+    }
+}
+
+void SnapshotBenchmark(int rows, int cols)
+{
+    Sheet sheet;
+    std::istringstream input(MakeTsv(rows, cols, true));
+    {
+        LOG_DURATION("Snapshot source import " + to_string(rows * cols) + " cells")
+        sheet.ImportTexts(input);
+    }
+    std::stringstream snapshot;
+    {
+        LOG_DURATION("Snapshot save")
+        sheet.SaveSnapshot(snapshot);
+    }
+    Sheet loaded;
+    {
+        LOG_DURATION("Snapshot load " + to_string(snapshot.str().size()) + " bytes")
+        loaded.LoadSnapshot(snapshot);
+    }
+}
+
+void MappedSheetBenchmark(int rows, int cols, int reads)
+{
+    std::string path;
+    {
+        Sheet sheet;
+        std::istringstream input(MakeTsv(rows, cols, true));
+        sheet.ImportTexts(input);
+        path = SaveSnapshotFile(sheet, "table_bench_mapped.snapshot");
+    }
+    auto ramBefore = getRAM();
+    auto start = std::chrono::steady_clock::now();
+    MappedSheet mapped(path);
+    std::chrono::duration<double> opened = std::chrono::steady_clock::now() - start;
+
+    std::mt19937 random(42);
+    double sum = 0.0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reads; ++i)
+    {
+        Position pos{int(random() % rows), int(random() % cols)};
+        auto value = mapped.GetCell(pos)->GetValue();
+        if (holds_alternative<double>(value))
+            sum += get<double>(value);
+    }
+    std::chrono::duration<double> read = std::chrono::steady_clock::now() - start;
+    cerr << "Mapped sheet " << std::filesystem::file_size(path) << " bytes: open "
+         << opened.count() * 1000 << " ms, " << reads << " random reads " << read.count() * 1000
+         << " ms, " << mapped.DecodedTiles() << " tiles decoded, RSS growth "
+         << int64_t(getRAM()) - int64_t(ramBefore) << " (checksum " << sum << ")" << endl;
+    std::filesystem::remove(path);
+}
+
+void JournalBenchmark(int operations)
+{
+    auto path = (std::filesystem::temp_directory_path() / "table_bench.journal").string();
+    std::filesystem::remove(path);
+    auto run = [operations](Sheet &sheet) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < operations; ++i)
+            sheet.SetCell({i % 1000, i / 1000 % 100}, std::to_string(i));
+        std::chrono::duration<double, std::nano> spent = std::chrono::steady_clock::now() - start;
+        return spent.count() / operations;
+    };
+    Sheet plain;
+    const double plainNs = run(plain);
+    Sheet journaled;
+    Journal journal(path);
+    journaled.AttachJournal(&journal);
+    const double journaledNs = run(journaled);
+    auto start = std::chrono::steady_clock::now();
+    journal.Sync();
+    std::chrono::duration<double, std::milli> synced = std::chrono::steady_clock::now() - start;
+    cerr << "Journal " << operations << " SetCell: " << plainNs << " ns without journal, "
+         << journaledNs << " ns with group commit, overhead " << journaledNs - plainNs
+         << " ns, final sync " << synced.count() << " ms, " << std::filesystem::file_size(path)
+         << " bytes" << endl;
+    journaled.AttachJournal(nullptr);
+    std::filesystem::remove(path);
+}
+
+void BackgroundSnapshotBenchmark(int rows, int cols, int edits)
+{
+    Sheet sheet;
+    std::istringstream input(MakeTsv(rows, cols, true));
+    sheet.ImportTexts(input);
+    std::mt19937 random(42);
+    auto edit = [&](std::vector<double> &latencies) {
+        Position pos{int(random() % rows), int(random() % (cols / 4)) * 4};
+        auto start = std::chrono::steady_clock::now();
+        sheet.SetCell(pos, std::to_string(random() % 1000));
+        std::chrono::duration<double, std::micro> spent = std::chrono::steady_clock::now() - start;
+        latencies.push_back(spent.count());
+    };
+    auto describe = [](std::vector<double> latencies) {
+        std::sort(latencies.begin(), latencies.end());
+        std::ostringstream text;
+        text << "p50 " << latencies[latencies.size() / 2] << " us, p99 " << latencies[latencies.size() * 99 / 100]
+             << " us, max " << latencies.back() << " us";
+        return text.str();
+    };
+
+    std::vector<double> idle, during;
+    for (int i = 0; i < edits; ++i)
+        edit(idle);
+    auto path = (std::filesystem::temp_directory_path() / "table_bench_background.snapshot").string();
+    auto start = std::chrono::steady_clock::now();
+    auto job = sheet.SaveSnapshotInBackground(path);
+    std::chrono::duration<double, std::milli> forked = std::chrono::steady_clock::now() - start;
+    while (job->Done() == false)
+        edit(during);
+    std::chrono::duration<double, std::milli> finished = std::chrono::steady_clock::now() - start;
+    job->Wait();
+    cerr << "Background snapshot " << std::filesystem::file_size(path) << " bytes: fork " << forked.count()
+         << " ms, done after " << finished.count() << " ms, " << during.size() << " edits meanwhile" << endl;
+    cerr << "  SetCell idle: " << describe(idle) << endl;
+    if (during.empty() == false)
+        cerr << "  SetCell during snapshot: " << describe(during) << endl;
+    std::filesystem::remove(path);
+}
+
+void ForkBenchmark(int rows, int cols, int forks)
+{
+    Sheet base;
+    for (int i = 0; i < rows; ++i)
+    {
+        for (int j = 0; j < cols; ++j)
+            base.SetCell({i, j}, std::to_string(i + j));
+        base.SetCell({i, cols}, "=" + Position{i, 0}.ToString() + "*2+" + Position{i, 1}.ToString());
+    }
+    std::stringstream snapshot;
+    base.SaveSnapshot(snapshot);
+
+    auto ramBefore = getRAM();
+    double sum = 0.0;
+    std::vector<std::unique_ptr<SheetFork>> scenarios;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < forks; ++k)
+    {
+        scenarios.push_back(base.Fork());
+        scenarios.back()->SetCell({k % rows, 0}, std::to_string(k));
+        sum += get<double>(scenarios.back()->GetCell({k % rows, cols})->GetValue());
+    }
+    std::chrono::duration<double, std::micro> forked = std::chrono::steady_clock::now() - start;
+    const int64_t forkRam = int64_t(getRAM()) - int64_t(ramBefore);
+
+    ramBefore = getRAM();
+    start = std::chrono::steady_clock::now();
+    Sheet copy;
+    copy.LoadSnapshot(snapshot);
+    std::chrono::duration<double, std::milli> copied = std::chrono::steady_clock::now() - start;
+    const int64_t copyRam = int64_t(getRAM()) - int64_t(ramBefore);
+    cerr << "Fork " << forks << " scenarios of " << rows * (cols + 1) << " cells: " << forked.count() / forks
+         << " us and " << forkRam / forks << " bytes of RSS each; a copy by snapshot "
+         << copied.count() << " ms and " << copyRam << " bytes (checksum " << sum << ")" << endl;
+}
+
+void ScenarioBenchmark(int formulas, int scenarios, int serialScenarios)
+{
+    Sheet sheet;
+    const std::vector<Position> inputs{"A1"_pos, "A2"_pos, "A3"_pos};
+    for (const auto &pos : inputs)
+        sheet.SetCell(pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*A2+A3");
+    for (int i = 1; i < formulas; ++i)
+        sheet.SetCell({i, 1}, "=" + Position{i - 1, 1}.ToString() + "*0.5+" + inputs[i % 3].ToString() + "/(1+A3*A3)");
+    std::vector<Position> outputs;
+    for (int i = formulas - 10; i < formulas; ++i)
+        outputs.push_back({i, 1});
+    std::vector<double> values;
+    for (int k = 0; k < scenarios; ++k)
+        for (size_t i = 0; i < inputs.size(); ++i)
+            values.push_back(1.0 + (k * 7 + i) % 13 * 0.125);
+
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < serialScenarios; ++k)
+    {
+        for (size_t i = 0; i < inputs.size(); ++i)
+            sheet.SetCell(inputs[i], std::to_string(values[k * inputs.size() + i]));
+        for (const auto &pos : outputs)
+            sum += get<double>(sheet.GetCell(pos)->GetValue());
+    }
+    std::chrono::duration<double, std::micro> serial = std::chrono::steady_clock::now() - start;
+
+    for (unsigned threads : {1u, 0u})
+    {
+        start = std::chrono::steady_clock::now();
+        ScenarioMatrix result = sheet.EvaluateScenarios(inputs, values, outputs, threads);
+        std::chrono::duration<double, std::micro> batch = std::chrono::steady_clock::now() - start;
+        for (double value : result.values)
+            sum += value;
+        cerr << "Scenarios over " << formulas << " formulas, threads " << threads << ": SetCell loop "
+             << serial.count() / serialScenarios << " us, batch " << batch.count() / scenarios
+             << " us per scenario (checksum " << sum << ")" << endl;
+    }
+}
+
+void SensitivityBenchmark(int inputCount, int formulas)
+{
+    Sheet sheet;
+    std::vector<Position> inputs;
+    std::vector<double> point;
+    for (int i = 0; i < inputCount; ++i)
+    {
+        inputs.push_back({i, 0});
+        point.push_back(1.0 + i % 7 * 0.25);
+        sheet.SetCell(inputs.back(), std::to_string(point.back()));
+    }
+    sheet.SetCell("B1"_pos, "=A1*A2");
+    for (int i = 1; i < formulas; ++i)
+        sheet.SetCell({i, 1}, "=" + Position{i - 1, 1}.ToString() + "*0.5+" + inputs[i % inputCount].ToString() + "*" +
+                                  inputs[i * 7 % inputCount].ToString());
+    std::vector<Position> outputs;
+    for (int i = formulas - 10; i < formulas; ++i)
+        outputs.push_back({i, 1});
+
+    // Partials by bumping every input and recalculating
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < inputCount; ++i)
+    {
+        sheet.SetCell(inputs[i], std::to_string(point[i] + 1e-6));
+        for (const auto &pos : outputs)
+            sum += get<double>(sheet.GetCell(pos)->GetValue());
+        sheet.SetCell(inputs[i], std::to_string(point[i]));
+    }
+    std::chrono::duration<double, std::milli> bumped = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    ScenarioModel model(sheet, inputs, outputs);
+    Sensitivities result = model.Differentiate(point);
+    std::chrono::duration<double, std::milli> differentiated = std::chrono::steady_clock::now() - start;
+    for (double partial : result.partials)
+        sum += partial;
+    cerr << "Sensitivities of " << outputs.size() << " outputs by " << inputCount << " inputs over " << formulas
+         << " formulas: bump and recalculate " << bumped.count() << " ms, forward mode " << differentiated.count()
+         << " ms (checksum " << sum << ")" << endl;
+}
+
+void RangeAggregateBenchmark(int rows, int updates)
+{
+    double sum = 0.0;
+    for (bool ranges : {true, false})
+    {
+        Sheet sheet;
+        std::string formula = "=SUM(A1:A" + std::to_string(rows) + ")";
+        if (ranges == false)
+        {
+            formula = "=A1";
+            for (int i = 1; i < rows; ++i)
+                formula += "+" + Position{i, 0}.ToString();
+        }
+        for (int i = 0; i < rows; ++i)
+            sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({0, 1}, formula);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int k = 0; k < updates; ++k)
+        {
+            sheet.SetCell({k * 7919 % rows, 0}, std::to_string(k));
+            sum += get<double>(sheet.GetCell({0, 1})->GetValue());
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        cerr << (ranges ? "SUM over a range of " : "Sum of references to ") << rows << " cells: "
+             << elapsed.count() / updates << " us per point update and read (checksum " << sum << ")" << endl;
+    }
+}
+
+void RangeWatchBenchmark(int formulas, int updates)
+{
+    Sheet sheet;
+    for (int i = 0; i < formulas; ++i)
+    {
+        sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({i, 1}, "=SUM(" + Position{i, 0}.ToString() + ":" + Position{i + 99, 0}.ToString() + ")");
+    }
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < updates; ++k)
+    {
+        const int row = k * 7919 % formulas;
+        sheet.SetCell({row, 0}, std::to_string(k));
+        sum += get<double>(sheet.GetCell({row, 1})->GetValue());
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    cerr << "Point updates under " << formulas << " overlapping range formulas: " << elapsed.count() / updates
+         << " us each (checksum " << sum << ")" << endl;
+}
+
+void LookupBenchmark(int rows, int lookups)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+    {
+        sheet.SetCell({i, 0}, std::to_string(i * 7919 % rows));
+        sheet.SetCell({i, 1}, std::to_string(i));
+    }
+    sheet.SetCell("D1"_pos, "=VLOOKUP(C1,A1:B" + std::to_string(rows) + ",2,0)+MATCH(C1+0.5,A1:A" + std::to_string(rows) + ")");
+    // Most of the numbers nearest to the key are outside of the short range
+    sheet.SetCell("D2"_pos, "=VLOOKUP(C1-0.5,A1:B100,2)");
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < lookups; ++k)
+    {
+        sheet.SetCell("C1"_pos, std::to_string(k * 31 % rows));
+        sum += get<double>(sheet.GetCell("D1"_pos)->GetValue());
+        if (auto value = sheet.GetCell("D2"_pos)->GetValue(); holds_alternative<double>(value))
+            sum += get<double>(value);
+    }
+    std::chrono::duration<double, std::micro> indexed = std::chrono::steady_clock::now() - start;
+
+    const int scans = std::max(lookups / 100, 1);
+    const Range column{{0, 0}, {rows - 1, 0}};
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < scans; ++k)
+        sum += *sheet.ISheet::LookupRange(column, k * 31 % rows, LookupMode::Exact);
+    std::chrono::duration<double, std::micro> scanned = std::chrono::steady_clock::now() - start;
+    cerr << "Lookups in " << rows << " rows: " << indexed.count() / lookups << " us per update and indexed VLOOKUP+MATCH+VLOOKUP of 100 rows, "
+         << scanned.count() / scans << " us per scan (checksum " << sum << ")" << endl;
+}
+
+void ConditionalAggregateBenchmark(int rows, int updates)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+    {
+        sheet.SetCell({i, 0}, std::to_string(i * 7919 % 1000));
+        sheet.SetCell({i, 1}, std::to_string(i % 100));
+    }
+    const std::string column = std::to_string(rows);
+    sheet.SetCell("D1"_pos, "=SUMIF(A1:A" + column + ",\">=500\",B1:B" + column + ")+COUNTIF(A1:A" + column + ",\"<100\")");
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < updates; ++k)
+    {
+        sheet.SetCell({k * 31 % rows, 0}, std::to_string(k % 1000));
+        sum += get<double>(sheet.GetCell("D1"_pos)->GetValue());
+    }
+    std::chrono::duration<double, std::micro> indexed = std::chrono::steady_clock::now() - start;
+
+    const int scans = std::max(updates / 100, 1);
+    const Range keys{{0, 0}, {rows - 1, 0}};
+    const Range values{{0, 1}, {rows - 1, 1}};
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < scans; ++k)
+    {
+        sum += sheet.ISheet::SummarizeIf(keys, {Criterion::Comparison::GreaterOrEqual, 500.0}, values).sum;
+        sum += static_cast<double>(sheet.ISheet::SummarizeIf(keys, {Criterion::Comparison::Less, 100.0}, keys).count);
+    }
+    std::chrono::duration<double, std::micro> scanned = std::chrono::steady_clock::now() - start;
+    cerr << "Conditional aggregates over " << rows << " rows: " << indexed.count() / updates
+         << " us per update and indexed SUMIF+COUNTIF, " << scanned.count() / scans << " us per scan (checksum " << sum << ")" << endl;
+}
+
+void ConditionalCriteriaBenchmark(int rows, int formulas)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+        sheet.SetCell({i, 0}, std::to_string(i * 7919 % 1000));
+    const std::string column = "A1:A" + std::to_string(rows);
+    sheet.BeginBatch();
+    for (int i = 0; i < formulas; ++i)
+    {
+        sheet.SetCell({i, 1}, std::to_string(i));
+        sheet.SetCell({i, 2}, "=COUNTIF(" + column + ",B" + std::to_string(i + 1) + ")+SUMIF(" + column + ",\">=500\")");
+    }
+    sheet.Commit();
+    // An edit of the keys recalculates every formula, each with its own criterion
+    double sum = 0.0;
+    constexpr int kRounds = 4;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < kRounds; ++k)
+    {
+        sheet.SetCell({k * 31 % rows, 0}, std::to_string(k));
+        for (int i = 0; i < formulas; ++i)
+            sum += get<double>(sheet.GetCell({i, 2})->GetValue());
+    }
+    std::chrono::duration<double, std::micro> indexed = std::chrono::steady_clock::now() - start;
+
+    const Range keys{{0, 0}, {rows - 1, 0}};
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < formulas; ++i)
+    {
+        sum += static_cast<double>(sheet.ISheet::SummarizeIf(keys, {Criterion::Comparison::Equal, static_cast<double>(i)}, keys).count);
+        sum += sheet.ISheet::SummarizeIf(keys, {Criterion::Comparison::GreaterOrEqual, 500.0}, keys).sum;
+    }
+    std::chrono::duration<double, std::micro> scanned = std::chrono::steady_clock::now() - start;
+    cerr << "Criterion per row over " << rows << " rows: " << indexed.count() / (kRounds * formulas)
+         << " us per indexed COUNTIF+SUMIF, " << scanned.count() / formulas << " us per scan (checksum " << sum << ")" << endl;
+}
+
+void SumProductBenchmark(int rows, int updates)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+    {
+        sheet.SetCell({i, 0}, std::to_string(i % 100));
+        sheet.SetCell({i, 1}, std::to_string(i % 7));
+    }
+    const std::string last = std::to_string(rows);
+    sheet.SetCell("D1"_pos, "=SUMPRODUCT(A1:A" + last + ",B1:B" + last + ")+MAX(A2:A" + last + ")");
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < updates; ++k)
+    {
+        sheet.SetCell({k * 31 % rows, 0}, std::to_string(k % 100));
+        sum += get<double>(sheet.GetCell("D1"_pos)->GetValue());
+    }
+    std::chrono::duration<double, std::micro> indexed = std::chrono::steady_clock::now() - start;
+
+    const int scans = std::max(updates / 100, 1);
+    const std::vector<Range> ranges{{{0, 0}, {rows - 1, 0}}, {{0, 1}, {rows - 1, 1}}};
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < scans; ++k)
+        sum += sheet.ISheet::SumProduct(ranges).sum;
+    std::chrono::duration<double, std::micro> scanned = std::chrono::steady_clock::now() - start;
+    cerr << "SUMPRODUCT over " << rows << " rows with " << KernelsName() << " kernels: " << indexed.count() / updates
+         << " us per update, " << scanned.count() / scans << " us per scan (checksum " << sum << ")" << endl;
+}
+
+void ValueViewBenchmark(int rows, int rounds)
+{
+    Sheet sheet;
+    {
+        Sheet::Batch batch(sheet);
+        for (int i = 0; i < rows; ++i)
+        {
+            sheet.SetCell({i, 0}, "report line of customer number " + std::to_string(i));
+            sheet.SetCell({i, 1}, "'" + std::to_string(i));
+        }
+        batch.Commit();
+    }
+    size_t length = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < rounds; ++k)
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < 2; ++j)
+                length += get<std::string>(sheet.GetCell({i, j})->GetValue()).size();
+    std::chrono::duration<double, std::milli> copies = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < rounds; ++k)
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < 2; ++j)
+                length += sheet.GetValueView({i, j}).GetText().size();
+    std::chrono::duration<double, std::milli> views = std::chrono::steady_clock::now() - start;
+    cerr << "Reading " << 2 * rows * rounds << " text cells: " << copies.count() << " ms by GetValue, "
+         << views.count() << " ms by GetValueView (checksum " << length << ")" << endl;
+}
+
+void ReadValuesBenchmark(int rows, int cols, unsigned threads)
+{
+    Sheet sheet;
+    std::istringstream input(MakeTsv(rows, cols, true));
+    sheet.ImportTexts(input);
+    const Range range{{0, 0}, {rows - 1, cols - 1}};
+    std::vector<double> values(static_cast<size_t>(rows) * cols);
+    std::vector<ValueStatus> statuses(values.size());
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            if (const ICell *cell = sheet.GetCell({i, j}); cell != nullptr)
+                if (const auto value = cell->GetValue(); holds_alternative<double>(value))
+                    sum += get<double>(value);
+    std::chrono::duration<double, std::milli> cells = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    sheet.ReadValues(range, values.data(), statuses.data(), threads);
+    for (size_t k = 0; k < values.size(); ++k)
+        if (statuses[k] == ValueStatus::Number)
+            sum += values[k];
+    std::chrono::duration<double, std::milli> bulk = std::chrono::steady_clock::now() - start;
+    cerr << "Reading " << rows << "x" << cols << " values: " << cells.count() << " ms cell by cell, "
+         << bulk.count() << " ms by ReadValues on " << threads << " threads (checksum " << sum << ")" << endl;
+}
+
+void TypedSettersBenchmark(int rows, int cols)
+{
+    std::vector<double> values(static_cast<size_t>(rows) * cols);
+    for (size_t k = 0; k < values.size(); ++k)
+        values[k] = static_cast<double>(k) * 0.37 + 0.5;
+    Sheet texts;
+    auto start = std::chrono::steady_clock::now();
+    {
+        Sheet::Batch batch(texts);
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                texts.SetCell({i, j}, std::to_string(values[static_cast<size_t>(i) * cols + j]));
+        batch.Commit();
+    }
+    std::chrono::duration<double, std::milli> formatted = std::chrono::steady_clock::now() - start;
+
+    Sheet numbers;
+    start = std::chrono::steady_clock::now();
+    numbers.SetNumbers({{0, 0}, {rows - 1, cols - 1}}, values.data());
+    std::chrono::duration<double, std::milli> typed = std::chrono::steady_clock::now() - start;
+    cerr << "Setting " << values.size() << " numbers: " << formatted.count() << " ms by SetCell of texts, "
+         << typed.count() << " ms by SetNumbers" << endl;
+}
+
+void RepeatedSetCellBenchmark(int formulas, int rounds)
+{
+    Sheet sheet;
+    std::vector<std::string> texts;
+    for (int i = 0; i < formulas; ++i)
+    {
+        const std::string n = std::to_string(i + 1);
+        texts.push_back("=(A" + n + "+B" + n + ")*C" + n + "-(A" + n + "/(B" + n + "+1))+SUM(A1:C" + n + ")");
+        sheet.SetCell({i, 3}, texts.back());
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < rounds; ++k)
+        for (int i = 0; i < formulas; ++i)
+            sheet.SetCell({i, 3}, texts[i]);
+    std::chrono::duration<double, std::milli> resent = std::chrono::steady_clock::now() - start;
+    cerr << "Resending " << formulas * rounds << " unchanged formulas: " << resent.count() << " ms" << endl;
+}
+
+void FormulaTextBenchmark(int rows, int rounds)
+{
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i)
+    {
+        const std::string n = std::to_string(i + 1);
+        sheet.SetCell({i, 0}, std::to_string(i * 0.25));
+        sheet.SetCell({i, 1}, "=(A" + n + "+0.1)*A" + n + "-SUM(A1:A" + n + ")/3.75+MAX(A" + n + ",1e20)");
+    }
+    size_t size = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < rounds; ++k)
+    {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        size += output.str().size();
+    }
+    std::chrono::duration<double, std::milli> printed = std::chrono::steady_clock::now() - start;
+    cerr << "Printing " << rows << " formula texts " << rounds << " times: " << printed.count() << " ms ("
+         << size << " bytes)" << endl;
+}
+
 void SubTestForDoubleFormulaChange(ISheet *sheet)
 {
     sheet->SetCell("A1"_pos, "1");
@@ -1069,7 +3460,7 @@ void LimitsTest()
     SubTestForDoubleFormulaChange(sheet.get());
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     cerr << getRAM() << " On start";
     PascaleTriangle(4, true);
@@ -1112,9 +3503,66 @@ int main()
         RUN_TEST(tr, TestFormulaExpressionFormattingEx);
         RUN_TEST(tr, TestCellsDeletionRefUpdate);
         RUN_TEST(tr, TestCellClearFormulaUpdate);  
+        RUN_TEST(tr, TestDeepDependencyChain);
+        RUN_TEST(tr, TestDeepRangeChain);
+        RUN_TEST(tr, TestBatchCommit);
+        RUN_TEST(tr, TestBatchRollback);
+        RUN_TEST(tr, TestBatchClearCell);
+        RUN_TEST(tr, TestImportTexts);
+        RUN_TEST(tr, TestExportRange);
+        RUN_TEST(tr, TestParallelExport);
+        RUN_TEST(tr, TestSnapshot);
+        RUN_TEST(tr, TestMappedSheet);
+        RUN_TEST(tr, TestJournal);
+        RUN_TEST(tr, TestBackgroundSnapshot);
+        RUN_TEST(tr, TestSheetFork);
+        RUN_TEST(tr, TestScenarios);
+        RUN_TEST(tr, TestDifferentiate);
+        RUN_TEST(tr, TestRangeFunctions);
+        RUN_TEST(tr, TestRangeTree);
+        RUN_TEST(tr, TestLookupFunctions);
+        RUN_TEST(tr, TestConditionalAggregates);
+        RUN_TEST(tr, TestColumnKernels);
+        RUN_TEST(tr, TestBoxedValue);
+        RUN_TEST(tr, TestValueView);
+        RUN_TEST(tr, TestReadValues);
+        RUN_TEST(tr, TestTypedSetters);
+        RUN_TEST(tr, TestRepeatedSetCell);
+        RUN_TEST(tr, TestFormulaTextCache);
+        RUN_TEST(tr, TestStructuralEdits);
     }
     TestRunner tr;
     RUN_TEST(tr, LimitsTest);  
 
+    // Benchmarks take minutes, write files and fork, so they run only on request
+    if (argc < 2 || std::string(argv[1]) != "--bench")
+        return 0;
+    ImportBenchmark(2000, 200, false);
+    ImportBenchmark(2000, 200, true);
+    ExportBenchmark(2000, 200, false);
+    ExportBenchmark(2000, 200, true);
+    ExportBenchmark(2000, 200, true, 0);
+    SnapshotBenchmark(2000, 200);
+    MappedSheetBenchmark(2000, 200, 100);
+    JournalBenchmark(200000);
+    BackgroundSnapshotBenchmark(2000, 200, 10000);
+    ForkBenchmark(2000, 50, 5000);
+    ScenarioBenchmark(1000, 20000, 500);
+    SensitivityBenchmark(100, 2000);
+    DeepChainBenchmark(1 << 20);
+    BatchLoadBenchmark(1000);
+    RangeAggregateBenchmark(10000, 2000);
+    RangeWatchBenchmark(10000, 20000);
+    LookupBenchmark(16000, 20000);
+    ConditionalAggregateBenchmark(16000, 20000);
+    ConditionalCriteriaBenchmark(16000, 2000);
+    SumProductBenchmark(16000, 20000);
+    ValueViewBenchmark(16000, 60);
+    ReadValuesBenchmark(2000, 200, 1);
+    ReadValuesBenchmark(2000, 200, 4);
+    TypedSettersBenchmark(2000, 200);
+    RepeatedSetCellBenchmark(1000, 100);
+    FormulaTextBenchmark(10000, 20);
+
     return 0;
 }
@@ -0,0 +1,613 @@
+#include "mapped_sheet.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cell.h"
+#include "formula_impl.h"
+#include "tsv.h"
+
+
+using namespace std;
+
+
+namespace {
+
+ICell::Value ToCellValue(const IFormula::Value& value) {
+    if (holds_alternative<double>(value))
+        return get<double>(value);
+    return get<FormulaError>(value);
+}
+
+ValueView ToValueView(const IFormula::Value& value) {
+    if (holds_alternative<double>(value))
+        return get<double>(value);
+    return get<FormulaError>(value);
+}
+
+}
+
+
+MappedCell::MappedCell(const MappedSheet& sheet, Position pos)
+    : sheet(sheet), pos(pos) {
+}
+
+
+ICell::Value MappedCell::GetValue() const {
+    switch (kind) {
+    case SnapshotCellKind::Empty:
+        return 0.0;
+    case SnapshotCellKind::Text:
+        if (text.empty() == false && text[0] == kEscapeSign)
+            return string(text.substr(1));
+        return string(text);
+    case SnapshotCellKind::Formula:
+        if (invalid)
+            sheet.Recalculate(*this);
+        return ToCellValue(value);
+    default:
+        return ToCellValue(value);
+    }
+}
+
+
+ValueView MappedCell::GetValueView() const {
+    switch (kind) {
+    case SnapshotCellKind::Empty:
+        return 0.0;
+    case SnapshotCellKind::Text:
+        if (text.empty() == false && text[0] == kEscapeSign)
+            return ValueView(text.substr(1));
+        return ValueView(text);
+    case SnapshotCellKind::Formula:
+        if (invalid)
+            sheet.Recalculate(*this);
+        return ToValueView(value);
+    default:
+        return ToValueView(value);
+    }
+}
+
+
+string MappedCell::GetText() const {
+    if (kind == SnapshotCellKind::Formula)
+        return kFormulaSign + GetFormula().GetExpression();
+    return string(text);
+}
+
+
+vector<Position> MappedCell::GetReferencedCells() const {
+    if (kind == SnapshotCellKind::Formula)
+        return GetFormula().GetReferencedCells();
+    return {};
+}
+
+
+const IFormula& MappedCell::GetFormula() const {
+    if (formula == nullptr) {
+        SnapshotReader reader(program.data(), program.size());
+        formula = Formula::Load(reader);
+    }
+    return *formula;
+}
+
+
+vector<Position> MappedCell::GetDependents() const {
+    if (isPrivate)
+        return ownDependents;
+    vector<Position> dependents;
+    dependents.reserve(dependentsCount);
+    SnapshotReader reader(dependentsData.data(), dependentsData.size());
+    for (uint32_t i = 0; i < dependentsCount; ++i)
+        dependents.push_back(reader.GetPosition());
+    return dependents;
+}
+
+
+void MappedCell::MakePrivate() {
+    if (isPrivate)
+        return;
+    ownDependents = GetDependents();
+    ownText = string(text);
+    text = ownText;
+    ownProgram = string(program);
+    program = ownProgram;
+    dependentsData = {};
+    dependentsCount = 0;
+    isPrivate = true;
+}
+
+
+
+#ifndef _WIN32
+MappedSheet::MappedSheet(const string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw SnapshotError("Cannot open snapshot " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < kSnapshotHeaderSize + sizeof(uint64_t)) {
+        close(fd);
+        throw SnapshotError("Snapshot is truncated");
+    }
+    size = static_cast<size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw SnapshotError("Cannot map snapshot " + path);
+    // Tiles are read where cells are asked for, read-ahead would only grow the resident set
+    madvise(mapping, size, MADV_RANDOM);
+    data = static_cast<const char*>(mapping);
+
+    try {
+        SnapshotReader headerReader(data, kSnapshotHeaderSize);
+        const auto header = SnapshotHeader::Read(headerReader);
+        rowsCount = header.rows;
+        colsCount = header.cols;
+        tileCount = header.tileCount;
+        SnapshotReader trailer(data + size - sizeof(uint64_t), sizeof(uint64_t));
+        directoryOffset = trailer.Get<uint64_t>();
+        const uint64_t rangesOffset = directoryOffset + tileCount * kSnapshotDirectoryEntrySize;
+        if (directoryOffset < kSnapshotHeaderSize || tileCount > size / kSnapshotDirectoryEntrySize
+                || directoryOffset > size || rangesOffset + sizeof(uint32_t) + sizeof(uint64_t) > size)
+            throw SnapshotError("Malformed snapshot directory");
+        SnapshotReader ranges(data + rangesOffset, size - sizeof(uint64_t) - rangesOffset);
+        const uint32_t rangeCount = ranges.Get<uint32_t>();
+        if (rangeCount > size / (2 * sizeof(int32_t))
+                || rangesOffset + sizeof(uint32_t) + rangeCount * 2 * sizeof(int32_t) + sizeof(uint64_t) != size)
+            throw SnapshotError("Malformed snapshot directory");
+        rangeFormulas.reserve(rangeCount);
+        for (uint32_t i = 0; i < rangeCount; ++i)
+            rangeFormulas.push_back(ranges.GetPosition());
+    }
+    catch (...) {
+        munmap(const_cast<char*>(data), size);
+        throw;
+    }
+}
+
+
+MappedSheet::~MappedSheet() {
+    tiles.clear();
+    munmap(const_cast<char*>(data), size);
+}
+#else
+// The snapshot is mapped with POSIX mmap only
+MappedSheet::MappedSheet(const string& path) {
+    throw logic_error("Mapped snapshots are not supported on this platform");
+}
+
+
+MappedSheet::~MappedSheet() {
+}
+#endif
+
+
+int MappedSheet::TileKey(int tileRow, int tileCol) {
+    return tileRow * (Position::kMaxCols / kSnapshotTileSize) + tileCol;
+}
+
+
+MappedSheet::Tile* MappedSheet::FindTile(int tileRow, int tileCol) const {
+    if (auto it = tiles.find(TileKey(tileRow, tileCol)); it != tiles.end())
+        return it->second.get();
+    return DecodeTile(tileRow, tileCol);
+}
+
+
+MappedSheet::Tile* MappedSheet::DecodeTile(int tileRow, int tileCol) const {
+    // The directory is sorted by position, so it is searched right in the mapped pages
+    const char* directory = data + directoryOffset;
+    uint64_t first = 0;
+    uint64_t last = tileCount;
+    while (first < last) {
+        const uint64_t middle = first + (last - first) / 2;
+        SnapshotReader entry(directory + middle * kSnapshotDirectoryEntrySize, kSnapshotDirectoryEntrySize);
+        const int entryRow = entry.Get<int32_t>();
+        const int entryCol = entry.Get<int32_t>();
+        if (make_pair(entryRow, entryCol) < make_pair(tileRow, tileCol))
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    if (first == tileCount)
+        return nullptr;
+    SnapshotReader entry(directory + first * kSnapshotDirectoryEntrySize, kSnapshotDirectoryEntrySize);
+    if (entry.Get<int32_t>() != tileRow || entry.Get<int32_t>() != tileCol)
+        return nullptr;
+    const uint64_t offset = entry.Get<uint64_t>();
+    const uint64_t tileSize = entry.Get<uint64_t>();
+    if (offset < kSnapshotHeaderSize || tileSize < kSnapshotTileHeaderSize
+            || offset > directoryOffset || tileSize > directoryOffset - offset)
+        throw SnapshotError("Malformed snapshot directory");
+
+    SnapshotReader tileHeader(data + offset, kSnapshotTileHeaderSize);
+    if (tileHeader.Get<int32_t>() != tileRow || tileHeader.Get<int32_t>() != tileCol)
+        throw SnapshotError("Malformed snapshot tile");
+    const uint32_t cellCount = tileHeader.Get<uint32_t>();
+    if (tileHeader.Get<uint64_t>() != tileSize - kSnapshotTileHeaderSize)
+        throw SnapshotError("Malformed snapshot tile");
+
+    auto tile = make_unique<Tile>();
+    tile->payload = data + offset + kSnapshotTileHeaderSize;
+    tile->payloadSize = tileSize - kSnapshotTileHeaderSize;
+    if (tile->payloadSize >= kNoRecord)
+        throw SnapshotError("Snapshot tile is too big");
+    SnapshotReader reader(tile->payload, tile->payloadSize);
+    MappedCell scratch(*this, {});
+    for (uint32_t k = 0; k < cellCount; ++k) {
+        const int index = reader.Get<uint16_t>();
+        if (index >= kTileCells || tile->records[index] != kNoRecord)
+            throw SnapshotError("Malformed snapshot tile");
+        tile->records[index] = static_cast<uint32_t>(reader.Offset());
+        ReadRecord(reader, tile->payload, scratch);
+    }
+    if (reader.AtEnd() == false)
+        throw SnapshotError("Malformed snapshot tile");
+    return tiles.emplace(TileKey(tileRow, tileCol), move(tile)).first->second.get();
+}
+
+
+void MappedSheet::ReadRecord(SnapshotReader& reader, const char* base, MappedCell& cell) {
+    cell.kind = reader.Get<SnapshotCellKind>();
+    switch (cell.kind) {
+    case SnapshotCellKind::Empty:
+        break;
+    case SnapshotCellKind::Text:
+        cell.text = reader.GetString();
+        break;
+    case SnapshotCellKind::Number:
+        cell.text = reader.GetString();
+        cell.value = reader.Get<double>();
+        break;
+    case SnapshotCellKind::Error:
+        cell.text = reader.GetString();
+        cell.value = FormulaError(reader.GetErrorCategory());
+        break;
+    case SnapshotCellKind::Formula: {
+        const size_t programStart = reader.Offset();
+        Formula::SkipProgram(reader);
+        cell.program = string_view(base + programStart, reader.Offset() - programStart);
+        if (reader.Get<uint8_t>() != 0)
+            cell.value = FormulaError(reader.GetErrorCategory());
+        else
+            cell.value = reader.Get<double>();
+        break;
+    }
+    default:
+        throw SnapshotError("Unknown cell kind");
+    }
+    cell.dependentsCount = reader.Get<uint32_t>();
+    cell.dependentsData = reader.GetBytes(size_t(cell.dependentsCount) * 2 * sizeof(int32_t));
+}
+
+
+MappedCell* MappedSheet::FindCell(Position pos) const {
+    Tile* tile = FindTile(pos.row / kSnapshotTileSize, pos.col / kSnapshotTileSize);
+    if (tile == nullptr)
+        return nullptr;
+    const int index = (pos.row % kSnapshotTileSize) * kSnapshotTileSize + pos.col % kSnapshotTileSize;
+    auto& cell = tile->cells[index];
+    if (cell == nullptr && tile->records[index] != kNoRecord) {
+        cell = make_unique<MappedCell>(*this, pos);
+        const uint32_t record = tile->records[index];
+        SnapshotReader reader(tile->payload + record, tile->payloadSize - record);
+        ReadRecord(reader, tile->payload + record, *cell);
+    }
+    return cell.get();
+}
+
+
+MappedCell& MappedSheet::PrivateCell(Position pos) {
+    const int tileRow = pos.row / kSnapshotTileSize;
+    const int tileCol = pos.col / kSnapshotTileSize;
+    Tile* tile = FindTile(tileRow, tileCol);
+    if (tile == nullptr)
+        tile = tiles.emplace(TileKey(tileRow, tileCol), make_unique<Tile>()).first->second.get();
+    if (tile->isPrivate == false) {
+        for (int index = 0; index < kTileCells; ++index) {
+            if (tile->records[index] == kNoRecord)
+                continue;
+            FindCell({tileRow * kSnapshotTileSize + index / kSnapshotTileSize, 
+                tileCol * kSnapshotTileSize + index % kSnapshotTileSize})->MakePrivate();
+            tile->records[index] = kNoRecord;
+        }
+        tile->isPrivate = true;
+    }
+
+    auto& cell = tile->cells[(pos.row % kSnapshotTileSize) * kSnapshotTileSize + pos.col % kSnapshotTileSize];
+    if (cell == nullptr) {
+        cell = make_unique<MappedCell>(*this, pos);
+        cell->isPrivate = true;
+        rowsCount = max(rowsCount, pos.row + 1);
+        colsCount = max(colsCount, pos.col + 1);
+    }
+    return *cell;
+}
+
+
+bool MappedSheet::HasCycle(Position pos, const vector<Position>& refs, const vector<Range>& ranges) const {
+    vector<Position> stack(refs.rbegin(), refs.rend());
+    unordered_set<const MappedCell*> visited;
+    // Cells of ranges are walked as references, only the existing ones may lead back to pos
+    auto pushRange = [this, &stack](const Range& range) {
+        for (int row = range.first.row; row <= min(range.last.row, rowsCount - 1); ++row)
+            for (int col = range.first.col; col <= min(range.last.col, colsCount - 1); ++col)
+                stack.push_back({row, col});
+    };
+    for (const auto& range: ranges) {
+        if (range.Contains(pos))
+            return true;
+        pushRange(range);
+    }
+    while (stack.empty() == false) {
+        const Position refPos = stack.back();
+        stack.pop_back();
+        if (refPos == pos)
+            return true;
+        const MappedCell* cell = FindCell(refPos);
+        if (cell == nullptr || cell->kind != SnapshotCellKind::Formula || visited.insert(cell).second == false)
+            continue;
+        auto subRefs = cell->GetReferencedCells();
+        stack.insert(stack.end(), subRefs.rbegin(), subRefs.rend());
+        for (const auto& range: cell->GetFormula().GetReferencedRanges()) {
+            if (range.Contains(pos))
+                return true;
+            pushRange(range);
+        }
+    }
+    return false;
+}
+
+
+void MappedSheet::Recalculate(const MappedCell& cell) const {
+    // Post-order walk as in Sheet::UpdateChache, a cell is evaluated after its invalid references
+    vector<pair<const MappedCell*, bool>> stack {{&cell, false}};
+    while (stack.empty() == false) {
+        auto [current, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            if (current->invalid) {
+                current->value = current->GetFormula().Evaluate(*this);
+                current->invalid = false;
+            }
+            continue;
+        }
+        stack.push_back({current, true});
+        for (const auto& refPos: current->GetReferencedCells())
+            if (const MappedCell* ref = FindCell(refPos); ref != nullptr && ref->invalid)
+                stack.push_back({ref, false});
+    }
+}
+
+
+RangeTree<Position>& MappedSheet::RangeDependents() {
+    for (const auto& formulaPos: rangeFormulas)
+        if (const MappedCell* formulaCell = FindCell(formulaPos); formulaCell != nullptr
+                && formulaCell->kind == SnapshotCellKind::Formula)
+            for (const auto& range: formulaCell->GetFormula().GetReferencedRanges())
+                rangeDependents.Insert(range, formulaPos);
+    rangeFormulas.clear();
+    return rangeDependents;
+}
+
+
+void MappedSheet::InvalidateDependents(const MappedCell& cell) {
+    // Only cached values change, so dependents are invalidated without copying their tiles
+    vector<Position> stack = cell.GetDependents();
+    auto& ranges = RangeDependents();
+    auto addRangeDependents = [&ranges, &stack](Position pos) {
+        ranges.Stab(pos, [&stack](Position dependentPos) {
+            stack.push_back(dependentPos);
+        });
+    };
+    addRangeDependents(cell.pos);
+    while (stack.empty() == false) {
+        const MappedCell* dependent = FindCell(stack.back());
+        stack.pop_back();
+        if (dependent == nullptr || dependent->kind != SnapshotCellKind::Formula || dependent->invalid)
+            continue;
+        dependent->invalid = true;
+        auto dependents = dependent->GetDependents();
+        stack.insert(stack.end(), dependents.begin(), dependents.end());
+        addRangeDependents(dependent->pos);
+    }
+}
+
+
+void MappedSheet::Unlink(const MappedCell& cell) {
+    if (cell.kind == SnapshotCellKind::Formula)
+        for (const auto& range: cell.GetFormula().GetReferencedRanges())
+            RangeDependents().Erase(range, cell.pos);
+    for (const auto& refPos: cell.GetReferencedCells()) {
+        if (FindCell(refPos) == nullptr)
+            continue;
+        auto& dependents = PrivateCell(refPos).ownDependents;
+        if (auto it = find(dependents.begin(), dependents.end(), cell.pos); it != dependents.end())
+            dependents.erase(it);
+    }
+}
+
+
+void MappedSheet::SetCell(Position pos, string text) {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    if (const MappedCell* cell = FindCell(pos); cell != nullptr && cell->GetText() == text)
+        return;
+
+    // Everything that may throw is done before the first change
+    auto kind = SnapshotCellKind::Empty;
+    IFormula::Value value = 0.0;
+    unique_ptr<IFormula> formula;
+    vector<Position> refs;
+    if (text.size() > 1 && text[0] == kFormulaSign) {
+        try {
+            formula = ParseFormula(text.substr(1));
+            kind = SnapshotCellKind::Formula;
+        }
+        catch(out_of_range& e) {
+            kind = SnapshotCellKind::Error;
+            value = FormulaError(FormulaError::Category::Div0);
+        }
+    }
+    else if (text.empty() == false) {
+        const LiteralCell literal(text);
+        kind = SnapshotCellKind::Text;
+        if (const ValueView literalValue = literal.GetValueView(); text[0] != kEscapeSign && literalValue.IsNumber()) {
+            kind = SnapshotCellKind::Number;
+            value = literalValue.GetNumber();
+        }
+    }
+    if (formula != nullptr) {
+        if (auto impl = dynamic_cast<Formula*>(formula.get()); impl && impl->HasInvalidReferences())
+            throw FormulaException("Invalid position");
+        refs = formula->GetReferencedCells();
+        if (HasCycle(pos, refs, formula->GetReferencedRanges()))
+            throw CircularDependencyException("Failed");
+        value = formula->Evaluate(*this);
+    }
+
+    MappedCell& cell = PrivateCell(pos);
+    Unlink(cell);
+    cell.kind = kind;
+    cell.ownText = kind == SnapshotCellKind::Formula ? string() : move(text);
+    cell.text = cell.ownText;
+    cell.ownProgram.clear();
+    cell.program = {};
+    cell.formula = move(formula);
+    cell.value = value;
+    cell.invalid = false;
+    for (const auto& refPos: refs)
+        PrivateCell(refPos).ownDependents.push_back(pos);
+    if (cell.formula != nullptr)
+        for (const auto& range: cell.formula->GetReferencedRanges())
+            RangeDependents().Insert(range, pos);
+    InvalidateDependents(cell);
+}
+
+
+const ICell* MappedSheet::GetCell(Position pos) const {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    return FindCell(pos);
+}
+
+
+ICell* MappedSheet::GetCell(Position pos) {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    return FindCell(pos);
+}
+
+
+void MappedSheet::ClearCell(Position pos) {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    const MappedCell* cell = FindCell(pos);
+    if (cell == nullptr)
+        return;
+    InvalidateDependents(*cell);
+    RemoveCell(pos);
+}
+
+
+void MappedSheet::RemoveCell(Position pos) {
+    MappedCell& cell = PrivateCell(pos);
+    Unlink(cell);
+    Tile& tile = *tiles.at(TileKey(pos.row / kSnapshotTileSize, pos.col / kSnapshotTileSize));
+    tile.cells[(pos.row % kSnapshotTileSize) * kSnapshotTileSize + pos.col % kSnapshotTileSize] = nullptr;
+}
+
+
+void MappedSheet::InsertRows(int before, int count) {
+    throw logic_error("Structural edits are not supported by MappedSheet");
+}
+
+
+void MappedSheet::InsertCols(int before, int count) {
+    throw logic_error("Structural edits are not supported by MappedSheet");
+}
+
+
+void MappedSheet::DeleteRows(int first, int count) {
+    throw logic_error("Structural edits are not supported by MappedSheet");
+}
+
+
+void MappedSheet::DeleteCols(int first, int count) {
+    throw logic_error("Structural edits are not supported by MappedSheet");
+}
+
+
+Size MappedSheet::GetPrintableSize() const {
+    return {rowsCount, colsCount};
+}
+
+
+template <typename Write>
+void MappedSheet::Print(ostream& output, const Write& write) const {
+    thread_local vector<char> buffer;
+    TsvWriter writer(output, buffer);
+    const int tileCols = (colsCount + kSnapshotTileSize - 1) / kSnapshotTileSize;
+    vector<const Tile*> band(tileCols);
+    for (int tileRow = 0; tileRow * kSnapshotTileSize < rowsCount; ++tileRow) {
+        for (int tileCol = 0; tileCol < tileCols; ++tileCol)
+            band[tileCol] = FindTile(tileRow, tileCol);
+        const int lastRow = min(rowsCount, (tileRow + 1) * kSnapshotTileSize);
+        for (int i = tileRow * kSnapshotTileSize; i < lastRow; ++i) {
+            int printedCol = 0;
+            for (int tileCol = 0; tileCol < tileCols; ++tileCol) {
+                if (band[tileCol] == nullptr)
+                    continue;
+                const int first = (i % kSnapshotTileSize) * kSnapshotTileSize;
+                for (int k = 0; k < kSnapshotTileSize; ++k) {
+                    if (band[tileCol]->cells[first + k] == nullptr && band[tileCol]->records[first + k] == kNoRecord)
+                        continue;
+                    const int j = tileCol * kSnapshotTileSize + k;
+                    writer.Write('\t', j - printedCol);
+                    printedCol = j;
+                    write(writer, *FindCell({i, j}));
+                }
+            }
+            writer.Write('\t', max(colsCount - 1, 0) - printedCol);
+            writer.Write('\n');
+        }
+    }
+}
+
+
+void MappedSheet::PrintValues(ostream& output) const {
+    Print(output, [](TsvWriter& writer, const MappedCell& cell) {
+        const ValueView value = cell.GetValueView();
+        if (value.IsText())
+            writer.Write(value.GetText());
+        else if (value.IsNumber())
+            writer.WriteNumber(value.GetNumber(), false);
+    });
+}
+
+
+void MappedSheet::PrintTexts(ostream& output) const {
+    Print(output, [](TsvWriter& writer, const MappedCell& cell) {
+        writer.Write(cell.GetText());
+    });
+}
+
+
+size_t MappedSheet::DecodedTiles() const {
+    return tiles.size();
+}
+
+
+size_t MappedSheet::PrivateTiles() const {
+    return count_if(tiles.begin(), tiles.end(), [](const auto& tile) {
+        return tile.second->isPrivate;
+    });
+}
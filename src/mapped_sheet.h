@@ -0,0 +1,137 @@
+#ifndef TABLE_MAPPED_SHEET
+#define TABLE_MAPPED_SHEET
+
+#include "common.h"
+#include "formula.h"
+#include "range_tree.h"
+#include "snapshot.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+class MappedSheet;
+
+
+// Cell of a MappedSheet. Its text, program and dependents point into the mapped file
+// until the tile of the cell is edited, then into the private copy owned by the cell
+class MappedCell : public ICell {
+public:
+    MappedCell(const MappedSheet& sheet, Position pos);
+
+    virtual Value GetValue() const override;
+    // Text points into the mapped file or into the private copy of the tile
+    virtual ValueView GetValueView() const override;
+    virtual std::string GetText() const override;
+    virtual std::vector<Position> GetReferencedCells() const override;
+
+private:
+    friend class MappedSheet;
+
+    const MappedSheet& sheet;
+    Position pos;
+    SnapshotCellKind kind = SnapshotCellKind::Empty;
+    std::string_view text;
+    std::string_view program;
+    std::string_view dependentsData;
+    uint32_t dependentsCount = 0;
+    mutable IFormula::Value value = 0.0;
+    mutable bool invalid = false;
+    mutable std::unique_ptr<IFormula> formula;
+
+    bool isPrivate = false;
+    std::string ownText;
+    std::string ownProgram;
+    std::vector<Position> ownDependents;
+
+    const IFormula& GetFormula() const;
+    std::vector<Position> GetDependents() const;
+    void MakePrivate();
+};
+
+
+
+// Read-mostly sheet over a snapshot file mapped into memory, see snapshot.h.
+// Opening reads only the header and the directory. A tile is decoded on the first access
+// and its cells refer to the mapped pages, which are shared with other processes through
+// the page cache. The first edit of a tile copies it into private memory, the file is never changed.
+// Structural edits are not supported, load the snapshot into a Sheet for them.
+class MappedSheet : public ISheet {
+public:
+    explicit MappedSheet(const std::string& path);
+    virtual ~MappedSheet();
+
+    MappedSheet(const MappedSheet&) = delete;
+    MappedSheet& operator=(const MappedSheet&) = delete;
+
+    virtual void SetCell(Position pos, std::string text) override;
+
+    virtual const ICell* GetCell(Position pos) const override;
+    virtual ICell* GetCell(Position pos) override;
+
+    virtual void ClearCell(Position pos) override;
+
+    // Throw std::logic_error
+    virtual void InsertRows(int before, int count = 1) override;
+    virtual void InsertCols(int before, int count = 1) override;
+    virtual void DeleteRows(int first, int count = 1) override;
+    virtual void DeleteCols(int first, int count = 1) override;
+
+    virtual Size GetPrintableSize() const override;
+    virtual void PrintValues(std::ostream& output) const override;
+    virtual void PrintTexts(std::ostream& output) const override;
+
+    size_t DecodedTiles() const;
+    size_t PrivateTiles() const;
+
+private:
+    friend class MappedCell;
+
+    static constexpr int kTileCells = kSnapshotTileSize * kSnapshotTileSize;
+    static constexpr uint32_t kNoRecord = 0xFFFFFFFF;
+
+    // Decoding a tile only finds where the record of each cell starts,
+    // a cell is created from its record on the first access
+    struct Tile {
+        const char* payload = nullptr;
+        size_t payloadSize = 0;
+        std::vector<uint32_t> records = std::vector<uint32_t>(kTileCells, kNoRecord);
+        std::vector<std::unique_ptr<MappedCell>> cells = std::vector<std::unique_ptr<MappedCell>>(kTileCells);
+        bool isPrivate = false;
+    };
+
+    const char* data = nullptr;
+    size_t size = 0;
+    uint64_t tileCount = 0;
+    uint64_t directoryOffset = 0;
+    int rowsCount = 0;
+    int colsCount = 0;
+    mutable std::unordered_map<int, std::unique_ptr<Tile>> tiles;
+    // Formulas with range arguments, they are not among the dependents of the cells of the ranges.
+    // Positions listed in the snapshot are put into the tree by their ranges on the first edit
+    std::vector<Position> rangeFormulas;
+    RangeTree<Position> rangeDependents;
+
+    static int TileKey(int tileRow, int tileCol);
+    Tile* FindTile(int tileRow, int tileCol) const;
+    Tile* DecodeTile(int tileRow, int tileCol) const;
+    static void ReadRecord(SnapshotReader& reader, const char* base, MappedCell& cell);
+    MappedCell* FindCell(Position pos) const;
+    MappedCell& PrivateCell(Position pos);
+
+    bool HasCycle(Position pos, const std::vector<Position>& refs, const std::vector<Range>& ranges) const;
+    void Recalculate(const MappedCell& cell) const;
+    RangeTree<Position>& RangeDependents();
+    void InvalidateDependents(const MappedCell& cell);
+    void Unlink(const MappedCell& cell);
+    void RemoveCell(Position pos);
+
+    template <typename Write>
+    void Print(std::ostream& output, const Write& write) const;
+};
+
+
+#endif
@@ -20,4 +20,11 @@ inline size_t getRAM() { //C way to check RAM on linux
     return (size_t)rss * (size_t)sysconf( _SC_PAGESIZE);
 }
 
+inline size_t getPeakRAM() { //ru_maxrss is in kilobytes on linux
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return (size_t)0L;
+    return (size_t)usage.ru_maxrss * 1024;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,630 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "cell.h"
+#include "column_kernels.h"
+#include "sheet.h"
+
+
+using namespace std;
+
+
+namespace {
+
+// Rows of a tile, the least capacity of a column
+constexpr int kTileRows = 64;
+// Leaves of the segment trees of lookup columns
+constexpr int kLookupTiles = Position::kMaxRows / kTileRows;
+// Bitmaps kept per column, criteria computed from changing cells would pile up otherwise
+constexpr size_t kMaxBitmaps = 16;
+// Criteria remembered by their first miss of a full cache
+constexpr size_t kMaxMissed = 16;
+
+bool IsMarked(const vector<uint64_t>& bits, int row) {
+    return (bits[row / 64] >> (row % 64) & 1) != 0;
+}
+
+void Mark(vector<uint64_t>& bits, int row, bool marked) {
+    const uint64_t bit = uint64_t{1} << (row % 64);
+    bits[row / 64] = marked ? bits[row / 64] | bit : bits[row / 64] & ~bit;
+}
+
+}
+
+
+RangeIndex::RangeIndex(const Sheet& sheet)
+    : sheet(sheet) {
+}
+
+
+RangeSummary RangeIndex::Summarize(Range range) {
+    RangeSummary summary;
+    int errorRow = Position::kMaxRows;
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        Column& column = GetColumn(col);
+        RefreshStale(column, col, range.first.row, range.last.row);
+        if (range.first.row >= column.capacity)
+            continue;
+        const int lastRow = min(range.last.row, column.capacity - 1);
+        const Node total = Query(column, range.first.row, lastRow);
+        summary.sum += total.sum;
+        summary.min = min(summary.min, total.min);
+        summary.max = max(summary.max, total.max);
+        summary.count += total.count;
+        if (total.errors > 0) {
+            const int row = FirstError(column, range.first.row, lastRow);
+            if (row < errorRow) {
+                errorRow = row;
+                summary.error = FormulaError(static_cast<FormulaError::Category>(column.errorKinds[row] - 1));
+            }
+        }
+    }
+    return summary;
+}
+
+
+// The row of the number itself, otherwise the first row of the nearest number inside the range
+optional<int> RangeIndex::Lookup(Range range, double value, LookupMode mode) {
+    const int col = range.first.col;
+    Column& column = GetColumn(col);
+    RefreshStale(column, col, range.first.row, range.last.row);
+    if (column.lookup == nullptr)
+        BuildLookup(column, col);
+    const LookupColumn& lookup = *column.lookup;
+    auto firstRow = [&lookup, &range](double key) -> optional<int> {
+        auto it = lookup.rows.find(key);
+        if (it == lookup.rows.end())
+            return nullopt;
+        auto row = it->second.lower_bound(range.first.row);
+        if (row == it->second.end() || *row > range.last.row)
+            return nullopt;
+        return *row - range.first.row;
+    };
+    if (auto offset = firstRow(value))
+        return offset;
+    if (mode == LookupMode::Exact)
+        return nullopt;
+    const auto key = NearestKey(lookup, range.first.row, range.last.row, value, mode);
+    if (key.has_value() == false)
+        return nullopt;
+    return firstRow(*key);
+}
+
+
+// Matching rows are taken tile by tile from the bitmap, the cells of the sum range
+// are read from the numbers of its column
+RangeSummary RangeIndex::SummarizeIf(Range range, const Criterion& criterion, Range sumRange) {
+    RangeSummary summary;
+    int errorRow = Position::kMaxRows;
+    const int shift = sumRange.first.row - range.first.row;
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const int sumCol = sumRange.first.col + col - range.first.col;
+        Column& column = GetColumn(col);
+        Column& sumColumn = GetColumn(sumCol);
+        RefreshStale(column, col, range.first.row, range.last.row);
+        RefreshStale(sumColumn, sumCol, sumRange.first.row, sumRange.last.row);
+        if (range.first.row >= column.capacity)
+            continue;
+        const int lastRow = min(range.last.row, column.capacity - 1);
+        Bitmap* bitmap = GetBitmap(column, criterion);
+        for (int tile = range.first.row / kTileRows; tile <= lastRow / kTileRows; ++tile) {
+            uint64_t word = 0;
+            if (bitmap == nullptr)
+                word = MatchTile(column, criterion, tile);
+            else if (bitmap->valid[tile] == false) {
+                word = bitmap->words[tile] = MatchTile(column, criterion, tile);
+                bitmap->valid[tile] = true;
+            }
+            else
+                word = bitmap->words[tile];
+            const int firstBit = max(range.first.row - tile * kTileRows, 0);
+            const int lastBit = min(lastRow - tile * kTileRows, kTileRows - 1);
+            uint64_t bits = word >> firstBit;
+            if (lastBit - firstBit < kTileRows - 1)
+                bits &= (uint64_t{1} << (lastBit - firstBit + 1)) - 1;
+            for (int row = tile * kTileRows + firstBit; bits != 0; bits >>= 1, ++row) {
+                if ((bits & 1) == 0)
+                    continue;
+                const int sumRow = row + shift;
+                if (sumRow >= sumColumn.capacity)
+                    continue;
+                if (IsMarked(sumColumn.numberBits, sumRow)) {
+                    const double number = sumColumn.numbers[sumRow];
+                    summary.sum += number;
+                    summary.min = min(summary.min, number);
+                    summary.max = max(summary.max, number);
+                    ++summary.count;
+                }
+                else if (IsMarked(sumColumn.errorBits, sumRow) && row < errorRow) {
+                    errorRow = row;
+                    summary.error = FormulaError(static_cast<FormulaError::Category>(sumColumn.errorKinds[sumRow] - 1));
+                }
+            }
+        }
+    }
+    return summary;
+}
+
+
+// Columns at the same offset are multiplied row by row in a scratch column. All of them are
+// refreshed before the numbers are read, rows past the capacity of a column are empty
+RangeSummary RangeIndex::SumProduct(const vector<Range>& ranges) {
+    RangeSummary summary;
+    const int rows = ranges[0].last.row - ranges[0].first.row + 1;
+    const int cols = ranges[0].last.col - ranges[0].first.col + 1;
+    vector<Column*> productColumns(ranges.size());
+    vector<double> products;
+    for (int offset = 0; offset < cols; ++offset) {
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            const int col = ranges[i].first.col + offset;
+            productColumns[i] = &GetColumn(col);
+            RefreshStale(*productColumns[i], col, ranges[i].first.row, ranges[i].last.row);
+        }
+        int count = rows;
+        for (size_t i = 0; i < ranges.size(); ++i)
+            count = max(min(count, productColumns[i]->capacity - ranges[i].first.row), 0);
+        if (count == 0)
+            continue;
+        const double* first = productColumns[0]->numbers.data() + ranges[0].first.row;
+        if (ranges.size() == 1) {
+            summary.sum += SumNumbers(first, count);
+            continue;
+        }
+        const double* second = productColumns[1]->numbers.data() + ranges[1].first.row;
+        if (ranges.size() == 2) {
+            summary.sum += DotNumbers(first, second, count);
+            continue;
+        }
+        products.assign(first, first + count);
+        for (size_t i = 1; i < ranges.size(); ++i)
+            MultiplyNumbers(products.data(), productColumns[i]->numbers.data() + ranges[i].first.row, count);
+        summary.sum += SumNumbers(products.data(), count);
+    }
+    for (const auto& range: ranges) {
+        int errorRow = Position::kMaxRows;
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const Column& column = columns.at(col);
+            if (range.first.row >= column.capacity)
+                continue;
+            const int lastRow = min(range.last.row, column.capacity - 1);
+            if (CountMarked(column.errorBits.data(), range.first.row, lastRow - range.first.row + 1) == 0)
+                continue;
+            if (const int row = FirstError(column, range.first.row, lastRow); row < errorRow) {
+                errorRow = row;
+                summary.error = FormulaError(static_cast<FormulaError::Category>(column.errorKinds[row] - 1));
+            }
+        }
+        if (summary.error.has_value())
+            break;
+    }
+    return summary;
+}
+
+
+void RangeIndex::CellChanged(Position pos, vector<const CellHolder*>& dependents) {
+    if (auto it = columns.find(pos.col); it != columns.end()) {
+        Column& column = it->second;
+        column.stale.insert(pos.row);
+        if (auto formula = column.formulas.find(pos.row); formula != column.formulas.end()) {
+            formulaPositions.erase(formula->second);
+            column.formulas.erase(formula);
+        }
+        if (sheet.CellExists(pos)) {
+            const CellHolder* holder = sheet.GetCellPtr(pos);
+            if (holder->HasFormula())
+                Track(column, pos, holder);
+        }
+    }
+    AddWatchers(pos, dependents, true);
+}
+
+
+void RangeIndex::FormulaInvalidated(const CellHolder* holder, vector<const CellHolder*>& dependents) {
+    auto it = formulaPositions.find(holder);
+    if (it == formulaPositions.end())
+        return;
+    const Position pos = it->second;
+    columns.at(pos.col).stale.insert(pos.row);
+    AddWatchers(pos, dependents, true);
+}
+
+
+void RangeIndex::Watch(const CellHolder* holder, const vector<Range>& ranges) {
+    Unwatch(holder);
+    for (const auto& range: ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col)
+            GetColumn(col);
+        watchTree.Insert(range, holder);
+    }
+    watches[holder] = ranges;
+}
+
+
+void RangeIndex::Unwatch(const CellHolder* holder) {
+    auto it = watches.find(holder);
+    if (it == watches.end())
+        return;
+    for (const auto& range: it->second)
+        watchTree.Erase(range, holder);
+    watches.erase(it);
+}
+
+
+bool RangeIndex::HasWatches() const {
+    return watches.empty() == false;
+}
+
+
+void RangeIndex::Watchers(Position pos, vector<const CellHolder*>& watchers) const {
+    AddWatchers(pos, watchers, false);
+}
+
+
+void RangeIndex::FormulaWatchers(const CellHolder* holder, vector<const CellHolder*>& watchers) const {
+    if (auto it = formulaPositions.find(holder); it != formulaPositions.end())
+        AddWatchers(it->second, watchers, false);
+}
+
+
+vector<const CellHolder*> RangeIndex::Watched() const {
+    vector<const CellHolder*> watched;
+    watched.reserve(watches.size());
+    for (const auto& [holder, ranges]: watches)
+        watched.push_back(holder);
+    return watched;
+}
+
+
+void RangeIndex::AddWatchers(Position pos, vector<const CellHolder*>& watchers, bool validOnly) const {
+    const size_t first = watchers.size();
+    watchTree.Stab(pos, [&](const CellHolder* holder) {
+        if (validOnly && holder->IsInvalid())
+            return;
+        // A formula is met once per its range containing pos
+        if (watches.at(holder).size() > 1 && find(watchers.begin() + first, watchers.end(), holder) != watchers.end())
+            return;
+        watchers.push_back(holder);
+    });
+}
+
+
+void RangeIndex::Formulas(Range range, vector<const CellHolder*>& formulas) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const Column& column = GetColumn(col);
+        for (auto it = column.formulas.lower_bound(range.first.row);
+                it != column.formulas.end() && it->first <= range.last.row; ++it)
+            formulas.push_back(it->second);
+    }
+}
+
+
+const CellHolder* RangeIndex::NextInvalid(Range range) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        Column& column = GetColumn(col);
+        for (auto it = column.stale.lower_bound(range.first.row); it != column.stale.end() && *it <= range.last.row;
+                it = column.stale.lower_bound(range.first.row)) {
+            const Position pos{*it, col};
+            if (sheet.CellExists(pos) && sheet.GetCellPtr(pos)->IsInvalid())
+                return sheet.GetCellPtr(pos);
+            column.stale.erase(it);
+            Refresh(column, pos);
+        }
+    }
+    return nullptr;
+}
+
+
+void RangeIndex::Reset() {
+    columns.clear();
+    formulaPositions.clear();
+    watches.clear();
+    watchTree.Clear();
+}
+
+
+// Every occupied row of a new column is stale, values are read by the first summary
+RangeIndex::Column& RangeIndex::GetColumn(int col) {
+    auto [it, inserted] = columns.try_emplace(col);
+    Column& column = it->second;
+    if (inserted == false)
+        return column;
+    column.capacity = kTileRows;
+    while (column.capacity < static_cast<int>(sheet.cells.size()))
+        column.capacity *= 2;
+    column.numbers.resize(column.capacity);
+    column.numberBits.resize(column.capacity / kTileRows);
+    column.errorBits.resize(column.capacity / kTileRows);
+    column.errorKinds.resize(column.capacity);
+    column.nodes.resize(2 * column.capacity / kTileRows);
+    for (size_t i = 0; i < sheet.cells.size(); ++i) {
+        const auto& row = sheet.cells[i];
+        if (row.size() <= static_cast<size_t>(col) || row[col] == nullptr)
+            continue;
+        const Position pos{static_cast<int>(i), col};
+        column.stale.insert(column.stale.end(), pos.row);
+        if (row[col]->HasFormula())
+            Track(column, pos, row[col].get());
+    }
+    return column;
+}
+
+
+void RangeIndex::Track(Column& column, Position pos, const CellHolder* holder) {
+    column.formulas[pos.row] = holder;
+    formulaPositions[holder] = pos;
+    holder->rangeIndexed = true;
+}
+
+
+// A stale row is taken out before its cell is read, so nested summaries skip it
+void RangeIndex::RefreshStale(Column& column, int col, int first, int last) {
+    for (auto it = column.stale.lower_bound(first); it != column.stale.end() && *it <= last;
+            it = column.stale.lower_bound(first)) {
+        const int row = *it;
+        column.stale.erase(it);
+        Refresh(column, {row, col});
+    }
+}
+
+
+// Empty cells and texts are empty leaves
+void RangeIndex::Refresh(Column& column, Position pos) {
+    optional<double> number;
+    uint8_t errorKind = 0;
+    if (sheet.CellExists(pos)) {
+        const BoxedValue value = sheet.GetCellPtr(pos)->GetBoxedValue();
+        if (value.IsNumber())
+            number = value.GetNumber();
+        else if (value.IsError())
+            errorKind = static_cast<uint8_t>(value.GetError().GetCategory()) + 1;
+    }
+    if (pos.row >= column.capacity)
+        Grow(column, pos.row);
+    column.numbers[pos.row] = number.value_or(0.0);
+    Mark(column.numberBits, pos.row, number.has_value());
+    Mark(column.errorBits, pos.row, errorKind > 0);
+    column.errorKinds[pos.row] = errorKind;
+    column.dirtyTiles.insert(pos.row / kTileRows);
+    for (auto& [criterion, bitmap]: column.bitmaps)
+        bitmap.valid[pos.row / kTileRows] = false;
+    if (column.lookup != nullptr)
+        UpdateLookup(*column.lookup, pos.row, number.value_or(NAN));
+}
+
+
+void RangeIndex::BuildLookup(Column& column, int col) {
+    auto lookup = make_unique<LookupColumn>();
+    vector<pair<double, int>> numbers;
+    for (size_t i = 0; i < sheet.cells.size(); ++i) {
+        const auto& row = sheet.cells[i];
+        if (row.size() <= static_cast<size_t>(col) || row[col] == nullptr)
+            continue;
+        if (const BoxedValue value = row[col]->GetBoxedValue(); value.IsNumber())
+            numbers.push_back({value.GetNumber(), static_cast<int>(i)});
+    }
+    sort(numbers.begin(), numbers.end());
+    lookup->keys.assign(sheet.cells.size(), NAN);
+    lookup->rows.reserve(numbers.size());
+    lookup->tree.resize(2 * kLookupTiles);
+    for (const auto& [key, row]: numbers) {
+        lookup->keys[row] = key;
+        auto& rows = lookup->rows[key];
+        rows.insert(rows.end(), row);
+        for (int node = kLookupTiles + row / kTileRows; node > 0; node /= 2)
+            lookup->tree[node].insert(lookup->tree[node].end(), key);
+    }
+    column.lookup = move(lookup);
+}
+
+
+void RangeIndex::UpdateLookup(LookupColumn& lookup, int row, double key) {
+    if (lookup.keys.size() <= static_cast<size_t>(row))
+        lookup.keys.resize(row + 1, NAN);
+    const double old = lookup.keys[row];
+    if (isnan(old) == false) {
+        auto it = lookup.rows.find(old);
+        it->second.erase(row);
+        if (it->second.empty())
+            lookup.rows.erase(it);
+        for (int node = kLookupTiles + row / kTileRows; node > 0; node /= 2)
+            lookup.tree[node].erase(lookup.tree[node].find(old));
+    }
+    lookup.keys[row] = key;
+    if (isnan(key) == false) {
+        lookup.rows[key].insert(row);
+        for (int node = kLookupTiles + row / kTileRows; node > 0; node /= 2)
+            lookup.tree[node].insert(key);
+    }
+}
+
+
+// The rows of the partial tiles at the ends of the range are read from the keys,
+// the whole tiles between them are covered by O(log tiles) nodes of the tree
+optional<double> RangeIndex::NearestKey(const LookupColumn& lookup, int first, int last,
+        double value, LookupMode mode) {
+    const bool smaller = mode == LookupMode::NextSmaller;
+    optional<double> nearest;
+    auto consider = [&nearest, smaller](double key) {
+        if (nearest.has_value() == false || (smaller ? key > *nearest : key < *nearest))
+            nearest = key;
+    };
+    auto scanRows = [&](int from, int to) {
+        to = min(to, static_cast<int>(lookup.keys.size()) - 1);
+        for (int row = from; row <= to; ++row) {
+            const double key = lookup.keys[row];
+            if (isnan(key) == false && (smaller ? key < value : key > value))
+                consider(key);
+        }
+    };
+    const int firstTile = first / kTileRows;
+    const int lastTile = last / kTileRows;
+    if (firstTile == lastTile) {
+        scanRows(first, last);
+        return nearest;
+    }
+    scanRows(first, (firstTile + 1) * kTileRows - 1);
+    scanRows(lastTile * kTileRows, last);
+    auto searchNode = [&](int node) {
+        const auto& keys = lookup.tree[node];
+        if (smaller) {
+            if (auto it = keys.lower_bound(value); it != keys.begin())
+                consider(*prev(it));
+        }
+        else if (auto it = keys.upper_bound(value); it != keys.end())
+            consider(*it);
+    };
+    for (int left = kLookupTiles + firstTile + 1, right = kLookupTiles + lastTile; left < right;
+            left /= 2, right /= 2) {
+        if (left % 2 == 1)
+            searchNode(left++);
+        if (right % 2 == 1)
+            searchNode(--right);
+    }
+    return nearest;
+}
+
+
+// A new bitmap has every tile invalid. When the cache is full, a criterion is matched tile by tile
+// without a bitmap until it misses again, e.g. a criterion per row is never cached, and then
+// takes the place of the least recently used bitmap
+RangeIndex::Bitmap* RangeIndex::GetBitmap(Column& column, const Criterion& criterion) {
+    const uint64_t use = ++column.summaries;
+    if (auto it = column.bitmaps.find(criterion); it != column.bitmaps.end()) {
+        it->second.lastUse = use;
+        return &it->second;
+    }
+    if (column.bitmaps.size() >= kMaxBitmaps) {
+        auto& missed = column.missed;
+        auto again = find_if(missed.begin(), missed.end(), [&criterion](const Criterion& other) {
+            return CriterionLess()(criterion, other) == false && CriterionLess()(other, criterion) == false;
+        });
+        if (again == missed.end()) {
+            if (missed.size() >= kMaxMissed)
+                missed.erase(missed.begin());
+            missed.push_back(criterion);
+            return nullptr;
+        }
+        missed.erase(again);
+        column.bitmaps.erase(min_element(column.bitmaps.begin(), column.bitmaps.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.second.lastUse < rhs.second.lastUse; }));
+    }
+    Bitmap& bitmap = column.bitmaps[criterion];
+    const size_t tiles = column.capacity / kTileRows;
+    bitmap.words.resize(tiles);
+    bitmap.valid.resize(tiles, false);
+    bitmap.lastUse = use;
+    return &bitmap;
+}
+
+
+uint64_t RangeIndex::MatchTile(const Column& column, const Criterion& criterion, int tile) {
+    const int first = tile * kTileRows;
+    uint64_t word = 0;
+    for (int bit = 0; bit < kTileRows; ++bit)
+        if (IsMarked(column.numberBits, first + bit) && criterion.Matches(column.numbers[first + bit]))
+            word |= uint64_t{1} << bit;
+    return word;
+}
+
+
+// Old tiles keep their nodes and bitmap words, a capacity is a multiple of the tile
+void RangeIndex::Grow(Column& column, int row) {
+    int capacity = column.capacity;
+    while (capacity <= row)
+        capacity *= 2;
+    const int tiles = capacity / kTileRows;
+    vector<Node> nodes(2 * tiles);
+    copy(column.nodes.begin() + column.capacity / kTileRows, column.nodes.end(), nodes.begin() + tiles);
+    for (int node = tiles - 1; node > 0; --node) {
+        nodes[node] = nodes[2 * node];
+        Combine(nodes[node], nodes[2 * node + 1]);
+    }
+    column.nodes = move(nodes);
+    column.numbers.resize(capacity);
+    column.numberBits.resize(tiles);
+    column.errorBits.resize(tiles);
+    column.errorKinds.resize(capacity);
+    column.capacity = capacity;
+    for (auto& [criterion, bitmap]: column.bitmaps) {
+        bitmap.words.resize(tiles);
+        bitmap.valid.resize(tiles, false);
+    }
+}
+
+
+void RangeIndex::Combine(Node& total, const Node& node) {
+    total.sum += node.sum;
+    total.min = min(total.min, node.min);
+    total.max = max(total.max, node.max);
+    total.count += node.count;
+    total.errors += node.errors;
+}
+
+
+bool RangeIndex::CriterionLess::operator()(const Criterion& lhs, const Criterion& rhs) const {
+    return pair(lhs.comparison, lhs.value) < pair(rhs.comparison, rhs.value);
+}
+
+
+RangeIndex::Node RangeIndex::Scan(const Column& column, int first, int last) {
+    Node total;
+    const size_t count = last - first + 1;
+    total.count = static_cast<uint32_t>(CountMarked(column.numberBits.data(), first, count));
+    total.errors = static_cast<uint32_t>(CountMarked(column.errorBits.data(), first, count));
+    if (total.count > 0) {
+        total.sum = SumNumbers(column.numbers.data() + first, count);
+        MinMaxNumbers(column.numbers.data(), column.numberBits.data(), first, count, total.min, total.max);
+    }
+    return total;
+}
+
+
+void RangeIndex::UpdateTiles(Column& column) {
+    const int tiles = column.capacity / kTileRows;
+    for (const int tile: column.dirtyTiles) {
+        int node = tiles + tile;
+        column.nodes[node] = Scan(column, tile * kTileRows, (tile + 1) * kTileRows - 1);
+        for (node /= 2; node > 0; node /= 2) {
+            column.nodes[node] = column.nodes[2 * node];
+            Combine(column.nodes[node], column.nodes[2 * node + 1]);
+        }
+    }
+    column.dirtyTiles.clear();
+}
+
+
+// The tiles at the ends of the rows are scanned, the whole tiles between them come from the tree
+RangeIndex::Node RangeIndex::Query(Column& column, int first, int last) {
+    const int firstTile = first / kTileRows;
+    const int lastTile = last / kTileRows;
+    if (firstTile == lastTile)
+        return Scan(column, first, last);
+    UpdateTiles(column);
+    Node total = Scan(column, first, (firstTile + 1) * kTileRows - 1);
+    const int tiles = column.capacity / kTileRows;
+    for (int lo = firstTile + 1 + tiles, hi = lastTile + tiles; lo < hi; lo /= 2, hi /= 2) {
+        if (lo % 2 == 1)
+            Combine(total, column.nodes[lo++]);
+        if (hi % 2 == 1)
+            Combine(total, column.nodes[--hi]);
+    }
+    Combine(total, Scan(column, lastTile * kTileRows, last));
+    return total;
+}
+
+
+// Words of the error bits are scanned, a range of rows has at most kMaxRows / 64 of them
+int RangeIndex::FirstError(const Column& column, int first, int last) {
+    for (int row = first; row <= last; row = (row / 64 + 1) * 64) {
+        uint64_t word = column.errorBits[row / 64] >> (row % 64);
+        if (word == 0)
+            continue;
+        for (; (word & 1) == 0; word >>= 1)
+            ++row;
+        return min(row, last);
+    }
+    return last;
+}
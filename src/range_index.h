@@ -0,0 +1,148 @@
+#ifndef TABLE_RANGE_INDEX
+#define TABLE_RANGE_INDEX
+
+#include "common.h"
+#include "range_tree.h"
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+
+class Sheet;
+class CellHolder;
+
+
+// Dense columns of numbers under the columns used by range arguments of formulas, with
+// segment trees over their tiles of 64 rows, so an aggregate of a range costs O(log rows)
+// per column after a point update instead of a scan; the tiles at the ends of a range and
+// the products of SUMPRODUCT go through the vectorized kernels of column_kernels.h.
+// Rows are refreshed lazily: an edit marks its row stale and the next summary of a range
+// containing the row reads the cell once. Formula cells of indexed columns are tracked,
+// their invalidation marks their rows stale and reaches the formulas watching them
+class RangeIndex {
+public:
+    explicit RangeIndex(const Sheet& sheet);
+
+    RangeSummary Summarize(Range range);
+    // Row offset of the number in a range of one column, see ISheet::LookupRange
+    std::optional<int> Lookup(Range range, double value, LookupMode mode);
+    // Cells of sumRange where the numbers of range match, see ISheet::SummarizeIf
+    RangeSummary SummarizeIf(Range range, const Criterion& criterion, Range sumRange);
+    // Ranges of the same size, see ISheet::SumProduct
+    RangeSummary SumProduct(const std::vector<Range>& ranges);
+
+    // Content of the cell changed, adds the valid watchers of the cell to dependents
+    void CellChanged(Position pos, std::vector<const CellHolder*>& dependents);
+    // A tracked formula cell was invalidated, adds its valid watchers to dependents
+    void FormulaInvalidated(const CellHolder* holder, std::vector<const CellHolder*>& dependents);
+
+    // Formula cell with range arguments, reached by the changes of the cells of the ranges
+    void Watch(const CellHolder* holder, const std::vector<Range>& ranges);
+    void Unwatch(const CellHolder* holder);
+    bool HasWatches() const;
+    // Watching formulas of ranges containing pos, valid or not
+    void Watchers(Position pos, std::vector<const CellHolder*>& watchers) const;
+    // Watchers of the position of a tracked formula cell
+    void FormulaWatchers(const CellHolder* holder, std::vector<const CellHolder*>& watchers) const;
+    std::vector<const CellHolder*> Watched() const;
+    // Formula cells inside the range
+    void Formulas(Range range, std::vector<const CellHolder*>& formulas);
+    // First invalid formula cell among the stale rows of the range, nullptr for none. The stale
+    // rows before it are refreshed, so once it is updated the next call goes past it and
+    // the summaries of the range read no invalid cell
+    const CellHolder* NextInvalid(Range range);
+
+    // Drops columns and watches without touching the cells, they may be gone already
+    void Reset();
+
+private:
+    struct Node {
+        double sum = 0.0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        uint32_t count = 0;
+        uint32_t errors = 0;
+    };
+
+    // Numbers of a column by value for lookups, built in bulk by the first lookup in the column
+    // and then updated with the leaves
+    struct LookupColumn {
+        // Number of each row, NaN for none
+        std::vector<double> keys;
+        std::unordered_map<double, std::set<int>> rows;
+        // Segment tree over the tiles of all the rows a sheet may have, a node holds the numbers
+        // of its rows in order, so the nearest number inside a range is found in O(log^2 rows)
+        std::vector<std::multiset<double>> tree;
+    };
+
+    // Rows of a column matching a criterion, a bit per row. A tile of 64 rows is one word,
+    // a refreshed row invalidates its tile and the next summary recomputes the tile from the numbers
+    struct Bitmap {
+        std::vector<uint64_t> words;
+        std::vector<bool> valid;
+        // Conditional summary of the column that used the bitmap last
+        uint64_t lastUse = 0;
+    };
+
+    struct CriterionLess {
+        bool operator()(const Criterion& lhs, const Criterion& rhs) const;
+    };
+
+    struct Column {
+        // Rows, a power of two and a multiple of the tile
+        int capacity = 0;
+        // Number of each row, 0 for none, the rows holding numbers and errors are marked in the bits
+        std::vector<double> numbers;
+        std::vector<uint64_t> numberBits;
+        std::vector<uint64_t> errorBits;
+        // 1 + FormulaError::Category of the error in the row, 0 for no error
+        std::vector<uint8_t> errorKinds;
+        // Segment tree over the tiles, leaves are nodes[tiles + tile]. Tiles with refreshed rows
+        // are recomputed by the next query
+        std::vector<Node> nodes;
+        std::set<int> dirtyTiles;
+        std::set<int> stale;
+        std::map<int, const CellHolder*> formulas;
+        std::unique_ptr<LookupColumn> lookup;
+        // By the criteria of recent conditional summaries, the least recently used is dropped
+        std::map<Criterion, Bitmap, CriterionLess> bitmaps;
+        uint64_t summaries = 0;
+        // Criteria that missed a full cache recently, a bitmap is built on the second miss
+        std::vector<Criterion> missed;
+    };
+
+    const Sheet& sheet;
+    // Columns are created on demand and never move, nested summaries keep their references
+    std::map<int, Column> columns;
+    std::unordered_map<const CellHolder*, Position> formulaPositions;
+    std::unordered_map<const CellHolder*, std::vector<Range>> watches;
+    // Watching formulas by their ranges
+    RangeTree<const CellHolder*> watchTree;
+
+    void AddWatchers(Position pos, std::vector<const CellHolder*>& watchers, bool validOnly) const;
+    Column& GetColumn(int col);
+    void Track(Column& column, Position pos, const CellHolder* holder);
+    void RefreshStale(Column& column, int col, int first, int last);
+    void Refresh(Column& column, Position pos);
+    void BuildLookup(Column& column, int col);
+    static void UpdateLookup(LookupColumn& lookup, int row, double key);
+    static std::optional<double> NearestKey(const LookupColumn& lookup, int first, int last,
+        double value, LookupMode mode);
+    static Bitmap* GetBitmap(Column& column, const Criterion& criterion);
+    static uint64_t MatchTile(const Column& column, const Criterion& criterion, int tile);
+    void Grow(Column& column, int row);
+    static void Combine(Node& total, const Node& node);
+    static Node Scan(const Column& column, int first, int last);
+    static void UpdateTiles(Column& column);
+    static Node Query(Column& column, int first, int last);
+    static int FirstError(const Column& column, int first, int last);
+};
+
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef TABLE_RANGE_TREE
+#define TABLE_RANGE_TREE
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+// Values keyed by rectangles of the sheet, answers which rectangles contain a cell.
+// A two-dimensional segment tree over the whole sheet: a rectangle is stored in the buckets
+// of the canonical nodes of its rows crossed with the canonical nodes of its columns,
+// O(log rows * log cols) of them, so the memory is proportional to the number of rectangles
+// and not to the covered cells. A query looks at the nodes on the paths from the root
+// to the row and to the column of the cell, every rectangle containing it is met exactly once
+template <typename T>
+class RangeTree {
+public:
+    void Insert(const Range& range, T value) {
+        if (rowNodes.empty())
+            rowNodes.resize(kNodes);
+        ForEachNode(range, [this, &value](uint32_t key) {
+            buckets[key].push_back(value);
+            ++rowNodes[key / kNodes];
+        });
+        ++size;
+    }
+
+    void Erase(const Range& range, const T& value) {
+        ForEachNode(range, [this, &value](uint32_t key) {
+            auto it = buckets.find(key);
+            if (it == buckets.end())
+                return;
+            auto& bucket = it->second;
+            if (auto found = std::find(bucket.begin(), bucket.end(), value); found != bucket.end()) {
+                *found = bucket.back();
+                bucket.pop_back();
+                --rowNodes[key / kNodes];
+            }
+            if (bucket.empty())
+                buckets.erase(it);
+        });
+        --size;
+    }
+
+    // visit(value) for every stored rectangle containing pos
+    template <typename Visit>
+    void Stab(Position pos, Visit visit) const {
+        if (size == 0)
+            return;
+        for (uint32_t row = kLeaves + pos.row; row > 0; row /= 2) {
+            if (rowNodes[row] == 0)
+                continue;
+            for (uint32_t col = kLeaves + pos.col; col > 0; col /= 2)
+                if (auto it = buckets.find(row * kNodes + col); it != buckets.end())
+                    for (const auto& value: it->second)
+                        visit(value);
+        }
+    }
+
+    bool Empty() const {
+        return size == 0;
+    }
+
+    void Clear() {
+        buckets.clear();
+        rowNodes.clear();
+        size = 0;
+    }
+
+private:
+    static_assert(Position::kMaxRows == Position::kMaxCols, "Rows and columns share the node numbering");
+    static constexpr uint32_t kLeaves = Position::kMaxRows;
+    static constexpr uint32_t kNodes = 2 * kLeaves;
+
+    std::unordered_map<uint32_t, std::vector<T>> buckets;
+    // Values stored under each row node, most of the row nodes of a query are empty.
+    // Allocated by the first insertion, a tree of a fork usually stays empty
+    std::vector<uint32_t> rowNodes;
+    size_t size = 0;
+
+    // Canonical nodes of [first, last] bottom-up, as in RangeIndex::Query
+    template <typename Visit>
+    static void ForEachCanonical(int first, int last, Visit visit) {
+        for (uint32_t lo = kLeaves + first, hi = kLeaves + last + 1; lo < hi; lo /= 2, hi /= 2) {
+            if (lo % 2 == 1)
+                visit(lo++);
+            if (hi % 2 == 1)
+                visit(--hi);
+        }
+    }
+
+    template <typename Visit>
+    static void ForEachNode(const Range& range, Visit visit) {
+        ForEachCanonical(range.first.row, range.last.row, [&](uint32_t row) {
+            ForEachCanonical(range.first.col, range.last.col, [&](uint32_t col) {
+                visit(row * kNodes + col);
+            });
+        });
+    }
+};
+
+
+#endif
@@ -0,0 +1,468 @@
+#include "scenario.h"
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "cell.h"
+#include "formula_impl.h"
+#include "sheet.h"
+#include "workers.h"
+
+
+using namespace std;
+
+
+namespace {
+
+constexpr uint32_t kVisiting = numeric_limits<uint32_t>::max();
+constexpr uint8_t kDiv0 = 1 + static_cast<uint8_t>(FormulaError::Category::Div0);
+// Blocks of scenarios taken by a worker at once
+constexpr size_t kBlocksPerClaim = 8;
+
+int Key(Position pos) {
+    return pos.row * Position::kMaxCols + pos.col;
+}
+
+void Encode(BoxedValue value, double& number, uint8_t& error) {
+    if (value.IsError()) {
+        number = numeric_limits<double>::quiet_NaN();
+        error = 1 + static_cast<uint8_t>(value.GetError().GetCategory());
+    }
+    else {
+        number = value.GetNumber();
+        error = 0;
+    }
+}
+
+// Error of the left operand first, as ApplyBinary
+template <typename Op>
+void ApplyLanes(double* lhs, uint8_t* lhsErrors, const double* rhs, const uint8_t* rhsErrors, const Op& op) {
+    for (size_t lane = 0; lane < ScenarioModel::kLanes; ++lane) {
+        const double result = op(lhs[lane], rhs[lane]);
+        // Not finite exactly when result - result is not 0
+        const uint8_t failed = (result - result == 0.0) ? 0 : kDiv0;
+        const uint8_t error = lhsErrors[lane] != 0 ? lhsErrors[lane] : rhsErrors[lane];
+        lhs[lane] = result;
+        lhsErrors[lane] = error != 0 ? error : failed;
+    }
+}
+
+void DivideLanes(double* lhs, uint8_t* lhsErrors, const double* rhs, const uint8_t* rhsErrors) {
+    for (size_t lane = 0; lane < ScenarioModel::kLanes; ++lane) {
+        const uint8_t failed = rhs[lane] <= 1e-200 ? kDiv0 : 0;
+        const uint8_t error = lhsErrors[lane] != 0 ? lhsErrors[lane] : rhsErrors[lane];
+        lhs[lane] = lhs[lane] / rhs[lane];
+        lhsErrors[lane] = error != 0 ? error : failed;
+    }
+}
+
+}
+
+
+IFormula::Value ScenarioMatrix::Get(size_t scenario, size_t output) const {
+    const size_t index = scenario * outputs + output;
+    if (errors[index] != 0)
+        return FormulaError(static_cast<FormulaError::Category>(errors[index] - 1));
+    return values[index];
+}
+
+
+
+// Registers of the inputs, the formulas and the evaluation stack, kLanes values each.
+// In the tangent mode the lanes are the derivatives and a register has one value
+struct ScenarioModel::Lanes {
+    vector<double> values;
+    vector<uint8_t> errors;
+    vector<double> points;
+};
+
+
+ScenarioModel::ScenarioModel(const Sheet& sheet, const vector<Position>& inputs, const vector<Position>& outputPositions) {
+    if (sheet.InBatch())
+        throw logic_error("Cannot compile scenarios inside a batch");
+    auto holderAt = [&sheet](Position pos) -> const CellHolder* {
+        return pos.IsValid() && sheet.CellExists(pos) ? sheet.GetCellPtr(pos) : nullptr;
+    };
+    auto programOf = [](const CellHolder* holder) -> const Program* {
+        auto formula = holder != nullptr ? dynamic_cast<const Formula*>(holder->GetFormula()) : nullptr;
+        return formula != nullptr ? &formula->GetProgram() : nullptr;
+    };
+
+    inputCount = inputs.size();
+    unordered_map<int, uint32_t> inputSlots;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs[i].IsValid() == false)
+            throw InvalidPositionException("Position invalid");
+        if (inputSlots.emplace(Key(inputs[i]), static_cast<uint32_t>(i)).second == false)
+            throw invalid_argument("Duplicate scenario input");
+    }
+
+    // Only the formulas reachable from the inputs may change, by references or by ranges
+    unordered_set<const CellHolder*> affected;
+    vector<const CellHolder*> pending;
+    for (const auto& pos: inputs) {
+        if (const CellHolder* holder = holderAt(pos); holder != nullptr)
+            pending.insert(pending.end(), holder->usedBy.begin(), holder->usedBy.end());
+        sheet.rangeIndex.Watchers(pos, pending);
+    }
+    while (pending.empty() == false) {
+        const CellHolder* holder = pending.back();
+        pending.pop_back();
+        if (affected.insert(holder).second == false)
+            continue;
+        pending.insert(pending.end(), holder->usedBy.begin(), holder->usedBy.end());
+        if (holder->rangeIndexed)
+            sheet.rangeIndex.FormulaWatchers(holder, pending);
+    }
+
+    // Affected formulas needed by the outputs in post-order, the slot of each
+    unordered_map<const CellHolder*, uint32_t> slots;
+    vector<const CellHolder*> order;
+    auto isComputed = [&](Position pos, const CellHolder*& holder) {
+        holder = inputSlots.count(Key(pos)) ? nullptr : holderAt(pos);
+        return holder != nullptr && affected.count(holder) && programOf(holder) != nullptr;
+    };
+    auto visit = [&](const CellHolder* root) {
+        vector<pair<const CellHolder*, bool>> stack {{root, false}};
+        while (stack.empty() == false) {
+            auto [holder, expanded] = stack.back();
+            stack.pop_back();
+            if (expanded) {
+                slots[holder] = static_cast<uint32_t>(inputCount + order.size());
+                order.push_back(holder);
+                continue;
+            }
+            auto [it, inserted] = slots.try_emplace(holder, kVisiting);
+            if (inserted == false) {
+                if (it->second == kVisiting)
+                    throw CircularDependencyException("Failed");
+                continue;
+            }
+            stack.push_back({holder, true});
+            for (const auto& instruction: *programOf(holder)) {
+                const CellHolder* ref = nullptr;
+                if (instruction.code == Instruction::Code::Cell && isComputed(instruction.cell->pos, ref))
+                    stack.push_back({ref, false});
+            }
+        }
+    };
+
+    for (const auto& pos: outputPositions) {
+        if (pos.IsValid() == false)
+            throw InvalidPositionException("Position invalid");
+        Output output;
+        const CellHolder* holder = nullptr;
+        if (auto it = inputSlots.find(Key(pos)); it != inputSlots.end())
+            output.slot = it->second;
+        else if (isComputed(pos, holder)) {
+            visit(holder);
+            output.slot = slots.at(holder);
+        }
+        else {
+            output.constant = true;
+            Encode(CellStatement(pos).Execute(sheet), output.value, output.error);
+        }
+        outputs.push_back(output);
+    }
+
+    for (const CellHolder* holder: order) {
+        size_t depth = 0;
+        for (const auto& instruction: *programOf(holder)) {
+            switch (instruction.code) {
+            case Instruction::Code::Literal:
+                steps.push_back({Code::Constant, 0, instruction.value});
+                stackDepth = max(stackDepth, ++depth);
+                break;
+            case Instruction::Code::Cell: {
+                const Position pos = instruction.cell->pos;
+                const CellHolder* ref = nullptr;
+                Step step {Code::Load};
+                if (auto it = inputSlots.find(Key(pos)); pos.IsValid() && it != inputSlots.end())
+                    step.slot = it->second;
+                else if (pos.IsValid() && isComputed(pos, ref))
+                    step.slot = slots.at(ref);
+                else {
+                    step.code = Code::Constant;
+                    Encode(instruction.cell->Execute(sheet), step.value, step.error);
+                }
+                steps.push_back(step);
+                stackDepth = max(stackDepth, ++depth);
+                break;
+            }
+            case Instruction::Code::Unary:
+                if (instruction.operation == '-')
+                    steps.push_back({Code::Negate});
+                break;
+            case Instruction::Code::Binary:
+                switch (instruction.operation) {
+                case '+': steps.push_back({Code::Add}); break;
+                case '-': steps.push_back({Code::Subtract}); break;
+                case '*': steps.push_back({Code::Multiply}); break;
+                case '/': steps.push_back({Code::Divide}); break;
+                default: throw logic_error("Unknown formula operation");
+                }
+                --depth;
+                break;
+            case Instruction::Code::Parens:
+                break;
+            case Instruction::Code::Range:
+            case Instruction::Code::Criterion:
+            case Instruction::Code::Function:
+                throw logic_error("Functions depending on scenario inputs are not supported");
+            }
+        }
+        steps.push_back({Code::Store, slots.at(holder)});
+    }
+    formulaCount = order.size();
+    slotCount = inputCount + formulaCount;
+}
+
+
+size_t ScenarioModel::Inputs() const {
+    return inputCount;
+}
+
+
+size_t ScenarioModel::Outputs() const {
+    return outputs.size();
+}
+
+
+size_t ScenarioModel::Formulas() const {
+    return formulaCount;
+}
+
+
+void ScenarioModel::EvaluateBlock(Lanes& lanes, const double* values, size_t count, ScenarioMatrix& result, size_t first) const {
+    double* registers = lanes.values.data();
+    uint8_t* errors = lanes.errors.data();
+    // Lanes past count repeat the last scenario to stay finite
+    for (size_t i = 0; i < inputCount; ++i)
+        for (size_t lane = 0; lane < kLanes; ++lane) {
+            registers[i * kLanes + lane] = values[min(lane, count - 1) * inputCount + i];
+            errors[i * kLanes + lane] = 0;
+        }
+
+    size_t top = slotCount;
+    for (const Step& step: steps) {
+        double* topValues = registers + top * kLanes;
+        uint8_t* topErrors = errors + top * kLanes;
+        switch (step.code) {
+        case Code::Load:
+            copy_n(registers + step.slot * kLanes, kLanes, topValues);
+            copy_n(errors + step.slot * kLanes, kLanes, topErrors);
+            ++top;
+            break;
+        case Code::Constant:
+            fill_n(topValues, kLanes, step.value);
+            fill_n(topErrors, kLanes, step.error);
+            ++top;
+            break;
+        case Code::Negate: {
+            double* operand = topValues - kLanes;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                operand[lane] = -operand[lane];
+            break;
+        }
+        case Code::Add:
+            ApplyLanes(topValues - 2 * kLanes, topErrors - 2 * kLanes, topValues - kLanes, topErrors - kLanes,
+                [](double lhs, double rhs) { return lhs + rhs; });
+            --top;
+            break;
+        case Code::Subtract:
+            ApplyLanes(topValues - 2 * kLanes, topErrors - 2 * kLanes, topValues - kLanes, topErrors - kLanes,
+                [](double lhs, double rhs) { return lhs - rhs; });
+            --top;
+            break;
+        case Code::Multiply:
+            ApplyLanes(topValues - 2 * kLanes, topErrors - 2 * kLanes, topValues - kLanes, topErrors - kLanes,
+                [](double lhs, double rhs) { return lhs * rhs; });
+            --top;
+            break;
+        case Code::Divide:
+            DivideLanes(topValues - 2 * kLanes, topErrors - 2 * kLanes, topValues - kLanes, topErrors - kLanes);
+            --top;
+            break;
+        case Code::Store:
+            copy_n(topValues - kLanes, kLanes, registers + step.slot * kLanes);
+            copy_n(topErrors - kLanes, kLanes, errors + step.slot * kLanes);
+            --top;
+            break;
+        }
+    }
+
+    for (size_t lane = 0; lane < count; ++lane)
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            const Output& output = outputs[i];
+            const size_t index = (first + lane) * outputs.size() + i;
+            double value = output.value;
+            uint8_t error = output.error;
+            if (output.constant == false) {
+                value = registers[output.slot * kLanes + lane];
+                error = errors[output.slot * kLanes + lane];
+            }
+            result.values[index] = error != 0 ? numeric_limits<double>::quiet_NaN() : value;
+            result.errors[index] = error;
+        }
+}
+
+
+ScenarioMatrix ScenarioModel::Evaluate(const vector<double>& values, unsigned threads) const {
+    ScenarioMatrix result;
+    result.scenarios = inputCount > 0 ? values.size() / inputCount : 0;
+    result.outputs = outputs.size();
+    if (result.scenarios * inputCount != values.size())
+        throw invalid_argument("Scenario values do not match the inputs");
+    result.values.resize(result.scenarios * result.outputs);
+    result.errors.resize(result.scenarios * result.outputs);
+
+    const size_t blocks = (result.scenarios + kLanes - 1) / kLanes;
+    const size_t claims = (blocks + kBlocksPerClaim - 1) / kBlocksPerClaim;
+    atomic<size_t> nextClaim = 0;
+    const unsigned workers = static_cast<unsigned>(min<size_t>(WorkerCount(threads), max<size_t>(claims, 1)));
+    RunWorkers(workers, [&](unsigned) {
+        Lanes lanes;
+        lanes.values.resize((slotCount + stackDepth) * kLanes);
+        lanes.errors.resize((slotCount + stackDepth) * kLanes);
+        for (size_t claim = nextClaim++; claim < claims; claim = nextClaim++)
+            for (size_t block = claim * kBlocksPerClaim; block < min(blocks, (claim + 1) * kBlocksPerClaim); ++block) {
+                const size_t first = block * kLanes;
+                const size_t count = min(kLanes, result.scenarios - first);
+                EvaluateBlock(lanes, values.data() + first * inputCount, count, result, first);
+            }
+    });
+    return result;
+}
+
+
+void ScenarioModel::EvaluateTangents(Lanes& lanes, const vector<double>& point, const double* directions, size_t count) const {
+    double* tangents = lanes.values.data();
+    double* values = lanes.points.data();
+    uint8_t* errors = lanes.errors.data();
+    for (size_t i = 0; i < inputCount; ++i) {
+        values[i] = point[i];
+        errors[i] = 0;
+        for (size_t lane = 0; lane < kLanes; ++lane)
+            tangents[i * kLanes + lane] = lane < count ? directions[lane * inputCount + i] : 0.0;
+    }
+
+    size_t top = slotCount;
+    for (const Step& step: steps) {
+        switch (step.code) {
+        case Code::Load:
+            copy_n(tangents + step.slot * kLanes, kLanes, tangents + top * kLanes);
+            values[top] = values[step.slot];
+            errors[top] = errors[step.slot];
+            ++top;
+            continue;
+        case Code::Constant:
+            fill_n(tangents + top * kLanes, kLanes, 0.0);
+            values[top] = step.value;
+            errors[top] = step.error;
+            ++top;
+            continue;
+        case Code::Negate: {
+            double* operand = tangents + (top - 1) * kLanes;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                operand[lane] = -operand[lane];
+            values[top - 1] = -values[top - 1];
+            continue;
+        }
+        case Code::Store:
+            --top;
+            copy_n(tangents + top * kLanes, kLanes, tangents + step.slot * kLanes);
+            values[step.slot] = values[top];
+            errors[step.slot] = errors[top];
+            continue;
+        default:
+            break;
+        }
+
+        // Binary operations, errors as in ApplyBinary
+        --top;
+        double* lhs = tangents + (top - 1) * kLanes;
+        const double* rhs = tangents + top * kLanes;
+        const double a = values[top - 1];
+        const double b = values[top];
+        double result = 0.0;
+        switch (step.code) {
+        case Code::Add:
+            result = a + b;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                lhs[lane] += rhs[lane];
+            break;
+        case Code::Subtract:
+            result = a - b;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                lhs[lane] -= rhs[lane];
+            break;
+        case Code::Multiply:
+            result = a * b;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                lhs[lane] = lhs[lane] * b + a * rhs[lane];
+            break;
+        default:
+            result = a / b;
+            for (size_t lane = 0; lane < kLanes; ++lane)
+                lhs[lane] = (lhs[lane] - result * rhs[lane]) / b;
+            break;
+        }
+        const bool failed = step.code == Code::Divide ? b <= 1e-200 : isfinite(result) == false;
+        values[top - 1] = result;
+        if (errors[top - 1] == 0)
+            errors[top - 1] = errors[top] != 0 ? errors[top] : (failed ? kDiv0 : 0);
+    }
+}
+
+
+Sensitivities ScenarioModel::Differentiate(const vector<double>& point, const vector<double>& directions) const {
+    if (point.size() != inputCount)
+        throw invalid_argument("Point does not match the inputs");
+    const size_t directionCount = inputCount > 0 ? directions.size() / inputCount : 0;
+    if (directionCount * inputCount != directions.size())
+        throw invalid_argument("Directions do not match the inputs");
+
+    Lanes lanes;
+    lanes.values.resize((slotCount + stackDepth) * kLanes);
+    lanes.errors.resize(slotCount + stackDepth);
+    lanes.points.resize(slotCount + stackDepth);
+    Sensitivities result;
+    result.partials.resize(outputs.size() * directionCount);
+    // The values come with the first pass, so there is one even without directions
+    for (size_t first = 0; first == 0 || first < directionCount; first += kLanes) {
+        const size_t count = min(kLanes, directionCount - first);
+        EvaluateTangents(lanes, point, directions.data() + first * inputCount, count);
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            const Output& output = outputs[i];
+            double value = output.value;
+            uint8_t error = output.error;
+            if (output.constant == false) {
+                value = lanes.points[output.slot];
+                error = lanes.errors[output.slot];
+            }
+            if (first == 0) {
+                if (error != 0)
+                    result.values.push_back(FormulaError(static_cast<FormulaError::Category>(error - 1)));
+                else
+                    result.values.push_back(value);
+            }
+            for (size_t lane = 0; lane < count; ++lane) {
+                const double partial = output.constant ? 0.0 : lanes.values[output.slot * kLanes + lane];
+                result.partials[i * directionCount + first + lane] = error != 0 ? numeric_limits<double>::quiet_NaN() : partial;
+            }
+        }
+    }
+    return result;
+}
+
+
+Sensitivities ScenarioModel::Differentiate(const vector<double>& point) const {
+    vector<double> directions(inputCount * inputCount);
+    for (size_t i = 0; i < inputCount; ++i)
+        directions[i * inputCount + i] = 1.0;
+    return Differentiate(point, directions);
+}
@@ -0,0 +1,103 @@
+#ifndef TABLE_SCENARIO
+#define TABLE_SCENARIO
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <vector>
+
+
+class Sheet;
+
+
+// Dense row-major scenarios x outputs matrix
+struct ScenarioMatrix {
+    size_t scenarios = 0;
+    size_t outputs = 0;
+    std::vector<double> values;
+    // 0 for a number, 1 + FormulaError::Category for an error
+    std::vector<uint8_t> errors;
+
+    IFormula::Value Get(size_t scenario, size_t output) const;
+};
+
+
+struct Sensitivities {
+    // By output
+    std::vector<IFormula::Value> values;
+    // Row-major outputs x directions, NaN for an output with an error
+    std::vector<double> partials;
+};
+
+
+// Formulas of a sheet between input and output cells compiled into one program over
+// blocks of scenarios: every step works on kLanes scenarios at once, so the loops of
+// the arithmetic are vectorized by the compiler, and blocks are spread over threads.
+// Results are the same as of SetCell of the input numbers and GetValue of the outputs.
+// The model keeps the values of the cells not depending on the inputs and does not
+// refer to the sheet after the construction. Functions depending on the inputs are not
+// compiled, the construction throws std::logic_error for them
+class ScenarioModel {
+public:
+    static constexpr size_t kLanes = 16;
+
+    ScenarioModel(const Sheet& sheet, const std::vector<Position>& inputs, const std::vector<Position>& outputs);
+
+    // values is row-major scenarios x inputs, threads as in ExportOptions
+    ScenarioMatrix Evaluate(const std::vector<double>& values, unsigned threads = 1) const;
+
+    // Forward-mode differentiation at the point of input values: every register carries
+    // the value and its derivatives along kLanes directions, so one pass gives kLanes partials.
+    // directions is row-major directions x inputs, a single direction is the dual number mode
+    Sensitivities Differentiate(const std::vector<double>& point, const std::vector<double>& directions) const;
+    // Partials by every input, the directions are the unit vectors
+    Sensitivities Differentiate(const std::vector<double>& point) const;
+
+    size_t Inputs() const;
+    size_t Outputs() const;
+    // Formulas evaluated per scenario
+    size_t Formulas() const;
+
+private:
+    enum class Code : uint8_t {
+        Load,
+        Constant,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Store
+    };
+
+    struct Step {
+        Code code;
+        uint32_t slot = 0;
+        double value = 0.0;
+        uint8_t error = 0;
+    };
+
+    // Output taken from a slot or a constant
+    struct Output {
+        bool constant = false;
+        uint32_t slot = 0;
+        double value = 0.0;
+        uint8_t error = 0;
+    };
+
+    size_t inputCount = 0;
+    size_t formulaCount = 0;
+    // Inputs first, then formulas in evaluation order
+    size_t slotCount = 0;
+    size_t stackDepth = 0;
+    std::vector<Step> steps;
+    std::vector<Output> outputs;
+
+    struct Lanes;
+    void EvaluateBlock(Lanes& lanes, const double* values, size_t count, ScenarioMatrix& result, size_t first) const;
+    void EvaluateTangents(Lanes& lanes, const std::vector<double>& point, const double* directions, size_t count) const;
+};
+
+
+#endif
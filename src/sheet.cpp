@@ -3,9 +3,15 @@
 #include <iostream>
 #include <algorithm>
 #include <unordered_set>
+#include <charconv>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include "formula_impl.h"
 #include "formula.h"
+#include "workers.h"
 
 
 //#include "memchecker.h"
@@ -89,19 +95,36 @@ CellHolder* Sheet::GetCellPtr(const Position& pos) const {
 
 
 
+// graphMark is 0 for the visited cells, instead of a set of them
 bool Sheet::CheckDependency(Position pos, const vector<Position> &refs) const {
-    for (const auto& refPos: refs) {
-       if (pos  == refPos)
-            return true;
+    thread_local vector<Position> stack;
+    thread_local vector<const CellHolder*> visited;
+    stack.assign(refs.rbegin(), refs.rend());
+    bool cycle = false;
+    while (stack.empty() == false) {
+        auto refPos = stack.back();
+        stack.pop_back();
+        if (pos == refPos) {
+            cycle = true;
+            break;
+        }
         if (CellExists(refPos)) {
             auto cellPtr = GetCellPtr(refPos);
+            if (cellPtr->graphMark >= 0)
+                continue;
+            cellPtr->graphMark = 0;
+            visited.push_back(cellPtr);
             if (cellPtr->DepCheckFlag())
-                if (cellPtr->usedBy.empty() == false) 
-                    if (CheckDependency(pos, cellPtr->GetReferencedCells()))
-                        return true;
+                if (cellPtr->usedBy.empty() == false) {
+                    auto subRefs = cellPtr->GetReferencedCells();
+                    stack.insert(stack.end(), subRefs.rbegin(), subRefs.rend());
+                }
         }
     }
-    return false;
+    for (auto cellPtr: visited)
+        cellPtr->graphMark = -1;
+    visited.clear();
+    return cycle;
 }
 
 
@@ -120,6 +143,20 @@ void Sheet::ClearUsedGraph(CellHolder* cell, const std::vector<Position>& refs)
 
 
 void Sheet::SetCell(Position pos, string text) {
+    CheckNotForked();
+    if (journal == nullptr) {
+        ApplySetCell(pos, move(text));
+        return;
+    }
+    ApplySetCell(pos, text);
+    if (batchDepth > 0)
+        batchJournal.push_back({JournalOp::SetCell, pos, move(text)});
+    else
+        journalLsn = journal->SetCell(pos, text);
+}
+
+
+void Sheet::ApplySetCell(Position pos, string text) {
 
     //cerr << "Set " << pos.ToString() << " " << text << endl;
 
@@ -134,6 +171,11 @@ void Sheet::SetCell(Position pos, string text) {
     if (pos.IsValid() == false) 
         throw InvalidPositionException("Position invalid");
 
+    if (batchDepth > 0) {
+        SetCellInBatch(pos, move(text));
+        return;
+    }
+
     bool cellExisted = false;
     if (CellExists(pos) == false)
         CreateCell(pos);
@@ -141,7 +183,8 @@ void Sheet::SetCell(Position pos, string text) {
         cellExisted = true;
 
     auto cell = GetCellPtr(pos);
-    if (cell->GetLastCall() == text)
+    const uint64_t fingerprint = CellHolder::Fingerprint(text);
+    if (SameText(cell, text, fingerprint))
         return;
 
     if (auto refs = cell->GetReferencedCells(); refs.empty() == false)  
@@ -151,6 +194,7 @@ void Sheet::SetCell(Position pos, string text) {
         HandleFormulaCreation(pos, move(text), cellExisted);
     }
     else {
+        rangeIndex.Unwatch(cell);
         if (text.empty())
             cell->reset(*this);
         else
@@ -161,6 +205,89 @@ void Sheet::SetCell(Position pos, string text) {
         for (const auto& depCell: cell->usedBy) 
             if (depCell->IsInvalid() == false)
                 InvalidateCache(depCell);
+    RangeCellChanged(pos);
+    cell->sourceFingerprint = fingerprint;
+}
+
+
+// A known fingerprint decides without rendering the formula of the cell, the source text
+// itself is not kept. Different texts with equal fingerprints are taken as the same text and
+// the write is skipped: for texts that are not crafted to collide with 64-bit FNV-1a that is
+// about 2^-64 per repeated SetCell
+bool Sheet::SameText(const CellHolder* cell, const string& text, uint64_t fingerprint) {
+    if (cell->sourceFingerprint != 0)
+        return cell->sourceFingerprint == fingerprint;
+    return cell->GetLastCall() == text;
+}
+
+
+void Sheet::SetNumber(Position pos, double value) {
+    if (isfinite(value) == false)
+        throw invalid_argument("Number is not finite");
+    ApplyLiteral(pos, make_unique<LiteralCell>(value));
+}
+
+
+void Sheet::SetText(Position pos, string_view text) {
+    if (text.empty()) {
+        SetCell(pos, string());
+        return;
+    }
+    // Texts without letters may be read as numbers, the escape sign keeps them texts
+    bool escaped = text[0] == kFormulaSign || text[0] == kEscapeSign
+        || find_if(text.begin(), text.end(), [](char c) { return isalpha(c); }) == text.end();
+    string literal;
+    literal.reserve(text.size() + 1);
+    if (escaped)
+        literal.push_back(kEscapeSign);
+    literal.append(text);
+    ApplyLiteral(pos, make_unique<LiteralCell>(move(literal)));
+}
+
+
+void Sheet::SetNumbers(Range range, const double* values) {
+    if (range.IsValid() == false)
+        throw InvalidPositionException("Invalid range");
+    const int cols = range.last.col - range.first.col + 1;
+    const size_t size = static_cast<size_t>(range.last.row - range.first.row + 1) * cols;
+    if (find_if(values, values + size, [](double value) { return isfinite(value) == false; }) != values + size)
+        throw invalid_argument("Number is not finite");
+    CheckNotForked();
+    Batch batch(*this);
+    for (int i = range.first.row; i <= range.last.row; ++i)
+        for (int j = range.first.col; j <= range.last.col; ++j)
+            ApplyLiteral({i, j}, make_unique<LiteralCell>(*values++));
+    batch.Commit();
+}
+
+
+// Typed setters skip the parsing of ApplySetCell, the journal gets the text of the literal
+void Sheet::ApplyLiteral(Position pos, unique_ptr<InnerCell> literal) {
+    CheckNotForked();
+    if (pos.IsValid() == false) 
+        throw InvalidPositionException("Position invalid");
+    string text = journal != nullptr ? literal->GetText() : string();
+
+    if (batchDepth > 0)
+        StoreInBatch(pos, move(literal), CellExists(pos));
+    else {
+        auto cell = CreateCell(pos).get();
+        if (auto refs = cell->GetReferencedCells(); refs.empty() == false)  
+            ClearUsedGraph(cell, refs);
+        rangeIndex.Unwatch(cell);
+        cell->reset(*this, move(literal));
+        for (const auto& depCell: cell->usedBy) 
+            if (depCell->IsInvalid() == false)
+                InvalidateCache(depCell);
+        RangeCellChanged(pos);
+    }
+
+    if (journal == nullptr)
+        return;
+    if (batchDepth > 0)
+        batchJournal.push_back({JournalOp::SetCell, pos, move(text)});
+    else
+        journalLsn = journal->SetCell(pos, text);
 }
 
 
@@ -171,10 +298,12 @@ void Sheet::HandleFormulaCreation(Position pos, string text, bool cellExisted) {
         preFormula = ParseFormula(move(text.substr(1)));
     }
     catch(out_of_range& e) {
+        rangeIndex.Unwatch(cell);
         cell->reset(*this, text, FormulaError::Category::Div0);
         return;
     } 
     const auto& refs = preFormula->GetReferencedCells();
+    const auto ranges = preFormula->GetReferencedRanges();
     /*if (refs.empty()) { //Possible optimization for memory in some cases
         auto expr = "=" + preFormula->GetExpression();
         auto value = preFormula->Evaluate(*this);
@@ -186,7 +315,11 @@ void Sheet::HandleFormulaCreation(Position pos, string text, bool cellExisted) {
             if (CellExists(refPos)) 
                 GetCellPtr(refPos)->usedBy.push_back(cell);
 
-    if (CheckDependency(pos, refs)) {
+    // Dependencies through ranges are not in usedBy, they are checked by a full walk
+    bool cycle = CheckDependency(pos, refs);
+    if (cycle == false && (ranges.empty() == false || rangeIndex.HasWatches()))
+        cycle = CheckRangeDependency(pos, refs, ranges);
+    if (cycle) {
         ClearUsedGraph(cell, refs);
         if (cellExisted == false)
             ClearCell(pos);
@@ -198,11 +331,19 @@ void Sheet::HandleFormulaCreation(Position pos, string text, bool cellExisted) {
                 if (refCell->IsInvalid())
                     UpdateChache(refCell);
             }
+    for (const auto& range: ranges)
+        while (const CellHolder* next = rangeIndex.NextInvalid(range))
+            UpdateChache(next);
+    rangeIndex.Unwatch(cell);
+    if (ranges.empty() == false)
+        rangeIndex.Watch(cell, ranges);
     IFormula::Value cellValue;
     try {
         cellValue = preFormula->Evaluate(*this);
     }
     catch(FormulaException& e) {
+        rangeIndex.Unwatch(cell);
+        WatchRanges(cell);
         ClearUsedGraph(cell, refs);
         if (cellExisted == false)
             ClearCell(pos);
@@ -218,6 +359,279 @@ void Sheet::HandleFormulaCreation(Position pos, string text, bool cellExisted) {
 }
 
 
+void Sheet::SetCellInBatch(Position pos, string text) {
+    bool cellExisted = CellExists(pos);
+    const uint64_t fingerprint = CellHolder::Fingerprint(text);
+    if (cellExisted && SameText(GetCellPtr(pos), text, fingerprint)) {
+        // An empty text keeps the holder of a cell cleared earlier in the batch
+        if (auto cell = GetCellPtr(pos); cell->batchEdit >= 0)
+            batchEdits[cell->batchEdit].removed = false;
+        return;
+    }
+
+    unique_ptr<InnerCell> inner;
+    if (textHasFormula(text)) {
+        try {
+            auto formula = ParseFormula(text.substr(1));
+            if (auto impl = dynamic_cast<Formula*>(formula.get()); impl && impl->HasInvalidReferences())
+                throw FormulaException("Invalid position");
+            inner = make_unique<FormulaCell>(*this, move(formula), 0.0);
+            inner->Invalidate();
+        }
+        catch(out_of_range& e) {
+            inner = make_unique<ErrorCell>(text, FormulaError::Category::Div0);
+        }
+    }
+    else if (text.empty() == false)
+        inner = make_unique<LiteralCell>(text);
+
+    StoreInBatch(pos, move(inner), cellExisted);
+    GetCellPtr(pos)->sourceFingerprint = fingerprint;
+}
+
+
+Sheet::BatchEdit& Sheet::StoreInBatch(Position pos, unique_ptr<InnerCell> inner, bool cellExisted) {
+    auto cell = CreateCell(pos).get();
+    if (cell->batchEdit < 0) {
+        cell->batchEdit = static_cast<int>(batchEdits.size());
+        batchEdits.push_back({pos, cellExisted, cell->GetReferencedCells(), cell->Detach()});
+    }
+    cell->Attach(move(inner));
+    auto& edit = batchEdits[cell->batchEdit];
+    edit.removed = false;
+    return edit;
+}
+
+
+void Sheet::ImportTexts(istream& input, size_t blockSize) {
+    CheckNotForked();
+    TsvReader reader(input, blockSize);
+    Batch batch(*this);
+    reader.Read([this](int row, int col, string_view field) {
+        ImportField({row, col}, field);
+        if (journal != nullptr)
+            batchJournal.push_back({JournalOp::SetCell, {row, col}, string(field)});
+    });
+    batch.Commit();
+}
+
+
+// Numbers skip the stod of LiteralCell, the rest goes through the batched SetCell
+void Sheet::ImportField(Position pos, string_view text) {
+    if (pos.IsValid() == false) 
+        throw InvalidPositionException("Position invalid");
+    bool cellExisted = CellExists(pos);
+    if (text[0] == kFormulaSign || text[0] == kEscapeSign || cellExisted) {
+        SetCellInBatch(pos, string(text));
+        return;
+    }
+    bool plainNumber = isdigit(static_cast<unsigned char>(text[0])) || text[0] == '-' || text[0] == '.';
+    bool containsLetter = find_if(text.begin(), text.end(),
+        [](char c) { return isalpha(c); }) != text.end();
+    if (plainNumber && containsLetter == false) {
+        double value = 0.0;
+        auto [ptr, ec] = from_chars(text.data(), text.data() + text.size(), value);
+        if (ec == errc()) {
+            StoreInBatch(pos, make_unique<LiteralCell>(string(text), value), cellExisted);
+            GetCellPtr(pos)->sourceFingerprint = CellHolder::Fingerprint(text);
+            return;
+        }
+    }
+    StoreInBatch(pos, make_unique<LiteralCell>(string(text)), cellExisted);
+    GetCellPtr(pos)->sourceFingerprint = CellHolder::Fingerprint(text);
+}
+
+
+void Sheet::BeginBatch() {
+    if (batchDepth == 0)
+        batchSize = {rowsCount, colsCount};
+    ++batchDepth;
+}
+
+
+bool Sheet::InBatch() const {
+    return batchDepth > 0;
+}
+
+
+void Sheet::CommitPending() {
+    if (batchDepth > 0) {
+        batchDepth = 1;
+        Commit();
+    }
+}
+
+
+void Sheet::Commit() {
+    if (batchDepth == 0)
+        return;
+    if (--batchDepth > 0)
+        return;
+
+    for (const auto& edit: batchEdits) {
+        auto cell = GetCellPtr(edit.pos);
+        ClearUsedGraph(cell, edit.oldRefs);
+        for (const auto& refPos: cell->GetReferencedCells()) {
+            if (CellExists(refPos) == false) {
+                CreateCell(refPos);
+                batchCreated.push_back(refPos);
+            }
+            GetCellPtr(refPos)->usedBy.push_back(cell);
+        }
+        rangeIndex.Unwatch(cell);
+        WatchRanges(cell);
+    }
+    batchWired = true;
+    // Edited formulas are tracked by the index before the cycle check walks the ranges
+    vector<const CellHolder*> rangeDependents;
+    for (const auto& edit: batchEdits)
+        rangeIndex.CellChanged(edit.pos, rangeDependents);
+
+    vector<const CellHolder*> order;
+    if (SortBatchRegion(order) == false || (rangeIndex.HasWatches() && HasBatchRangeCycle())) {
+        Rollback();
+        throw CircularDependencyException("Batch has circular dependency");
+    }
+    for (auto cell: order)
+        cell->Invalidate();
+    // Watchers of the edited cells are out of the region, they are invalidated before the updates
+    for (auto cell: order)
+        if (cell->rangeIndexed)
+            rangeIndex.FormulaInvalidated(cell, rangeDependents);
+    for (auto cell: rangeDependents)
+        if (cell->IsInvalid() == false)
+            InvalidateCache(cell);
+    for (auto cell: order)
+        if (cell->HasFormula())
+            cell->Update();
+    RemoveCleared();
+    if (journal != nullptr && batchJournal.empty() == false)
+        journalLsn = journal->Batch(batchJournal);
+    ClearBatch();
+}
+
+
+// Kahn's algorithm over every cell reachable from the batched edits by usedBy edges.
+// Any new cycle passes through an edited formula, so it lies inside this region.
+// Edited literals without dependents need neither the check nor recalculation
+bool Sheet::SortBatchRegion(vector<const CellHolder*>& order) const {
+    // graphMark holds the in-degree inside the region, -1 for cells outside of it
+    vector<const CellHolder*> region;
+    region.reserve(batchEdits.size());
+    for (const auto& edit: batchEdits) {
+        auto cell = GetCellPtr(edit.pos);
+        if (cell->usedBy.empty() && cell->HasFormula() == false)
+            continue;
+        cell->graphMark = 0;
+        region.push_back(cell);
+    }
+    for (size_t i = 0; i < region.size(); ++i)
+        for (const auto depCell: region[i]->usedBy)
+            if (depCell->graphMark < 0) {
+                depCell->graphMark = 0;
+                region.push_back(depCell);
+            }
+
+    for (const auto cell: region)
+        for (const auto depCell: cell->usedBy)
+            ++depCell->graphMark;
+
+    order.clear();
+    for (const auto cell: region)
+        if (cell->graphMark == 0)
+            order.push_back(cell);
+    for (size_t i = 0; i < order.size(); ++i)
+        for (const auto depCell: order[i]->usedBy)
+            if (--depCell->graphMark == 0)
+                order.push_back(depCell);
+
+    for (const auto cell: region)
+        cell->graphMark = -1;
+    return order.size() == region.size();
+}
+
+
+void Sheet::Rollback() {
+    for (auto it = batchEdits.rbegin(); it != batchEdits.rend(); ++it) {
+        auto cell = GetCellPtr(it->pos);
+        if (batchWired) {
+            ClearUsedGraph(cell, cell->GetReferencedCells());
+            for (const auto& refPos: it->oldRefs)
+                if (CellExists(refPos))
+                    GetCellPtr(refPos)->usedBy.push_back(cell);
+        }
+        rangeIndex.Unwatch(cell);
+        cell->Attach(move(it->oldCell));
+        WatchRanges(cell);
+        InvalidateCache(cell);
+        if (it->existed == false) 
+            cells[it->pos.row][it->pos.col] = nullptr;
+        RangeCellChanged(it->pos);
+    }
+    for (const auto& pos: batchCreated)
+        if (CellExists(pos)) {
+            auto cell = GetCellPtr(pos);
+            if (cell->usedBy.empty() && cell->IsEmpty())
+                cells[pos.row][pos.col] = nullptr;
+        }
+    if (batchDepth > 0 || batchWired) {
+        rowsCount = batchSize.rows;
+        colsCount = batchSize.cols;
+    }
+    batchDepth = 0;
+    ClearBatch();
+}
+
+
+// Holders of the cells cleared by the batch are dropped after their dependents are updated,
+// as ClearCell does outside of a batch
+void Sheet::RemoveCleared() {
+    bool removed = false;
+    for (const auto& edit: batchEdits) {
+        if (edit.removed == false)
+            continue;
+        CellHolder* cell = GetCellPtr(edit.pos);
+        ClearGraph(cell);
+        cell->batchEdit = -1;
+        cells[edit.pos.row][edit.pos.col] = nullptr;
+        removed = true;
+    }
+    if (removed && CellHolder::getTotalObject() == 0) {
+        colsCount = 0;
+        rowsCount = 0;
+    }
+}
+
+
+void Sheet::ClearBatch() {
+    for (const auto& edit: batchEdits)
+        if (CellExists(edit.pos))
+            GetCellPtr(edit.pos)->batchEdit = -1;
+    batchWired = false;
+    batchEdits.clear();
+    batchCreated.clear();
+    batchJournal.clear();
+}
+
+
+Sheet::Batch::Batch(Sheet& sheet) 
+    : sheet(sheet) {
+    sheet.BeginBatch();
+}
+
+
+Sheet::Batch::~Batch() {
+    if (committed == false)
+        sheet.Rollback();
+}
+
+
+void Sheet::Batch::Commit() {
+    committed = true;
+    sheet.Commit();
+}
+
+
 ICell* Sheet::GetCell(Position pos)  {
     if (pos.IsValid() == false) {
         throw InvalidPositionException("Position invalid");
@@ -241,16 +655,35 @@ const ICell* Sheet::GetCell(Position pos) const  {
 
 
 void Sheet::UpdateChache(const CellHolder * const cellPtr) const{
-    for (const auto& depPos: cellPtr->GetReferencedCells()) {
-        if (CellExists(depPos)) {
-            CellHolder* depPtr = GetCellPtr(depPos);
-            if (depPtr->IsInvalid()) 
-                UpdateChache(depPtr);   
-        }   
-    }      
-    if (cellPtr->HasFormula()) { 
-        cellPtr->Update();
-    }   
+    // Post-order walk: a cell is updated only after all of its invalid references.
+    // Invalid cells of its ranges are taken one at a time from the range index before the update,
+    // so evaluation never reaches an invalid cell through a range summary.
+    // Nested calls from FormulaCell::Update share the stack above their own base
+    thread_local vector<pair<const CellHolder*, bool>> stack;
+    const size_t base = stack.size();
+    stack.push_back({cellPtr, false});
+    while (stack.size() > base) {
+        auto [current, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            if (const CellHolder* next = NextInvalidInRanges(current)) {
+                stack.push_back({current, true});
+                stack.push_back({next, false});
+                continue;
+            }
+            if (current->HasFormula()) 
+                current->Update();
+            continue;
+        }
+        stack.push_back({current, true});
+        for (const auto& depPos: current->GetReferencedCells()) {
+            if (CellExists(depPos)) {
+                CellHolder* depPtr = GetCellPtr(depPos);
+                if (depPtr->IsInvalid()) 
+                    stack.push_back({depPtr, false});
+            }   
+        }      
+    }
 }
 
 
@@ -262,12 +695,186 @@ void Sheet::UpdateDependent(const CellHolder * const cellPtr) const{
                 UpdateChache(depPtr);   
         }   
     }      
+    while (const CellHolder* next = NextInvalidInRanges(cellPtr))
+        UpdateChache(next);
+}
+
+
+const CellHolder* Sheet::NextInvalidInRanges(const CellHolder* cellPtr) const {
+    const IFormula* formula = cellPtr->GetFormula();
+    if (formula == nullptr)
+        return nullptr;
+    for (const auto& range: formula->GetReferencedRanges())
+        if (const CellHolder* next = rangeIndex.NextInvalid(range))
+            return next;
+    return nullptr;
+}
+
+
+BoxedValue Sheet::GetOperand(Position pos) const {
+    return CellExists(pos) ? GetCellPtr(pos)->GetOperand() : 0.0;
+}
+
+
+RangeSummary Sheet::SummarizeRange(Range range) const {
+    return rangeIndex.Summarize(range);
+}
+
+
+optional<int> Sheet::LookupRange(Range range, double value, LookupMode mode) const {
+    if (range.first.col != range.last.col)
+        return ISheet::LookupRange(range, value, mode);
+    return rangeIndex.Lookup(range, value, mode);
+}
+
+
+RangeSummary Sheet::SummarizeIf(Range range, const Criterion& criterion, Range sumRange) const {
+    return rangeIndex.SummarizeIf(range, criterion, sumRange);
+}
+
+
+RangeSummary Sheet::SumProduct(const vector<Range>& ranges) const {
+    return rangeIndex.SumProduct(ranges);
+}
+
+
+void Sheet::RangeCellChanged(Position pos) {
+    vector<const CellHolder*> dependents;
+    rangeIndex.CellChanged(pos, dependents);
+    for (auto cell: dependents)
+        if (cell->IsInvalid() == false)
+            InvalidateCache(cell);
+}
+
+
+void Sheet::WatchRanges(const CellHolder* cell) {
+    if (const IFormula* formula = cell->GetFormula(); formula != nullptr)
+        if (auto ranges = formula->GetReferencedRanges(); ranges.empty() == false)
+            rangeIndex.Watch(cell, ranges);
+}
+
+
+// Watches every formula with range arguments of the sheet, returns them
+vector<const CellHolder*> Sheet::WatchRangeFormulas() {
+    for (const auto& row: cells)
+        for (const auto& cellPtr: row)
+            if (cellPtr != nullptr)
+                WatchRanges(cellPtr.get());
+    return rangeIndex.Watched();
+}
+
+
+// Structural edits move the cells under the index, so it is dropped after the watched formulas
+// are updated and is built anew after the edit
+void Sheet::HandleRangeFormulas(unordered_set<CellHolder*>& allreadyChanged,
+        const function<IFormula::HandlingResult(CellHolder*)>& handle) {
+    for (auto watched: rangeIndex.Watched()) {
+        auto cell = const_cast<CellHolder*>(watched);
+        if (allreadyChanged.insert(cell).second)
+            handle(cell);
+    }
+    rangeIndex.Reset();
+}
+
+
+bool Sheet::CheckRangeDependency(Position pos, const vector<Position>& refs, 
+        const vector<Range>& ranges) const {
+    vector<Position> cellStack(refs.rbegin(), refs.rend());
+    vector<Range> rangeStack(ranges.rbegin(), ranges.rend());
+    unordered_set<const CellHolder*> visited;
+    vector<const CellHolder*> formulas;
+    auto expand = [&](const CellHolder* cell) {
+        if (cell->HasFormula() == false || visited.insert(cell).second == false)
+            return;
+        const IFormula* formula = cell->GetFormula();
+        auto subRefs = formula->GetReferencedCells();
+        auto subRanges = formula->GetReferencedRanges();
+        cellStack.insert(cellStack.end(), subRefs.rbegin(), subRefs.rend());
+        rangeStack.insert(rangeStack.end(), subRanges.rbegin(), subRanges.rend());
+    };
+    while (cellStack.empty() == false || rangeStack.empty() == false) {
+        if (rangeStack.empty() == false) {
+            const Range range = rangeStack.back();
+            rangeStack.pop_back();
+            if (range.Contains(pos))
+                return true;
+            formulas.clear();
+            rangeIndex.Formulas(range, formulas);
+            for (auto cell: formulas)
+                expand(cell);
+            continue;
+        }
+        const Position refPos = cellStack.back();
+        cellStack.pop_back();
+        if (refPos == pos)
+            return true;
+        if (CellExists(refPos))
+            expand(GetCellPtr(refPos));
+    }
+    return false;
+}
+
+
+// Depth-first search from the edited formulas through references and ranges,
+// graphMark is 0 on the current path and 1 for finished cells
+bool Sheet::HasBatchRangeCycle() const {
+    vector<pair<const CellHolder*, bool>> stack;
+    vector<const CellHolder*> marked;
+    vector<const CellHolder*> successors;
+    bool cycle = false;
+    for (const auto& edit: batchEdits) {
+        stack.push_back({GetCellPtr(edit.pos), false});
+        while (cycle == false && stack.empty() == false) {
+            auto [current, expanded] = stack.back();
+            stack.pop_back();
+            if (expanded) {
+                current->graphMark = 1;
+                continue;
+            }
+            const IFormula* formula = current->GetFormula();
+            if (current->graphMark >= 0 || formula == nullptr)
+                continue;
+            current->graphMark = 0;
+            marked.push_back(current);
+            stack.push_back({current, true});
+            successors.clear();
+            for (const auto& refPos: formula->GetReferencedCells())
+                if (CellExists(refPos))
+                    successors.push_back(GetCellPtr(refPos));
+            for (const auto& range: formula->GetReferencedRanges())
+                rangeIndex.Formulas(range, successors);
+            for (auto next: successors) {
+                if (next->graphMark == 0) {
+                    cycle = true;
+                    break;
+                }
+                if (next->graphMark < 0)
+                    stack.push_back({next, false});
+            }
+        }
+        stack.clear();
+        if (cycle)
+            break;
+    }
+    for (auto cell: marked)
+        cell->graphMark = -1;
+    return cycle;
 }
 
 
 void Sheet::ClearCell(Position pos)  {
+    CheckNotForked();
     if (pos.IsValid() == false) 
         throw InvalidPositionException("Position invalid");
+    if (batchDepth > 0) {
+        if (CellExists(pos)) {
+            StoreInBatch(pos, nullptr, true).removed = true;
+            GetCellPtr(pos)->sourceFingerprint = 0;
+            if (journal != nullptr)
+                batchJournal.push_back({JournalOp::ClearCell, pos, {}});
+        }
+        return;
+    }
     if (CellExists(pos)) {
         CellHolder* cell = GetCellPtr(pos);
         InvalidateCache(cell);
@@ -277,11 +884,14 @@ void Sheet::ClearCell(Position pos)  {
             size_t colIdx = static_cast<size_t>(pos.col);
             cells[rowIdx][colIdx] = nullptr;
         }
+        RangeCellChanged(pos);
     }
     if (CellHolder::getTotalObject() == 0) {
         colsCount = 0;
         rowsCount = 0;
     }
+    if (journal != nullptr)
+        journalLsn = journal->ClearCell(pos);
 }
 
 
@@ -296,6 +906,7 @@ void Sheet::ClearGraph(CellHolder* cellPtr) {
             usedVec.erase(it);
     }      
     cellPtr->usedBy.clear();
+    rangeIndex.Unwatch(cellPtr);
 }
 
 
@@ -305,158 +916,183 @@ void Sheet::UpdateFormulaOnInsert(CellHolder* cellPtr, unordered_set<CellHolder*
         return;
     if (cellPtr->usedBy.empty() == false) { 
         for (const auto refPtr: cellPtr->usedBy) {
-            if (allreadyChanged.count(refPtr))
+            if (allreadyChanged.insert(refPtr).second == false)
                 continue;
             if (row)
                 refPtr->HandleInsertedRows(before, count);
             else
                 refPtr->HandleInsertedCols(before, count); 
-            allreadyChanged.insert(refPtr);
         }
     }
 }
 
 
+// Every row after before moves down, so the dependents of all of them are renamed
 void Sheet::InsertRows(int before, int count)  {
+    CheckNotForked();
+    CommitPending();
     if ((rowsCount + count) >= 16384)
                 throw TableTooBigException("Cannot insert new row");
-    rowsCount += count; 
-    cells.resize(rowsCount); 
+    const bool watched = rangeIndex.HasWatches();
     unordered_set<CellHolder*> allreadyChanged;
-    for (int i = before; i < (before + count); ++i) {
-        if (cells[i].empty() == false) {
+    HandleRangeFormulas(allreadyChanged, [before, count](CellHolder* cell) {
+        return cell->HandleInsertedRows(before, count);
+    });
+    rowsCount += count;
+    if (static_cast<size_t>(before) < cells.size()) {
+        for (size_t i = before; i < cells.size(); ++i)
             for (auto& cell: cells[i])
                 UpdateFormulaOnInsert(cell.get(), allreadyChanged, before, count, true);
-            cells[i + count] = move(cells[i]);
-        }
-        else {
-            cells[i] = Sheet::TableRow();
-            cells[i + count] = move(cells[i]);
-        }
+        cells.resize(cells.size() + count);
+        rotate(cells.begin() + before, cells.end() - count, cells.end());
     }
+    if (watched)
+        for (auto cell: WatchRangeFormulas())
+            InvalidateCache(cell);
+    JournalStructural(JournalOp::InsertRows, before, count);
 }
 
 
 void Sheet::InsertCols(int before, int count) {
+    CheckNotForked();
+    CommitPending();
     if ((colsCount + count) >= 16384)
                 throw TableTooBigException("Cannot insert new row"); 
-    colsCount += count;
+    const bool watched = rangeIndex.HasWatches();
     unordered_set<CellHolder*> allreadyChanged;
-    for (size_t i = 0; i < static_cast<size_t>(rowsCount); ++i) {
-        if (cells[i].empty() == false) {
-            auto& row = cells[i];
-            if (row.size() <= static_cast<size_t>(colsCount)) {
-                row.resize(colsCount);
-            }
-            int border = colsCount - count; 
-            for (int j = border-1; j >= before; --j) {
-                size_t idx1 = static_cast<size_t> (j + count);
-                size_t idx2 = static_cast<size_t> (j);
-                auto ptr = row[idx2].get();
-                if (ptr != nullptr)
-                    UpdateFormulaOnInsert(ptr, allreadyChanged, before, count, false);
-                row[idx1] = move(row[idx2]);
-            } 
-        }
+    HandleRangeFormulas(allreadyChanged, [before, count](CellHolder* cell) {
+        return cell->HandleInsertedCols(before, count);
+    });
+    colsCount += count;
+    for (auto& row: cells) {
+        if (row.size() <= static_cast<size_t>(before))
+            continue;
+        for (size_t j = before; j < row.size(); ++j)
+            UpdateFormulaOnInsert(row[j].get(), allreadyChanged, before, count, false);
+        row.resize(row.size() + count);
+        rotate(row.begin() + before, row.end() - count, row.end());
     }
+    if (watched)
+        for (auto cell: WatchRangeFormulas())
+            InvalidateCache(cell);
+    JournalStructural(JournalOp::InsertCols, before, count);
 }
 
 
 
 void Sheet::InvalidateCache(const CellHolder * const cellPtr) const { 
-    cellPtr->Invalidate();
-    if (cellPtr->usedBy.empty() == false)
-        for (const auto& depCell: cellPtr->usedBy) 
+    thread_local vector<const CellHolder*> stack;
+    const size_t base = stack.size();
+    stack.push_back(cellPtr);
+    while (stack.size() > base) {
+        auto current = stack.back();
+        stack.pop_back();
+        current->Invalidate();
+        if (current->rangeIndexed)
+            rangeIndex.FormulaInvalidated(current, stack);
+        for (const auto& depCell: current->usedBy) 
             if (depCell->IsInvalid() == false)
-                InvalidateCache(depCell); 
+                stack.push_back(depCell);
+    }
 }
 
 
 
 void Sheet::DeleteRows(int first, int count) {
+    CheckNotForked();
+    CommitPending();
+    const bool watched = rangeIndex.HasWatches();
+    const size_t firstRow = min(static_cast<size_t>(first), cells.size());
+    const size_t lastRow = min(static_cast<size_t>(first) + count, cells.size());
+    vector<CellHolder*> deleted;
+    for (size_t i = firstRow; i < lastRow; ++i)
+        for (const auto& cell: cells[i])
+            if (cell != nullptr)
+                deleted.push_back(cell.get());
     unordered_set<CellHolder*> allreadyChanged;
-    for (int i = first; i < (rowsCount - count); ++i) { 
-        if (cells[i+count].empty() == false)
-            for (size_t j = 0; j < cells[i+count].size(); ++ j) {
-                auto ptr = cells[i+count][j].get();
-                if (ptr != nullptr) {
-                    UpdateFormulaOnDelete(ptr, allreadyChanged, first, count, true);
-                }
-            }
-             for (size_t j = 0; j < cells[i].size(); ++ j) {
-                    CellHolder* cellPtr = cells[i][j].get();
-                    if (cellPtr) {
-                        UpdateFormulaOnDelete(cellPtr, allreadyChanged, first, count, true);
-                        InvalidateCache(cellPtr);
-                        ClearGraph(cellPtr);
-                        cells.at(i).at(j) = nullptr;
-                    }
-                }
-        cells[i] = move(cells[i + count]);
-    }
-    rowsCount -= count;
-    cells.resize(rowsCount); 
-    if (rowsCount < 0)
-        rowsCount = 0;
+    DeleteCells(deleted, allreadyChanged, first, count, true);
+    HandleRangeFormulas(allreadyChanged, [first, count](CellHolder* cell) {
+        return cell->HandleDeletedRows(first, count);
+    });
+    for (size_t i = lastRow; i < cells.size(); ++i)
+        for (const auto& cell: cells[i])
+            UpdateFormulaOnDelete(cell.get(), allreadyChanged, first, count, true);
+    cells.erase(cells.begin() + firstRow, cells.begin() + lastRow);
+    if (first < rowsCount)
+        rowsCount = max(first, rowsCount - count);
     if (colsCount == 1 && rowsCount == 0) 
         colsCount = 0;
+    if (watched)
+        for (auto cell: WatchRangeFormulas())
+            InvalidateCache(cell);
+    JournalStructural(JournalOp::DeleteRows, first, count);
 }
 
 
 
 void Sheet::DeleteCols(int first, int count) { 
+    CheckNotForked();
+    CommitPending();
+    const bool watched = rangeIndex.HasWatches();
+    vector<CellHolder*> deleted;
+    for (const auto& row: cells)
+        for (size_t j = first; j < min(static_cast<size_t>(first) + count, row.size()); ++j)
+            if (row[j] != nullptr)
+                deleted.push_back(row[j].get());
     unordered_set<CellHolder*> allreadyChanged;
-    for (size_t i = 0; i < static_cast<size_t>(rowsCount); ++i) {
-        if (cells[i].empty() == false) {
-            auto& row = cells[i];     
-
-            for (int j = first; j < first + count; ++j) {
-                size_t idx = static_cast<size_t> (j);
-                CellHolder* cellPtr = row.at(idx).get();
-                if (cellPtr) {
-                    UpdateFormulaOnDelete(cellPtr, allreadyChanged, first, count, false);
-                    InvalidateCache(cellPtr);
-                    ClearGraph(cellPtr);
-                    row.at(idx) = nullptr;
-                }
-            }
-            for (int j = first; 
-                j < colsCount - count; ++j) { 
-                size_t idx1 = static_cast<size_t> (j);
-                size_t idx2 = static_cast<size_t> (j + count);
-                if (idx2 == row.size())
-                    break;
-                auto ptr = row.at(idx2).get();
-                if (ptr != nullptr) {
-                    UpdateFormulaOnDelete(ptr, allreadyChanged, first, count, false);
-                }
-                row.at(idx1) = move(row.at(idx2));
-            }  
-            row.resize(colsCount - count);
-        }
-    }
-    colsCount -= count;
-    if (colsCount < 0)
-        colsCount = 0;
+    DeleteCells(deleted, allreadyChanged, first, count, false);
+    HandleRangeFormulas(allreadyChanged, [first, count](CellHolder* cell) {
+        return cell->HandleDeletedCols(first, count);
+    });
+    for (const auto& row: cells)
+        for (size_t j = static_cast<size_t>(first) + count; j < row.size(); ++j)
+            UpdateFormulaOnDelete(row[j].get(), allreadyChanged, first, count, false);
+    for (auto& row: cells)
+        if (row.size() > static_cast<size_t>(first))
+            row.erase(row.begin() + first, row.begin() + min(static_cast<size_t>(first) + count, row.size()));
+    if (first < colsCount)
+        colsCount = max(first, colsCount - count);
     if (colsCount == 0 && rowsCount == 1) 
         rowsCount = 0;
+    if (watched)
+        for (auto cell: WatchRangeFormulas())
+            InvalidateCache(cell);
+    JournalStructural(JournalOp::DeleteCols, first, count);
 }
 
 
-void Sheet::UpdateFormulaOnDelete(CellHolder* cellPtr,  unordered_set<CellHolder*>& allreadyChanged,
+// Unlinks the deleted cells from each other before any formula is renamed, so the edges
+// are found at the old positions, then the surviving dependents lose their references
+void Sheet::DeleteCells(const vector<CellHolder*>& deleted, unordered_set<CellHolder*>& allreadyChanged,
+        int first, int count, bool row) {
+    for (auto cellPtr: deleted)
+        InvalidateCache(cellPtr);
+    for (auto cellPtr: deleted) {
+        auto dependents = move(cellPtr->usedBy);
+        ClearGraph(cellPtr);
+        cellPtr->usedBy = move(dependents);
+        allreadyChanged.insert(cellPtr);
+    }
+    for (auto cellPtr: deleted) {
+        UpdateFormulaOnDelete(cellPtr, allreadyChanged, first, count, row);
+        cellPtr->usedBy.clear();
+    }
+}
+
+
+void Sheet::UpdateFormulaOnDelete(CellHolder* cellPtr, unordered_set<CellHolder*>& allreadyChanged,
      int first, int count, bool row) const {
     if (cellPtr == nullptr)
         return;
     if (cellPtr->usedBy.empty() == false) { 
         for (const auto refPtr: cellPtr->usedBy) {
-            if (allreadyChanged.count(refPtr))
+            if (allreadyChanged.insert(refPtr).second == false)
                 continue;
             IFormula::HandlingResult hr;
             if (row)
                 hr = refPtr->HandleDeletedRows(first, count);
             else
                 hr = refPtr->HandleDeletedCols(first, count); 
-            allreadyChanged.insert(refPtr);
             if (hr == IFormula::HandlingResult::NothingChanged)
                 continue;
             if (hr == IFormula::HandlingResult::ReferencesChanged) 
@@ -472,37 +1108,548 @@ Size Sheet::GetPrintableSize() const  {
 
 
 void Sheet::PrintValues(ostream& output) const {
-    for (int i = 0; i < rowsCount; ++i) {
-        for (int j = 0; j < colsCount; ++j) {
-            Position pos {i, j};
-            if (CellExists(pos)) { 
-                auto cellValue = GetCellPtr(pos)->GetValue(); 
-                if (holds_alternative<string>(cellValue))
-                    output << get<string>(cellValue);
-                if (holds_alternative<double>(cellValue))
-                    output << get<double>(cellValue);
+    PrintValues(output, {nullopt, false});
+}
+
+
+void Sheet::PrintTexts(ostream& output) const  {
+    PrintTexts(output, {nullopt, false});
+}
+
+
+void Sheet::PrintValues(ostream& output, const ExportOptions& options) const {
+    const Range range = ExportRange(options);
+    const unsigned threads = WorkerCount(options.threads);
+    if (threads > 1) {
+        RecalculateParallel(range, threads);
+        ExportParallel(output, range, true, options.shortestNumbers, threads);
+        return;
+    }
+    thread_local vector<char> buffer;
+    TsvWriter writer(output, buffer);
+    Export(writer, range, true, options.shortestNumbers);
+}
+
+
+void Sheet::PrintTexts(ostream& output, const ExportOptions& options) const {
+    const Range range = ExportRange(options);
+    const unsigned threads = WorkerCount(options.threads);
+    if (threads > 1) {
+        ExportParallel(output, range, false, options.shortestNumbers, threads);
+        return;
+    }
+    thread_local vector<char> buffer;
+    TsvWriter writer(output, buffer);
+    Export(writer, range, false, options.shortestNumbers);
+}
+
+
+void Sheet::ReadValues(Range range, double* values, ValueStatus* statuses, unsigned threads) const {
+    if (range.IsValid() == false)
+        throw InvalidPositionException("Invalid read range");
+    threads = WorkerCount(threads);
+    RecalculateParallel(range, threads);
+    const int rows = range.last.row - range.first.row + 1;
+    // Copying is cheap, small ranges are not worth waking the workers
+    constexpr int kMinRowsPerWorker = 256;
+    const unsigned workers = static_cast<unsigned>(max(1, min(static_cast<int>(threads), rows / kMinRowsPerWorker)));
+    const int bandRows = (rows + static_cast<int>(workers) - 1) / static_cast<int>(workers);
+    RunWorkers(workers, [&](unsigned worker) {
+        const int firstRow = range.first.row + bandRows * static_cast<int>(worker);
+        const int lastRow = min(firstRow + bandRows - 1, range.last.row);
+        if (firstRow <= lastRow)
+            CopyValues(range, firstRow, lastRow, values, statuses);
+    });
+}
+
+
+void Sheet::CopyValues(Range range, int firstRow, int lastRow, double* values, ValueStatus* statuses) const {
+    const int cols = range.last.col - range.first.col + 1;
+    for (int i = firstRow; i <= lastRow; ++i) {
+        const size_t offset = static_cast<size_t>(i - range.first.row) * cols;
+        double* rowValues = values + offset;
+        ValueStatus* rowStatuses = statuses != nullptr ? statuses + offset : nullptr;
+        fill_n(rowValues, cols, 0.0);
+        if (rowStatuses != nullptr)
+            fill_n(rowStatuses, cols, ValueStatus::Empty);
+        if (static_cast<size_t>(i) >= cells.size())
+            continue;
+        const auto& row = cells[i];
+        const int rowEnd = min(static_cast<int>(row.size()), range.last.col + 1);
+        for (int j = range.first.col; j < rowEnd; ++j) {
+            if (row[j] == nullptr)
+                continue;
+            const BoxedValue value = row[j]->GetBoxedValue();
+            const int k = j - range.first.col;
+            ValueStatus status = ValueStatus::Empty;
+            switch (value.GetKind()) {
+            case BoxedValue::Kind::Number:
+                rowValues[k] = value.GetNumber();
+                status = ValueStatus::Number;
+                break;
+            case BoxedValue::Kind::Error:
+                rowValues[k] = numeric_limits<double>::quiet_NaN();
+                status = static_cast<ValueStatus>(static_cast<uint8_t>(ValueStatus::RefError)
+                    + static_cast<uint8_t>(value.GetError().GetCategory()));
+                break;
+            case BoxedValue::Kind::Text:
+                rowValues[k] = numeric_limits<double>::quiet_NaN();
+                status = ValueStatus::Text;
+                break;
+            case BoxedValue::Kind::Empty:
+                break;
             }
-            if (j != colsCount - 1)
-                output << "\t";
+            if (rowStatuses != nullptr)
+                rowStatuses[k] = status;
         }
-        output << "\n";
     }
 }
 
 
-void Sheet::PrintTexts(ostream& output) const  {
-    for (int i = 0; i < rowsCount; ++i) {
-        for (int j = 0; j < colsCount; ++j) {
-            Position pos {i, j};
-            if (CellExists(pos)) 
-                output << GetCellPtr(pos)->GetText(); 
-            if (j != colsCount - 1)
-                output << "\t";
+Range Sheet::ExportRange(const ExportOptions& options) const {
+    if (options.range.has_value() == false)
+        return {{0, 0}, {rowsCount - 1, colsCount - 1}};
+    if (options.range->IsValid() == false)
+        throw InvalidPositionException("Invalid export range");
+    return *options.range;
+}
+
+
+void Sheet::Export(TsvWriter& writer, Range range, bool values, bool shortestNumbers) const {
+    // An empty column range still prints one line per row
+    const int tabs = max(range.last.col - range.first.col, 0);
+    for (int i = range.first.row; i <= range.last.row; ++i) {
+        int printedCol = range.first.col;
+        if (static_cast<size_t>(i) < cells.size()) {
+            const auto& row = cells[i];
+            const int rowEnd = min(static_cast<int>(row.size()), range.last.col + 1);
+            for (int j = range.first.col; j < rowEnd; ++j) {
+                if (row[j] == nullptr)
+                    continue;
+                writer.Write('\t', j - printedCol);
+                printedCol = j;
+                if (values)
+                    row[j]->WriteValue(writer, shortestNumbers);
+                else
+                    row[j]->WriteText(writer);
+            }
         }
-        output << "\n";
+        writer.Write('\t', range.first.col + tabs - printedCol);
+        writer.Write('\n');
     }
 }
 
+void Sheet::ExportParallel(ostream& output, Range range, bool values, bool shortestNumbers,
+        unsigned threads) const {
+    // Each wave formats one band per worker, then the bands are written in order.
+    // Several waves keep the buffered part of the output small for big sheets
+    constexpr int kWaves = 8;
+    const int bands = static_cast<int>(threads) * kWaves;
+    const int rows = range.last.row - range.first.row + 1;
+    const int bandRows = max(1, (rows + bands - 1) / bands);
+    vector<vector<char>> buffers(threads);
+    for (int waveFirst = range.first.row; waveFirst <= range.last.row; 
+            waveFirst += bandRows * static_cast<int>(threads)) {
+        RunWorkers(threads, [&](unsigned worker) {
+            Range band = range;
+            band.first.row = waveFirst + bandRows * static_cast<int>(worker);
+            band.last.row = min(band.first.row + bandRows - 1, range.last.row);
+            TsvWriter writer(buffers[worker], &output);
+            if (band.first.row <= band.last.row)
+                Export(writer, band, values, shortestNumbers);
+        });
+        for (const auto& buffer: buffers)
+            output.write(buffer.data(), buffer.size());
+    }
+}
+
+
+void Sheet::RecalculateParallel(Range range, unsigned threads) const {
+    // Level of an invalid formula is one more than the highest level of its invalid references.
+    // Cells of one level only read valid cells, so every level is evaluated in parallel.
+    // Range arguments are not levelled, with them the cells are updated in turn
+    if (rangeIndex.HasWatches()) {
+        const int lastRow = min(range.last.row, static_cast<int>(cells.size()) - 1);
+        for (int i = range.first.row; i <= lastRow; ++i) {
+            const auto& row = cells[i];
+            const int rowEnd = min(static_cast<int>(row.size()), range.last.col + 1);
+            for (int j = range.first.col; j < rowEnd; ++j)
+                if (row[j] != nullptr && row[j]->IsInvalid())
+                    row[j]->Update();
+        }
+        return;
+    }
+    vector<vector<const CellHolder*>> levels;
+    vector<pair<const CellHolder*, bool>> stack;
+    const int lastRow = min(range.last.row, static_cast<int>(cells.size()) - 1);
+    for (int i = range.first.row; i <= lastRow; ++i) {
+        const auto& row = cells[i];
+        const int rowEnd = min(static_cast<int>(row.size()), range.last.col + 1);
+        for (int j = range.first.col; j < rowEnd; ++j) {
+            if (row[j] == nullptr || row[j]->IsInvalid() == false || row[j]->graphMark >= 0)
+                continue;
+            stack.push_back({row[j].get(), false});
+            while (stack.empty() == false) {
+                auto [current, expanded] = stack.back();
+                stack.pop_back();
+                if (expanded == false && current->graphMark >= 0)
+                    continue;
+                int level = 0;
+                bool pushed = false;
+                for (const auto& depPos: current->GetReferencedCells()) {
+                    if (CellExists(depPos) == false)
+                        continue;
+                    const CellHolder* depPtr = GetCellPtr(depPos);
+                    if (depPtr->IsInvalid() == false)
+                        continue;
+                    if (depPtr->graphMark >= 0) {
+                        level = max(level, depPtr->graphMark + 1);
+                    }
+                    else if (expanded == false) {
+                        if (pushed == false)
+                            stack.push_back({current, true});
+                        pushed = true;
+                        stack.push_back({depPtr, false});
+                    }
+                }
+                if (pushed)
+                    continue;
+                current->graphMark = level;
+                if (levels.size() <= static_cast<size_t>(level))
+                    levels.resize(level + 1);
+                levels[level].push_back(current);
+            }
+        }
+    }
+
+    // Small levels are not worth waking the workers
+    constexpr size_t kMinCellsPerWorker = 256;
+    for (const auto& level: levels)
+        for (auto cellPtr: level)
+            cellPtr->graphMark = -1;
+    for (const auto& level: levels) {
+        const unsigned workers = static_cast<unsigned>(
+            min<size_t>(threads, level.size() / kMinCellsPerWorker));
+        if (workers <= 1) {
+            for (auto cellPtr: level)
+                cellPtr->Update();
+            continue;
+        }
+        atomic<size_t> next = 0;
+        RunWorkers(workers, [&](unsigned) {
+            constexpr size_t kChunk = 64;
+            for (size_t first = next.fetch_add(kChunk); first < level.size(); 
+                    first = next.fetch_add(kChunk))
+                for (size_t k = first; k < min(first + kChunk, level.size()); ++k)
+                    level[k]->Update();
+        });
+    }
+}
+
+void Sheet::SaveSnapshot(ostream& output) const {
+    SaveSnapshot(output, {});
+}
+
+
+void Sheet::SaveSnapshot(ostream& output, const SnapshotProgress& progress) const {
+    constexpr int kTile = kSnapshotTileSize;
+    const int tileRows = (static_cast<int>(cells.size()) + kTile - 1) / kTile;
+    vector<pair<int, int>> tiles;
+    for (int tileRow = 0; tileRow < tileRows; ++tileRow) {
+        const int lastRow = min((tileRow + 1) * kTile, static_cast<int>(cells.size()));
+        vector<bool> occupied;
+        for (int i = tileRow * kTile; i < lastRow; ++i)
+            for (size_t j = 0; j < cells[i].size(); ++j)
+                if (cells[i][j] != nullptr) {
+                    if (occupied.size() <= j / kTile)
+                        occupied.resize(j / kTile + 1);
+                    occupied[j / kTile] = true;
+                }
+        for (size_t tileCol = 0; tileCol < occupied.size(); ++tileCol)
+            if (occupied[tileCol])
+                tiles.push_back({tileRow, static_cast<int>(tileCol)});
+    }
+
+    // Values are brought up to date first, then graphMark holds the packed position
+    // of every cell, so dependents are saved by position
+    for (const auto& row: cells)
+        for (const auto& cellPtr: row)
+            if (cellPtr != nullptr)
+                cellPtr->Update();
+    for (size_t i = 0; i < cells.size(); ++i)
+        for (size_t j = 0; j < cells[i].size(); ++j)
+            if (cells[i][j] != nullptr)
+                cells[i][j]->graphMark = static_cast<int>(i * Position::kMaxCols + j);
+
+    SnapshotWriter writer(output);
+    SnapshotHeader{rowsCount, colsCount, tiles.size(), journalLsn}.Write(writer);
+
+    vector<pair<uint64_t, uint64_t>> directory;
+    directory.reserve(tiles.size());
+    vector<char> payload;
+    if (progress)
+        progress(0, tiles.size());
+    for (auto [tileRow, tileCol]: tiles) {
+        SnapshotWriter tileWriter(payload);
+        uint32_t cellCount = 0;
+        const int lastRow = min((tileRow + 1) * kTile, static_cast<int>(cells.size()));
+        for (int i = tileRow * kTile; i < lastRow; ++i) {
+            const auto& row = cells[i];
+            const int lastCol = min((tileCol + 1) * kTile, static_cast<int>(row.size()));
+            for (int j = tileCol * kTile; j < lastCol; ++j) {
+                if (row[j] == nullptr)
+                    continue;
+                ++cellCount;
+                tileWriter.Put<uint16_t>(static_cast<uint16_t>((i % kTile) * kTile + j % kTile));
+                row[j]->Save(tileWriter);
+                tileWriter.Put<uint32_t>(static_cast<uint32_t>(row[j]->usedBy.size()));
+                for (auto dependent: row[j]->usedBy)
+                    tileWriter.PutPosition({dependent->graphMark / Position::kMaxCols, 
+                        dependent->graphMark % Position::kMaxCols});
+            }
+        }
+        directory.push_back({writer.Offset(), kSnapshotTileHeaderSize + payload.size()});
+        writer.Put<int32_t>(tileRow);
+        writer.Put<int32_t>(tileCol);
+        writer.Put<uint32_t>(cellCount);
+        writer.Put<uint64_t>(payload.size());
+        writer.Write(string_view(payload.data(), payload.size()));
+        if (progress)
+            progress(directory.size(), tiles.size());
+    }
+
+    const uint64_t directoryOffset = writer.Offset();
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        writer.Put<int32_t>(tiles[i].first);
+        writer.Put<int32_t>(tiles[i].second);
+        writer.Put<uint64_t>(directory[i].first);
+        writer.Put<uint64_t>(directory[i].second);
+    }
+    vector<Position> rangeFormulas;
+    for (auto holder: rangeIndex.Watched())
+        rangeFormulas.push_back({holder->graphMark / Position::kMaxCols, holder->graphMark % Position::kMaxCols});
+    sort(rangeFormulas.begin(), rangeFormulas.end(), [](Position lhs, Position rhs) {
+        return make_pair(lhs.row, lhs.col) < make_pair(rhs.row, rhs.col);
+    });
+    writer.Put<uint32_t>(static_cast<uint32_t>(rangeFormulas.size()));
+    for (auto pos: rangeFormulas)
+        writer.PutPosition(pos);
+    writer.Put<uint64_t>(directoryOffset);
+
+    for (const auto& row: cells)
+        for (const auto& cellPtr: row)
+            if (cellPtr != nullptr)
+                cellPtr->graphMark = -1;
+}
+
+
+unique_ptr<BackgroundSnapshot> Sheet::SaveSnapshotInBackground(const string& path) {
+    CommitPending();
+    return make_unique<BackgroundSnapshot>(*this, path);
+}
+
+
+void Sheet::LoadSnapshot(istream& input) {
+    CheckNotForked();
+    CommitPending();
+    // Sizes come from the file, so the buffer grows by chunks as the data actually arrives
+    // and a corrupt size ends with the truncated stream instead of a huge allocation
+    auto readExactly = [&input](vector<char>& buffer, uint64_t size) {
+        constexpr uint64_t kChunk = 1 << 20;
+        buffer.clear();
+        while (buffer.size() < size) {
+            const size_t offset = buffer.size();
+            const size_t chunk = static_cast<size_t>(min(size - offset, kChunk));
+            buffer.resize(offset + chunk);
+            if (input.read(buffer.data() + offset, chunk).gcount() != static_cast<streamsize>(chunk))
+                throw SnapshotError("Snapshot is truncated");
+        }
+    };
+
+    vector<char> buffer;
+    readExactly(buffer, kSnapshotHeaderSize);
+    SnapshotReader headerReader(buffer.data(), buffer.size());
+    const auto [rows, cols, tileCount, lsn] = SnapshotHeader::Read(headerReader);
+
+    // Dependents are linked after all cells exist, their positions are kept flat meanwhile
+    vector<TableRow> loaded(rows);
+    vector<CellHolder*> holders;
+    vector<uint32_t> dependentCounts;
+    vector<Position> dependents;
+    auto holderAt = [&loaded](Position pos) -> CellHolder* {
+        if (pos.row < 0 || static_cast<size_t>(pos.row) >= loaded.size() || pos.col < 0
+                || static_cast<size_t>(pos.col) >= loaded[pos.row].size())
+            return nullptr;
+        return loaded[pos.row][pos.col].get();
+    };
+
+    for (uint64_t tile = 0; tile < tileCount; ++tile) {
+        readExactly(buffer, kSnapshotTileHeaderSize);
+        SnapshotReader tileHeader(buffer.data(), buffer.size());
+        const int tileRow = tileHeader.Get<int32_t>();
+        const int tileCol = tileHeader.Get<int32_t>();
+        const uint32_t cellCount = tileHeader.Get<uint32_t>();
+        readExactly(buffer, tileHeader.Get<uint64_t>());
+        SnapshotReader reader(buffer.data(), buffer.size());
+        for (uint32_t k = 0; k < cellCount; ++k) {
+            const int index = reader.Get<uint16_t>();
+            Position pos{tileRow * kSnapshotTileSize + index / kSnapshotTileSize, 
+                tileCol * kSnapshotTileSize + index % kSnapshotTileSize};
+            if (index >= kSnapshotTileSize * kSnapshotTileSize || pos.row < 0 || pos.row >= rows 
+                    || pos.col < 0 || pos.col >= cols)
+                throw SnapshotError("Cell out of the snapshot size");
+            auto& row = loaded[pos.row];
+            if (row.size() <= static_cast<size_t>(pos.col))
+                row.resize(pos.col + 1);
+            if (row[pos.col] != nullptr)
+                throw SnapshotError("Duplicate cell in snapshot");
+            row[pos.col] = make_unique<CellHolder>();
+            row[pos.col]->Load(*this, reader);
+            holders.push_back(row[pos.col].get());
+            dependentCounts.push_back(reader.Get<uint32_t>());
+            for (uint32_t d = 0; d < dependentCounts.back(); ++d)
+                dependents.push_back(reader.GetPosition());
+        }
+        if (reader.AtEnd() == false)
+            throw SnapshotError("Malformed snapshot tile");
+    }
+
+    size_t next = 0;
+    for (size_t k = 0; k < holders.size(); ++k) {
+        auto& usedBy = holders[k]->usedBy;
+        usedBy.reserve(dependentCounts[k]);
+        for (uint32_t d = 0; d < dependentCounts[k]; ++d) {
+            CellHolder* dependent = holderAt(dependents[next++]);
+            if (dependent == nullptr)
+                throw SnapshotError("Dependent cell is missing in snapshot");
+            usedBy.push_back(dependent);
+        }
+    }
+
+    cells = move(loaded);
+    rowsCount = rows;
+    colsCount = cols;
+    journalLsn = lsn;
+    rangeIndex.Reset();
+    WatchRangeFormulas();
+    if (journal != nullptr)
+        journal->SkipTo(journalLsn);
+}
+
+
+void Sheet::AttachJournal(Journal* journal) {
+    CommitPending();
+    this->journal = journal;
+    if (journal != nullptr)
+        journal->SkipTo(journalLsn);
+}
+
+
+uint64_t Sheet::JournalLsn() const {
+    return journalLsn;
+}
+
+
+void Sheet::JournalStructural(JournalOp op, int first, int count) {
+    if (journal != nullptr)
+        journalLsn = journal->Structural(op, first, count);
+}
+
+
+size_t Sheet::ReplayJournal(const string& path) {
+    CommitPending();
+    // Replayed operations are in the journal already
+    Journal* attached = journal;
+    journal = nullptr;
+    size_t replayed = 0;
+    try {
+        Journal::Read(path, [this, &replayed](const JournalRecord& record) {
+            if (record.lsn <= journalLsn)
+                return;
+            ApplyJournalRecord(record);
+            journalLsn = record.lsn;
+            ++replayed;
+        });
+    }
+    catch (...) {
+        journal = attached;
+        throw;
+    }
+    AttachJournal(attached);
+    return replayed;
+}
+
+
+void Sheet::ApplyJournalRecord(const JournalRecord& record) {
+    auto applyEdit = [this](const JournalEdit& edit) {
+        if (edit.op == JournalOp::SetCell)
+            SetCell(edit.pos, edit.text);
+        else
+            ClearCell(edit.pos);
+    };
+    switch (record.op) {
+    case JournalOp::SetCell:
+    case JournalOp::ClearCell:
+        applyEdit(record.edits.front());
+        break;
+    case JournalOp::InsertRows:
+        InsertRows(record.first, record.count);
+        break;
+    case JournalOp::InsertCols:
+        InsertCols(record.first, record.count);
+        break;
+    case JournalOp::DeleteRows:
+        DeleteRows(record.first, record.count);
+        break;
+    case JournalOp::DeleteCols:
+        DeleteCols(record.first, record.count);
+        break;
+    case JournalOp::Batch: {
+        Batch batch(*this);
+        for (const auto& edit: record.edits)
+            applyEdit(edit);
+        batch.Commit();
+        break;
+    }
+    }
+}
+
+
+
+unique_ptr<SheetFork> Sheet::Fork() const {
+    if (InBatch())
+        throw logic_error("Cannot fork a sheet inside a batch");
+    return make_unique<SheetFork>(*this);
+}
+
+
+ScenarioMatrix Sheet::EvaluateScenarios(const vector<Position>& inputs, const vector<double>& values,
+        const vector<Position>& outputs, unsigned threads) const {
+    return ScenarioModel(*this, inputs, outputs).Evaluate(values, threads);
+}
+
+
+void Sheet::AddFork() const {
+    if (forkCount++ > 0)
+        return;
+    forkPositions.clear();
+    for (size_t i = 0; i < cells.size(); ++i)
+        for (size_t j = 0; j < cells[i].size(); ++j)
+            if (cells[i][j] != nullptr)
+                forkPositions[cells[i][j].get()] = {static_cast<int>(i), static_cast<int>(j)};
+}
+
+
+void Sheet::RemoveFork() const {
+    if (--forkCount == 0)
+        forkPositions = {};
+}
+
+
+void Sheet::CheckNotForked() const {
+    if (forkCount > 0)
+        throw logic_error("Cannot edit a sheet with forks");
+}
 
 
 unique_ptr<ISheet> CreateSheet() {
@@ -3,6 +3,13 @@
 
 #include "common.h"
 #include "cell.h"
+#include "tsv.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "background_snapshot.h"
+#include "sheet_fork.h"
+#include "scenario.h"
+#include "range_index.h"
 
 #include <unordered_map>
 #include <unordered_set>
@@ -10,7 +17,34 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
 #include <optional>
+#include <functional>
+
+
+struct ExportOptions {
+    // Whole printable area when empty
+    std::optional<Range> range;
+    // Shortest round-trip numbers instead of the precision and flags of the output stream
+    bool shortestNumbers = true;
+    // Worker threads formatting row bands, 0 means one per hardware thread.
+    // The output is the same for any number of threads
+    unsigned threads = 1;
+};
+
+
+// Kind of a value read by Sheet::ReadValues. The errors follow FormulaError::Category
+enum class ValueStatus : uint8_t {
+    Number,
+    // An empty or missing cell, its value is 0
+    Empty,
+    // The value of a text cell is NaN, the text is read by GetValueView
+    Text,
+    // The value of an error is NaN
+    RefError,
+    ValueError,
+    Div0Error,
+};
 
 
 class Sheet : public ISheet
@@ -34,11 +68,104 @@ public:
     virtual void PrintValues(std::ostream &output) const override;
     virtual void PrintTexts(std::ostream &output) const override;
 
+    // Served by the segment trees of the range index, see RangeIndex
+    virtual RangeSummary SummarizeRange(Range range) const override;
+    // Reads the cell without copying its value
+    virtual BoxedValue GetOperand(Position pos) const override;
+    // Ranges of one column are looked up in the range index
+    virtual std::optional<int> LookupRange(Range range, double value, LookupMode mode) const override;
+    // Matching rows come from the criterion bitmaps of the range index
+    virtual RangeSummary SummarizeIf(Range range, const Criterion& criterion, Range sumRange) const override;
+    // Numbers are multiplied by the vectorized kernels over the dense columns of the range index
+    virtual RangeSummary SumProduct(const std::vector<Range>& ranges) const override;
+
+    // Visits only occupied cells and writes through a buffer flushed in large chunks.
+    // Positions of the range outside of the printable area are printed as empty cells
+    void PrintValues(std::ostream &output, const ExportOptions& options) const;
+    void PrintTexts(std::ostream &output, const ExportOptions& options) const;
+
+    // Fills rows x cols buffers with the values of the range in row-major order, statuses
+    // may be nullptr. Invalid formulas of the range are recalculated first, by levels on
+    // threads workers as PrintValues, then the rows are copied in bands, one per worker
+    void ReadValues(Range range, double* values, ValueStatus* statuses, unsigned threads = 1) const;
+
     void InvalidateCache(const CellHolder * const cellPtr) const;
     void UpdateDependent(const CellHolder * const cellPtr) const;
 
+    // Batch mode: SetCell and ClearCell only store new contents, dependency edges,
+    // cycle check and recalculation of the affected cells are done once in Commit.
+    // Values read inside a batch are not refreshed by the batched edits.
+    // On a cycle Commit rolls the whole batch back and throws CircularDependencyException.
+    // Batches nest, only the outermost Commit applies the edits.
+    // Structural edits commit the pending batch first.
+    void BeginBatch();
+    void Commit();
+    void Rollback();
+    bool InBatch() const;
+
+    // Imports tab separated texts in the layout of PrintTexts, starting at A1.
+    // Non-empty fields are set as by SetCell inside one batch, empty fields are skipped
+    void ImportTexts(std::istream& input, size_t blockSize = TsvReader::kBlockSize);
+
+    // Typed setters, as SetCell of the text of the value without formatting and parsing it.
+    // The text of a number is formatted by the first GetText with the shortest round-trip
+    // digits in fixed notation, so SetCell and ImportTexts read it back as the same number.
+    // A number that is not finite throws std::invalid_argument.
+    // A text is the value of the cell, it is escaped when SetCell would not read it as text
+    void SetNumber(Position pos, double value);
+    void SetText(Position pos, std::string_view text);
+    // Rows x cols numbers of the range in row-major order, set inside one batch,
+    // so the dependents are invalidated and recalculated once by its Commit
+    void SetNumbers(Range range, const double* values);
+
+    // Binary snapshot with formula programs, cached values and dependencies, see snapshot.h.
+    // Loading replaces the whole sheet without parsing or recalculation,
+    // a malformed snapshot throws SnapshotError and leaves the sheet unchanged
+    void SaveSnapshot(std::ostream& output) const;
+    void LoadSnapshot(std::istream& input);
+
+    using SnapshotProgress = std::function<void(uint64_t savedTiles, uint64_t tiles)>;
+    void SaveSnapshot(std::ostream& output, const SnapshotProgress& progress) const;
+    // Forks and saves the snapshot in the child while this sheet stays editable,
+    // the snapshot holds the sheet as it was at the call. Commits the pending batch first
+    std::unique_ptr<BackgroundSnapshot> SaveSnapshotInBackground(const std::string& path);
+
+    // Successful edits are appended to the journal after they are applied,
+    // the edits of a batch as one record on Commit. The journal must outlive the sheet
+    // or be detached by nullptr
+    void AttachJournal(Journal* journal);
+    // Lsn of the last journaled operation applied to the sheet, saved in snapshots
+    uint64_t JournalLsn() const;
+    // Recovery after LoadSnapshot of the last snapshot: applies the journaled operations
+    // newer than JournalLsn, returns their count
+    size_t ReplayJournal(const std::string& path);
+
+    // Copy-on-write scenario sharing the cells and compiled formulas of this sheet, see SheetFork.
+    // Edits of this sheet throw std::logic_error while it has forks
+    std::unique_ptr<SheetFork> Fork() const;
+
+    // Outputs for every row of the row-major scenarios x inputs values set to the inputs,
+    // without changing the sheet, see ScenarioModel
+    ScenarioMatrix EvaluateScenarios(const std::vector<Position>& inputs, const std::vector<double>& values,
+        const std::vector<Position>& outputs, unsigned threads = 1) const;
+
+    // Rolls the batch back unless it was committed
+    class Batch {
+    public:
+        explicit Batch(Sheet& sheet);
+        ~Batch();
+        void Commit();
+    private:
+        Sheet& sheet;
+        bool committed = false;
+    };
+
 
 private:
+    friend class SheetFork;
+    friend class ScenarioModel;
+    friend class RangeIndex;
+
     using CellPtr = std::unique_ptr<CellHolder>;
     using TableRow = std::vector<CellPtr>;
     std::vector<TableRow> cells;
@@ -53,18 +180,82 @@ private:
         int first, int count, bool row) const;
     void UpdateFormulaOnInsert(CellHolder *cellPtr, std::unordered_set<CellHolder*>& allreadyChanged,
          int first, int count, bool row) const;
+    void DeleteCells(const std::vector<CellHolder*>& deleted, std::unordered_set<CellHolder*>& allreadyChanged,
+        int first, int count, bool row);
 
     void UpdateChache(const CellHolder * const cellPtr) const;
 
+    // Positions of the cells for the dependents of SheetFork, kept while forks exist
+    mutable int forkCount = 0;
+    mutable std::unordered_map<const CellHolder*, Position> forkPositions;
+
+    void AddFork() const;
+    void RemoveFork() const;
+    void CheckNotForked() const;
+
+    Journal* journal = nullptr;
+    uint64_t journalLsn = 0;
+    std::vector<JournalEdit> batchJournal;
+
+    void ApplySetCell(Position pos, std::string text);
+    void ApplyLiteral(Position pos, std::unique_ptr<InnerCell> literal);
+    void JournalStructural(JournalOp op, int first, int count);
+    void ApplyJournalRecord(const JournalRecord& record);
+
     static bool textHasFormula(const std::string& text);
+    static bool SameText(const CellHolder* cell, const std::string& text, uint64_t fingerprint);
     void HandleFormulaCreation(Position pos, std::string text, bool cellExisted);
 
+    Range ExportRange(const ExportOptions& options) const;
+    void Export(TsvWriter& writer, Range range, bool values, bool shortestNumbers) const;
+    void ExportParallel(std::ostream& output, Range range, bool values, bool shortestNumbers,
+        unsigned threads) const;
+    void RecalculateParallel(Range range, unsigned threads) const;
+    void CopyValues(Range range, int firstRow, int lastRow, double* values, ValueStatus* statuses) const;
+
     bool CellExists(const Position &pos) const;
     CellHolder *GetCellPtr(const Position &pos) const;
 
     bool CheckDependency(Position pos, const std::vector<Position> &refs) const;
+    // First invalid formula cell inside the ranges of the formula of the cell, see RangeIndex::NextInvalid
+    const CellHolder* NextInvalidInRanges(const CellHolder* cellPtr) const;
+    bool CheckRangeDependency(Position pos, const std::vector<Position>& refs, 
+        const std::vector<Range>& ranges) const;
     void ClearUsedGraph(CellHolder* cell, const std::vector<Position>& refs);
     void ClearGraph(CellHolder *cellPtr);
+
+    struct BatchEdit {
+        Position pos;
+        bool existed = false;
+        std::vector<Position> oldRefs;
+        std::unique_ptr<InnerCell> oldCell;
+        // Cleared by ClearCell, the holder is dropped by the commit as by an immediate ClearCell
+        bool removed = false;
+    };
+
+    int batchDepth = 0;
+    bool batchWired = false;
+    Size batchSize;
+    std::vector<BatchEdit> batchEdits;
+    std::vector<Position> batchCreated;
+
+    void SetCellInBatch(Position pos, std::string text);
+    BatchEdit& StoreInBatch(Position pos, std::unique_ptr<InnerCell> inner, bool cellExisted);
+    void ImportField(Position pos, std::string_view text);
+    void CommitPending();
+    bool SortBatchRegion(std::vector<const CellHolder*>& order) const;
+    bool HasBatchRangeCycle() const;
+    void RemoveCleared();
+    void ClearBatch();
+
+    // Formulas with range arguments are watched by the index instead of usedBy edges
+    mutable RangeIndex rangeIndex{*this};
+
+    void RangeCellChanged(Position pos);
+    void WatchRanges(const CellHolder* cell);
+    std::vector<const CellHolder*> WatchRangeFormulas();
+    void HandleRangeFormulas(std::unordered_set<CellHolder*>& allreadyChanged, 
+        const std::function<IFormula::HandlingResult(CellHolder*)>& handle);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,424 @@
+#include "sheet_fork.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+#include "cell.h"
+#include "formula_impl.h"
+#include "sheet.h"
+#include "tsv.h"
+
+
+using namespace std;
+
+
+namespace {
+
+ICell::Value ToCellValue(const IFormula::Value& value) {
+    if (holds_alternative<double>(value))
+        return get<double>(value);
+    return get<FormulaError>(value);
+}
+
+ValueView ToValueView(const IFormula::Value& value) {
+    if (holds_alternative<double>(value))
+        return get<double>(value);
+    return get<FormulaError>(value);
+}
+
+}
+
+
+ForkCell::ForkCell(const SheetFork& fork, Position pos)
+    : fork(fork), pos(pos) {
+}
+
+
+ForkCell::~ForkCell() = default;
+
+
+const IFormula* ForkCell::GetFormula() const {
+    if (formula != nullptr)
+        return formula.get();
+    if (shadowed != nullptr)
+        return shadowed->GetFormula();
+    return nullptr;
+}
+
+
+ICell::Value ForkCell::GetValue() const {
+    if (GetFormula() == nullptr)
+        return literal != nullptr ? literal->GetValue() : 0.0;
+    if (invalid)
+        fork.Recalculate(*this);
+    return ToCellValue(value);
+}
+
+
+ValueView ForkCell::GetValueView() const {
+    if (GetFormula() == nullptr)
+        return literal != nullptr ? literal->GetValueView() : 0.0;
+    if (invalid)
+        fork.Recalculate(*this);
+    return ToValueView(value);
+}
+
+
+string ForkCell::GetText() const {
+    if (formula != nullptr)
+        return kFormulaSign + formula->GetExpression();
+    if (shadowed != nullptr)
+        return shadowed->GetText();
+    return literal != nullptr ? literal->GetText() : string();
+}
+
+
+vector<Position> ForkCell::GetReferencedCells() const {
+    if (const IFormula* cellFormula = GetFormula(); cellFormula != nullptr)
+        return cellFormula->GetReferencedCells();
+    return {};
+}
+
+
+
+SheetFork::SheetFork(const Sheet& base)
+    : base(base) {
+    const Size size = base.GetPrintableSize();
+    rowsCount = size.rows;
+    colsCount = size.cols;
+    base.AddFork();
+}
+
+
+SheetFork::~SheetFork() {
+    cells.clear();
+    base.RemoveFork();
+}
+
+
+int SheetFork::Key(Position pos) {
+    return pos.row * Position::kMaxCols + pos.col;
+}
+
+
+ForkCell* SheetFork::FindForked(Position pos) const {
+    if (auto it = cells.find(Key(pos)); it != cells.end())
+        return it->second.get();
+    return nullptr;
+}
+
+
+const CellHolder* SheetFork::BaseCell(Position pos) const {
+    return base.CellExists(pos) ? base.GetCellPtr(pos) : nullptr;
+}
+
+
+const ICell* SheetFork::FindCell(Position pos) const {
+    if (const ForkCell* cell = FindForked(pos); cell != nullptr)
+        return cell->cleared ? nullptr : cell;
+    return BaseCell(pos);
+}
+
+
+const IFormula* SheetFork::FindFormula(Position pos) const {
+    if (const ForkCell* cell = FindForked(pos); cell != nullptr)
+        return cell->cleared ? nullptr : cell->GetFormula();
+    const CellHolder* holder = BaseCell(pos);
+    return holder != nullptr ? holder->GetFormula() : nullptr;
+}
+
+
+ForkCell& SheetFork::OwnCell(Position pos) {
+    auto& cell = cells[Key(pos)];
+    if (cell == nullptr)
+        cell = make_unique<ForkCell>(*this, pos);
+    cell->shadowed = nullptr;
+    cell->literal = nullptr;
+    cell->formula = nullptr;
+    cell->cleared = false;
+    cell->invalid = false;
+    rowsCount = max(rowsCount, pos.row + 1);
+    colsCount = max(colsCount, pos.col + 1);
+    return *cell;
+}
+
+
+vector<Position> SheetFork::GetDependents(Position pos) const {
+    vector<Position> result;
+    if (const CellHolder* holder = BaseCell(pos); holder != nullptr)
+        for (auto dependent: holder->usedBy)
+            result.push_back(base.forkPositions.at(dependent));
+    if (auto it = dependents.find(Key(pos)); it != dependents.end())
+        result.insert(result.end(), it->second.begin(), it->second.end());
+    thread_local vector<const CellHolder*> watchers;
+    watchers.clear();
+    base.rangeIndex.Watchers(pos, watchers);
+    for (auto watcher: watchers)
+        result.push_back(base.forkPositions.at(watcher));
+    // A formula with several ranges containing pos is listed once per range, the walks skip repeats
+    rangeDependents.Stab(pos, [&result](Position dependentPos) {
+        result.push_back(dependentPos);
+    });
+    return result;
+}
+
+
+// Cells of a range are walked as references, within the printable size
+bool SheetFork::HasCycle(Position pos, const vector<Position>& refs, const vector<Range>& ranges) const {
+    vector<Position> stack(refs.rbegin(), refs.rend());
+    vector<Range> rangeStack(ranges.rbegin(), ranges.rend());
+    unordered_set<int> visited;
+    while (stack.empty() == false || rangeStack.empty() == false) {
+        if (rangeStack.empty() == false) {
+            const Range range = rangeStack.back();
+            rangeStack.pop_back();
+            if (range.Contains(pos))
+                return true;
+            for (int i = range.first.row; i <= min(range.last.row, rowsCount - 1); ++i)
+                for (int j = range.first.col; j <= min(range.last.col, colsCount - 1); ++j)
+                    stack.push_back({i, j});
+            continue;
+        }
+        const Position refPos = stack.back();
+        stack.pop_back();
+        if (refPos == pos)
+            return true;
+        const IFormula* formula = FindFormula(refPos);
+        if (formula == nullptr || visited.insert(Key(refPos)).second == false)
+            continue;
+        auto subRefs = formula->GetReferencedCells();
+        auto subRanges = formula->GetReferencedRanges();
+        stack.insert(stack.end(), subRefs.rbegin(), subRefs.rend());
+        rangeStack.insert(rangeStack.end(), subRanges.rbegin(), subRanges.rend());
+    }
+    return false;
+}
+
+
+void SheetFork::Recalculate(const ForkCell& cell) const {
+    // Post-order walk as in Sheet::UpdateChache, base cells are brought up to date by the base
+    vector<pair<const ForkCell*, bool>> stack {{&cell, false}};
+    while (stack.empty() == false) {
+        auto [current, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            if (current->invalid) {
+                current->value = current->GetFormula()->Evaluate(*this);
+                current->invalid = false;
+            }
+            continue;
+        }
+        stack.push_back({current, true});
+        for (const auto& refPos: current->GetReferencedCells())
+            if (const ForkCell* ref = FindForked(refPos); ref != nullptr && ref->invalid)
+                stack.push_back({ref, false});
+    }
+}
+
+
+void SheetFork::InvalidateDependents(Position pos) {
+    // A base formula reached here gets its own value in the fork
+    vector<Position> stack = GetDependents(pos);
+    while (stack.empty() == false) {
+        const Position dependentPos = stack.back();
+        stack.pop_back();
+        ForkCell* dependent = FindForked(dependentPos);
+        if (dependent == nullptr) {
+            const CellHolder* holder = BaseCell(dependentPos);
+            if (holder == nullptr || holder->HasFormula() == false)
+                continue;
+            auto& cell = cells[Key(dependentPos)];
+            cell = make_unique<ForkCell>(*this, dependentPos);
+            cell->shadowed = holder;
+            dependent = cell.get();
+        }
+        else if (dependent->cleared || dependent->GetFormula() == nullptr || dependent->invalid)
+            continue;
+        dependent->invalid = true;
+        auto next = GetDependents(dependentPos);
+        stack.insert(stack.end(), next.begin(), next.end());
+    }
+}
+
+
+void SheetFork::Unlink(const ForkCell& cell) {
+    if (cell.formula == nullptr)
+        return;
+    for (const auto& range: cell.formula->GetReferencedRanges())
+        rangeDependents.Erase(range, cell.pos);
+    for (const auto& refPos: cell.formula->GetReferencedCells()) {
+        auto it = dependents.find(Key(refPos));
+        if (it == dependents.end())
+            continue;
+        auto& refDependents = it->second;
+        if (auto found = find(refDependents.begin(), refDependents.end(), cell.pos); found != refDependents.end())
+            refDependents.erase(found);
+        if (refDependents.empty())
+            dependents.erase(it);
+    }
+}
+
+
+void SheetFork::SetCell(Position pos, string text) {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    if (const ICell* cell = FindCell(pos); cell != nullptr && cell->GetText() == text)
+        return;
+
+    // Everything that may throw is done before the first change
+    unique_ptr<InnerCell> literal;
+    unique_ptr<IFormula> formula;
+    IFormula::Value value = 0.0;
+    vector<Position> refs;
+    vector<Range> ranges;
+    if (text.size() > 1 && text[0] == kFormulaSign) {
+        try {
+            formula = ParseFormula(text.substr(1));
+        }
+        catch(out_of_range& e) {
+            literal = make_unique<ErrorCell>(text, FormulaError::Category::Div0);
+        }
+    }
+    else if (text.empty() == false)
+        literal = make_unique<LiteralCell>(text);
+    if (formula != nullptr) {
+        if (auto impl = dynamic_cast<Formula*>(formula.get()); impl && impl->HasInvalidReferences())
+            throw FormulaException("Invalid position");
+        refs = formula->GetReferencedCells();
+        ranges = formula->GetReferencedRanges();
+        if (HasCycle(pos, refs, ranges))
+            throw CircularDependencyException("Failed");
+        value = formula->Evaluate(*this);
+    }
+
+    if (ForkCell* cell = FindForked(pos); cell != nullptr)
+        Unlink(*cell);
+    ForkCell& cell = OwnCell(pos);
+    cell.literal = move(literal);
+    cell.formula = move(formula);
+    cell.value = value;
+    for (const auto& range: ranges)
+        rangeDependents.Insert(range, pos);
+    for (const auto& refPos: refs) {
+        dependents[Key(refPos)].push_back(pos);
+        // Referenced cells exist as empty cells, as in Sheet
+        if (FindCell(refPos) == nullptr)
+            OwnCell(refPos);
+    }
+    InvalidateDependents(pos);
+}
+
+
+const ICell* SheetFork::GetCell(Position pos) const {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    return FindCell(pos);
+}
+
+
+// Cells are never changed through ICell, so a base cell is handed out as it is
+ICell* SheetFork::GetCell(Position pos) {
+    return const_cast<ICell*>(static_cast<const SheetFork&>(*this).GetCell(pos));
+}
+
+
+void SheetFork::ClearCell(Position pos) {
+    if (pos.IsValid() == false)
+        throw InvalidPositionException("Position invalid");
+    if (FindCell(pos) == nullptr)
+        return;
+    if (ForkCell* cell = FindForked(pos); cell != nullptr)
+        Unlink(*cell);
+    OwnCell(pos).cleared = true;
+    InvalidateDependents(pos);
+}
+
+
+void SheetFork::InsertRows(int before, int count) {
+    throw logic_error("Structural edits are not supported by SheetFork");
+}
+
+
+void SheetFork::InsertCols(int before, int count) {
+    throw logic_error("Structural edits are not supported by SheetFork");
+}
+
+
+void SheetFork::DeleteRows(int first, int count) {
+    throw logic_error("Structural edits are not supported by SheetFork");
+}
+
+
+void SheetFork::DeleteCols(int first, int count) {
+    throw logic_error("Structural edits are not supported by SheetFork");
+}
+
+
+Size SheetFork::GetPrintableSize() const {
+    return {rowsCount, colsCount};
+}
+
+
+// Merges every base row with the forked cells of the row
+template <typename Write>
+void SheetFork::Print(ostream& output, const Write& write) const {
+    thread_local vector<char> buffer;
+    TsvWriter writer(output, buffer);
+    auto forked = cells.begin();
+    for (int i = 0; i < rowsCount; ++i) {
+        const auto* row = static_cast<size_t>(i) < base.cells.size() ? &base.cells[i] : nullptr;
+        const int rowSize = row != nullptr ? static_cast<int>(row->size()) : 0;
+        const int rowEnd = Key({i + 1, 0});
+        int printedCol = 0;
+        int j = 0;
+        while (true) {
+            while (j < rowSize && (*row)[j] == nullptr)
+                ++j;
+            const int forkedCol = forked != cells.end() && forked->first < rowEnd
+                ? forked->first - Key({i, 0}) : Position::kMaxCols;
+            const int col = min(j < rowSize ? j : Position::kMaxCols, forkedCol);
+            if (col == Position::kMaxCols)
+                break;
+            const ICell* cell = nullptr;
+            if (col == forkedCol) {
+                cell = forked->second->cleared ? nullptr : forked->second.get();
+                ++forked;
+            }
+            else
+                cell = (*row)[col].get();
+            if (col == j)
+                ++j;
+            if (cell == nullptr)
+                continue;
+            writer.Write('\t', col - printedCol);
+            printedCol = col;
+            write(writer, *cell);
+        }
+        writer.Write('\t', max(colsCount - 1, 0) - printedCol);
+        writer.Write('\n');
+    }
+}
+
+
+void SheetFork::PrintValues(ostream& output) const {
+    Print(output, [](TsvWriter& writer, const ICell& cell) {
+        const ValueView value = cell.GetValueView();
+        if (value.IsText())
+            writer.Write(value.GetText());
+        else if (value.IsNumber())
+            writer.WriteNumber(value.GetNumber(), false);
+    });
+}
+
+
+void SheetFork::PrintTexts(ostream& output) const {
+    Print(output, [](TsvWriter& writer, const ICell& cell) {
+        writer.Write(cell.GetText());
+    });
+}
+
+
+size_t SheetFork::ForkedCells() const {
+    return cells.size();
+}
@@ -0,0 +1,114 @@
+#ifndef TABLE_SHEET_FORK
+#define TABLE_SHEET_FORK
+
+#include "common.h"
+#include "formula.h"
+#include "range_tree.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+class Sheet;
+class SheetFork;
+class CellHolder;
+class InnerCell;
+
+
+// Cell of a SheetFork: own content set in the fork, or a base formula cell whose value
+// differs in the fork, evaluated by the compiled formula of the base
+class ForkCell : public ICell {
+public:
+    ForkCell(const SheetFork& fork, Position pos);
+    ~ForkCell();
+
+    virtual Value GetValue() const override;
+    virtual ValueView GetValueView() const override;
+    virtual std::string GetText() const override;
+    virtual std::vector<Position> GetReferencedCells() const override;
+
+private:
+    friend class SheetFork;
+
+    const SheetFork& fork;
+    Position pos;
+    const CellHolder* shadowed = nullptr;
+    // Own content: text of a literal or an error, a formula, or nothing for an empty cell
+    std::unique_ptr<InnerCell> literal;
+    std::unique_ptr<IFormula> formula;
+    bool cleared = false;
+    mutable IFormula::Value value = 0.0;
+    mutable bool invalid = false;
+
+    const IFormula* GetFormula() const;
+};
+
+
+
+// What-if scenario over a sheet. Cells of the base sheet and their compiled formulas are
+// shared, the fork keeps only the cells edited in it and the base formulas depending on them,
+// so a fork costs memory for the cells it changes.
+// The base sheet cannot be edited while it has forks, its edits throw std::logic_error.
+// Structural edits are not supported by forks and throw std::logic_error too
+class SheetFork : public ISheet {
+public:
+    explicit SheetFork(const Sheet& base);
+    virtual ~SheetFork();
+
+    SheetFork(const SheetFork&) = delete;
+    SheetFork& operator=(const SheetFork&) = delete;
+
+    virtual void SetCell(Position pos, std::string text) override;
+
+    virtual const ICell* GetCell(Position pos) const override;
+    virtual ICell* GetCell(Position pos) override;
+
+    virtual void ClearCell(Position pos) override;
+
+    virtual void InsertRows(int before, int count = 1) override;
+    virtual void InsertCols(int before, int count = 1) override;
+    virtual void DeleteRows(int first, int count = 1) override;
+    virtual void DeleteCols(int first, int count = 1) override;
+
+    virtual Size GetPrintableSize() const override;
+    virtual void PrintValues(std::ostream& output) const override;
+    virtual void PrintTexts(std::ostream& output) const override;
+
+    // Cells kept by the fork, own and recalculated ones
+    size_t ForkedCells() const;
+
+private:
+    friend class ForkCell;
+
+    const Sheet& base;
+    int rowsCount = 0;
+    int colsCount = 0;
+    // By row * Position::kMaxCols + col, so the order is the print order
+    std::map<int, std::unique_ptr<ForkCell>> cells;
+    // Positions of own formulas referring to a position, base formulas are found by the base graph
+    std::unordered_map<int, std::vector<Position>> dependents;
+    // Positions of own formulas with range arguments, base ones are found by the base range index
+    RangeTree<Position> rangeDependents;
+
+    static int Key(Position pos);
+    const CellHolder* BaseCell(Position pos) const;
+    ForkCell* FindForked(Position pos) const;
+    const ICell* FindCell(Position pos) const;
+    const IFormula* FindFormula(Position pos) const;
+    ForkCell& OwnCell(Position pos);
+
+    std::vector<Position> GetDependents(Position pos) const;
+    bool HasCycle(Position pos, const std::vector<Position>& refs, const std::vector<Range>& ranges) const;
+    void Recalculate(const ForkCell& cell) const;
+    void InvalidateDependents(Position pos);
+    void Unlink(const ForkCell& cell);
+
+    template <typename Write>
+    void Print(std::ostream& output, const Write& write) const;
+};
+
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef TABLE_SNAPSHOT
+#define TABLE_SNAPSHOT
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+
+// Binary snapshot of a sheet, numbers are stored as in memory of a little-endian host.
+//   header:    magic, u32 version, u32 tile size, i32 rows, i32 cols, u64 tile count,
+//              u64 lsn of the last journaled operation contained, see journal.h
+//   tiles:     i32 tile row, i32 tile col, u32 cell count, u64 payload size, payload
+//   directory: i32 tile row, i32 tile col, u64 offset, u64 size per tile, sorted by position
+//   ranges:    u32 count, i32 row, i32 col of every formula with range arguments
+//   trailer:   u64 directory offset
+// A payload is a sequence of cell records: u16 index in the tile, u8 SnapshotCellKind,
+// the kind specific data and the positions of dependent cells (u32 count, i32 row, i32 col each).
+// Formulas are stored as their post-order program with cached values, so loading
+// needs neither the parser nor recalculation.
+inline constexpr char kSnapshotMagic[8] = "TBLSNAP";
+inline constexpr uint32_t kSnapshotVersion = 3;
+inline constexpr int kSnapshotTileSize = 64;
+inline constexpr size_t kSnapshotHeaderSize = 40;
+inline constexpr size_t kSnapshotTileHeaderSize = 20;
+inline constexpr size_t kSnapshotDirectoryEntrySize = 24;
+
+enum class SnapshotCellKind : uint8_t {
+    Empty,
+    Text,
+    Number,
+    Error,
+    Formula
+};
+
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+
+// Writes through a large buffer flushed to the stream, without a stream everything stays in the buffer
+class SnapshotWriter {
+public:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    explicit SnapshotWriter(std::ostream& output)
+        : output(&output), buffer(ownBuffer) {
+        buffer.reserve(kBufferSize);
+    }
+
+    explicit SnapshotWriter(std::vector<char>& buffer)
+        : buffer(buffer) {
+        buffer.clear();
+    }
+
+    ~SnapshotWriter() {
+        Flush();
+    }
+
+    template <typename T>
+    void Put(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Write(std::string_view(reinterpret_cast<const char*>(&value), sizeof(T)));
+    }
+
+    void PutString(std::string_view text) {
+        Put<uint32_t>(static_cast<uint32_t>(text.size()));
+        Write(text);
+    }
+
+    void PutPosition(Position pos) {
+        Put<int32_t>(pos.row);
+        Put<int32_t>(pos.col);
+    }
+
+    void Write(std::string_view bytes) {
+        if (output && buffer.size() + bytes.size() > buffer.capacity()) {
+            Flush();
+            if (bytes.size() > buffer.capacity()) {
+                output->write(bytes.data(), bytes.size());
+                flushed += bytes.size();
+                return;
+            }
+        }
+        buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+    }
+
+    uint64_t Offset() const {
+        return flushed + buffer.size();
+    }
+
+    void Flush() {
+        if (output && buffer.empty() == false) {
+            output->write(buffer.data(), buffer.size());
+            flushed += buffer.size();
+            buffer.clear();
+        }
+    }
+
+private:
+    std::ostream* output = nullptr;
+    std::vector<char> ownBuffer;
+    std::vector<char>& buffer;
+    uint64_t flushed = 0;
+};
+
+
+
+// Reads from memory, throws SnapshotError instead of reading past the end
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size)
+        : data(data), size(size) {
+    }
+
+    template <typename T>
+    T Get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Need(sizeof(T));
+        T value;
+        std::memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    std::string_view GetString() {
+        const size_t length = Get<uint32_t>();
+        Need(length);
+        std::string_view text(data + offset, length);
+        offset += length;
+        return text;
+    }
+
+    Position GetPosition() {
+        Position pos;
+        pos.row = Get<int32_t>();
+        pos.col = Get<int32_t>();
+        return pos;
+    }
+
+    FormulaError::Category GetErrorCategory() {
+        const auto category = Get<uint8_t>();
+        if (category > static_cast<uint8_t>(FormulaError::Category::Div0))
+            throw SnapshotError("Unknown error category");
+        return static_cast<FormulaError::Category>(category);
+    }
+
+    std::string_view GetBytes(size_t count) {
+        Need(count);
+        std::string_view bytes(data + offset, count);
+        offset += count;
+        return bytes;
+    }
+
+    size_t Offset() const {
+        return offset;
+    }
+
+    bool AtEnd() const {
+        return offset == size;
+    }
+
+private:
+    const char* data;
+    size_t size;
+    size_t offset = 0;
+
+    void Need(size_t count) const {
+        if (size - offset < count)
+            throw SnapshotError("Snapshot is truncated");
+    }
+};
+
+
+
+struct SnapshotHeader {
+    int rows = 0;
+    int cols = 0;
+    uint64_t tileCount = 0;
+    uint64_t journalLsn = 0;
+
+    void Write(SnapshotWriter& writer) const {
+        writer.Write(std::string_view(kSnapshotMagic, sizeof(kSnapshotMagic)));
+        writer.Put<uint32_t>(kSnapshotVersion);
+        writer.Put<uint32_t>(kSnapshotTileSize);
+        writer.Put<int32_t>(rows);
+        writer.Put<int32_t>(cols);
+        writer.Put<uint64_t>(tileCount);
+        writer.Put<uint64_t>(journalLsn);
+    }
+
+    // Throws SnapshotError for another format, version or tile size
+    static SnapshotHeader Read(SnapshotReader& reader) {
+        for (char c: kSnapshotMagic)
+            if (reader.Get<char>() != c)
+                throw SnapshotError("Not a sheet snapshot");
+        if (reader.Get<uint32_t>() != kSnapshotVersion)
+            throw SnapshotError("Unsupported snapshot version");
+        if (reader.Get<uint32_t>() != static_cast<uint32_t>(kSnapshotTileSize))
+            throw SnapshotError("Unsupported snapshot tile size");
+        SnapshotHeader header;
+        header.rows = reader.Get<int32_t>();
+        header.cols = reader.Get<int32_t>();
+        header.tileCount = reader.Get<uint64_t>();
+        header.journalLsn = reader.Get<uint64_t>();
+        if (header.rows < 0 || header.rows > Position::kMaxRows 
+                || header.cols < 0 || header.cols > Position::kMaxCols)
+            throw SnapshotError("Invalid snapshot size");
+        return header;
+    }
+};
+
+
+#endif
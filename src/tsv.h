@@ -0,0 +1,172 @@
+#ifndef TABLE_TSV
+#define TABLE_TSV
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <charconv>
+
+
+// Reads tab separated text in the layout of PrintTexts by large blocks.
+// Fields are passed as views into the block buffer, so they are valid only inside the callback.
+class TsvReader {
+public:
+    static constexpr size_t kBlockSize = 1 << 20;
+
+    explicit TsvReader(std::istream& input, size_t blockSize = kBlockSize)
+        : input(input), buffer(blockSize) {
+    }
+
+    // Calls onField(row, col, field) for every non-empty field
+    template <typename Callback>
+    void Read(Callback onField) {
+        size_t filled = 0;
+        int row = 0;
+        while (true) {
+            if (filled == buffer.size())
+                buffer.resize(buffer.size() * 2);
+            input.read(buffer.data() + filled, buffer.size() - filled);
+            size_t got = static_cast<size_t>(input.gcount());
+            bytesRead += got;
+            filled += got;
+            bool last = got == 0;
+
+            const char* begin = buffer.data();
+            const char* end = begin + filled;
+            const char* lineBegin = begin;
+            while (lineBegin < end) {
+                auto lineEnd = static_cast<const char*>(std::memchr(lineBegin, '\n', end - lineBegin));
+                if (lineEnd == nullptr) {
+                    if (last == false)
+                        break;
+                    lineEnd = end;
+                }
+                ReadLine(row++, lineBegin, lineEnd, onField);
+                lineBegin = lineEnd == end ? end : lineEnd + 1;
+            }
+            if (last)
+                return;
+            filled = end - lineBegin;
+            std::memmove(buffer.data(), lineBegin, filled);
+        }
+    }
+
+    size_t BytesRead() const {
+        return bytesRead;
+    }
+
+private:
+    std::istream& input;
+    std::vector<char> buffer;
+    size_t bytesRead = 0;
+
+    template <typename Callback>
+    static void ReadLine(int row, const char* begin, const char* end, Callback& onField) {
+        if (end > begin && end[-1] == '\r')
+            --end;
+        int col = 0;
+        while (true) {
+            auto fieldEnd = static_cast<const char*>(std::memchr(begin, '\t', end - begin));
+            if (fieldEnd == nullptr)
+                fieldEnd = end;
+            if (fieldEnd != begin)
+                onField(row, col, std::string_view(begin, fieldEnd - begin));
+            if (fieldEnd == end)
+                return;
+            begin = fieldEnd + 1;
+            ++col;
+        }
+    }
+};
+
+
+
+// Writes tab separated text through a large buffer that is flushed to the stream in chunks.
+// Without a stream everything stays in the buffer.
+// Numbers not in the shortest form follow the precision and flags of the stream, the default
+// ones are formatted by to_chars and the others through a stream with a copy of the format.
+class TsvWriter {
+public:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    TsvWriter(std::ostream& output, std::vector<char>& buffer)
+        : output(&output), buffer(buffer), numberFormat(CustomFormat(output)) {
+        Reserve(kBufferSize);
+    }
+
+    // numberFormat is the stream the buffer is written to later
+    explicit TsvWriter(std::vector<char>& buffer, const std::ostream* numberFormat = nullptr)
+        : buffer(buffer), numberFormat(numberFormat ? CustomFormat(*numberFormat) : nullptr) {
+        buffer.clear();
+    }
+
+    ~TsvWriter() {
+        Flush();
+    }
+
+    void Write(std::string_view text) {
+        if (output && buffer.size() + text.size() > buffer.capacity()) {
+            Flush();
+            if (text.size() > buffer.capacity()) {
+                output->write(text.data(), text.size());
+                return;
+            }
+        }
+        buffer.insert(buffer.end(), text.begin(), text.end());
+    }
+
+    void Write(char c, size_t count = 1) {
+        if (output && buffer.size() + count > buffer.capacity())
+            Flush();
+        buffer.insert(buffer.end(), count, c);
+    }
+
+    // Shortest text that reads back to the same double, or as the stream prints it
+    void WriteNumber(double value, bool shortest) {
+        if (shortest == false && numberFormat) {
+            thread_local std::ostringstream formatted;
+            formatted.str({});
+            formatted.copyfmt(*numberFormat);
+            formatted.width(0);
+            formatted << value;
+            Write(formatted.str());
+            return;
+        }
+        char text[32];
+        auto result = shortest ? std::to_chars(text, text + sizeof(text), value)
+            : std::to_chars(text, text + sizeof(text), value, std::chars_format::general, 6);
+        Write(std::string_view(text, result.ptr - text));
+    }
+
+    void Flush() {
+        if (output && buffer.empty() == false) {
+            output->write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+private:
+    std::ostream* output = nullptr;
+    std::vector<char>& buffer;
+    // Stream with other than the default precision and flags, printf("%g") is used otherwise
+    const std::ostream* numberFormat = nullptr;
+
+    static const std::ostream* CustomFormat(const std::ostream& stream) {
+        constexpr auto kDefaultFlags = std::ios_base::dec | std::ios_base::skipws;
+        if (stream.flags() == kDefaultFlags && stream.precision() == 6)
+            return nullptr;
+        return &stream;
+    }
+
+    void Reserve(size_t size) {
+        buffer.clear();
+        if (buffer.capacity() < size)
+            buffer.reserve(size);
+    }
+};
+
+
+#endif
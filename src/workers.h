@@ -0,0 +1,43 @@
+#ifndef TABLE_WORKERS
+#define TABLE_WORKERS
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
+
+// 0 means one worker per hardware thread
+inline unsigned WorkerCount(unsigned threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return std::max(threads, 1u);
+}
+
+
+// Runs work(worker) on count threads including the calling one, rethrows the first exception
+template <typename Work>
+void RunWorkers(unsigned count, const Work& work) {
+    std::vector<std::exception_ptr> errors(count);
+    auto guarded = [&](unsigned worker) {
+        try {
+            work(worker);
+        }
+        catch (...) {
+            errors[worker] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(count - 1);
+    for (unsigned worker = 1; worker < count; ++worker)
+        workers.emplace_back(guarded, worker);
+    guarded(0);
+    for (auto& worker: workers)
+        worker.join();
+    for (auto& error: errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+
+#endif